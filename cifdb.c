@@ -34,6 +34,7 @@
 #include "misc.h"
 #include "db.h"
 #include "database.h"
+#include "corpus.h"
 #include "build.h"
 
 #define NAME "cifdb"
@@ -48,6 +49,7 @@ static word debug, opt_fetch_all, run, opt_test, opt_print, opt_insecure, used_i
 static char * opt_filename;
 static char * opt_url;
 static dword update_id;
+static word batch_locations;
 static time_t start_time, last_reported_time;
 #define INVALID_SORT_TIME 9999
 
@@ -225,6 +227,7 @@ int main(int argc, char **argv)
 
    // Initialise database
    if(db_init(conf[conf_db_server], conf[conf_db_user], conf[conf_db_password], conf[conf_db_name], DB_MODE_NORMAL)) exit(1);
+   batch_locations = db_batch("cif_schedule_locations", NULL, 0, 0);
 
    if(opt_fetch_all && !opt_test) reset_database();
 
@@ -1255,7 +1258,7 @@ static word process_schedule(const char * const c)
       {
          //| update_id             | smallint(5) unsigned | NO   |     | NULL    |       |
          //| cif_schedule_id       | int(10) unsigned     | NO   | MUL | NULL    |       |
-         sprintf(query, "INSERT INTO cif_schedule_locations VALUES(%d, %d", update_id, schedule_id);
+         sprintf(query, "%d, %d", update_id, schedule_id);
          //| location_type         | char(12)             | NO   |     | NULL    |       |
          EXTRACT_APPEND(29, 12);
          //| record_identity       | char(2)              | NO   |     | NULL    |       |
@@ -1293,15 +1296,14 @@ static word process_schedule(const char * const c)
          EXTRACT_APPEND(27, 2);
          //| performance_allowance | char(2)              | NO   |     | NULL    |       |
          EXTRACT_APPEND(41, 2);
-         strcat(query, ")");
-         if(db_query(query)) return 1;
+         if(db_batch_add(batch_locations, query)) return 1;
          stats[ScheduleLocCreate]++;
       }
       else if(c[1] == 'I')
       {
          //| update_id             | smallint(5) unsigned | NO   |     | NULL    |       |
          //| cif_schedule_id       | int(10) unsigned     | NO   | MUL | NULL    |       |
-         sprintf(query, "INSERT INTO cif_schedule_locations VALUES(%d, %d", update_id, schedule_id);
+         sprintf(query, "%d, %d", update_id, schedule_id);
          //| location_type         | char(12)             | NO   |     | NULL    |       |
          EXTRACT_APPEND(42, 12);
          //| record_identity       | char(2)              | NO   |     | NULL    |       |
@@ -1344,15 +1346,14 @@ static word process_schedule(const char * const c)
          EXTRACT_APPEND(56, 2);
          //| performance_allowance | char(2)              | NO   |     | NULL    |       |
          EXTRACT_APPEND(58, 2);
-         strcat(query, ")");
-         if(db_query(query)) return 1;
+         if(db_batch_add(batch_locations, query)) return 1;
          stats[ScheduleLocCreate]++;
       }
       else if(c[1] == 'T')
       {
          //| update_id             | smallint(5) unsigned | NO   |     | NULL    |       |
          //| cif_schedule_id       | int(10) unsigned     | NO   | MUL | NULL    |       |
-         sprintf(query, "INSERT INTO cif_schedule_locations VALUES(%d, %d", update_id, schedule_id);
+         sprintf(query, "%d, %d", update_id, schedule_id);
          //| location_type         | char(12)             | NO   |     | NULL    |       |
          EXTRACT_APPEND(25, 12);
          //| record_identity       | char(2)              | NO   |     | NULL    |       |
@@ -1389,8 +1390,7 @@ static word process_schedule(const char * const c)
          strcat(query, ", ''");
          //| performance_allowance | char(2)              | NO   |     | NULL    |       |
          strcat(query, ", ''");
-         strcat(query, ")");
-         if(db_query(query)) return 1;
+         if(db_batch_add(batch_locations, query)) return 1;
          stats[ScheduleLocCreate]++;
       }
 
@@ -1708,24 +1708,11 @@ static word create_tiploc(const char * const c)
 static char * tiploc_name(const char * const tiploc)
 {
    // Not re-entrant
-   char query[256];
-   MYSQL_RES * result;
-   MYSQL_ROW row;
    static char name[128];
+   const char * fn = corpus_tiploc_name(tiploc);
 
-   sprintf(query, "select fn from corpus where tiploc = '%s'", tiploc);
-   db_query(query);
-   result = db_store_result();
-   if((row = mysql_fetch_row(result)) && row[0][0]) 
-   {
-      strncpy(name, row[0], 127);
-      name[127] = '\0';
-   }
-   else
-   {
-      strcpy(name, tiploc);
-   }
-   mysql_free_result(result);
+   strncpy(name, fn[0] ? fn : tiploc, 127);
+   name[127] = '\0';
    return name;
 }
 
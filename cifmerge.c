@@ -35,6 +35,7 @@
 #include "misc.h"
 #include "db.h"
 #include "database.h"
+#include "corpus.h"
 #include "build.h"
 
 #define NAME "cifmerge"
@@ -1504,24 +1505,11 @@ static word create_tiploc(const char * const c)
 static char * tiploc_name(const char * const tiploc)
 {
    // Not re-entrant
-   char query[256];
-   MYSQL_RES * result;
-   MYSQL_ROW row;
    static char name[128];
+   const char * fn = corpus_tiploc_name(tiploc);
 
-   sprintf(query, "select fn from corpus where tiploc = '%s'", tiploc);
-   db_query(query);
-   result = db_store_result();
-   if((row = mysql_fetch_row(result)) && row[0][0]) 
-   {
-      strncpy(name, row[0], 127);
-      name[127] = '\0';
-   }
-   else
-   {
-      strcpy(name, tiploc);
-   }
-   mysql_free_result(result);
+   strncpy(name, fn[0] ? fn : tiploc, 127);
+   name[127] = '\0';
    return name;
 }
 
@@ -0,0 +1,458 @@
+/*
+    Copyright (C) 2026 Phil Wieland
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    phil@philwieland.com
+
+*/
+
+#include <string.h>
+#include <strings.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "misc.h"
+#include "db.h"
+#include "corpus.h"
+
+// File layout:  Header, the locations in corpus table order, then the numbers of the locations sorted by STANOX, of
+// those with a TIPLOC sorted by TIPLOC, and of those with a 3-alpha code sorted by that, then the string table.
+struct corpus_header
+{
+   dword magic;
+   dword locations, tiplocs, alphas;
+   dword strings;
+   dword spare;
+   qword written;
+};
+
+// Each thread maps the snapshot for itself, so that one thread's remap can't pull it from under another.
+static __thread const struct corpus_header * snapshot;
+static __thread size_t snapshot_size;
+static __thread const struct corpus_location * locations;
+static __thread const dword * by_stanox, * by_tiploc, * by_3alpha;
+static __thread const char * strings;
+static __thread dev_t snapshot_dev;
+static __thread ino_t snapshot_ino;
+static __thread time_t snapshot_checked;
+
+static const char * snapshot_path(void);
+static word stanox_valid(const char * const stanox);
+static const char * query_one(const char * const query, char * const result, const size_t size);
+static word snapshot_map(const char * const path);
+static void snapshot_unmap(void);
+static dword search_index(const dword * const index, const dword count, int (* const compare)(const struct corpus_location * const, const void * const), const void * const key);
+static const struct corpus_location * search(const dword * const index, const dword count, int (* const compare)(const struct corpus_location * const, const void * const), const void * const key);
+static int compare_stanox(const struct corpus_location * const location, const void * const key);
+static int compare_tiploc(const struct corpus_location * const location, const void * const key);
+static int compare_3alpha(const struct corpus_location * const location, const void * const key);
+static int sort_stanox(const void * a, const void * b);
+static int sort_tiploc(const void * a, const void * b);
+static int sort_3alpha(const void * a, const void * b);
+
+word corpus_open(void)
+{
+   struct stat st;
+   time_t now = time(NULL);
+
+   if(now < snapshot_checked + CORPUS_CHECK_INTERVAL) return snapshot ? 0 : 1;
+   snapshot_checked = now;
+
+   if(stat(snapshot_path(), &st))
+   {
+      snapshot_unmap();
+      return 1;
+   }
+   if(snapshot && st.st_dev == snapshot_dev && st.st_ino == snapshot_ino) return 0;
+
+   return snapshot_map(snapshot_path());
+}
+
+const struct corpus_location * corpus_by_stanox(const dword stanox)
+{
+   dword i, first;
+
+   if(!snapshot) return NULL;
+   first = search_index(by_stanox, snapshot->locations, compare_stanox, &stanox);
+   if(first >= snapshot->locations) return NULL;
+   for(i = first; i < snapshot->locations && locations[by_stanox[i]].stanox == stanox; i++)
+   {
+      if(locations[by_stanox[i]].tiploc[0]) return locations + by_stanox[i];
+   }
+   return locations + by_stanox[first];
+}
+
+const struct corpus_location * corpus_by_tiploc(const char * const tiploc)
+{
+   if(!snapshot) return NULL;
+   return search(by_tiploc, snapshot->tiplocs, compare_tiploc, tiploc);
+}
+
+const struct corpus_location * corpus_by_3alpha(const char * const alpha)
+{
+   if(!snapshot) return NULL;
+   return search(by_3alpha, snapshot->alphas, compare_3alpha, alpha);
+}
+
+const char * corpus_fn(const struct corpus_location * const location)
+{
+   if(!snapshot || !location || location->fn >= snapshot->strings) return "";
+   return strings + location->fn;
+}
+
+word corpus_stanox_known(const char * const stanox)
+{
+   char query[256], result[16];
+
+   if(!stanox_valid(stanox)) return false;
+   if(!corpus_open()) return (corpus_by_stanox(atol(stanox)) != NULL);
+   sprintf(query, "SELECT 1 FROM corpus WHERE stanox = %s LIMIT 1", stanox);
+   return (query_one(query, result, sizeof(result))[0] != '\0');
+}
+
+const char * corpus_stanox_tiploc(const char * const stanox)
+{
+   static __thread char result[sizeof(((struct corpus_location *) 0)->tiploc)];
+   char query[256];
+
+   if(!stanox_valid(stanox)) return "";
+   if(!corpus_open())
+   {
+      const struct corpus_location * l = corpus_by_stanox(atol(stanox));
+      strcpy(result, l ? l->tiploc : "");
+      return result;
+   }
+   sprintf(query, "SELECT tiploc FROM corpus WHERE stanox = %s AND tiploc != ''", stanox);
+   return query_one(query, result, sizeof(result));
+}
+
+const char * corpus_tiploc_name(const char * const tiploc)
+{
+   static __thread char result[256];
+   char query[256], escaped[64];
+
+   if(!corpus_open())
+   {
+      strncpy(result, corpus_fn(corpus_by_tiploc(tiploc)), sizeof(result) - 1);
+      result[sizeof(result) - 1] = '\0';
+      return result;
+   }
+   if(strlen(tiploc) > 16) return "";
+   db_real_escape_string(escaped, tiploc, strlen(tiploc));
+   sprintf(query, "SELECT fn FROM corpus WHERE tiploc = '%s'", escaped);
+   return query_one(query, result, sizeof(result));
+}
+
+const char * corpus_stanox_name(const char * const stanox)
+{
+   static __thread char result[256];
+   char query[256];
+
+   if(!stanox_valid(stanox)) return "";
+   if(!corpus_open())
+   {
+      strncpy(result, corpus_fn(corpus_by_stanox(atol(stanox))), sizeof(result) - 1);
+      result[sizeof(result) - 1] = '\0';
+      return result;
+   }
+   sprintf(query, "SELECT fn FROM corpus WHERE stanox = %s", stanox);
+   return query_one(query, result, sizeof(result));
+}
+
+static word stanox_valid(const char * const stanox)
+{
+   // Non-empty and all digits, so that it is safe in a query and isn't taken as STANOX 0.
+   size_t l = strlen(stanox);
+   return (l && l <= 16 && strspn(stanox, "0123456789") == l);
+}
+
+static const char * query_one(const char * const query, char * const result, const size_t size)
+{
+   // First column of the first row, or "".
+   MYSQL_RES * db_result;
+   MYSQL_ROW db_row;
+
+   result[0] = '\0';
+   if(!db_query(query))
+   {
+      db_result = db_store_result();
+      if((db_row = mysql_fetch_row(db_result)) && db_row[0])
+      {
+         strncpy(result, db_row[0], size - 1);
+         result[size - 1] = '\0';
+      }
+      mysql_free_result(db_result);
+   }
+   return result;
+}
+
+static const char * snapshot_path(void)
+{
+   return *conf[conf_corpus_snapshot] ? conf[conf_corpus_snapshot] : CORPUS_SNAPSHOT;
+}
+
+static word snapshot_map(const char * const path)
+{
+   // Map the file, and drop any previous mapping if it is good.
+   struct stat st;
+   const struct corpus_header * h;
+   int fd;
+   dword i;
+
+   if((fd = open(path, O_RDONLY)) < 0) return 1;
+   if(fstat(fd, &st) || (size_t) st.st_size < sizeof(struct corpus_header))
+   {
+      close(fd);
+      return 1;
+   }
+   h = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+   close(fd);
+   if(h == MAP_FAILED)
+   {
+      _log(MAJOR, "Failed to map corpus snapshot \"%s\".  Error %d %s", path, errno, strerror(errno));
+      return 1;
+   }
+
+   const struct corpus_location * l = (const struct corpus_location *) (h + 1);
+   const dword * s = (const dword *) (l + h->locations);
+   const dword * t = s + h->locations;
+   const dword * a = t + h->tiplocs;
+   const char * z = (const char *) (a + h->alphas);
+   word good = h->magic == CORPUS_MAGIC &&
+      h->tiplocs <= h->locations && h->alphas <= h->locations && h->strings &&
+      sizeof(*h) + (size_t) h->locations * sizeof(*l) + ((size_t) h->locations + h->tiplocs + h->alphas) * sizeof(dword) + h->strings == (size_t) st.st_size &&
+      !z[h->strings - 1];
+   for(i = 0; good && i < h->locations; i++)
+   {
+      if(l[i].tiploc[sizeof(l[i].tiploc) - 1] || l[i].alpha[sizeof(l[i].alpha) - 1] || s[i] >= h->locations) good = false;
+   }
+   for(i = 0; good && i < h->tiplocs; i++) if(t[i] >= h->locations) good = false;
+   for(i = 0; good && i < h->alphas;  i++) if(a[i] >= h->locations) good = false;
+   if(!good)
+   {
+      _log(MAJOR, "Corpus snapshot \"%s\" is not valid.", path);
+      munmap((void *) h, st.st_size);
+      return 1;
+   }
+
+   snapshot_unmap();
+   snapshot = h;
+   snapshot_size = st.st_size;
+   snapshot_dev = st.st_dev;
+   snapshot_ino = st.st_ino;
+   locations = l;
+   by_stanox = s;
+   by_tiploc = t;
+   by_3alpha = a;
+   strings = z;
+   _log(DEBUG, "Mapped corpus snapshot \"%s\", %d locations.", path, h->locations);
+   return 0;
+}
+
+static void snapshot_unmap(void)
+{
+   if(snapshot) munmap((void *) snapshot, snapshot_size);
+   snapshot = NULL;
+}
+
+static dword search_index(const dword * const index, const dword count, int (* const compare)(const struct corpus_location * const, const void * const), const void * const key)
+{
+   // Position in the index of the first match, or count.
+   dword low = 0, high = count, mid;
+
+   while(low < high)
+   {
+      mid = low + (high - low) / 2;
+      if(compare(locations + index[mid], key) < 0) low = mid + 1;
+      else high = mid;
+   }
+   if(low < count && !compare(locations + index[low], key)) return low;
+   return count;
+}
+
+static const struct corpus_location * search(const dword * const index, const dword count, int (* const compare)(const struct corpus_location * const, const void * const), const void * const key)
+{
+   // First match in the index, or NULL.
+   dword i = search_index(index, count, compare, key);
+   return (i < count) ? locations + index[i] : NULL;
+}
+
+static int compare_stanox(const struct corpus_location * const location, const void * const key)
+{
+   dword stanox = *(const dword *) key;
+   return (location->stanox < stanox) ? -1 : (location->stanox > stanox);
+}
+
+static int compare_tiploc(const struct corpus_location * const location, const void * const key)
+{
+   return strcasecmp(location->tiploc, key);
+}
+
+static int compare_3alpha(const struct corpus_location * const location, const void * const key)
+{
+   return strcasecmp(location->alpha, key);
+}
+
+// Writer.  The sort functions compare location numbers.
+static struct corpus_location * sort_locations;
+
+word corpus_snapshot_write(void)
+{
+   // Returns 0 on success.
+   MYSQL_RES * result;
+   MYSQL_ROW row;
+   struct corpus_header h;
+   struct corpus_location * l;
+   dword * s, * t, * a, i;
+   char * z, * zz;
+   size_t z_size, z_length;
+   char path[512];
+   FILE * fp;
+   word failed = false;
+
+   if(db_query("SELECT stanox, tiploc, 3alpha, fn FROM corpus ORDER BY id")) return 1;
+   result = db_store_result();
+
+   memset(&h, 0, sizeof(h));
+   h.magic = CORPUS_MAGIC;
+   h.locations = mysql_num_rows(result);
+   h.written = time(NULL);
+   l = calloc(h.locations + 1, sizeof(*l));
+   s = malloc((h.locations + 1) * sizeof(dword));
+   t = malloc((h.locations + 1) * sizeof(dword));
+   a = malloc((h.locations + 1) * sizeof(dword));
+   z_size = 1024 * 1024;
+   z = malloc(z_size);
+   if(!l || !s || !t || !a || !z)
+   {
+      _log(MAJOR, "corpus_snapshot_write():  Out of memory.");
+      failed = true;
+   }
+
+   // The string table starts with "", for locations with no name.
+   z_length = 1;
+   if(z) z[0] = '\0';
+   for(i = 0; !failed && i < h.locations && (row = mysql_fetch_row(result)); i++)
+   {
+      size_t fn_length = strlen(row[3]);
+      l[i].stanox = atol(row[0]);
+      if(strlen(row[1]) < sizeof(l[i].tiploc)) strcpy(l[i].tiploc, row[1]);
+      if(strlen(row[2]) < sizeof(l[i].alpha))  strcpy(l[i].alpha, row[2]);
+      if(fn_length)
+      {
+         if(z_length + fn_length + 1 > z_size)
+         {
+            z_size *= 2;
+            if(!(zz = realloc(z, z_size)))
+            {
+               _log(MAJOR, "corpus_snapshot_write():  Out of memory.");
+               failed = true;
+               break;
+            }
+            z = zz;
+         }
+         l[i].fn = z_length;
+         memcpy(z + z_length, row[3], fn_length + 1);
+         z_length += fn_length + 1;
+      }
+      s[i] = i;
+      if(l[i].tiploc[0]) t[h.tiplocs++] = i;
+      if(l[i].alpha[0])  a[h.alphas++] = i;
+   }
+   mysql_free_result(result);
+   h.locations = i;
+   h.strings = z_length;
+
+   if(!failed)
+   {
+      sort_locations = l;
+      qsort(s, h.locations, sizeof(dword), sort_stanox);
+      qsort(t, h.tiplocs,   sizeof(dword), sort_tiploc);
+      qsort(a, h.alphas,    sizeof(dword), sort_3alpha);
+
+      // Write a new file and rename it over the old one, so that readers never see a partial file.
+      snprintf(path, sizeof(path), "%s.new", snapshot_path());
+      if(!(fp = fopen(path, "w")))
+      {
+         _log(MAJOR, "Failed to open \"%s\" for writing.  Error %d %s", path, errno, strerror(errno));
+         failed = true;
+      }
+      else
+      {
+         if(fwrite(&h, sizeof(h), 1, fp) != 1 ||
+            fwrite(l, sizeof(*l), h.locations, fp) != h.locations ||
+            fwrite(s, sizeof(dword), h.locations, fp) != h.locations ||
+            fwrite(t, sizeof(dword), h.tiplocs, fp) != h.tiplocs ||
+            fwrite(a, sizeof(dword), h.alphas, fp) != h.alphas ||
+            fwrite(z, 1, h.strings, fp) != h.strings)
+         {
+            failed = true;
+         }
+         if(fclose(fp)) failed = true;
+         if(failed)
+         {
+            _log(MAJOR, "Failed to write \"%s\".  Error %d %s", path, errno, strerror(errno));
+            unlink(path);
+         }
+         else if(rename(path, snapshot_path()))
+         {
+            _log(MAJOR, "Failed to rename \"%s\".  Error %d %s", path, errno, strerror(errno));
+            unlink(path);
+            failed = true;
+         }
+      }
+   }
+
+   if(!failed)
+   {
+      _log(GENERAL, "Corpus snapshot \"%s\" written.  %s locations.", snapshot_path(), commas(h.locations));
+      snapshot_checked = 0;
+   }
+   free(l);
+   free(s);
+   free(t);
+   free(a);
+   free(z);
+   return failed;
+}
+
+static int sort_stanox(const void * a, const void * b)
+{
+   // By STANOX, then those with a TIPLOC first, then in table order.
+   const struct corpus_location * la = sort_locations + *(const dword *) a;
+   const struct corpus_location * lb = sort_locations + *(const dword *) b;
+   if(la->stanox != lb->stanox) return (la->stanox < lb->stanox) ? -1 : 1;
+   if(!la->tiploc[0] != !lb->tiploc[0]) return la->tiploc[0] ? -1 : 1;
+   return (*(const dword *) a < *(const dword *) b) ? -1 : 1;
+}
+
+static int sort_tiploc(const void * a, const void * b)
+{
+   int r = strcasecmp(sort_locations[*(const dword *) a].tiploc, sort_locations[*(const dword *) b].tiploc);
+   if(r) return r;
+   return (*(const dword *) a < *(const dword *) b) ? -1 : 1;
+}
+
+static int sort_3alpha(const void * a, const void * b)
+{
+   int r = strcasecmp(sort_locations[*(const dword *) a].alpha, sort_locations[*(const dword *) b].alpha);
+   if(r) return r;
+   return (*(const dword *) a < *(const dword *) b) ? -1 : 1;
+}
@@ -0,0 +1,58 @@
+/*
+    Copyright (C) 2026 Phil Wieland
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    phil@philwieland.com
+
+*/
+
+// Snapshot of the corpus table.  corpusdb writes it after each load, to the file given by corpus_snapshot in the
+// config file, or CORPUS_SNAPSHOT.  Any program can then look up locations by STANOX, TIPLOC or 3-alpha code
+// without going to the database.  corpus_open() maps the file, and maps it again if corpusdb has replaced it.
+// It returns non-zero if there is no usable snapshot, in which case ask the database instead.
+// Pointers returned are valid until the next call of corpus_open() by the same thread.  Each thread has its own
+// mapping.  TIPLOC and 3-alpha matches ignore case.
+// Only the corpus table is included.  The 20 character names in friendly_names_20, which tddb maintains, are not.
+
+#define CORPUS_SNAPSHOT "/var/lib/garner/corpus.snapshot"
+#define CORPUS_MAGIC 0x50524f43
+// Seconds between checks that the file has not been replaced.
+#define CORPUS_CHECK_INTERVAL 64
+
+struct corpus_location
+{
+   dword stanox;
+   dword fn;        // Friendly name, as an offset into the string table.  Use corpus_fn().
+   char tiploc[8];
+   char alpha[4];   // 3-alpha (CRS) code
+};
+
+extern word corpus_open(void);
+// By STANOX, a location with a TIPLOC if there is one.
+extern const struct corpus_location * corpus_by_stanox(const dword stanox);
+extern const struct corpus_location * corpus_by_tiploc(const char * const tiploc);
+extern const struct corpus_location * corpus_by_3alpha(const char * const alpha);
+extern const char * corpus_fn(const struct corpus_location * const location);
+
+// Lookups which use the snapshot if there is one, otherwise the database.  They return "" if the location is not
+// known, or has no TIPLOC or name.  The result is in a per-thread buffer, overwritten by the next call of the function.
+// A STANOX must be all digits.
+extern word corpus_stanox_known(const char * const stanox);
+extern const char * corpus_stanox_tiploc(const char * const stanox);
+extern const char * corpus_tiploc_name(const char * const tiploc);
+extern const char * corpus_stanox_name(const char * const stanox);
+
+// Used by corpusdb.  Writes the snapshot from the corpus table.
+extern word corpus_snapshot_write(void);
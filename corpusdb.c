@@ -33,6 +33,7 @@
 #include "misc.h"
 #include "db.h"
 #include "database.h"
+#include "corpus.h"
 #include "build.h"
 
 #define NAME  "corpusdb"
@@ -66,7 +67,7 @@ static const char * const stats_category[MAXStats] =
 static word fetch_corpus(void);
 static size_t corpus_write_data(void *buffer, size_t size, size_t nmemb, void *userp);
 static word process_corpus(void);
-static void process_corpus_object(const char * object_string);
+static void process_corpus_object(const char * const object_string, const jsmntok_t * const tokens);
 static word update_friendly_names(void);
 
 word opt_insecure, used_insecure, opt_verbose;
@@ -163,11 +164,17 @@ int main(int argc, char **argv)
 
    if(!fetch_corpus() && !process_corpus() && !update_friendly_names())
    {
+      word snapshot_failed = corpus_snapshot_write();
       db_disconnect();
       char report[8192];
 
       _log(GENERAL, "End of run:");
       strcpy(report, "Corpus update completed:\n");
+      if(snapshot_failed)
+      {
+         strcat(report, "*** Warning: Failed to write corpus snapshot.\n");
+         _log(GENERAL, "*** Warning: Failed to write corpus snapshot.");
+      }
       if(used_insecure)
       {
          strcat(report, "*** Warning: Insecure download used.\n");
@@ -337,27 +344,38 @@ static word process_corpus(void)
 {
    char zs[1024];
 
-#define MAX_BUF 32768
-   char buffer[MAX_BUF];
-#define MAX_OBJ 65536
-   char obj[MAX_OBJ];
-   char in_q = 0;
-   char b_depth = 0;
-
-   size_t ibuf;
-   size_t iobj = 0;
-   size_t buf_end;
+#define MAX_TOKENS 1024
+   jsmntok_t tokens[MAX_TOKENS];
+   jsmn_stream stream;
+   jsmnerr_t r;
+   char * json;
+   long length;
 
    FILE * fp;
    
 
-   // Read in json data
+   // Read in json data.  It is parsed in place, one location at a time.
    if(!(fp = fopen(filepath, "r")))
    {
       sprintf(zs, "Failed to open \"%s\" for reading.", filepath);
       _log(CRITICAL, zs);
       return 11;
    }      
+   if(fseek(fp, 0, SEEK_END) || (length = ftell(fp)) < 0 || fseek(fp, 0, SEEK_SET) || !(json = malloc(length + 1)))
+   {
+      _log(CRITICAL, "Failed to load \"%s\".", filepath);
+      fclose(fp);
+      return 11;
+   }
+   if(fread(json, 1, length, fp) != (size_t) length)
+   {
+      _log(CRITICAL, "Failed to read \"%s\".", filepath);
+      free(json);
+      fclose(fp);
+      return 11;
+   }
+   json[length] = '\0';
+   fclose(fp);
 
    // Reset the database
    word e;
@@ -373,34 +391,28 @@ static word process_corpus(void)
 
    _log(GENERAL, "Processing CORPUS data.");
 
-   // Bodge:  Bin off the array stuff
-   buf_end = fread(buffer, 1, 15, fp);
-
-   while((buf_end = fread(buffer, 1, MAX_BUF, fp)))
+   jsmn_stream_init(&stream, json);
+   while((r = jsmn_stream_next(&stream, tokens, MAX_TOKENS)) != JSMN_END)
    {
-      for(ibuf = 0; ibuf < buf_end; ibuf++)
+      if(r != JSMN_SUCCESS)
       {
-         char c = buffer[ibuf];
-         if(c != '\r' && c != '\n') obj[iobj++] = c;
-         if(iobj >= MAX_OBJ)
-         {
-            obj[64] = '\0';
-            sprintf(zs, "Object buffer overflow:  \"%.100s\"...", obj);
-            _log(CRITICAL, zs);
-            exit(1);
-         }
-         if(c == '"') in_q = ! in_q;
-         if(!in_q && c == '{') b_depth++;
-         if(!in_q && c == '}' && b_depth-- && b_depth == 0)
+         sprintf(zs, "Parser result %d.  ", r);
+      
+         switch(r)
          {
-            obj[iobj] = '\0';
-            process_corpus_object(obj);
-            iobj = 0;
+         case JSMN_ERROR_INVAL: strcat(zs, "Error - Invalid.  "); break;
+         case JSMN_ERROR_NOMEM: strcat(zs, "Error - Nomem.  "); break;
+         case JSMN_ERROR_PART:  strcat(zs, "Error - Part JSON.  "); break;
+         default:               strcat(zs, "Unknown response.  "); break;
          }
+      
+         _log(MAJOR, zs);
+         continue;
       }
+      process_corpus_object(json, tokens);
    }
 
-   fclose(fp);
+   free(json);
    return 0;
    
 }
@@ -414,35 +426,10 @@ if((zs[0] == '\0') || (zs[1] == '\0' && zs[0] == ' ')) { zs[0] = '0'; zs[1] = '\
 db_real_escape_string(zs1, zs, strlen(zs)); \
 strcat(query, ", "); strcat(query, zs1); }
 
-static void process_corpus_object(const char * object_string)
+static void process_corpus_object(const char * const object_string, const jsmntok_t * const tokens)
 {
    char zs[1024], zs1[1024];
 
-   jsmn_parser parser;
-
-#define MAX_TOKENS 1024
-   jsmntok_t tokens[MAX_TOKENS];
-
-   jsmn_init(&parser);
-
-   int r = jsmn_parse(&parser, object_string, tokens, MAX_TOKENS);
-   if(r != JSMN_SUCCESS)
-   {
-      sprintf(zs, "Parser result %d.  ", r);
-      
-      switch(r)
-      {
-      case JSMN_SUCCESS:     strcat(zs, "Success.  "); break;
-      case JSMN_ERROR_INVAL: strcat(zs, "Error - Invalid.  "); break;
-      case JSMN_ERROR_NOMEM: strcat(zs, "Error - Nomem.  "); break;
-      case JSMN_ERROR_PART:  strcat(zs, "Error - Part JSON.  "); break;
-      default:               strcat(zs, "Unknown response.  "); break;
-      }
-      
-      _log(MAJOR, zs);
-      return;
-   }
-
    char query[2048];
    char nlcdesc16[1024];
 
@@ -499,6 +499,20 @@ word database_upgrade(const word caller)
       _log(GENERAL, "Created database table \"trust_movement\".");
    }
 
+   if((caller == trustdb) && !table_exists("trust_frame_part"))
+   {
+      if((result = db_query(
+"CREATE TABLE trust_frame_part "
+"(digest             BIGINT NOT NULL, "
+"shards              TINYINT UNSIGNED NOT NULL, "
+"shard               TINYINT UNSIGNED NOT NULL, "
+"created             INT UNSIGNED NOT NULL, "
+"PRIMARY KEY(digest, shards, shard), INDEX(created) "
+") ENGINE = InnoDB"
+               ))) return result;
+      _log(GENERAL, "Created database table \"trust_frame_part\".");
+   }
+
    if((caller == trustdb) && !table_exists("trust_changeorigin"))
    {
       if((result = db_query(
@@ -21,16 +21,95 @@
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdarg.h>
+#include <ctype.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
 #include "misc.h"
 #include "db.h"
 #include "jsmn.h"
 
-static MYSQL * mysql_object;
+// The connection, statement handles, batches and db_errored belong to the thread.
+static __thread MYSQL * mysql_object;
 static char server[256], user[256], password[256], database[256];
 static word mode_flags;
 
+// Read replica.  Used in DB_MODE_REPLICA if configured, and if not more than this many seconds behind.
+#define REPLICA_MAX_LAG 120
+static word replica_rejected;
+
+// Prepared statements.  The SQL is kept so that they can be prepared again after a reconnect.
+static struct
+{
+   char name[32];
+   char * sql;
+} statements[DB_STATEMENTS];
+static word statement_count;
+static __thread MYSQL_STMT * statement_stmt[DB_STATEMENTS];
+
+// Multi-row INSERT batches.  Rows are pending on the connection of the thread which added them.
+static struct
+{
+   char * prefix;
+   size_t max_bytes;
+   word max_rows;
+} batches[DB_BATCHES];
+static word batch_count;
+static __thread struct
+{
+   char * buffer;
+   size_t length, size;
+   word rows;
+} pending[DB_BATCHES];
+
+// Query profile.  Latency buckets are quarter octaves of microseconds.
+#define PROFILE_BUCKETS 144
+static struct profile
+{
+   char text[DB_PROFILE_TEXT];
+   qword count, total, max, rows;
+   dword bucket[PROFILE_BUCKETS];
+} profiles[DB_PROFILE_TEMPLATES];
+static word profile_used, profile_installed;
+static pthread_mutex_t profile_lock = PTHREAD_MUTEX_INITIALIZER;
+// Entry of this thread's last query, for db_store_result(), valid while profile_period is unchanged.
+static __thread word profile_last;
+static __thread dword profile_last_period;
+static dword profile_period;
+static time_t profile_start;
+static volatile sig_atomic_t profile_report_due;
+
+// Asynchronous mode.
+static pthread_t async_thread;
+static pthread_mutex_t async_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t async_work = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t async_done = PTHREAD_COND_INITIALIZER;
+static struct
+{
+   void (* job)(void * const);
+   void * arg;
+} async_queue[DB_ASYNC_DEPTH];
+static qword async_submitted, async_completed;
+static word async_running, async_stopping;
+
+static word open_connection(const char * const host, const word level);
+static word check_replica(void);
+static word prepare_statement(const word handle);
+static void close_statements(void);
+static word flush_batches(void);
+static word discard_batches(void);
+static qword profile_clock(void);
+static void profile_record(const char * const query, const qword elapsed, const qword rows);
+static size_t profile_literal(char * const t, size_t o);
+static qword profile_percentile(const struct profile * const p, const word percent);
+static void profile_signal(int signum);
+static void profile_exit(void);
+static void * async_worker(void * arg);
+static void async_check(void);
+
 /* Public data */
-word db_errored;
+__thread word db_errored;
 
 word db_init(const char * const s, const char * const u, const char * const p, const char * const d, const word f)
 {
@@ -47,6 +126,23 @@ word db_init(const char * const s, const char * const u, const char * const p, c
    mysql_object = 0;
    db_errored = false;
    mode_flags = f;
+   replica_rejected = false;
+
+   if(!profile_installed)
+   {
+      // Leave SIGUSR1 alone if the program has its own use for it.
+      struct sigaction act;
+      if(!sigaction(SIGUSR1, NULL, &act) && act.sa_handler == SIG_DFL)
+      {
+         act.sa_handler = profile_signal;
+         sigemptyset(&act.sa_mask);
+         act.sa_flags = SA_RESTART;
+         sigaction(SIGUSR1, &act, NULL);
+      }
+      if(*conf[conf_db_profile]) atexit(profile_exit);
+      profile_start = time(NULL);
+      profile_installed = true;
+   }
 
    // Test if database is there
    return db_connect();
@@ -54,6 +150,12 @@ word db_init(const char * const s, const char * const u, const char * const p, c
 
 word db_query(const char * const query)
 {
+   async_check();
+   qword start;
+   int rc;
+
+   if(profile_report_due) db_profile_report();
+
    if(strlen(query) > 4000)
    {
       _log(MAJOR, "db_query() called with overlong query.");
@@ -64,8 +166,12 @@ word db_query(const char * const query)
    _log(PROC, "db_query(\"%s\")", query);
 
    if(db_connect()) return 9;
+   if(flush_batches()) return 3;
    
-   if(mysql_query(mysql_object, query))
+   start = profile_clock();
+   rc = mysql_query(mysql_object, query);
+   profile_record(query, profile_clock() - start, (rc || mysql_field_count(mysql_object)) ? 0 : mysql_affected_rows(mysql_object));
+   if(rc)
    {
       _log(CRITICAL, "db_query():  mysql_query() Error %u: %s    Query:", mysql_errno(mysql_object), mysql_error(mysql_object));
       _log(CRITICAL, query);
@@ -79,18 +185,34 @@ word db_query(const char * const query)
 
 MYSQL_RES * db_store_result(void)
 {
-   if(mysql_object) return mysql_store_result(mysql_object);
-   return NULL;
+   async_check();
+   // The time taken to transfer the result, and the number of rows, count towards the profile of the query.
+   MYSQL_RES * result;
+   qword start = profile_clock();
+
+   if(!mysql_object) return NULL;
+
+   result = mysql_store_result(mysql_object);
+   pthread_mutex_lock(&profile_lock);
+   if(profile_last && profile_last_period == profile_period)
+   {
+      profiles[profile_last - 1].total += profile_clock() - start;
+      if(result) profiles[profile_last - 1].rows += mysql_num_rows(result);
+   }
+   pthread_mutex_unlock(&profile_lock);
+   return result;
 }
 
 MYSQL_RES * db_use_result(void)
 {
+   async_check();
    if(mysql_object) return mysql_use_result(mysql_object);
    return NULL;
 }
 
 qword db_affected_rows(void)
 {
+   async_check();
    _log(PROC, "db_affected_rows()");
    if(db_connect()) return 0LL;
 
@@ -101,6 +223,7 @@ qword db_affected_rows(void)
 
 word db_row_count(void)
 {
+   async_check();
    // Returns number of rows affected by immediately preceding DELETE or UPDATE.
    // Doesn't work after a SELECT.
    // Doesn't work after COMMITting.
@@ -131,47 +254,113 @@ word db_row_count(void)
 
 word db_connect(void)
 {
-   dword flags;
+   async_check();
    _log(PROC, "db_connect()");
 
    if(!mysql_object)
    {
-      _log(DEBUG, "   Connecting to database.");
-      mysql_object = mysql_init(NULL);
-      if(mysql_object == NULL)
+      if((mode_flags & DB_MODE_REPLICA) && *conf[conf_db_replica_server] && !replica_rejected)
       {
-         _log(CRITICAL, "db_connect() error 1: mysql_init() returned NULL");
-         db_errored = true;
-         return 1;
+         if(!open_connection(conf[conf_db_replica_server], MINOR) && !check_replica())
+         {
+            _log(GENERAL, "Connection to database \"%s\" on replica \"%s\" opened.", database, conf[conf_db_replica_server]);
+            return 0;
+         }
+         // Don't try it again for the life of this program.
+         db_disconnect();
+         db_errored = false;
+         replica_rejected = true;
+         _log(MINOR, "Using primary database server.");
       }
-   
-      flags = 0;
-      if(mode_flags & 0x0001) flags += CLIENT_FOUND_ROWS;
 
-      if(mysql_real_connect(mysql_object, server, user, password, database, 0, NULL, flags) == NULL) 
+      word rc = open_connection(server, CRITICAL);
+      if(rc)
       {
-         _log(CRITICAL, "db_connect() error 2: Connect failed:  Error %u: %s", mysql_errno(mysql_object), mysql_error(mysql_object));
          db_errored = true;
-
          db_disconnect();
-         return 2;
+         return rc;
       }
 
-      // Disable auto-reconnect
-      // my_bool reconnect = 0;
-      int reconnect = 0;
-      mysql_options(mysql_object, MYSQL_OPT_RECONNECT, &reconnect);   
-
       _log(GENERAL, "Connection to database \"%s\" opened.", database);
    }
   
    return 0;
 }
 
+static word open_connection(const char * const host, const word level)
+{
+   dword flags;
+
+   _log(DEBUG, "   Connecting to database on \"%s\".", host);
+   mysql_object = mysql_init(NULL);
+   if(mysql_object == NULL)
+   {
+      _log(level, "db_connect() error 1: mysql_init() returned NULL");
+      return 1;
+   }
+   
+   flags = 0;
+   if(mode_flags & DB_MODE_FOUND_ROWS) flags += CLIENT_FOUND_ROWS;
+
+   if(mysql_real_connect(mysql_object, host, user, password, database, 0, NULL, flags) == NULL) 
+   {
+      _log(level, "db_connect() error 2: Connect to \"%s\" failed:  Error %u: %s", host, mysql_errno(mysql_object), mysql_error(mysql_object));
+      return 2;
+   }
+
+   // Disable auto-reconnect
+   // my_bool reconnect = 0;
+   int reconnect = 0;
+   mysql_options(mysql_object, MYSQL_OPT_RECONNECT, &reconnect);   
+
+   return 0;
+}
+
+static word check_replica(void)
+{
+   // Returns 0 if the replica is up to date.  The daemons stamp the status table as they process each message,
+   // so the most recent stamp shows how far replication has got.
+   MYSQL_RES * result;
+   MYSQL_ROW row;
+   time_t stamp = 0, lag, max_lag;
+
+   max_lag = atol(conf[conf_db_replica_max_lag]);
+   if(max_lag <= 0) max_lag = REPLICA_MAX_LAG;
+
+   if(mysql_query(mysql_object, "SELECT GREATEST(last_trust_processed, last_td_processed) FROM status"))
+   {
+      _log(MINOR, "Replica status query failed:  Error %u: %s", mysql_errno(mysql_object), mysql_error(mysql_object));
+      return 1;
+   }
+   if((result = mysql_store_result(mysql_object)))
+   {
+      if((row = mysql_fetch_row(result)) && row[0]) stamp = atol(row[0]);
+      mysql_free_result(result);
+   }
+
+   lag = time(NULL) - stamp;
+   if(lag > max_lag)
+   {
+      _log(MINOR, "Replica \"%s\" is %ld seconds behind, limit %ld.", conf[conf_db_replica_server], (long) lag, (long) max_lag);
+      return 1;
+   }
+   _log(DEBUG, "   Replica is %ld seconds behind.", (long) lag);
+   return 0;
+}
+
 void db_disconnect(void)
 {
+   async_check();
+   word discarded;
+
+   if((discarded = discard_batches()))
+   {
+      _log(MAJOR, "db_disconnect():  %d unsent batched rows discarded.", discarded);
+   }
+
    if(mysql_object) 
    {
+      close_statements();
       mysql_close(mysql_object);
       _log(GENERAL, "Connection to database closed.");
    }
@@ -180,6 +369,7 @@ void db_disconnect(void)
 
 void dump_mysql_result_query(const char * const query)
 {
+   async_check();
    if(db_connect()) return;
 
    MYSQL_RES * result;
@@ -232,6 +422,7 @@ void dump_mysql_result(MYSQL_RES * result)
 
 dword db_insert_id(void)
 {
+   async_check();
    if(mysql_object) return mysql_insert_id(mysql_object);
    return 0;
 }
@@ -266,9 +457,701 @@ word db_commit_transaction(void)
 
 word db_rollback_transaction(void)
 {
+   discard_batches();
    word r = db_query("ROLLBACK");
    if(r) db_errored = true;
    _log(TRANSACTION_LOG_LEVEL, "db_rollback_transaction() returns %d", r);
    return r;
 }
 
+word db_statement(const char * const name, const char * const sql)
+{
+   async_check();
+   // Returns handle, or 0 on failure.  Registering the same name again returns the existing handle.
+   // The statement is prepared when it is first executed on each connection.
+   word i;
+
+   _log(PROC, "db_statement(\"%s\", \"%s\")", name, sql);
+
+   for(i = 0; i < statement_count; i++)
+   {
+      if(!strcmp(statements[i].name, name)) return i + 1;
+   }
+
+   if(statement_count >= DB_STATEMENTS || strlen(name) >= sizeof(statements[0].name))
+   {
+      _log(MAJOR, "db_statement():  Cannot register statement \"%s\".", name);
+      return 0;
+   }
+
+   if(!(statements[statement_count].sql = strdup(sql)))
+   {
+      _log(MAJOR, "db_statement():  Out of memory.");
+      return 0;
+   }
+   strcpy(statements[statement_count].name, name);
+
+   return ++statement_count;
+}
+
+word db_execute(const word handle, const char * const types, ...)
+{
+   async_check();
+   // Execute a registered statement with bound parameters.  Return codes as db_query().
+   // Any result set is stored client side, ready for db_fetch().
+   MYSQL_BIND bind[DB_STATEMENT_BINDS];
+   long long value[DB_STATEMENT_BINDS];
+   unsigned long length[DB_STATEMENT_BINDS];
+   MYSQL_STMT * stmt;
+   word i, n;
+   qword start;
+   int rc;
+   va_list args;
+
+   if(profile_report_due) db_profile_report();
+
+   if(!handle || handle > statement_count || (n = strlen(types)) > DB_STATEMENT_BINDS)
+   {
+      _log(MAJOR, "db_execute() called with invalid statement %d.", handle);
+      db_errored = true;
+      return 99;
+   }
+
+   _log(PROC, "db_execute(\"%s\", \"%s\")", statements[handle - 1].name, types);
+
+   if(db_connect()) return 9;
+   if(flush_batches()) return 3;
+   if(prepare_statement(handle)) return 3;
+   stmt = statement_stmt[handle - 1];
+
+   if(n != mysql_stmt_param_count(stmt))
+   {
+      _log(MAJOR, "db_execute():  Statement \"%s\" given %d parameters, requires %lu.", statements[handle - 1].name, n, mysql_stmt_param_count(stmt));
+      db_errored = true;
+      return 99;
+   }
+
+   // Discard any unread result from the previous execution.
+   mysql_stmt_free_result(stmt);
+
+   memset(bind, 0, sizeof(bind));
+   va_start(args, types);
+   for(i = 0; i < n; i++)
+   {
+      switch(types[i])
+      {
+      case 'i':
+         value[i] = va_arg(args, int);
+         bind[i].buffer_type = MYSQL_TYPE_LONGLONG;
+         bind[i].buffer = &value[i];
+         break;
+
+      case 'l':
+         value[i] = va_arg(args, long);
+         bind[i].buffer_type = MYSQL_TYPE_LONGLONG;
+         bind[i].buffer = &value[i];
+         break;
+
+      case 's':
+         bind[i].buffer_type = MYSQL_TYPE_STRING;
+         bind[i].buffer = (void *) va_arg(args, const char *);
+         bind[i].buffer_length = length[i] = strlen(bind[i].buffer);
+         bind[i].length = &length[i];
+         break;
+
+      default:
+         va_end(args);
+         _log(MAJOR, "db_execute():  Statement \"%s\" invalid parameter type '%c'.", statements[handle - 1].name, types[i]);
+         db_errored = true;
+         return 99;
+      }
+   }
+   va_end(args);
+
+   start = profile_clock();
+   rc = mysql_stmt_bind_param(stmt, bind) || mysql_stmt_execute(stmt) || (mysql_stmt_field_count(stmt) && mysql_stmt_store_result(stmt));
+   profile_record(statements[handle - 1].sql, profile_clock() - start, rc ? 0 : (mysql_stmt_field_count(stmt) ? mysql_stmt_num_rows(stmt) : mysql_stmt_affected_rows(stmt)));
+   if(rc)
+   {
+      _log(CRITICAL, "db_execute():  Statement \"%s\" Error %u: %s    Query:", statements[handle - 1].name, mysql_stmt_errno(stmt), mysql_stmt_error(stmt));
+      _log(CRITICAL, statements[handle - 1].sql);
+      db_errored = true;
+
+      db_disconnect();
+      return 3;
+   }
+   return 0;
+}
+
+word db_fetch(const word handle, const char * const types, ...)
+{
+   async_check();
+   // Fetch the next row of the result of the last db_execute() of this statement into the given variables.
+   // Returns 0 if a row was fetched, 1 if there are no more rows, 3 on error.
+   // Strings are truncated to fit, and NULL columns are returned as zero or "".
+   MYSQL_BIND bind[DB_STATEMENT_BINDS];
+   long long value[DB_STATEMENT_BINDS];
+   unsigned long length[DB_STATEMENT_BINDS];
+   __typeof__(*bind[0].is_null) null[DB_STATEMENT_BINDS]; // my_bool or bool, depending on client library version.
+   void * target[DB_STATEMENT_BINDS];
+   size_t size[DB_STATEMENT_BINDS];
+   MYSQL_STMT * stmt;
+   word i, n;
+   int rc;
+   va_list args;
+
+   if(!handle || handle > statement_count || (n = strlen(types)) > DB_STATEMENT_BINDS)
+   {
+      _log(MAJOR, "db_fetch() called with invalid statement %d.", handle);
+      return 3;
+   }
+   if(!(stmt = statement_stmt[handle - 1])) return 1;
+
+   if(n != mysql_stmt_field_count(stmt))
+   {
+      _log(MAJOR, "db_fetch():  Statement \"%s\" given %d columns, result has %u.", statements[handle - 1].name, n, mysql_stmt_field_count(stmt));
+      return 3;
+   }
+
+   memset(bind, 0, sizeof(bind));
+   va_start(args, types);
+   for(i = 0; i < n; i++)
+   {
+      bind[i].is_null = &null[i];
+      bind[i].length = &length[i];
+      switch(types[i])
+      {
+      case 'i':
+      case 'l':
+         target[i] = va_arg(args, void *);
+         bind[i].buffer_type = MYSQL_TYPE_LONGLONG;
+         bind[i].buffer = &value[i];
+         break;
+
+      case 's':
+         target[i] = va_arg(args, char *);
+         size[i] = va_arg(args, size_t);
+         bind[i].buffer_type = MYSQL_TYPE_STRING;
+         bind[i].buffer = target[i];
+         bind[i].buffer_length = size[i] - 1;
+         break;
+
+      default:
+         va_end(args);
+         _log(MAJOR, "db_fetch():  Statement \"%s\" invalid result type '%c'.", statements[handle - 1].name, types[i]);
+         return 3;
+      }
+   }
+   va_end(args);
+
+   if(mysql_stmt_bind_result(stmt, bind))
+   {
+      _log(MAJOR, "db_fetch():  Statement \"%s\" Error %u: %s", statements[handle - 1].name, mysql_stmt_errno(stmt), mysql_stmt_error(stmt));
+      return 3;
+   }
+
+   rc = mysql_stmt_fetch(stmt);
+   if(rc == MYSQL_NO_DATA)
+   {
+      mysql_stmt_free_result(stmt);
+      return 1;
+   }
+   if(rc && rc != MYSQL_DATA_TRUNCATED)
+   {
+      _log(MAJOR, "db_fetch():  Statement \"%s\" Error %u: %s", statements[handle - 1].name, mysql_stmt_errno(stmt), mysql_stmt_error(stmt));
+      mysql_stmt_free_result(stmt);
+      return 3;
+   }
+
+   for(i = 0; i < n; i++)
+   {
+      switch(types[i])
+      {
+      case 'i': *((int *)  target[i]) = null[i] ? 0 : value[i]; break;
+      case 'l': *((long *) target[i]) = null[i] ? 0 : value[i]; break;
+      case 's': ((char *) target[i])[(null[i] || !size[i]) ? 0 : ((length[i] < size[i]) ? length[i] : size[i] - 1)] = '\0'; break;
+      }
+   }
+   return 0;
+}
+
+qword db_statement_affected_rows(const word handle)
+{
+   async_check();
+   if(handle && handle <= statement_count && statement_stmt[handle - 1]) return mysql_stmt_affected_rows(statement_stmt[handle - 1]);
+   return 0LL;
+}
+
+static word prepare_statement(const word handle)
+{
+   MYSQL_STMT * stmt;
+
+   if(statement_stmt[handle - 1]) return 0;
+
+   _log(DEBUG, "   Preparing statement \"%s\".", statements[handle - 1].name);
+   if(!(stmt = mysql_stmt_init(mysql_object)))
+   {
+      _log(CRITICAL, "prepare_statement():  mysql_stmt_init() returned NULL");
+      db_errored = true;
+      return 1;
+   }
+
+   if(mysql_stmt_prepare(stmt, statements[handle - 1].sql, strlen(statements[handle - 1].sql)))
+   {
+      _log(CRITICAL, "prepare_statement():  Statement \"%s\" Error %u: %s    Query:", statements[handle - 1].name, mysql_stmt_errno(stmt), mysql_stmt_error(stmt));
+      _log(CRITICAL, statements[handle - 1].sql);
+      mysql_stmt_close(stmt);
+      db_errored = true;
+
+      db_disconnect();
+      return 3;
+   }
+
+   statement_stmt[handle - 1] = stmt;
+   return 0;
+}
+
+static void close_statements(void)
+{
+   // Statements belong to the connection, so are closed with it.  They are prepared again on next use.
+   word i;
+
+   for(i = 0; i < statement_count; i++)
+   {
+      if(statement_stmt[i]) mysql_stmt_close(statement_stmt[i]);
+      statement_stmt[i] = NULL;
+   }
+}
+
+word db_batch(const char * const table, const char * const columns, const word max_rows, const size_t max_bytes)
+{
+   async_check();
+   // Returns handle, or 0 on failure.  columns may be NULL or "" to insert into every column in table order.
+   // max_rows and max_bytes may be 0 to use the defaults.
+   char prefix[2048];
+   word i;
+
+   _log(PROC, "db_batch(\"%s\", \"%s\", %d, %zu)", table, columns ? columns : "", max_rows, max_bytes);
+
+   if(strlen(table) + (columns ? strlen(columns) : 0) > 1000 || batch_count >= DB_BATCHES)
+   {
+      _log(MAJOR, "db_batch():  Cannot create batch for table \"%s\".", table);
+      return 0;
+   }
+
+   if(columns && columns[0])
+      sprintf(prefix, "INSERT INTO %s (%s) VALUES ", table, columns);
+   else
+      sprintf(prefix, "INSERT INTO %s VALUES ", table);
+
+   for(i = 0; i < batch_count; i++)
+   {
+      if(!strcmp(batches[i].prefix, prefix)) return i + 1;
+   }
+
+   if(!(batches[batch_count].prefix = strdup(prefix)))
+   {
+      _log(MAJOR, "db_batch():  Out of memory.");
+      return 0;
+   }
+   batches[batch_count].max_rows  = max_rows ? max_rows : DB_BATCH_ROWS;
+   batches[batch_count].max_bytes = max_bytes ? max_bytes : DB_BATCH_BYTES;
+
+   return ++batch_count;
+}
+
+word db_batch_add(const word handle, const char * const row)
+{
+   async_check();
+   // Return codes as db_query().  An error may be from sending earlier rows of the batch.
+   size_t l, needed;
+   char * buffer;
+
+   if(!handle || handle > batch_count)
+   {
+      _log(MAJOR, "db_batch_add() called with invalid batch %d.", handle);
+      db_errored = true;
+      return 99;
+   }
+
+   _log(PROC, "db_batch_add(%d, \"%s\")", handle, row);
+
+   l = strlen(row);
+   needed = (pending[handle - 1].rows ? pending[handle - 1].length : strlen(batches[handle - 1].prefix)) + l + 4;
+   if(needed > pending[handle - 1].size)
+   {
+      size_t size = pending[handle - 1].size ? pending[handle - 1].size : 65536;
+      while(size < needed) size *= 2;
+      if(!(buffer = realloc(pending[handle - 1].buffer, size)))
+      {
+         _log(MAJOR, "db_batch_add():  Out of memory.");
+         db_errored = true;
+         return 99;
+      }
+      pending[handle - 1].buffer = buffer;
+      pending[handle - 1].size   = size;
+   }
+
+   buffer = pending[handle - 1].buffer;
+   if(!pending[handle - 1].rows)
+   {
+      strcpy(buffer, batches[handle - 1].prefix);
+      pending[handle - 1].length = strlen(buffer);
+   }
+   else
+   {
+      buffer[pending[handle - 1].length++] = ',';
+   }
+   buffer[pending[handle - 1].length++] = '(';
+   memcpy(buffer + pending[handle - 1].length, row, l);
+   pending[handle - 1].length += l;
+   buffer[pending[handle - 1].length++] = ')';
+   buffer[pending[handle - 1].length] = '\0';
+
+   if(++pending[handle - 1].rows >= batches[handle - 1].max_rows || pending[handle - 1].length >= batches[handle - 1].max_bytes)
+   {
+      return db_batch_flush(handle);
+   }
+   return 0;
+}
+
+word db_batch_flush(const word handle)
+{
+   async_check();
+   // Send any pending rows.  Return codes as db_query().
+   word rows;
+   qword start;
+   int rc;
+   char text[DB_PROFILE_TEXT];
+
+   if(!handle || handle > batch_count)
+   {
+      _log(MAJOR, "db_batch_flush() called with invalid batch %d.", handle);
+      db_errored = true;
+      return 99;
+   }
+
+   if(!(rows = pending[handle - 1].rows)) return 0;
+   pending[handle - 1].rows = 0;
+
+   _log(PROC, "db_batch_flush(%d) %d rows, %zu bytes.", handle, rows, pending[handle - 1].length);
+
+   if(db_connect()) return 9;
+
+   start = profile_clock();
+   rc = mysql_real_query(mysql_object, pending[handle - 1].buffer, pending[handle - 1].length);
+   snprintf(text, sizeof(text), "%s(?)", batches[handle - 1].prefix);
+   profile_record(text, profile_clock() - start, rc ? 0 : mysql_affected_rows(mysql_object));
+   if(rc)
+   {
+      _log(CRITICAL, "db_batch_flush():  mysql_real_query() Error %u: %s    Query (%d rows):", mysql_errno(mysql_object), mysql_error(mysql_object), rows);
+      _log(CRITICAL, "%.2000s", pending[handle - 1].buffer);
+      db_errored = true;
+
+      db_disconnect();
+      return 3;
+   }
+   return 0;
+}
+
+static word flush_batches(void)
+{
+   word i, r;
+
+   for(i = 0; i < batch_count; i++)
+   {
+      if(pending[i].rows && (r = db_batch_flush(i + 1))) return r;
+   }
+   return 0;
+}
+
+static word discard_batches(void)
+{
+   // Returns number of rows discarded.
+   word i, discarded = 0;
+
+   for(i = 0; i < batch_count; i++)
+   {
+      discarded += pending[i].rows;
+      pending[i].rows = 0;
+   }
+   return discarded;
+}
+
+void db_profile_report(void)
+{
+   async_check();
+   // Log the most expensive query templates, in order of total time, then start a new period.
+   word order[DB_PROFILE_TEMPLATES];
+   word i, j, n, k;
+   qword count, total;
+
+   profile_report_due = false;
+   pthread_mutex_lock(&profile_lock);
+
+   for(i = n = 0, count = total = 0; i < DB_PROFILE_TEMPLATES; i++)
+   {
+      if(profiles[i].count)
+      {
+         count += profiles[i].count;
+         total += profiles[i].total;
+         for(j = n++; j && profiles[order[j - 1]].total < profiles[i].total; j--) order[j] = order[j - 1];
+         order[j] = i;
+      }
+   }
+
+   _log(GENERAL, "Database profile for the last %ld seconds:  %llu queries of %d shapes taking %llu ms.", time(NULL) - profile_start, count, n, total / 1000);
+   if(n)
+   {
+      _log(GENERAL, "     Count   Total ms   Mean us    p50 us    p99 us    Max us       Rows  Query");
+      for(k = 0; k < n && k < DB_PROFILE_REPORT; k++)
+      {
+         const struct profile * const p = &profiles[order[k]];
+         _log(GENERAL, "%10llu %10llu %9llu %9llu %9llu %9llu %10llu  %s", p->count, p->total / 1000, p->total / p->count, profile_percentile(p, 50), profile_percentile(p, 99), p->max, p->rows, p->text);
+      }
+   }
+
+   memset(profiles, 0, sizeof(profiles));
+   profile_used = 0;
+   profile_period++;
+   profile_start = time(NULL);
+   pthread_mutex_unlock(&profile_lock);
+}
+
+void db_profile_poll(void)
+{
+   // Serve a SIGUSR1 request without waiting for the next query.
+   if(profile_report_due) db_profile_report();
+}
+
+static void profile_exit(void)
+{
+   // Nothing to report if the program has just done so, as the daemons do at shutdown.
+   if(profile_used) db_profile_report();
+}
+
+static qword profile_clock(void)
+{
+   // Microseconds.
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static void profile_record(const char * const query, const qword elapsed, const qword rows)
+{
+   // Reduce the query to its template, with literals replaced by ?, and account it.
+   char t[DB_PROFILE_TEXT];
+   const char * q = query;
+   char quote;
+   size_t o = 0;
+   dword hash;
+   word i, b, msb;
+   struct profile * p;
+
+   while(*q && o < DB_PROFILE_TEXT - 1)
+   {
+      if(*q == '\'' || *q == '"')
+      {
+         quote = *q++;
+         while(*q && *q != quote)
+         {
+            if(*q == '\\' && q[1]) q++;
+            q++;
+         }
+         if(*q) q++;
+         o = profile_literal(t, o);
+      }
+      else if(*q == '?' || (isdigit(*q) && !(o && (isalnum(t[o - 1]) || t[o - 1] == '_'))))
+      {
+         q++;
+         while(isalnum(*q) || *q == '.') q++;
+         o = profile_literal(t, o);
+      }
+      else if(isspace(*q))
+      {
+         while(isspace(*q)) q++;
+         if(o && t[o - 1] != ' ') t[o++] = ' ';
+      }
+      else
+      {
+         t[o++] = *q++;
+      }
+   }
+   t[o] = '\0';
+
+   // Find or create entry.  When the table is getting full, new templates are lumped together.
+   pthread_mutex_lock(&profile_lock);
+   for(;;)
+   {
+      for(hash = 2166136261U, q = t; *q; q++) hash = (hash ^ (byte) *q) * 16777619U;
+      for(i = hash % DB_PROFILE_TEMPLATES; profiles[i].text[0] && strcmp(profiles[i].text, t); i = (i + 1) % DB_PROFILE_TEMPLATES);
+      if(profiles[i].text[0] || profile_used < DB_PROFILE_TEMPLATES * 3 / 4 || !strcmp(t, "(other)")) break;
+      strcpy(t, "(other)");
+   }
+   p = &profiles[i];
+   if(!p->text[0])
+   {
+      strcpy(p->text, t);
+      profile_used++;
+   }
+
+   p->count++;
+   p->total += elapsed;
+   p->rows  += rows;
+   if(elapsed > p->max) p->max = elapsed;
+   if(elapsed < 4)
+   {
+      b = elapsed;
+   }
+   else
+   {
+      msb = 63 - __builtin_clzll(elapsed);
+      b = (msb - 1) * 4 + ((elapsed >> (msb - 2)) & 3);
+      if(b >= PROFILE_BUCKETS) b = PROFILE_BUCKETS - 1;
+   }
+   p->bucket[b]++;
+   profile_last = i + 1;
+   profile_last_period = profile_period;
+   pthread_mutex_unlock(&profile_lock);
+}
+
+static size_t profile_literal(char * const t, size_t o)
+{
+   // Append a ? to the template, collapsing lists such as IN (1, 2, 3) to a single one.
+   if(o >= 3 && !strncmp(t + o - 3, "?, ", 3)) return o - 2;
+   if(o >= 2 && !strncmp(t + o - 2, "?,", 2)) return o - 1;
+   if(o && t[o - 1] == '?') return o;
+   t[o++] = '?';
+   return o;
+}
+
+static qword profile_percentile(const struct profile * const p, const word percent)
+{
+   // Upper bound of the bucket holding the given percentile.
+   qword target = (p->count * percent + 99) / 100, seen = 0, top;
+   word i, msb;
+
+   for(i = 0; i < PROFILE_BUCKETS; i++)
+   {
+      seen += p->bucket[i];
+      if(seen >= target)
+      {
+         if(i < 4) return i;
+         msb = i / 4 + 1;
+         top = ((qword) (4 + i % 4) << (msb - 2)) + ((qword) 1 << (msb - 2)) - 1;
+         return (top < p->max) ? top : p->max;
+      }
+   }
+   return p->max;
+}
+
+static void profile_signal(int signum)
+{
+   // The report is logged by db_profile_poll() or at the next query.
+   profile_report_due = true;
+}
+
+word db_async_start(void)
+{
+   // Returns 0 on success.  On failure jobs will be run synchronously.
+   int rc;
+
+   if(async_running) return 0;
+
+   async_stopping = false;
+   async_submitted = async_completed = 0;
+   if((rc = pthread_create(&async_thread, NULL, async_worker, NULL)))
+   {
+      _log(MAJOR, "db_async_start():  Failed to start worker thread.  Error %d %s.  Continuing synchronously.", rc, strerror(rc));
+      return 1;
+   }
+   async_running = true;
+   _log(DEBUG, "Database worker thread started.");
+   return 0;
+}
+
+void db_async_stop(void)
+{
+   if(!async_running) return;
+
+   pthread_mutex_lock(&async_lock);
+   async_stopping = true;
+   pthread_cond_signal(&async_work);
+   pthread_mutex_unlock(&async_lock);
+   pthread_join(async_thread, NULL);
+   async_running = false;
+   _log(DEBUG, "Database worker thread stopped.");
+}
+
+void db_async_submit(void (* const job)(void * const), void * const arg)
+{
+   if(!async_running)
+   {
+      job(arg);
+      return;
+   }
+
+   pthread_mutex_lock(&async_lock);
+   while(async_submitted - async_completed >= DB_ASYNC_DEPTH) pthread_cond_wait(&async_done, &async_lock);
+   async_queue[async_submitted % DB_ASYNC_DEPTH].job = job;
+   async_queue[async_submitted % DB_ASYNC_DEPTH].arg = arg;
+   async_submitted++;
+   pthread_cond_signal(&async_work);
+   pthread_mutex_unlock(&async_lock);
+}
+
+void db_async_drain(void)
+{
+   // Wait until every job submitted so far has finished.  Must not be called by a job.
+   if(!async_running) return;
+
+   pthread_mutex_lock(&async_lock);
+   while(async_completed < async_submitted) pthread_cond_wait(&async_done, &async_lock);
+   pthread_mutex_unlock(&async_lock);
+}
+
+static void * async_worker(void * arg)
+{
+   void (* job)(void * const);
+
+   db_thread_init();
+   pthread_mutex_lock(&async_lock);
+   for(;;)
+   {
+      while(async_completed == async_submitted && !async_stopping) pthread_cond_wait(&async_work, &async_lock);
+      if(async_completed == async_submitted) break;
+
+      job = async_queue[async_completed % DB_ASYNC_DEPTH].job;
+      arg = async_queue[async_completed % DB_ASYNC_DEPTH].arg;
+      pthread_mutex_unlock(&async_lock);
+
+      job(arg);
+
+      pthread_mutex_lock(&async_lock);
+      async_completed++;
+      pthread_cond_broadcast(&async_done);
+   }
+   pthread_mutex_unlock(&async_lock);
+   db_thread_end();
+   return NULL;
+}
+
+void db_thread_init(void)
+{
+   // The thread's connection is opened when it is first used.
+   mysql_thread_init();
+   db_errored = false;
+}
+
+void db_thread_end(void)
+{
+   db_disconnect();
+   mysql_thread_end();
+}
+
+static void async_check(void)
+{
+   // Calls from outside the worker wait for it to go idle, so the two never use the connection at once.
+   if(async_running && !pthread_equal(pthread_self(), async_thread)) db_async_drain();
+}
@@ -22,8 +22,44 @@
 
 #define DB_MODE_NORMAL     0
 #define DB_MODE_FOUND_ROWS 0x0001
+// Query-only program.  Use the db_replica_server if there is one and it is up to date, otherwise the given server.
+#define DB_MODE_REPLICA    0x0002
 
-extern word db_errored;
+// Prepared statements.  db_statement() registers the SQL once and returns a handle.
+// Parameters and results are described by a type string, one character per column:
+//    'i' int, 'l' long (e.g. time_t), 's' string.
+// In db_fetch() 'i' and 'l' take a pointer, 's' takes a char * followed by its size_t size.
+#define DB_STATEMENTS      32
+#define DB_STATEMENT_BINDS 16
+
+// Multi-row INSERT batches.  db_batch() returns a handle.  Each row is given to db_batch_add() as the text of
+// one VALUES entry without the enclosing parentheses.  Pending rows are sent when the batch reaches its row or
+// byte limit, on db_batch_flush(), and before any other query or statement, so later queries and COMMIT see them.
+#define DB_BATCHES         8
+#define DB_BATCH_ROWS      256
+#define DB_BATCH_BYTES     (256 * 1024)
+
+// Query profile.  Time, count and rows are recorded for each query template, that is the query text with its
+// literals replaced by '?'.  db_profile_report() logs the most expensive templates and starts a new period.
+// It is also run on SIGUSR1, unless the program handles that signal itself, and at exit if db_profile is set and
+// there is anything new to report.  The SIGUSR1 report is logged at the next query, or by db_profile_poll(), which
+// the daemons call when their main loop times out.
+#define DB_PROFILE_TEMPLATES 256
+#define DB_PROFILE_TEXT      160
+#define DB_PROFILE_REPORT    24
+
+// Threads.  Each thread has its own connection, opened when first needed, with its own prepared statement handles,
+// pending batch rows and db_errored.  Statements and batches registered by one thread may be used by any other, so
+// register them before starting threads.  A thread other than the one which called db_init() calls db_thread_init()
+// before its first db_ call and db_thread_end() before it exits.
+
+// Asynchronous mode.  After db_async_start() a worker thread runs submitted jobs one at a time, in order, on its
+// own connection.  Any db_ call from another thread first waits until the worker has finished every job
+// submitted so far.  db_async_submit() blocks while DB_ASYNC_DEPTH jobs are outstanding.
+// Without a worker, jobs are run immediately by db_async_submit().
+#define DB_ASYNC_DEPTH 4
+
+extern __thread word db_errored;
 
 extern word db_init(const char * const s, const char * const u, const char * const p, const char * const d, const word f);
 extern word db_query(const char * const query);
@@ -41,3 +77,23 @@ extern word db_real_escape_string(char * to, const char * const from, const size
 extern word db_start_transaction(void);
 extern word db_commit_transaction(void);
 extern word db_rollback_transaction(void);
+
+extern word db_statement(const char * const name, const char * const sql);
+extern word db_execute(const word handle, const char * const types, ...);
+extern word db_fetch(const word handle, const char * const types, ...);
+extern qword db_statement_affected_rows(const word handle);
+
+extern word db_batch(const char * const table, const char * const columns, const word max_rows, const size_t max_bytes);
+extern word db_batch_add(const word handle, const char * const row);
+extern word db_batch_flush(const word handle);
+
+extern void db_profile_report(void);
+extern void db_profile_poll(void);
+
+extern word db_async_start(void);
+extern void db_async_stop(void);
+extern void db_async_submit(void (* const job)(void * const), void * const arg);
+extern void db_async_drain(void);
+
+extern void db_thread_init(void);
+extern void db_thread_end(void);
@@ -21,6 +21,14 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <stdint.h>
+
+#if defined(__x86_64__) || (defined(__i386__) && defined(__SSE2__))
+#define JSMN_X86
+#include <immintrin.h>
+#endif
 
 #include "jsmn.h"
 #include "misc.h"
@@ -121,6 +129,90 @@ static jsmnerr_t jsmn_parse_primitive(jsmn_parser *parser, const char *js,
    return JSMN_SUCCESS;
 }
 
+/**
+ * String scanners.  Each returns the position of the first '\"', '\\' or NUL at or after pos.  The vector versions
+ * only make aligned loads, which cannot cross into the next page, so they may safely read past the terminating NUL.
+ */
+static size_t jsmn_scan_scalar(const char *js, size_t pos)
+{
+   while(js[pos] != '\"' && js[pos] != '\\' && js[pos] != '\0') pos++;
+   return pos;
+}
+
+#ifdef JSMN_X86
+static size_t jsmn_scan_sse2(const char *js, size_t pos)
+{
+   const char * block = (const char *) ((uintptr_t) (js + pos) & ~(uintptr_t) 15);
+   const __m128i quote = _mm_set1_epi8('\"'), backslash = _mm_set1_epi8('\\'), zero = _mm_setzero_si128();
+   __m128i v;
+   dword mask;
+
+   v = _mm_load_si128((const __m128i *) block);
+   mask = _mm_movemask_epi8(_mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, quote), _mm_cmpeq_epi8(v, backslash)), _mm_cmpeq_epi8(v, zero)));
+   mask &= ~0U << (js + pos - block);
+   while(!mask)
+   {
+      block += 16;
+      v = _mm_load_si128((const __m128i *) block);
+      mask = _mm_movemask_epi8(_mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, quote), _mm_cmpeq_epi8(v, backslash)), _mm_cmpeq_epi8(v, zero)));
+   }
+   return block + __builtin_ctz(mask) - js;
+}
+
+__attribute__((target("avx2")))
+static size_t jsmn_scan_avx2(const char *js, size_t pos)
+{
+   const char * block = (const char *) ((uintptr_t) (js + pos) & ~(uintptr_t) 31);
+   const __m256i quote = _mm256_set1_epi8('\"'), backslash = _mm256_set1_epi8('\\'), zero = _mm256_setzero_si256();
+   __m256i v;
+   dword mask;
+
+   v = _mm256_load_si256((const __m256i *) block);
+   mask = _mm256_movemask_epi8(_mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, quote), _mm256_cmpeq_epi8(v, backslash)), _mm256_cmpeq_epi8(v, zero)));
+   mask &= ~0U << (js + pos - block);
+   while(!mask)
+   {
+      block += 32;
+      v = _mm256_load_si256((const __m256i *) block);
+      mask = _mm256_movemask_epi8(_mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, quote), _mm256_cmpeq_epi8(v, backslash)), _mm256_cmpeq_epi8(v, zero)));
+   }
+   return block + __builtin_ctz(mask) - js;
+}
+#endif
+
+static size_t jsmn_scan_select(const char *js, size_t pos);
+static size_t (* jsmn_scan)(const char *js, size_t pos) = jsmn_scan_select;
+
+static size_t jsmn_scan_select(const char *js, size_t pos)
+{
+   // First use.  Pick the best scanner this CPU supports.
+   jsmn_scanner(JSMN_SCAN_AUTO);
+   return jsmn_scan(js, pos);
+}
+
+word jsmn_scanner(const word scanner)
+{
+   // Select the string scanner used by jsmn_parse(), and return the one actually selected.  JSMN_SCAN_AUTO picks the
+   // best one available, and a scanner this CPU lacks falls back to the next best.
+   word selected = JSMN_SCAN_SCALAR;
+
+#ifdef JSMN_X86
+   __builtin_cpu_init();
+   if((scanner == JSMN_SCAN_AUTO || scanner >= JSMN_SCAN_SSE2)) selected = JSMN_SCAN_SSE2;
+   if((scanner == JSMN_SCAN_AUTO || scanner >= JSMN_SCAN_AVX2) && __builtin_cpu_supports("avx2")) selected = JSMN_SCAN_AVX2;
+#endif
+
+   switch(selected)
+   {
+#ifdef JSMN_X86
+   case JSMN_SCAN_SSE2: jsmn_scan = jsmn_scan_sse2; break;
+   case JSMN_SCAN_AVX2: jsmn_scan = jsmn_scan_avx2; break;
+#endif
+   default:             jsmn_scan = jsmn_scan_scalar; break;
+   }
+   return selected;
+}
+
 /**
  * Filsl next token with JSON string.
  */
@@ -134,10 +226,14 @@ static jsmnerr_t jsmn_parse_string(jsmn_parser *parser, const char *js,
    parser->pos++;
 
    /* Skip starting quote */
-   for (; js[parser->pos] != '\0'; parser->pos++) 
+   for (;; parser->pos++) 
    {
+      /* Skip to the next quote, backslash or end */
+      parser->pos = jsmn_scan(js, parser->pos);
       char c = js[parser->pos];
 
+      if (c == '\0') break;
+
       /* Quote: end of string */
       if (c == '\"') 
       {
@@ -159,36 +255,45 @@ static jsmnerr_t jsmn_parse_string(jsmn_parser *parser, const char *js,
       }
 
       /* Backslash: Quoted symbol expected */
-      if (c == '\\') 
+      parser->pos++;
+      switch (js[parser->pos]) 
       {
-         parser->pos++;
-         switch (js[parser->pos]) 
-         {
-            /* Allowed escaped symbols */
-         case '\"': case '/' : case '\\' : case 'b' :
-         case 'f' : case 'r' : case 'n'  : case 't' :
-            break;
-            /* Allows escaped symbol \uXXXX */
-         case 'u':
-            /* TODO */
-            break;
-            /* Unexpected symbol */
-         default:
-            parser->pos = start;
-            _log(MINOR, "jsmn_parse_string():  Invalid character 0x%02x at %d\n", js[parser->pos], parser->pos);
-            return JSMN_ERROR_INVAL;
-         }
+         /* Allowed escaped symbols */
+      case '\"': case '/' : case '\\' : case 'b' :
+      case 'f' : case 'r' : case 'n'  : case 't' :
+         break;
+         /* Allows escaped symbol \uXXXX */
+      case 'u':
+         /* TODO */
+         break;
+         /* Unexpected symbol */
+      default:
+         parser->pos = start;
+         _log(MINOR, "jsmn_parse_string():  Invalid character 0x%02x at %d\n", js[parser->pos], parser->pos);
+         return JSMN_ERROR_INVAL;
       }
    }
    parser->pos = start;
    return JSMN_ERROR_PART;
 }
 
+static jsmnerr_t jsmn_parse_values(jsmn_parser *parser, const char *js, jsmntok_t *tokens, 
+		unsigned int num_tokens, const word one);
+
 /**
  * Parse JSON string and fill tokens.
  */
 jsmnerr_t jsmn_parse(jsmn_parser *parser, const char *js, jsmntok_t *tokens, 
 		unsigned int num_tokens) 
+{
+   return jsmn_parse_values(parser, js, tokens, num_tokens, false);
+}
+
+/**
+ * Parse until the end of the string or, if one is set, the end of the first complete value.
+ */
+static jsmnerr_t jsmn_parse_values(jsmn_parser *parser, const char *js, jsmntok_t *tokens, 
+		unsigned int num_tokens, const word one) 
 {
    jsmnerr_t r;
    int i;
@@ -212,10 +317,27 @@ jsmnerr_t jsmn_parse(jsmn_parser *parser, const char *js, jsmntok_t *tokens,
          token->type = (c == '{' ? JSMN_OBJECT : JSMN_ARRAY);
          token->start = parser->pos;
          parser->toksuper = parser->toknext - 1;
+         if (parser->depth < JSMN_DEPTH)
+            parser->stack[parser->depth] = parser->toksuper;
+         parser->depth++;
          break;
 
       case '}': case ']':
          type = (c == '}' ? JSMN_OBJECT : JSMN_ARRAY);
+         if (parser->depth > 0 && parser->depth <= JSMN_DEPTH)
+         {
+            /* The open objects and arrays are on the stack, so there is no need to search the tokens for them. */
+            token = &tokens[parser->stack[parser->depth - 1]];
+            if (token->type != type) {
+               _log(MINOR, "jsmn_parse():  Invalid character was wrong type 0x%02x %d\n", js[parser->pos], parser->pos);
+               return JSMN_ERROR_INVAL;
+            }
+            token->end = parser->pos + 1;
+            parser->depth--;
+            parser->toksuper = parser->depth ? parser->stack[parser->depth - 1] : -1;
+            break;
+         }
+         if (parser->depth > 0) parser->depth--;
          for (i = parser->toknext - 1; i >= 0; i--) {
             token = &tokens[i];
             if (token->start != -1 && token->end == -1) {
@@ -259,6 +381,12 @@ jsmnerr_t jsmn_parse(jsmn_parser *parser, const char *js, jsmntok_t *tokens,
          break;
          
       }
+
+      if (one && parser->depth == 0 && parser->toknext > 0)
+      {
+         parser->pos++;
+         break;
+      }
    }
    
    for (i = parser->toknext - 1; i >= 0; i--) {
@@ -276,6 +404,77 @@ jsmnerr_t jsmn_parse(jsmn_parser *parser, const char *js, jsmntok_t *tokens,
    return JSMN_SUCCESS;
 }
 
+/**
+ * Find the end of the value at pos without tokenising it, so that a stream can carry on after a bad one.  Stops
+ * at a ',' or closing bracket that is not part of the value.
+ */
+static unsigned int jsmn_skip_value(const char *js, unsigned int pos)
+{
+   int depth = 0;
+   word in_string = false;
+
+   for (; js[pos] != '\0'; pos++)
+   {
+      if (in_string)
+      {
+         if (js[pos] == '\\' && js[pos + 1] != '\0') pos++;
+         else if (js[pos] == '\"') in_string = false;
+         continue;
+      }
+      switch (js[pos])
+      {
+      case '\"':
+         in_string = true;
+         break;
+      case '{': case '[':
+         depth++;
+         break;
+      case '}': case ']':
+         if (depth == 0) return pos;
+         if (--depth == 0) return pos + 1;
+         break;
+      case ',':
+         if (depth == 0) return pos;
+         break;
+      }
+   }
+   return pos;
+}
+
+void jsmn_stream_init(jsmn_stream *stream, const char *js)
+{
+   // Position the stream at the first value of the outermost array, e.g. the array of locations in
+   // {"TIPLOCDATA":[{...},{...}]}.  The string must stay in place while the stream is in use.
+   const char * array = strchr(js, '[');
+
+   stream->js = js;
+   stream->pos = array ? array + 1 - js : strlen(js);
+}
+
+jsmnerr_t jsmn_stream_next(jsmn_stream *stream, jsmntok_t *tokens, unsigned int num_tokens)
+{
+   // Parse the next value of the array, which will be token 0.  The token positions are in the whole string, so
+   // stream->js is the string to give to jsmn_find_extract_token() and the rest.  Returns JSMN_END after the last
+   // value.  A bad value is skipped, and the error returned, so that the caller can report it and carry on.
+   jsmn_parser parser;
+   jsmnerr_t r;
+   const char * js = stream->js;
+
+   while (js[stream->pos] == ' ' || js[stream->pos] == '\t' || js[stream->pos] == '\r' || js[stream->pos] == '\n' || js[stream->pos] == ',')
+      stream->pos++;
+   if (js[stream->pos] == '\0' || js[stream->pos] == ']' || js[stream->pos] == '}')
+      return JSMN_END;
+
+   jsmn_init(&parser);
+   parser.pos = stream->pos;
+   r = jsmn_parse_values(&parser, js, tokens, num_tokens, true);
+   if (r == JSMN_SUCCESS)
+      stream->pos = parser.pos;
+   else
+      stream->pos = jsmn_skip_value(js, stream->pos);
+   return r;
+}
+
 /**
  * Creates a new parser based over a given  buffer with an array of tokens 
  * available.
@@ -284,25 +483,105 @@ void jsmn_init(jsmn_parser *parser) {
 	parser->pos = 0;
 	parser->toknext = 0;
 	parser->toksuper = -1;
+	parser->depth = 0;
+}
+
+static word name_matches(const char * string, const jsmntok_t * token, const char * search, const size_t search_length)
+{
+   // Compare a name token with search in place, ignoring case.
+   return (size_t)(token->end - token->start) == search_length && !strncasecmp(string + token->start, search, search_length);
+}
+
+static dword name_hash(const char * name, size_t length)
+{
+   // FNV-1a, ignoring case.
+   dword hash = 2166136261U;
+   while(length--) hash = (hash ^ (byte) tolower((byte) *name++)) * 16777619U;
+   return hash;
+}
+
+static long view_integer(const char * text, size_t length)
+{
+   long result = 0;
+   word negative = false;
+   while(length && isspace((byte) *text)) { text++; length--; }
+   if(length && (*text == '-' || *text == '+'))
+   {
+      negative = (*text == '-');
+      text++; length--;
+   }
+   while(length && isdigit((byte) *text))
+   {
+      result = result * 10 + (*text++ - '0');
+      length--;
+   }
+   return negative ? -result : result;
 }
 
 word jsmn_find_name_token(const char * string, const jsmntok_t * tokens, const word object_index, const char * search)
 {
    // Search the object at token number object_index for a name of value search, and return its token number or 0 for not found.
-   char zs[2048];
+   size_t length = strlen(search);
 
    word i;
    for(i = object_index + 1; tokens[i].start >= 0 && tokens[i].start < tokens[object_index].end; i++)
    {
-      if(tokens[i].type == JSMN_NAME)
+      if(tokens[i].type == JSMN_NAME && name_matches(string, &tokens[i], search, length))
       {
-         jsmn_extract_token(string, tokens, i, zs, sizeof(zs));
-         if(!strcasecmp(zs, search))
-         {
-            // Hit
-            return i;
-         }
+         // Hit
+         return i;
+      }
+   }
+
+   return 0;
+}
+
+void jsmn_index_object(jsmn_index * index, const char * string, const jsmntok_t * tokens, const word object_index)
+{
+   // Build the name index for the object at token number object_index.  As with jsmn_find_name_token(), names in
+   // nested objects are included, and where a name occurs more than once the first occurrence is kept.
+   word i, used = 0;
+   dword slot;
+
+   index->string = string;
+   index->tokens = tokens;
+   index->object_index = object_index;
+   index->overflow = false;
+   memset(index->slot, 0, sizeof(index->slot));
+
+   for(i = object_index + 1; tokens[i].start >= 0 && tokens[i].start < tokens[object_index].end; i++)
+   {
+      if(tokens[i].type != JSMN_NAME) continue;
+
+      for(slot = name_hash(string + tokens[i].start, tokens[i].end - tokens[i].start) % JSMN_INDEX_SIZE; index->slot[slot]; slot = (slot + 1) % JSMN_INDEX_SIZE)
+      {
+         if(name_matches(string, &tokens[index->slot[slot]], string + tokens[i].start, tokens[i].end - tokens[i].start)) break;
+      }
+      if(index->slot[slot]) continue;
+
+      if(used >= JSMN_INDEX_SIZE * 3 / 4)
+      {
+         // Too many distinct names.  Lookups will search the tokens instead.
+         _log(DEBUG, "jsmn_index_object():  More than %d names, index not used.", used);
+         index->overflow = true;
+         return;
       }
+      index->slot[slot] = i;
+      used++;
+   }
+}
+
+word jsmn_index_find(const jsmn_index * index, const char * search)
+{
+   // As jsmn_find_name_token(), using the index.
+   size_t length = strlen(search);
+   dword slot;
+
+   if(index->overflow) return jsmn_find_name_token(index->string, index->tokens, index->object_index, search);
+
+   for(slot = name_hash(search, length) % JSMN_INDEX_SIZE; index->slot[slot]; slot = (slot + 1) % JSMN_INDEX_SIZE)
+   {
+      if(name_matches(index->string, &index->tokens[index->slot[slot]], search, length)) return index->slot[slot];
    }
 
    return 0;
@@ -334,3 +613,61 @@ void jsmn_find_extract_token(const char * string, const jsmntok_t * tokens, cons
    }
 }
       
+
+void jsmn_index_extract(const jsmn_index * index, const char * search, char * result, const size_t max_length)
+{
+   // As jsmn_find_extract_token(), using the index.
+   word i = jsmn_index_find(index, search);
+   if(i > 0 && index->tokens[i + 1].start >= 0)
+   {
+      jsmn_extract_token(index->string, index->tokens, i + 1, result, max_length);
+   }
+   else
+   {
+      result[0] = '\0';
+   }
+}
+
+jsmn_view jsmn_index_view(const jsmn_index * index, const char * search)
+{
+   // The value of the field in place in the string.  Not NUL terminated.  Empty if the field is missing or null, in
+   // which case text is "" so that text[0] may be tested.
+   jsmn_view view = { "", 0 };
+   word i = jsmn_index_find(index, search);
+   if(i > 0 && index->tokens[i + 1].start >= 0)
+   {
+      view.text = index->string + index->tokens[i + 1].start;
+      view.length = index->tokens[i + 1].end - index->tokens[i + 1].start;
+      if(view.length == 4 && !strncmp(view.text, "null", 4)) view.length = 0;
+      if(!view.length) view.text = "";
+   }
+   return view;
+}
+
+long jsmn_index_integer(const jsmn_index * index, const char * search)
+{
+   // Decimal value of the field, as atol() of the extracted value.
+   jsmn_view view = jsmn_index_view(index, search);
+   return view_integer(view.text, view.length);
+}
+
+dword jsmn_index_hex(const jsmn_index * index, const char * search)
+{
+   // Hexadecimal value of the field, as strtoul(, , 16) of the extracted value.
+   jsmn_view view = jsmn_index_view(index, search);
+   dword result = 0;
+   size_t i;
+   for(i = 0; i < view.length && isxdigit((byte) view.text[i]); i++)
+   {
+      result = (result << 4) + (isdigit((byte) view.text[i]) ? view.text[i] - '0' : (tolower((byte) view.text[i]) - 'a' + 10));
+   }
+   return result;
+}
+
+time_t jsmn_index_timestamp(const jsmn_index * index, const char * search)
+{
+   // Value of a millisecond timestamp field, in seconds.  As the daemons have always done it, this is the first
+   // ten digits.
+   jsmn_view view = jsmn_index_view(index, search);
+   return view_integer(view.text, (view.length > 10) ? 10 : view.length);
+}
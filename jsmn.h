@@ -46,7 +46,9 @@ typedef enum {
 	/* The string is not a full JSON packet, more bytes expected */
 	JSMN_ERROR_PART = -3,
 	/* Everything was fine */
-	JSMN_SUCCESS = 0
+	JSMN_SUCCESS = 0,
+	/* No more values in the stream */
+	JSMN_END = 1
 } jsmnerr_t;
 
 /**
@@ -69,10 +71,13 @@ typedef struct {
  * JSON parser. Contains an array of token blocks available. Also stores
  * the string being parsed now and current position in that string
  */
+#define JSMN_DEPTH 32
 typedef struct {
 	unsigned int pos; /* offset in the JSON string */
 	int toknext; /* next token to allocate */
 	int toksuper; /* superior token node, e.g parent object or array */
+	int depth; /* number of open objects and arrays */
+	int stack[JSMN_DEPTH]; /* their tokens, innermost last */
 } jsmn_parser;
 
 /**
@@ -87,11 +92,63 @@ void jsmn_init(jsmn_parser *parser);
 jsmnerr_t jsmn_parse(jsmn_parser *parser, const char *js, 
 		jsmntok_t *tokens, unsigned int num_tokens);
 
+/**
+ * Stream over a large JSON string whose data is one array, such as a CORPUS or SMART file.  Each call of
+ * jsmn_stream_next() parses one value of the array in place, so the values need not be copied out and may be any size.
+ */
+typedef struct {
+	const char *js;
+	unsigned int pos;
+} jsmn_stream;
+
+void jsmn_stream_init(jsmn_stream *stream, const char *js);
+jsmnerr_t jsmn_stream_next(jsmn_stream *stream, jsmntok_t *tokens, unsigned int num_tokens);
+
+/**
+ * String scanner used by jsmn_parse().  The best one the CPU supports is chosen on first use.
+ */
+enum jsmn_scanners {JSMN_SCAN_AUTO, JSMN_SCAN_SCALAR, JSMN_SCAN_SSE2, JSMN_SCAN_AVX2};
+extern word jsmn_scanner(const word scanner);
+
+
+/**
+ * Name index over one object, so that several fields can be found without searching the tokens each time.
+ * Built by jsmn_index_object(), and valid as long as the string and tokens are unchanged.
+ */
+#define JSMN_INDEX_SIZE 256
+typedef struct {
+	const char * string;
+	const jsmntok_t * tokens;
+	word object_index;
+	word overflow;
+	word slot[JSMN_INDEX_SIZE];
+} jsmn_index;
+
+/**
+ * Value of a field in place in the JSON string.  Not NUL terminated.
+ */
+typedef struct {
+	const char * text;
+	size_t length;
+} jsmn_view;
 
 extern word jsmn_find_name_token(const char * string, const jsmntok_t * tokens, const word object_index, const char * search);
 
 extern void jsmn_extract_token(const char * string, const jsmntok_t * tokens, word index, char * result, const size_t max_length);
 extern void jsmn_find_extract_token(const char * string, const jsmntok_t * tokens, const word object_index, const char * search, char * result, const size_t max_length);
 
+extern void jsmn_index_object(jsmn_index * index, const char * string, const jsmntok_t * tokens, const word object_index);
+extern word jsmn_index_find(const jsmn_index * index, const char * search);
+extern void jsmn_index_extract(const jsmn_index * index, const char * search, char * result, const size_t max_length);
+
+/**
+ * Typed field values read directly from the JSON string, without extracting them.  A missing or null field gives
+ * an empty view, or 0.
+ */
+extern jsmn_view jsmn_index_view(const jsmn_index * index, const char * search);
+extern long jsmn_index_integer(const jsmn_index * index, const char * search);
+extern dword jsmn_index_hex(const jsmn_index * index, const char * search);
+extern time_t jsmn_index_timestamp(const jsmn_index * index, const char * search);
+
 
 #endif /* __JSMN_H_ */
@@ -0,0 +1,212 @@
+/*
+    Copyright (C) 2026 Phil Wieland
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    phil@philwieland.com
+
+*/
+
+// Time jsmn_parse() with each string scanner over recorded frames.
+// Input is stompy message logs, or the output of stompycat.  Every line that starts with '[' or '{' is taken as a
+// frame body.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <time.h>
+#include <zlib.h>
+
+#include "misc.h"
+#include "jsmn.h"
+#include "build.h"
+
+#define NAME "jsmnbench"
+
+#ifndef RELEASE_BUILD
+#define BUILD "0001p"
+#else
+#define BUILD RELEASE_BUILD
+#endif
+
+#define FRAME_SIZE 64000
+#define NUM_TOKENS 8192
+#define MAX_FRAMES 100000
+
+static word load_file(const char * const filepath);
+static word check(const word scanner);
+static qword run(const word repeats);
+static qword clock_ns(void);
+
+static char * frames[MAX_FRAMES];
+static size_t frame_count, frame_bytes;
+static jsmntok_t tokens[NUM_TOKENS];
+
+// Tokens given by the scalar scanner.
+static jsmntok_t * reference[MAX_FRAMES];
+static int reference_count[MAX_FRAMES];
+
+// jsmn.c logs through _log().  Don't pull in the rest of misc.c for that.
+void _log(const byte level, const char * text, ...)
+{
+   va_list args;
+   if(level < MINOR) return;
+   va_start(args, text);
+   vfprintf(stderr, text, args);
+   va_end(args);
+   fprintf(stderr, "\n");
+}
+
+int main(int argc, char *argv[])
+{
+   static const char * const scanner_names[] = {"auto", "scalar", "sse2", "avx2"};
+   word repeats = 20, scanner;
+   int i;
+   qword elapsed;
+
+   for(i = 1; i < argc && argv[i][0] == '-'; i++)
+   {
+      if(!strcmp(argv[i], "-n") && i + 1 < argc) repeats = atoi(argv[++i]);
+      else i = argc;
+   }
+   if(i >= argc || !repeats)
+   {
+      printf("%s %s\n\tUsage: %s [-n repeats] file...\n\tFiles are stompy message logs or stompycat output.\n\n", NAME, BUILD, argv[0]);
+      exit(1);
+   }
+
+   for(; i < argc; i++)
+   {
+      if(load_file(argv[i])) exit(1);
+   }
+   if(!frame_count)
+   {
+      fprintf(stderr, "No frames found.\n");
+      exit(1);
+   }
+   printf("%zu frames, %zu bytes, %d repeats.\n", frame_count, frame_bytes, repeats);
+
+   for(scanner = JSMN_SCAN_SCALAR; scanner <= JSMN_SCAN_AVX2; scanner++)
+   {
+      if(jsmn_scanner(scanner) != scanner)
+      {
+         printf("%-8s not supported by this CPU.\n", scanner_names[scanner]);
+         continue;
+      }
+      if(check(scanner)) exit(1);
+      elapsed = run(repeats);
+      printf("%-8s %10.1f ns/frame %8.1f MB/s\n", scanner_names[scanner],
+             (double) elapsed / (frame_count * repeats),
+             (double) frame_bytes * repeats * 1000.0 / (elapsed ? elapsed : 1));
+   }
+
+   exit(0);
+}
+
+static word load_file(const char * const filepath)
+{
+   // gzgets() reads gzip files and plain files alike.
+   static char line[FRAME_SIZE + 2];
+   gzFile gz;
+   size_t l;
+
+   if(!(gz = gzopen(filepath, "rb")))
+   {
+      fprintf(stderr, "Failed to open \"%s\".\n", filepath);
+      return 1;
+   }
+   while(frame_count < MAX_FRAMES && gzgets(gz, line, sizeof(line)))
+   {
+      l = strlen(line);
+      if(line[0] != '[' && line[0] != '{') continue;
+      if(line[l - 1] != '\n')
+      {
+         // Longer than a frame can be.  Skip the rest of it.
+         while(gzgets(gz, line, sizeof(line)) && line[strlen(line) - 1] != '\n');
+         continue;
+      }
+      line[--l] = '\0';
+      if(!(frames[frame_count] = malloc(l + 1)))
+      {
+         fprintf(stderr, "Out of memory.\n");
+         gzclose(gz);
+         return 1;
+      }
+      memcpy(frames[frame_count++], line, l + 1);
+      frame_bytes += l;
+   }
+   gzclose(gz);
+   return 0;
+}
+
+static word check(const word scanner)
+{
+   // Every scanner must give the same tokens as the scalar one.
+   jsmn_parser parser;
+   size_t f;
+   int rc, n;
+
+   for(f = 0; f < frame_count; f++)
+   {
+      jsmn_init(&parser);
+      rc = jsmn_parse(&parser, frames[f], tokens, NUM_TOKENS);
+      n = (rc == JSMN_SUCCESS) ? parser.toknext : rc;
+      if(scanner == JSMN_SCAN_SCALAR)
+      {
+         reference_count[f] = n;
+         if(n > 0)
+         {
+            if(!(reference[f] = malloc(n * sizeof(jsmntok_t))))
+            {
+               fprintf(stderr, "Out of memory.\n");
+               return 1;
+            }
+            memcpy(reference[f], tokens, n * sizeof(jsmntok_t));
+         }
+      }
+      else if(n != reference_count[f] || (n > 0 && memcmp(reference[f], tokens, n * sizeof(jsmntok_t))))
+      {
+         fprintf(stderr, "Frame %zu:  Tokens differ from those of the scalar scanner.\n", f);
+         return 1;
+      }
+   }
+   return 0;
+}
+
+static qword run(const word repeats)
+{
+   // Parse every frame repeats times and return the time taken in ns.
+   jsmn_parser parser;
+   size_t f;
+   word r;
+   qword start = clock_ns();
+
+   for(r = 0; r < repeats; r++)
+   {
+      for(f = 0; f < frame_count; f++)
+      {
+         jsmn_init(&parser);
+         jsmn_parse(&parser, frames[f], tokens, NUM_TOKENS);
+      }
+   }
+   return clock_ns() - start;
+}
+
+static qword clock_ns(void)
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
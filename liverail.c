@@ -30,6 +30,7 @@
 
 #include "misc.h"
 #include "db.h"
+#include "corpus.h"
 #include "build.h"
 
 #define NAME "liverail"
@@ -369,7 +370,7 @@ int main()
    location_name(NULL, false);
 
    // Initialise database
-   db_init(conf[conf_db_server], conf[conf_db_user], conf[conf_db_password], conf[conf_db_name], DB_MODE_NORMAL);
+   db_init(conf[conf_db_server], conf[conf_db_user], conf[conf_db_password], conf[conf_db_name], DB_MODE_REPLICA);
 
    sprintf(zs, "Parameters:  (l = %d)", l);
    _log(GENERAL, zs);
@@ -1511,43 +1512,18 @@ static void report_train_summary(const word index, const time_t when, const word
                      }
                      if(status < Departed)
                      {
-                        sprintf(query, "SELECT tiploc FROM corpus WHERE stanox = %s", row1[0]);
-                        if(!db_query(query))
+                        if(corpus_stanox_known(row1[0]))
                         {
-                           result2 = db_store_result();
-                           if((row2 = mysql_fetch_row(result2)))
+                           const char * movement_tiploc = corpus_stanox_tiploc(row1[0]);
+                           _log(DEBUG, "Looking for TIPLOC \"%s\" found movement at TIPLOC \"%s\".", calls[index].tiploc_code, movement_tiploc);
+                           if(movement_tiploc[0] && !strcasecmp(calls[index].tiploc_code, movement_tiploc))
                            {
-                              _log(DEBUG, "Looking for TIPLOC \"%s\" found movement at TIPLOC \"%s\".", calls[index].tiploc_code, row2[0]);
-                              if(!strcasecmp(calls[index].tiploc_code, row2[0]))
+                              if((flags & 0x0003) == 0x0001)
                               {
-                                 if((flags & 0x0003) == 0x0001)
+                                 _log(DEBUG, "Hit - Departure.");
+                                 // Got a departure report at our station
+                                 // Check if it is about the right time, in case train calls twice.
                                  {
-                                    _log(DEBUG, "Hit - Departure.");
-                                    // Got a departure report at our station
-                                    // Check if it is about the right time, in case train calls twice.
-                                    {
-                                       char z[8];
-                                       z[0] = train_time[0]; z[1] = train_time[1]; z[2] = '\0';
-                                       word sched = atoi(z)*60;
-                                       z[0] = train_time[2]; z[1] = train_time[3];
-                                       sched += atoi(z);
-                                       time_t planned_timestamp = atol(row1[3]);
-                                       struct tm * broken = localtime(&planned_timestamp);
-                                       word planned = broken->tm_hour * 60 + broken->tm_min;
-                                       if(planned > sched - 8 && planned < sched + 8) // This might fail close to midnight!
-                                       {
-                                          // Near enough!
-                                          status = Departed;
-                                          strcpy(actual, row1[1]);
-                                          deviation = atoi(row1[2]);
-                                          late = ((flags & 0x0018) == 0x0010);
-                                       }
-                                    }
-                                 }
-                                 else if(status < Arrived)
-                                 {
-                                    _log(DEBUG, "Hit - Arrival.");
-                                    // Got an arrival from our station AND haven't seen a departure yet
                                     char z[8];
                                     z[0] = train_time[0]; z[1] = train_time[1]; z[2] = '\0';
                                     word sched = atoi(z)*60;
@@ -1559,16 +1535,17 @@ static void report_train_summary(const word index, const time_t when, const word
                                     if(planned > sched - 8 && planned < sched + 8) // This might fail close to midnight!
                                     {
                                        // Near enough!
-                                       status = Arrived;
+                                       status = Departed;
                                        strcpy(actual, row1[1]);
                                        deviation = atoi(row1[2]);
                                        late = ((flags & 0x0018) == 0x0010);
                                     }
                                  }
                               }
-                              // Check for "gone"
-                              if(status < Departed)
+                              else if(status < Arrived)
                               {
+                                 _log(DEBUG, "Hit - Arrival.");
+                                 // Got an arrival from our station AND haven't seen a departure yet
                                  char z[8];
                                  z[0] = train_time[0]; z[1] = train_time[1]; z[2] = '\0';
                                  word sched = atoi(z)*60;
@@ -1577,19 +1554,38 @@ static void report_train_summary(const word index, const time_t when, const word
                                  time_t planned_timestamp = atol(row1[3]);
                                  struct tm * broken = localtime(&planned_timestamp);
                                  word planned = broken->tm_hour * 60 + broken->tm_min;
-                                 if(planned_timestamp && planned > sched + 2 && planned < sched + (12*60) )
+                                 if(planned > sched - 8 && planned < sched + 8) // This might fail close to midnight!
                                  {
-                                    status = DepartedDeduced;
+                                    // Near enough!
+                                    status = Arrived;
                                     strcpy(actual, row1[1]);
                                     deviation = atoi(row1[2]);
                                     late = ((flags & 0x0018) == 0x0010);
-                                    sched += (60*24) + (late?deviation:(-deviation));
-                                    sched %= (60*24);
-                                    sprintf(deduced_actual, "%02d%02d", sched/60, sched%60);
                                  }
                               }
                            }
-                           mysql_free_result(result2);
+                           // Check for "gone"
+                           if(status < Departed)
+                           {
+                              char z[8];
+                              z[0] = train_time[0]; z[1] = train_time[1]; z[2] = '\0';
+                              word sched = atoi(z)*60;
+                              z[0] = train_time[2]; z[1] = train_time[3];
+                              sched += atoi(z);
+                              time_t planned_timestamp = atol(row1[3]);
+                              struct tm * broken = localtime(&planned_timestamp);
+                              word planned = broken->tm_hour * 60 + broken->tm_min;
+                              if(planned_timestamp && planned > sched + 2 && planned < sched + (12*60) )
+                              {
+                                 status = DepartedDeduced;
+                                 strcpy(actual, row1[1]);
+                                 deviation = atoi(row1[2]);
+                                 late = ((flags & 0x0018) == 0x0010);
+                                 sched += (60*24) + (late?deviation:(-deviation));
+                                 sched %= (60*24);
+                                 sprintf(deduced_actual, "%02d%02d", sched/60, sched%60);
+                              }
+                           }
                         }
                      }
                   }
@@ -2919,6 +2915,16 @@ static char * location_name_and_codes(const char * const tiploc)
    MYSQL_RES * result0;
    MYSQL_ROW row0;
 
+   if(!corpus_open())
+   {
+      const struct corpus_location * l = corpus_by_tiploc(tiploc);
+      if(l && *corpus_fn(l))
+         sprintf(result, "%.900s (%s%s%s)", corpus_fn(l), tiploc, l->alpha[0]?" ":"", l->alpha);
+      else
+         strcpy(result, tiploc);
+      return result;
+   }
+
    sprintf(query, "select fn, 3alpha from corpus where tiploc = '%s'", tiploc);
    db_query(query);
    result0 = db_store_result();
@@ -2940,9 +2946,6 @@ static char * location_name(const char * const tiploc, const word use_cache)
 {
    // Not re-entrant
    // Set use_cache to false if hit is not expected, to bypass search.  Cache will still be updated.
-   char query[256];
-   MYSQL_RES * result0 = NULL;
-   MYSQL_ROW row0;
    static word next_cache;
    word i;
 
@@ -2974,21 +2977,11 @@ static char * location_name(const char * const tiploc, const word use_cache)
    else if (mode == PANEL && !strcmp(tiploc, "MNCRIAP")) strcpy(cache_val[next_cache], "Manchester Airport");
    else 
    {
-      sprintf(query, "select fn from corpus where tiploc = '%s'", tiploc);
-      db_query(query);
-      result0 = db_store_result();
-      if((row0 = mysql_fetch_row(result0)) && row0[0][0]) 
-      {
-         strncpy(cache_val[next_cache], row0[0], 127);
-         cache_val[next_cache][127] = '\0';
-      }
-      else
-      {
-         strcpy(cache_val[next_cache], tiploc);
-      }
+      const char * fn = corpus_tiploc_name(tiploc);
+      strncpy(cache_val[next_cache], fn[0] ? fn : tiploc, 127);
+      cache_val[next_cache][127] = '\0';
    }
    strcpy(cache_key[next_cache], tiploc);
-   mysql_free_result(result0);
 
    _log(DEBUG, "Cache miss for \"%s\" - Returning \"%s\"", tiploc, cache_val[next_cache]);
    return cache_val[next_cache];
@@ -2997,23 +2990,11 @@ static char * location_name(const char * const tiploc, const word use_cache)
 static char * show_stanox(const char * const stanox)
 {
    static char result[256];
-   char  query[256];
-   MYSQL_RES * result0;
-   MYSQL_ROW row0;
 
    if(stanox[0] != '\0')
    {
-      sprintf(query, "SELECT fn FROM corpus WHERE stanox = %s", stanox);
-      db_query(query);
-      result0 = db_store_result();
-      if((row0 = mysql_fetch_row(result0)) && row0[0][0]) 
-      {
-         strcpy(result, row0[0]);
-      }
-      else
-      {
-         strcpy(result, stanox);
-      }
+      const char * fn = corpus_stanox_name(stanox);
+      strcpy(result, fn[0] ? fn : stanox);
    }
    else
    {
@@ -3025,16 +3006,12 @@ static char * show_stanox(const char * const stanox)
 static char * show_stanox_link(const char * const stanox)
 {
    static char result[256];
-   char  query[256];
-   MYSQL_RES * result0;
-   MYSQL_ROW row0;
+   char tiploc[16];
 
-   sprintf(query, "SELECT tiploc FROM corpus WHERE stanox = %s", stanox);
-   db_query(query);
-   result0 = db_store_result();
-   if((row0 = mysql_fetch_row(result0)) && row0[0][0]) 
+   strcpy(tiploc, corpus_stanox_tiploc(stanox));
+   if(tiploc[0])
    {
-      return location_name_link(row0[0], true, "sum", 0);
+      return location_name_link(tiploc, true, "sum", 0);
    }
 
    strcpy(result, stanox);
@@ -30,6 +30,7 @@
 
 #include "misc.h"
 #include "db.h"
+#include "corpus.h"
 #include "build.h"
 
 static void page(void);
@@ -544,16 +545,8 @@ static char * location_name(const char * const tiploc)
 
    if(!strlen(response))
    {
-      sprintf(query, "SELECT SUBSTR(fn, 1, 20) FROM corpus WHERE tiploc = '%s'", tiploc);
-      if(!db_query(query))
-      {
-         result = db_store_result();
-         if((row = mysql_fetch_row(result)) && row[0][0])
-         {
-            strcpy(response, row[0]);
-         }
-         mysql_free_result(result);
-      }
+      strncpy(response, corpus_tiploc_name(tiploc), 20);
+      response[20] = '\0';
    }
 
    if(!strlen(response))
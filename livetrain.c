@@ -30,6 +30,7 @@
 
 #include "misc.h"
 #include "db.h"
+#include "corpus.h"
 #include "build.h"
 
 #define NAME "livetrain"
@@ -307,7 +308,7 @@ int main()
    location_name(NULL, false);
 
    // Initialise database
-   db_init(conf[conf_db_server], conf[conf_db_user], conf[conf_db_password], conf[conf_db_name], DB_MODE_NORMAL);
+   db_init(conf[conf_db_server], conf[conf_db_user], conf[conf_db_password], conf[conf_db_name], DB_MODE_REPLICA);
 
    _log(GENERAL, "Parameters:  (l = %d)", l);
    for(i=0;i < PARMS; i++)
@@ -1223,13 +1224,12 @@ static void train(void)
             // Mark the cancelled_here
             if(cancelled_at[0])
             {
-               sprintf(query, "SELECT tiploc from corpus where stanox = %s", cancelled_at);
-               if(!db_query(query) && (result0 = db_store_result()) && (row0 = mysql_fetch_row(result0)))
+               const char * cancelled_tiploc = corpus_stanox_tiploc(cancelled_at);
+               if(cancelled_tiploc[0])
                {
-                  sprintf(query, "UPDATE train SET cancelled_here = 1 WHERE tiploc_code = '%s'", row0[0]);
+                  sprintf(query, "UPDATE train SET cancelled_here = 1 WHERE tiploc_code = '%s'", cancelled_tiploc);
                   db_query(query);
                }
-               if(result0) mysql_free_result(result0);
             }
             
             // Now insert the train movement data
@@ -1245,16 +1245,8 @@ static void train(void)
                   char planned[128], tiploc[16];
                   strcpy(planned, trust_to_cif_time(row2[4]));
                   if(!planned[0]) strcpy(planned, "xxxxH");
-                  sprintf(query, "SELECT tiploc from corpus where stanox = %s", row2[1]);
-                  if(!db_query(query) && (result0 = db_store_result()) && (row0 = mysql_fetch_row(result0)))
-                  {
-                     strcpy(tiploc, row0[0]);
-                  }
-                  else
-                  {
-                     strcpy(tiploc, "Error1");
-                  }
-                  //if(row0) mysql_free_result(row0);
+                  strcpy(tiploc, corpus_stanox_tiploc(row2[1]));
+                  if(!tiploc[0]) strcpy(tiploc, "Error1");
                   
                   word dep = (atoi(row2[6]) & 0x0003) == 1;
                   if(!dep)
@@ -1689,9 +1681,6 @@ static char * location_name(const char * const tiploc, const word use_cache)
 {
    // Not re-entrant
    // Set use_cache to false if hit is not expected, to bypass search.  Cache will still be updated.
-   char query[256];
-   MYSQL_RES * result0 = NULL;
-   MYSQL_ROW row0;
    static word next_cache;
    word i;
 
@@ -1718,21 +1707,11 @@ static char * location_name(const char * const tiploc, const word use_cache)
 
    next_cache = (next_cache + 1) % CACHE_SIZE;
    {
-      sprintf(query, "select fn from corpus where tiploc = '%s'", tiploc);
-      db_query(query);
-      result0 = db_store_result();
-      if((row0 = mysql_fetch_row(result0)) && row0[0][0]) 
-      {
-         strncpy(cache_val[next_cache], row0[0], 127);
-         cache_val[next_cache][127] = '\0';
-      }
-      else
-      {
-         strcpy(cache_val[next_cache], tiploc);
-      }
+      const char * fn = corpus_tiploc_name(tiploc);
+      strncpy(cache_val[next_cache], fn[0] ? fn : tiploc, 127);
+      cache_val[next_cache][127] = '\0';
    }
    strcpy(cache_key[next_cache], tiploc);
-   mysql_free_result(result0);
 
    _log(DEBUG, "Cache miss for \"%s\" - Returning \"%s\"", tiploc, cache_val[next_cache]);
    return cache_val[next_cache];
@@ -1742,23 +1721,11 @@ static char * location_name(const char * const tiploc, const word use_cache)
 static char * show_stanox(const char * const stanox)
 {
    static char result[256];
-   char  query[256];
-   MYSQL_RES * result0;
-   MYSQL_ROW row0;
 
    if(stanox[0] != '\0')
    {
-      sprintf(query, "SELECT fn FROM corpus WHERE stanox = %s", stanox);
-      db_query(query);
-      result0 = db_store_result();
-      if((row0 = mysql_fetch_row(result0)) && row0[0][0]) 
-      {
-         strcpy(result, row0[0]);
-      }
-      else
-      {
-         strcpy(result, stanox);
-      }
+      const char * fn = corpus_stanox_name(stanox);
+      strcpy(result, fn[0] ? fn : stanox);
    }
    else
    {
@@ -26,24 +26,57 @@
 #include <sys/timex.h>
 #include <stdarg.h>
 #include <netinet/in.h>
+#include <arpa/inet.h>
 #include <errno.h>
 #include <netdb.h>
 #include <wait.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
 #include "misc.h"
 
 static char log_file[512];
 static word log_mode;
 
+// Log buffers
+// _log() formats lines into the active buffer, and they are written out by a background thread at most LOG_FLUSH_MS
+// later, or sooner if the buffer is half full.  The log file is kept open, and is reopened when log rotation has
+// renamed it or after _log_reopen().
+#define LOG_BUFFER_SIZE 65536
+#define LOG_FLUSH_MS 500
+static char log_buffer[2][LOG_BUFFER_SIZE];
+static size_t log_length;
+static word log_active, log_thread_running, log_sync;
+static volatile sig_atomic_t log_reopen_due;
+static int log_fd = -1;
+static time_t log_stamp_time;
+static char log_stamp[32];
+static pthread_t log_thread;
+static pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t log_write_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t log_wake = PTHREAD_COND_INITIALIZER;
+static void log_start_writer(void);
+static void * log_writer(void * arg);
+static void log_flush(void);
+static void log_fork_prepare(void);
+static void log_fork_parent(void);
+static void log_fork_child(void);
+
 /* Public data */
 char * conf[MAX_CONF];
 
 char * time_text(const time_t time, const byte local)
 {
-   struct tm * broken;
-   static char result[32];
+   // Results are per thread, as are those of day_date_text(), date_text(), commas() and commas_q().
+   struct tm tm, * broken;
+   static __thread char result[32];
 
-   broken = local?localtime(&time):gmtime(&time);
+   broken = local?localtime_r(&time, &tm):gmtime_r(&time, &tm);
       
    sprintf(result, "%02d/%02d/%02d %02d:%02d:%02d%s",
            broken->tm_mday, 
@@ -59,11 +92,11 @@ char * time_text(const time_t time, const byte local)
 
 char * day_date_text(const time_t time, const byte local)
 {
-   struct tm * broken;
-   static char result[32];
+   struct tm tm, * broken;
+   static __thread char result[32];
    char * days[] = {"Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat", "Sun"};
 
-   broken = local?localtime(&time):gmtime(&time);
+   broken = local?localtime_r(&time, &tm):gmtime_r(&time, &tm);
       
    sprintf(result, "%s %02d/%02d/%02d",
            days[broken->tm_wday],
@@ -76,7 +109,7 @@ char * day_date_text(const time_t time, const byte local)
 
 char * date_text(const time_t time, const byte local)
 {
-   static char result[32];
+   static __thread char result[32];
    strcpy(result, time_text(time, local));
    result[8] = '\0';
    return result;
@@ -120,8 +153,11 @@ time_t parse_timestamp(const char * string)
 
 void _log(const byte level, const char * text, ...)
 {
+   // Lines for the log file are formatted into the active log buffer, and written by log_writer() in the background.
+   // CRITICAL and ABEND lines are written before we return.
    char log[32];
-   FILE * fp;
+   size_t space;
+   int l;
 
    if(log_mode == 3) return;
    if((level == PROC || level == DEBUG) && (log_mode == 0 || log_mode == 4)) return;
@@ -130,18 +166,24 @@ void _log(const byte level, const char * text, ...)
    va_start(vargs0, text);
    va_copy(vargs1, vargs0);
 
-   time_t now = time(NULL);
-   struct tm * broken = gmtime(&now);
+   pthread_mutex_lock(&log_lock);
 
    if(text[0])
    {
-      sprintf(log, "%02d/%02d/%02d %02d:%02d:%02dZ ",
-              broken->tm_mday, 
-              broken->tm_mon + 1, 
-              broken->tm_year % 100,
-              broken->tm_hour,
-              broken->tm_min,
-              broken->tm_sec);
+      time_t now = time(NULL);
+      if(now != log_stamp_time)
+      {
+         struct tm broken_tm, * broken = gmtime_r(&now, &broken_tm);
+         sprintf(log_stamp, "%02d/%02d/%02d %02d:%02d:%02dZ ",
+                 broken->tm_mday, 
+                 broken->tm_mon + 1, 
+                 broken->tm_year % 100,
+                 broken->tm_hour,
+                 broken->tm_min,
+                 broken->tm_sec);
+         log_stamp_time = now;
+      }
+      strcpy(log, log_stamp);
 
       if(log_mode == 1 || log_mode == 2)
       {
@@ -175,15 +217,39 @@ void _log(const byte level, const char * text, ...)
       strcpy(log, "\n");
    }
 
-   // Write to log file
-   if(log_file[0] && (fp = fopen(log_file, "a")))
+   // Add to log buffer
+   if(log_file[0])
    {
-      fprintf(fp, "%s", log);
-      vfprintf(fp, text, vargs0);
-      fprintf(fp, "\n");
-      fclose(fp);
+      if(!log_thread_running && !log_sync) log_start_writer();
+      l = -1;
+      while(true)
+      {
+         space = LOG_BUFFER_SIZE - log_length;
+         l = snprintf(log_buffer[log_active] + log_length, space, "%s", log);
+         if(l >= 0 && l < space) l += vsnprintf(log_buffer[log_active] + log_length + l, space - l, text, vargs0);
+         if(l >= 0 && l + 1 < space) break;
+         if(!log_length)
+         {
+            // Too long for an empty buffer.  Truncate it.
+            l = space - 2;
+            break;
+         }
+         // Buffer full.  Write it out and try again.
+         pthread_mutex_unlock(&log_lock);
+         log_flush();
+         pthread_mutex_lock(&log_lock);
+         va_end(vargs0);
+         va_copy(vargs0, vargs1);
+      }
+      log_buffer[log_active][log_length + l] = '\n';
+      if(!log_length || (log_length < LOG_BUFFER_SIZE / 2 && log_length + l + 1 >= LOG_BUFFER_SIZE / 2))
+         pthread_cond_signal(&log_wake);
+      log_length += l + 1;
    }
 
+   pthread_mutex_unlock(&log_lock);
+   if(log_file[0] && (level >= CRITICAL || log_sync)) log_flush();
+
    // Print as well
    if(log_mode == 1 || log_mode == 4) 
    {
@@ -207,15 +273,135 @@ void _log_init(const char * l, const word d)
    // 3 No logging at all.
    // 4 Normal running plus print.
    // DANGER:  On a daemonised program, print WILL NOT WORK!
+   static word registered = false;
 
+   if(!registered)
+   {
+      atexit(log_flush);
+      pthread_atfork(log_fork_prepare, log_fork_parent, log_fork_child);
+      registered = true;
+   }
+   log_flush();
+   pthread_mutex_lock(&log_lock);
    if(strlen(l) < 500) strcpy(log_file, l);
    else log_file[0] = '\0';
    log_mode = d;
+   log_reopen_due = true;
+   pthread_mutex_unlock(&log_lock);
+}
+
+void _log_reopen(void)
+{
+   // Close and reopen the log file before the next write.  Safe to call from a signal handler.
+   log_reopen_due = true;
+}
+
+static void log_start_writer(void)
+{
+   // Called with log_lock held.  If there is no writer thread, every line is written at once.
+   pthread_attr_t attr;
+
+   pthread_attr_init(&attr);
+   pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+   if(pthread_create(&log_thread, &attr, log_writer, NULL)) log_sync = true;
+   else log_thread_running = true;
+   pthread_attr_destroy(&attr);
+}
+
+static void * log_writer(void * arg)
+{
+   // Background log writer.  Wait for something to be logged, give it LOG_FLUSH_MS for more to arrive, or
+   // until the buffer is half full, then write it out.
+   struct timespec due;
+
+   while(true)
+   {
+      pthread_mutex_lock(&log_lock);
+      while(!log_length) pthread_cond_wait(&log_wake, &log_lock);
+      if(log_length < LOG_BUFFER_SIZE / 2)
+      {
+         clock_gettime(CLOCK_REALTIME, &due);
+         due.tv_nsec += LOG_FLUSH_MS * 1000000L;
+         if(due.tv_nsec >= 1000000000L)
+         {
+            due.tv_sec++;
+            due.tv_nsec -= 1000000000L;
+         }
+         pthread_cond_timedwait(&log_wake, &log_lock, &due);
+      }
+      pthread_mutex_unlock(&log_lock);
+      log_flush();
+   }
+   return NULL;
+}
+
+static void log_flush(void)
+{
+   // Write out the active log buffer.  log_write_lock keeps the writes in order while the other buffer fills.
+   const char * buffer;
+   size_t length, done;
+   ssize_t l;
+   struct stat file, opened;
+
+   pthread_mutex_lock(&log_write_lock);
+   pthread_mutex_lock(&log_lock);
+   buffer = log_buffer[log_active];
+   length = log_length;
+   log_active ^= 1;
+   log_length = 0;
+   pthread_mutex_unlock(&log_lock);
+
+   if(length)
+   {
+      // Reopen if asked to, or if log rotation has moved the file away.
+      if(log_fd >= 0 && (log_reopen_due || stat(log_file, &file) || fstat(log_fd, &opened) || file.st_ino != opened.st_ino || file.st_dev != opened.st_dev))
+      {
+         close(log_fd);
+         log_fd = -1;
+      }
+      if(log_fd < 0)
+      {
+         log_reopen_due = false;
+         log_fd = open(log_file, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0666);
+      }
+      for(done = 0; log_fd >= 0 && done < length; done += l)
+      {
+         if((l = write(log_fd, buffer + done, length - done)) < 0)
+         {
+            if(errno == EINTR) l = 0;
+            else break;
+         }
+      }
+   }
+   pthread_mutex_unlock(&log_write_lock);
+}
+
+static void log_fork_prepare(void)
+{
+   // Empty the buffers so that the child doesn't write the parent's lines as well.
+   log_flush();
+   pthread_mutex_lock(&log_write_lock);
+   pthread_mutex_lock(&log_lock);
+}
+
+static void log_fork_parent(void)
+{
+   pthread_mutex_unlock(&log_lock);
+   pthread_mutex_unlock(&log_write_lock);
+}
+
+static void log_fork_child(void)
+{
+   // The writer thread doesn't survive fork().  _log() starts another when it is needed.
+   pthread_mutex_init(&log_lock, NULL);
+   pthread_mutex_init(&log_write_lock, NULL);
+   pthread_cond_init(&log_wake, NULL);
+   log_thread_running = false;
 }
 
 char * commas(const dword n)
 {
-   static char result[32];
+   static __thread char result[32];
    char zs[32];
    word i,j,k;
 
@@ -235,7 +421,7 @@ char * commas(const dword n)
 
 char * commas_q(const qword n)
 {
-   static char result[64];
+   static __thread char result[64];
    char zs[64];
    word i,j,k;
 
@@ -463,7 +649,13 @@ static const char * const config_keys[MAX_CONF] = {"db_server", "db_name", "db_u
                                                    "stomp_topics", "stomp_topic_names", "stomp_topic_log",
                                                    "stompy_bin", "trustdb_no_deduce_act", "huyton_alerts",
                                                    "live_server", "tddb_report_new", "server_split",
-                                                   "debug",};
+                                                   "debug",
+                                                   "stompy_memory", "stompy_consumers", "stompy_shm",
+                                                   "db_profile",
+                                                   "db_replica_server", "db_replica_max_lag",
+                                                   "trustdb_group_ms", "trustdb_group_messages", "trustdb_group_kb",
+                                                   "corpus_snapshot",
+                                                   "trustdb_shards",};
 static const byte config_type[MAX_CONF] = { 0, 0, 0, 0,
                                             0, 0, 0, 0,
                                             0, 0,
@@ -471,6 +663,12 @@ static const byte config_type[MAX_CONF] = { 0, 0, 0, 0,
                                             1, 1, 1,
                                             1, 1, 1,
                                             1,
+                                            0, 0, 1,
+                                            1,
+                                            0, 0,
+                                            0, 0, 0,
+                                            0,
+                                            0,
 };
 
 char * load_config(const char * const filepath)
@@ -610,11 +808,18 @@ ssize_t read_all(const int socket, void * buffer, const size_t size)
 
 static fd_set sockets;
 static int stompy_socket;
+static dword stompy_sequence;
+static word stompy_port;
+static struct stompy_ring * stompy_ring;
+static word read_stompy_ring(void * buffer, const size_t max_size, const qword ms);
 word open_stompy(const word port)
 {
    struct sockaddr_in serv_addr;
    struct hostent *server;
    stompy_socket = -1;
+   stompy_sequence = 0;
+   stompy_port = port;
+   stompy_ring = NULL;
 
    _log(GENERAL, "Connecting socket to stompy...");
    stompy_socket = socket(AF_INET, SOCK_STREAM, 0);
@@ -652,12 +857,25 @@ word open_stompy(const word port)
    _log(GENERAL, "Connected.  Waiting for messages...");
    FD_ZERO(&sockets);
    FD_SET(stompy_socket, &sockets);
+
+   // Ask for the shared memory ring.  stompy answers with a zero frame length when it has switched.
+   if(*conf[conf_stompy_shm] && write(stompy_socket, "M", 1) < 1)
+   {
+      _log(CRITICAL, "Failed to request shared memory ring.  Error %d %s", errno, strerror(errno));
+   }
    return 0;
 }
 
 word read_stompy(void * buffer, const size_t max_size, const word seconds)
+{
+   return read_stompy_ms(buffer, max_size, seconds * 1000LL);
+}
+
+word read_stompy_ms(void * buffer, const size_t max_size, const qword ms)
 {
    // Given a blocking socket, blocks until a full STOMP frame has been read, or end-of-file/error/timeout
+   // Timeout after ms milliseconds without the start of a frame, or never if ms is 0.  Once a frame has started the
+   // rest of it is given at least a second.
    // Return 0 Success.
    //        1 End of file.
    //        2 Error.  See errno.
@@ -672,17 +890,18 @@ word read_stompy(void * buffer, const size_t max_size, const word seconds)
    word result = 0;
    fd_set active_sockets;
    struct timeval wait_time;
-   _log(PROC, "read_stompy(~, %ld, %d)", max_size, seconds);
+   const qword body_ms = (ms && ms < 1000) ? 1000 : ms;
+   _log(PROC, "read_stompy_ms(~, %ld, %lld)", max_size, ms);
 
    if(stompy_socket < 0) return 4;
-
+   if(stompy_ring) return read_stompy_ring(buffer, max_size, ms);
 
    while(got < sizeof(ssize_t) && !result)
    {
       active_sockets = sockets;
-      wait_time.tv_sec = seconds;
-      wait_time.tv_usec = 0;
-      int r = select(FD_SETSIZE, &active_sockets, NULL, NULL, seconds?(&wait_time):NULL);
+      wait_time.tv_sec = (got ? body_ms : ms) / 1000;
+      wait_time.tv_usec = ((got ? body_ms : ms) % 1000) * 1000;
+      int r = select(FD_SETSIZE, &active_sockets, NULL, NULL, ms?(&wait_time):NULL);
       _log(DEBUG, "First select returns %d.", r);
       if(r == 0) result = 3;
       if(r <  0) result = 2;
@@ -700,6 +919,35 @@ word read_stompy(void * buffer, const size_t max_size, const word seconds)
 
    memcpy(&length, buffer, sizeof(ssize_t));
    _log(DEBUG, "Received frame length = 0x%zx", length);
+   if(length == 0)
+   {
+      // stompy has switched us to the shared memory ring.
+      char path[64];
+      int fd;
+      sprintf(path, STOMPY_RING_PATH, stompy_port);
+      if((fd = open(path, O_RDWR)) < 0)
+      {
+         _log(CRITICAL, "Failed to open ring \"%s\".  Error %d %s", path, errno, strerror(errno));
+         return 2;
+      }
+      stompy_ring = mmap(NULL, sizeof(struct stompy_ring) + STOMPY_RING_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+      close(fd);
+      if(stompy_ring == MAP_FAILED)
+      {
+         _log(CRITICAL, "Failed to map ring \"%s\".  Error %d %s", path, errno, strerror(errno));
+         stompy_ring = NULL;
+         return 2;
+      }
+      if(__atomic_load_n(&stompy_ring->magic, __ATOMIC_ACQUIRE) != STOMPY_RING_MAGIC || stompy_ring->size != STOMPY_RING_SIZE)
+      {
+         _log(CRITICAL, "Ring \"%s\" is not valid.", path);
+         munmap(stompy_ring, sizeof(struct stompy_ring) + STOMPY_RING_SIZE);
+         stompy_ring = NULL;
+         return 2;
+      }
+      _log(GENERAL, "Switched to shared memory ring \"%s\".", path);
+      return read_stompy_ring(buffer, max_size, ms);
+   }
    if(length > max_size) 
    {
       _log(MAJOR, "read_stompy() Error 5:  Received length 0x%08zx exceeds limit 0x%08zx.", length, max_size);
@@ -710,9 +958,9 @@ word read_stompy(void * buffer, const size_t max_size, const word seconds)
    while(got < length && !result)
    {
       active_sockets = sockets;
-      wait_time.tv_sec = seconds;
-      wait_time.tv_usec = 0;
-      int r = select(FD_SETSIZE, &active_sockets, NULL, NULL, seconds?(&wait_time):NULL);
+      wait_time.tv_sec = body_ms / 1000;
+      wait_time.tv_usec = (body_ms % 1000) * 1000;
+      int r = select(FD_SETSIZE, &active_sockets, NULL, NULL, ms?(&wait_time):NULL);
       _log(DEBUG, "Second select returns %d.", r);
       if(r == 0) result = 6;
       if(r <  0) result = 2;
@@ -727,21 +975,128 @@ word read_stompy(void * buffer, const size_t max_size, const word seconds)
    }
 
    if(result == 6) _log(MAJOR, "read_stompy() Error 6:  Timeout while waiting for message body.  Received 0x%08zx of 0x%08zx bytes.", got, length);
+   if(!result) stompy_sequence++;
 
    return result;
 }
 
 word ack_stompy(void)
 {
+   // Ack the oldest unacked frame.
    _log(PROC, "ack_stompy()");
    if(stompy_socket < 0) return 1;
    if(write(stompy_socket, "A", 1) < 1) return 1;
    return 0;
    
 }
+
+word ack_to_stompy(const dword sequence)
+{
+   // Cumulative ack.  Acks all frames up to and including frame number sequence, as returned by sequence_stompy().
+   char record[1 + sizeof(dword)];
+   dword n = htonl(sequence);
+   _log(PROC, "ack_to_stompy(%d)", sequence);
+   if(stompy_socket < 0) return 1;
+   record[0] = 'C';
+   memcpy(record + 1, &n, sizeof(dword));
+   if(write(stompy_socket, record, sizeof(record)) < sizeof(record)) return 1;
+   return 0;
+}
+
+word window_stompy(const word frames)
+{
+   // Ask stompy to send up to frames frames ahead of our acks.  Call after open_stompy().
+   // Stompy may reduce the window to suit itself.  Without this call, the window is 1.
+   char record[1 + sizeof(dword)];
+   dword n = htonl(frames);
+   _log(PROC, "window_stompy(%d)", frames);
+   if(stompy_socket < 0) return 1;
+   record[0] = 'W';
+   memcpy(record + 1, &n, sizeof(dword));
+   if(write(stompy_socket, record, sizeof(record)) < sizeof(record)) return 1;
+   return 0;
+}
+
+static word read_stompy_ring(void * buffer, const size_t max_size, const qword ms)
+{
+   // read_stompy() for a connection which has switched to the shared memory ring.  Same return values.
+   // While frames are waiting this makes no system calls.  Otherwise we sleep on the futex, checking the
+   // socket for end-of-file each time we wake without a frame, since stompy doesn't write to it any more.
+   struct stompy_ring * r = stompy_ring;
+   qword tail = r->tail;
+   qword head;
+   size_t length, offset;
+   qword give_up = ms?(time_ms() + ms):0;
+   qword now_ms, wait_ms;
+   struct timespec wait_time;
+   struct pollfd p;
+
+   while((head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE)) == tail)
+   {
+      dword written = __atomic_load_n(&r->written, __ATOMIC_SEQ_CST);
+      __atomic_store_n(&r->waiting, 1, __ATOMIC_SEQ_CST);
+      if(__atomic_load_n(&r->head, __ATOMIC_ACQUIRE) == tail)
+      {
+         // Wake at least once a second to look at the socket.
+         wait_ms = 1000;
+         if(give_up)
+         {
+            now_ms = time_ms();
+            wait_ms = (give_up > now_ms) ? give_up - now_ms : 1;
+            if(wait_ms > 1000) wait_ms = 1000;
+         }
+         wait_time.tv_sec = wait_ms / 1000;
+         wait_time.tv_nsec = (wait_ms % 1000) * 1000000;
+         syscall(SYS_futex, &r->written, FUTEX_WAIT, written, &wait_time, NULL, 0);
+      }
+      __atomic_store_n(&r->waiting, 0, __ATOMIC_SEQ_CST);
+
+      if(__atomic_load_n(&r->head, __ATOMIC_ACQUIRE) == tail)
+      {
+         p.fd = stompy_socket;
+         p.events = POLLIN;
+         if(poll(&p, 1, 0) > 0)
+         {
+            char c;
+            ssize_t l = read(stompy_socket, &c, 1);
+            if(l <  0) return 2;
+            if(l == 0) return 1;
+            _log(MAJOR, "read_stompy() Unexpected data on socket while using ring.");
+         }
+         if(give_up && time_ms() >= give_up) return 3;
+      }
+   }
+
+   offset = tail % r->size;
+   length = *(qword *) (r->data + offset);
+   if(length == STOMPY_RING_WRAP)
+   {
+      tail += r->size - offset;
+      offset = 0;
+      length = *(qword *) (r->data + offset);
+   }
+   _log(DEBUG, "Received frame length = 0x%zx from ring", length);
+   if(length > max_size || length > r->size)
+   {
+      _log(MAJOR, "read_stompy() Error 5:  Received length 0x%08zx exceeds limit 0x%08zx.", length, max_size);
+      return 5;
+   }
+   memcpy(buffer, r->data + offset + sizeof(qword), length);
+   __atomic_store_n(&r->tail, tail + sizeof(qword) + ((length + 7) & ~7), __ATOMIC_RELEASE);
+   stompy_sequence++;
+   return 0;
+}
+
+dword sequence_stompy(void)
+{
+   // Sequence number of the last frame returned by read_stompy().  The first frame on a connection is 1.
+   return stompy_sequence;
+}
 void close_stompy(void)
 {
    _log(PROC, "close_stompy()");
+   if(stompy_ring) munmap(stompy_ring, sizeof(struct stompy_ring) + STOMPY_RING_SIZE);
+   stompy_ring = NULL;
    if(stompy_socket >= 0) close(stompy_socket);
 }
 
@@ -41,10 +41,54 @@ enum config_keys {conf_db_server, conf_db_name, conf_db_user, conf_db_password,
                   conf_stompy_bin, conf_trustdb_no_deduce_act, conf_huyton_alerts,
                   conf_live_server, conf_tddb_report_new, conf_server_split,
                   conf_debug, 
+                  conf_stompy_memory, conf_stompy_consumers, conf_stompy_shm,
+                  conf_db_profile,
+                  conf_db_replica_server, conf_db_replica_max_lag,
+                  conf_trustdb_group_ms, conf_trustdb_group_messages, conf_trustdb_group_kb,
+                  conf_corpus_snapshot,
+                  conf_trustdb_shards,
                   MAX_CONF};
 extern char * conf[MAX_CONF];
 enum log_types {GENERAL, PROC, DEBUG, MINOR, MAJOR, CRITICAL, ABEND};
 
+// Shared memory ring in which stompy passes frames to a client, as an alternative to the TCP connection.
+// The file is named after the client's port.  stompy creates it afresh with mode 0600, so the client must run as
+// the same user.  stompy appends records and advances head, the client reads them and advances tail.  Each record
+// is a qword frame length followed by the frame including its \0, padded to a multiple of 8 bytes.  A length of STOMPY_RING_WRAP means the next record is at the start of data.
+// written counts frames appended and is the futex a client sleeps on when waiting is set.
+#define STOMPY_RING_PATH  "/dev/shm/stompy-%d"
+#define STOMPY_RING_MAGIC 0x474e4952
+#define STOMPY_RING_SIZE  (2 * 1024 * 1024)
+#define STOMPY_RING_WRAP  (~0ULL)
+struct stompy_ring
+{
+   dword magic, size;
+   qword head;
+   dword written;
+   dword waiting;
+   qword tail __attribute__ ((aligned (64)));
+   char data[] __attribute__ ((aligned (64)));
+};
+
+// Records in stompy's disc spool segments.  Either a struct spool_header followed by the frame without its \0,
+// or a struct spool_block followed by length bytes of deflate data which inflate to raw bytes of such frame records.
+#define SPOOL_MAGIC       0x53544f4d
+#define SPOOL_BLOCK_MAGIC 0x5a544f4d
+#define SPOOL_BLOCK_SIZE  (256 * 1024)
+struct spool_header
+{
+   dword magic;
+   dword length;
+   qword stamp;
+};
+struct spool_block
+{
+   dword magic;
+   dword length;
+   dword raw;
+   dword frames;
+};
+
 extern char * time_text(const time_t time, const byte local);
 extern char * day_date_text(const time_t time, const byte local);
 extern char * date_text(const time_t time, const byte local);
@@ -52,6 +96,7 @@ extern time_t parse_datestamp(const char * string);
 extern time_t parse_timestamp(const char * string);
 extern void _log(const byte level, const char * text, ...);
 extern void _log_init(const char * log_file, const word debug);
+extern void _log_reopen(void);
 extern char * commas(const dword n);
 extern char * commas_q(const qword n);
 extern char * show_spaces(const char * string);
@@ -65,7 +110,11 @@ extern qword time_us(void);
 extern ssize_t read_all(const int socket, void * buffer, const size_t size);
 extern word open_stompy(const word port);
 extern word read_stompy(void * buffer, const size_t max_size, const word seconds);
+extern word read_stompy_ms(void * buffer, const size_t max_size, const qword ms);
 extern word ack_stompy(void);
+extern word ack_to_stompy(const dword sequence);
+extern word window_stompy(const word frames);
+extern dword sequence_stompy(void);
 extern void close_stompy(void);
 extern void extract_match(const char * const source, const regmatch_t * const matches, const unsigned int match, char * result, const size_t max_length);
 extern char * system_call(const char * const command);
@@ -30,6 +30,7 @@
 
 #include "misc.h"
 #include "db.h"
+#include "corpus.h"
 #include "build.h"
 
 #define NAME "railquery"
@@ -187,7 +188,7 @@ int main()
    printf("<body style=\"font-family: arial,sans-serif;\" onload=\"startup();\">\n");
 
    // Initialise database
-   db_init(conf[conf_db_server], conf[conf_db_user], conf[conf_db_password], conf[conf_db_name], DB_MODE_NORMAL);
+   db_init(conf[conf_db_server], conf[conf_db_user], conf[conf_db_password], conf[conf_db_name], DB_MODE_REPLICA);
 
    _log(GENERAL, "Parameters:  (l = %d)", l);
    for(i=0;i < PARMS; i++)
@@ -1607,24 +1608,11 @@ static void report_h(void)
 static char * location_name(const char * const tiploc)
 {
    // Not re-entrant
-   char query[256];
    static char result[256];
-   MYSQL_RES * db_result;
-   MYSQL_ROW      db_row;
+   const char * fn = corpus_tiploc_name(tiploc);
 
-   sprintf(query, "select fn from corpus where tiploc = '%s'", tiploc);
-   db_query(query);
-   db_result = db_store_result();
-   if((db_row = mysql_fetch_row(db_result)) && db_row[0][0]) 
-   {
-      strncpy(result, db_row[0], 127);
-      result[127] = '\0';
-   }
-   else
-   {
-      strcpy(result, tiploc);
-   }
-   mysql_free_result(db_result);
+   strncpy(result, fn[0] ? fn : tiploc, 127);
+   result[127] = '\0';
 
    return result;
 }
@@ -1632,24 +1620,16 @@ static char * location_name(const char * const tiploc)
 static char * location_name_stanox(const dword stanox)
 {
    // Not re-entrant
-   char query[256];
    static char result[256];
-   MYSQL_RES * db_result;
-   MYSQL_ROW      db_row;
+   const char * fn;
 
-   sprintf(query, "select fn from corpus where stanox = %d", stanox);
-   db_query(query);
-   db_result = db_store_result();
-   if((db_row = mysql_fetch_row(db_result)) && db_row[0][0]) 
+   sprintf(result, "%d", stanox);
+   fn = corpus_stanox_name(result);
+   if(fn[0])
    {
-      strncpy(result, db_row[0], 127);
+      strncpy(result, fn, 127);
       result[127] = '\0';
    }
-   else
-   {
-      sprintf(result, "%d", stanox);
-   }
-   mysql_free_result(db_result);
 
    return result;
 }
@@ -28,6 +28,7 @@
 
 #include "misc.h"
 #include "db.h"
+#include "corpus.h"
 #include "build.h"
 
 static void report(const char * const tiploc, const word year, const word month);
@@ -141,7 +142,7 @@ int main(int argc, char **argv)
    _log_init("", debug?1:0);
 
    // Initialise database
-   db_init(conf[conf_db_server], conf[conf_db_user], conf[conf_db_password], conf[conf_db_name], DB_MODE_NORMAL);
+   db_init(conf[conf_db_server], conf[conf_db_user], conf[conf_db_password], conf[conf_db_name], DB_MODE_REPLICA);
 
    report(argv[optind], year, month);
 
@@ -562,31 +563,26 @@ static void report_train_day(const word index, const time_t when, const char * c
                      }
                      if(status < Departed)
                      {
-                        sprintf(query, "SELECT tiploc FROM corpus WHERE stanox = %s", row1[1]);
-                        if(!db_query(query))
+                        const char * movement_tiploc = corpus_stanox_tiploc(row1[1]);
+                        if(movement_tiploc[0])
                         {
-                           result2 = db_store_result();
-                           if((row2 = mysql_fetch_row(result2)))
+                           if(!strcasecmp(tiploc, movement_tiploc))
                            {
-                              if(!strcasecmp(tiploc, row2[0]))
+                              // Bug: For a train which calls twice, we will only analyse the first visit.
+                              if((flags & 0x0003) == 0x0001)
                               {
-                                 // Bug: For a train which calls twice, we will only analyse the first visit.
-                                 if((flags & 0x0003) == 0x0001)
-                                 {
-                                    // Got a departure report at our station
-                                    status = Departed;
-                                    strcpy(actual, row1[2]);
-                                    deviation = atoi(row1[3]);
-                                    late = ((flags & 0x0018) == 0x0010);
-                                 }
-                                 else if(status < Arrived)
-                                 {
-                                    // Got an arrival at our station AND haven't seen a departure yet
-                                    status = Arrived;
-                                 }
+                                 // Got a departure report at our station
+                                 status = Departed;
+                                 strcpy(actual, row1[2]);
+                                 deviation = atoi(row1[3]);
+                                 late = ((flags & 0x0018) == 0x0010);
+                              }
+                              else if(status < Arrived)
+                              {
+                                 // Got an arrival at our station AND haven't seen a departure yet
+                                 status = Arrived;
                               }
                            }
-                           mysql_free_result(result2);
                         }
                      }
                   }
@@ -57,7 +57,7 @@ word debug;
 static word fetch_file(void);
 static size_t file_write_data(void *buffer, size_t size, size_t nmemb, void *userp);
 static word process_file(void);
-static void process_smart_object(const char * const object_string);
+static void process_smart_object(const char * const object_string, const jsmntok_t * const tokens);
 
 dword count_records;
 
@@ -317,28 +317,39 @@ static word process_file(void)
 {
    char zs[1024];
 
-#define MAX_BUF 32768
-   char buffer[MAX_BUF];
-#define MAX_OBJ 65536
-   char obj[MAX_OBJ];
-   char in_q = 0;
-   char b_depth = 0;
-
-   size_t ibuf;
-   size_t iobj = 0;
-   size_t buf_end;
+#define MAX_TOKENS 1024
+   jsmntok_t tokens[MAX_TOKENS];
+   jsmn_stream stream;
+   jsmnerr_t r;
+   char * json;
+   long length;
 
    FILE * fp;
    
    _log(GENERAL, "Processing SMART data.");
 
-   // Read in json data
+   // Read in json data.  It is parsed in place, one berth step at a time.
    if(!(fp = fopen(filepath, "r")))
    {
       sprintf(zs, "Failed to open \"%s\" for reading.", filepath);
       _log(CRITICAL, zs);
       return 11;
    }      
+   if(fseek(fp, 0, SEEK_END) || (length = ftell(fp)) < 0 || fseek(fp, 0, SEEK_SET) || !(json = malloc(length + 1)))
+   {
+      _log(CRITICAL, "Failed to load \"%s\".", filepath);
+      fclose(fp);
+      return 11;
+   }
+   if(fread(json, 1, length, fp) != (size_t) length)
+   {
+      _log(CRITICAL, "Failed to read \"%s\".", filepath);
+      free(json);
+      fclose(fp);
+      return 11;
+   }
+   json[length] = '\0';
+   fclose(fp);
 
    // Upgrade the database
    word e;
@@ -350,35 +361,28 @@ static word process_file(void)
 
    db_query("DELETE FROM smart");
 
-   // Bodge:  Bin off the array stuff
-   buf_end = fread(buffer, 1, 14, fp);
-
-   while((buf_end = fread(buffer, 1, MAX_BUF, fp)))
+   jsmn_stream_init(&stream, json);
+   while((r = jsmn_stream_next(&stream, tokens, MAX_TOKENS)) != JSMN_END)
    {
-      // printf("Read %zd bytes.\n", buf_end);
-      for(ibuf = 0; ibuf < buf_end; ibuf++)
+      if(r != JSMN_SUCCESS)
       {
-         char c = buffer[ibuf];
-         if(c != '\r' && c != '\n') obj[iobj++] = c;
-         if(iobj >= MAX_OBJ)
-         {
-            obj[64] = '\0';
-            sprintf(zs, "Object buffer overflow:  \"%s\"...", obj);
-            _log(CRITICAL, zs);
-            exit(1);
-         }
-         if(c == '"') in_q = ! in_q;
-         if(!in_q && c == '{') b_depth++;
-         if(!in_q && c == '}' && b_depth-- && b_depth == 0)
+         sprintf(zs, "Parser result %d.  ", r);
+      
+         switch(r)
          {
-            obj[iobj] = '\0';
-            process_smart_object(obj);
-            iobj = 0;
+         case JSMN_ERROR_INVAL: strcat(zs, "Error - Invalid.  "); break;
+         case JSMN_ERROR_NOMEM: strcat(zs, "Error - Nomem.  "); break;
+         case JSMN_ERROR_PART:  strcat(zs, "Error - Part JSON.  "); break;
+         default:               strcat(zs, "Unknown response.  "); break;
          }
+      
+         _log(MAJOR, zs);
+         continue;
       }
+      process_smart_object(json, tokens);
    }
 
-   fclose(fp);
+   free(json);
 
    return 0;
    
@@ -394,35 +398,10 @@ if(strlen(zs1) > b) \
 } \
 strcat(query, ", '"); strcat(query, zs1); strcat(query, "'"); }
 
-static void process_smart_object(const char * const object_string)
+static void process_smart_object(const char * const object_string, const jsmntok_t * const tokens)
 {
    char zs[1024], zs1[1024];
 
-   jsmn_parser parser;
-
-#define MAX_TOKENS 1024
-   jsmntok_t tokens[MAX_TOKENS];
-
-   jsmn_init(&parser);
-
-   int r = jsmn_parse(&parser, object_string, tokens, MAX_TOKENS);
-   if(r != JSMN_SUCCESS)
-   {
-      sprintf(zs, "Parser result %d.  ", r);
-      
-      switch(r)
-      {
-      case JSMN_SUCCESS:     strcat(zs, "Success.  "); break;
-      case JSMN_ERROR_INVAL: strcat(zs, "Error - Invalid.  "); break;
-      case JSMN_ERROR_NOMEM: strcat(zs, "Error - Nomem.  "); break;
-      case JSMN_ERROR_PART:  strcat(zs, "Error - Part JSON.  "); break;
-      default:               strcat(zs, "Unknown response.  "); break;
-      }
-      
-      _log(MAJOR, zs);
-      return;
-   }
-
    // jsmn_dump_tokens(object_string, tokens, 0);
    // printf("|%s|\n", object_string);
    char query[2048];
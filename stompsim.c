@@ -0,0 +1,597 @@
+/*
+    Copyright (C) 2026 Phil Wieland
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    phil@philwieland.com
+
+*/
+
+// Stand-in for the Network Rail STOMP broker, for load testing stompy and the daemons behind it on one machine.
+// It accepts one STOMP connection at a time on the nr_stomp_port, and replays stompy message logs (plain or gzip) to
+// it.  Each logged message is sent to the subscription whose destination is the topic configured for its topic name
+// in stomp_topics and stomp_topic_names.  Like the broker with ack:client, it holds back once window messages are
+// unacked, and messages unacked when the connection drops are sent again on the next connection.
+// Point stompy at it with nr_server localhost in the config file.
+
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <zlib.h>
+
+#include "misc.h"
+#include "build.h"
+
+#define NAME "stompsim"
+
+#ifndef RELEASE_BUILD
+#define BUILD "0001p"
+#else
+#define BUILD RELEASE_BUILD
+#endif
+
+#define DEFAULT_STOMP_PORT 61618
+#define DEFAULT_WINDOW 256
+#define MAX_WINDOW 4096
+#define MAX_TOPICS 8
+#define LINE_SIZE 131072
+#define RX_SIZE 65536
+
+static word run;
+static int s_listen, s_client;
+
+// Topics from config.  subscription[] is the id stompy gave to each, or -1.
+static char * topic_names[MAX_TOPICS], * topic_destinations[MAX_TOPICS];
+static int subscription[MAX_TOPICS];
+static word topic_count;
+static char names[1024], destinations[1024];
+
+// Replay input
+static char ** files;
+static int file_count, file_index;
+static word loops;
+static gzFile input;
+static char line[LINE_SIZE];
+static double speed;
+static time_t log_base;
+static qword wall_base;
+
+// Messages sent and not yet acked, oldest first.  Index in_flight_off to in_flight_on - 1, modulo MAX_WINDOW.
+// pending is the next message to send if it has been read but not yet sent.
+struct message
+{
+   qword id, sent;
+   word topic;
+   time_t stamp;
+   char * body;
+};
+static struct message in_flight[MAX_WINDOW], pending;
+static dword in_flight_on, in_flight_off, resend, window;
+static qword next_id;
+static word have_pending, input_done;
+
+// Connection
+static char rx[RX_SIZE];
+static size_t rx_length;
+static word connected, subscribed;
+static dword heartbeat_ms;
+static qword heartbeat_due;
+static dword disconnect_after, sent_this_connection;
+
+// Statistics
+static qword count_sent, count_resent, count_acked, count_skipped, latency_total, latency_max;
+static qword start_time;
+
+static void termination_handler(int signum);
+static int  open_listener(const word port);
+static void client_accept(void);
+static void client_read(void);
+static void client_frame(char * const frame);
+static void client_close(const char * const reason);
+static void client_send(const char * const data, const size_t length);
+static void handle_ack(const char * const headers);
+static word next_message(void);
+static void send_message(struct message * const m);
+static qword due_time(const time_t stamp);
+static void report(void);
+
+int main(int argc, char *argv[])
+{
+   int c, i;
+   char config_file_path[256];
+   word usage = false;
+   word port;
+   struct pollfd p[2];
+   qword now, due;
+   int timeout;
+
+   strcpy(config_file_path, "/etc/openrail.conf");
+   speed = 1.0;
+   window = DEFAULT_WINDOW;
+   heartbeat_ms = 20000;
+   disconnect_after = 0;
+   loops = 1;
+   while ((c = getopt (argc, argv, ":c:s:w:b:d:l:")) != -1)
+   {
+      switch (c)
+      {
+      case 'c':
+         strcpy(config_file_path, optarg);
+         break;
+      case 's':
+         speed = atof(optarg);
+         break;
+      case 'w':
+         window = atoi(optarg);
+         break;
+      case 'b':
+         heartbeat_ms = atoi(optarg);
+         break;
+      case 'd':
+         disconnect_after = atoi(optarg);
+         break;
+      case 'l':
+         loops = atoi(optarg);
+         break;
+      case ':':
+         break;
+      case '?':
+      default:
+         usage = true;
+         break;
+      }
+   }
+   if(optind >= argc || window < 1 || window > MAX_WINDOW || speed < 0.0) usage = true;
+
+   char * config_fail;
+   if((config_fail = load_config(config_file_path)))
+   {
+      printf("Failed to read config file \"%s\":  %s\n", config_file_path, config_fail);
+      usage = true;
+   }
+
+   if(usage)
+   {
+      printf("%s %s\n", NAME, BUILD);
+      printf("\tUsage: %s [-c /path/to/config/file.conf] [-s speed] [-w window] [-b heartbeat] [-d messages] [-l loops] messagelog...\n", argv[0]);
+      printf("\t-s Replay speed as a multiple of real time.  0 means as fast as possible.  Default 1.\n");
+      printf("\t-w Maximum unacked messages, 1 to %d.  Default %d.\n", MAX_WINDOW, DEFAULT_WINDOW);
+      printf("\t-b Heartbeat interval in ms.  0 sends no heartbeats, to provoke a STOMP timeout.  Default 20000.\n");
+      printf("\t-d Drop the connection after this many messages.  Default never.\n");
+      printf("\t-l Replay the logs this many times.  0 means for ever.  Default 1.\n\n");
+      exit(1);
+   }
+   files = argv + optind;
+   file_count = argc - optind;
+
+   _log_init("/tmp/stompsim.log", 4);
+
+   // Topics from config
+   strcpy(destinations, conf[conf_stomp_topics]);
+   strcpy(names, conf[conf_stomp_topic_names]);
+   {
+      char * d = destinations, * n = names, * q;
+      for(topic_count = 0; topic_count < MAX_TOPICS && *d && *n; topic_count++)
+      {
+         topic_destinations[topic_count] = d;
+         topic_names[topic_count] = n;
+         subscription[topic_count] = -1;
+         if((q = strchr(d, ';'))) { *q = '\0'; d = q + 1; } else d += strlen(d);
+         if((q = strchr(n, ';'))) { *q = '\0'; n = q + 1; } else n += strlen(n);
+      }
+   }
+   if(!topic_count)
+   {
+      printf("No topics in stomp_topics and stomp_topic_names.\n");
+      exit(1);
+   }
+
+   port = DEFAULT_STOMP_PORT;
+   if(conf[conf_nr_stomp_port] && *conf[conf_nr_stomp_port]) port = atoi(conf[conf_nr_stomp_port]);
+
+   signal(SIGTERM, termination_handler);
+   signal(SIGINT,  termination_handler);
+   signal(SIGPIPE, SIG_IGN);
+
+   if((s_listen = open_listener(port)) < 0) exit(1);
+   s_client = -1;
+   _log(GENERAL, "%s %s listening on port %d.  Speed %g, window %u, heartbeat %ums.", NAME, BUILD, port, speed, window, heartbeat_ms);
+   for(i = 0; i < topic_count; i++) _log(GENERAL, "   Topic %s is /topic/%s.", topic_names[i], topic_destinations[i]);
+
+   file_index = 0;
+   input = NULL;
+   in_flight_on = in_flight_off = resend = 0;
+   next_id = 1;
+   have_pending = input_done = false;
+   log_base = 0;
+   start_time = 0;
+   run = true;
+
+   while(run)
+   {
+      now = time_us();
+      timeout = 1000;
+
+      if(connected && subscribed)
+      {
+         // Send whatever is due.
+         while(connected && in_flight_on - in_flight_off < window && (resend != in_flight_on || next_message()))
+         {
+            if(resend != in_flight_on)
+            {
+               // Redelivery after a reconnect goes out at once, once its topic is subscribed again.
+               if(subscription[in_flight[resend % MAX_WINDOW].topic] < 0) break;
+               send_message(&in_flight[resend % MAX_WINDOW]);
+               resend++;
+               count_resent++;
+               continue;
+            }
+            // A message for a topic not subscribed again yet is held, and the ones after it wait behind it.
+            if(subscription[pending.topic] < 0) break;
+            due = due_time(pending.stamp);
+            if(due > now)
+            {
+               if((due - now) / 1000 < timeout) timeout = (due - now) / 1000 + 1;
+               break;
+            }
+            pending.id = next_id++;
+            in_flight[in_flight_on % MAX_WINDOW] = pending;
+            have_pending = false;
+            send_message(&in_flight[in_flight_on % MAX_WINDOW]);
+            in_flight_on++;
+            resend = in_flight_on;
+            // Only new messages count towards a planned disconnect, so that redelivery can't prevent progress.
+            if(disconnect_after && ++sent_this_connection >= disconnect_after && s_client >= 0) client_close("Planned disconnect");
+         }
+         if(connected && heartbeat_ms)
+         {
+            now = time_us();
+            if(now >= heartbeat_due)
+            {
+               client_send("\n", 1);
+               heartbeat_due = now + heartbeat_ms * 1000LL;
+            }
+            if((heartbeat_due - now) / 1000 < timeout) timeout = (heartbeat_due - now) / 1000 + 1;
+         }
+      }
+
+      if(input_done && !have_pending && in_flight_on == in_flight_off && count_sent)
+      {
+         _log(GENERAL, "All messages sent and acked.");
+         run = false;
+         break;
+      }
+
+      p[0].fd = s_listen;
+      p[0].events = POLLIN;
+      p[1].fd = s_client;
+      p[1].events = POLLIN;
+      if(poll(p, 2, timeout) < 0)
+      {
+         if(errno != EINTR) _log(CRITICAL, "poll() error %d %s.", errno, strerror(errno));
+         continue;
+      }
+      if(p[0].revents & POLLIN) client_accept();
+      if(s_client >= 0 && (p[1].revents & (POLLIN | POLLERR | POLLHUP))) client_read();
+   }
+
+   if(s_client >= 0) close(s_client);
+   close(s_listen);
+   report();
+   exit(0);
+}
+
+static void termination_handler(int signum)
+{
+   run = false;
+}
+
+static int open_listener(const word port)
+{
+   struct sockaddr_in addr;
+   int s, on = 1;
+
+   if((s = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+   {
+      _log(CRITICAL, "Failed to create socket.  Error %d %s.", errno, strerror(errno));
+      return -1;
+   }
+   setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+   memset(&addr, 0, sizeof(addr));
+   addr.sin_family = AF_INET;
+   addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+   addr.sin_port = htons(port);
+   if(bind(s, (struct sockaddr *) &addr, sizeof(addr)) || listen(s, 1))
+   {
+      _log(CRITICAL, "Failed to listen on port %d.  Error %d %s.", port, errno, strerror(errno));
+      close(s);
+      return -1;
+   }
+   return s;
+}
+
+static void client_accept(void)
+{
+   int s, on = 1;
+
+   if((s = accept(s_listen, NULL, NULL)) < 0) return;
+   if(s_client >= 0)
+   {
+      _log(MINOR, "Second connection refused.");
+      close(s);
+      return;
+   }
+   setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+   s_client = s;
+   rx_length = 0;
+   connected = false;
+   sent_this_connection = 0;
+   _log(GENERAL, "Client connected.");
+}
+
+static void client_read(void)
+{
+   ssize_t l;
+   char * frame, * end;
+
+   if(rx_length >= RX_SIZE - 1)
+   {
+      client_close("Overlong frame from client");
+      return;
+   }
+   l = read(s_client, rx + rx_length, RX_SIZE - 1 - rx_length);
+   if(l <= 0)
+   {
+      client_close(l?"Read error":"Client disconnected");
+      return;
+   }
+   rx_length += l;
+
+   frame = rx;
+   while(s_client >= 0 && (end = memchr(frame, '\0', rx_length - (frame - rx))))
+   {
+      // Heartbeat newlines may come before a frame.
+      while(*frame == '\n' || *frame == '\r') frame++;
+      if(*frame) client_frame(frame);
+      frame = end + 1;
+   }
+   if(s_client < 0) return;
+   // Discard leading heartbeats and keep any partial frame.
+   while(frame < rx + rx_length && (*frame == '\n' || *frame == '\r')) frame++;
+   rx_length -= frame - rx;
+   memmove(rx, frame, rx_length);
+}
+
+static void client_frame(char * const frame)
+{
+   char reply[256], * p, * q;
+   word i;
+
+   if(!strncmp(frame, "CONNECT", 7) || !strncmp(frame, "STOMP", 5))
+   {
+      sprintf(reply, "CONNECTED\nversion:1.1\nserver:%s/%s\nheart-beat:%u,0\n\n", NAME, BUILD, heartbeat_ms);
+      client_send(reply, strlen(reply) + 1);
+      connected = true;
+      subscribed = false;
+      heartbeat_due = time_us() + heartbeat_ms * 1000LL;
+      for(i = 0; i < topic_count; i++) subscription[i] = -1;
+      // Unacked messages go again.
+      resend = in_flight_off;
+      _log(GENERAL, "CONNECT received.  %u unacked messages will be redelivered.", in_flight_on - in_flight_off);
+   }
+   else if(!strncmp(frame, "SUBSCRIBE", 9))
+   {
+      if((p = strstr(frame, "destination:/topic/")) && (q = strstr(frame, "\nid:")))
+      {
+         p += 19;
+         for(i = 0; i < topic_count; i++)
+         {
+            if(!strncmp(p, topic_destinations[i], strlen(topic_destinations[i])) && p[strlen(topic_destinations[i])] == '\n')
+            {
+               subscription[i] = atoi(q + 4);
+               subscribed = true;
+               _log(GENERAL, "Subscribed to %s as %d.", topic_names[i], subscription[i]);
+            }
+         }
+      }
+   }
+   else if(!strncmp(frame, "ACK", 3))
+   {
+      handle_ack(frame);
+   }
+   else if(!strncmp(frame, "DISCONNECT", 10))
+   {
+      client_close("DISCONNECT received");
+   }
+   else
+   {
+      _log(MINOR, "Unexpected frame from client:  \"%.20s\".", frame);
+   }
+}
+
+static void handle_ack(const char * const headers)
+{
+   // ack:client is cumulative, so everything up to and including this message id is acked.
+   const char * p;
+   qword id, now = time_us();
+   struct message * m;
+
+   if(!(p = strstr(headers, "message-id:"))) return;
+   id = strtoull(p + 11, NULL, 10);
+   while(in_flight_off != in_flight_on && in_flight[in_flight_off % MAX_WINDOW].id <= id)
+   {
+      m = &in_flight[in_flight_off % MAX_WINDOW];
+      if(now > m->sent)
+      {
+         latency_total += now - m->sent;
+         if(now - m->sent > latency_max) latency_max = now - m->sent;
+      }
+      free(m->body);
+      m->body = NULL;
+      in_flight_off++;
+      count_acked++;
+   }
+   if(resend < in_flight_off) resend = in_flight_off;
+}
+
+static void client_close(const char * const reason)
+{
+   _log(GENERAL, "%s.  Closing connection.  %u messages unacked.", reason, in_flight_on - in_flight_off);
+   if(s_client >= 0) close(s_client);
+   s_client = -1;
+   connected = subscribed = false;
+   rx_length = 0;
+}
+
+static void client_send(const char * const data, const size_t length)
+{
+   size_t done = 0;
+   ssize_t l;
+
+   while(s_client >= 0 && done < length)
+   {
+      if((l = write(s_client, data + done, length - done)) < 0)
+      {
+         if(errno == EINTR) continue;
+         client_close("Write error");
+         return;
+      }
+      done += l;
+   }
+}
+
+static word next_message(void)
+{
+   // Make sure pending holds the next message to go to a configured topic.  Returns false if there is none yet.
+   struct tm broken;
+   char name[64];
+   size_t l;
+   word i;
+
+   while(!have_pending && !input_done)
+   {
+      if(!input)
+      {
+         if(file_index >= file_count)
+         {
+            // -l 0 replays for ever.
+            if(loops == 1)
+            {
+               input_done = true;
+               break;
+            }
+            if(loops) loops--;
+            file_index = 0;
+            log_base = 0;
+         }
+         if(!(input = gzopen(files[file_index], "rb")))
+         {
+            _log(CRITICAL, "Failed to open \"%s\".", files[file_index]);
+            file_index++;
+            continue;
+         }
+         _log(GENERAL, "Replaying \"%s\".", files[file_index]);
+      }
+
+      // Each message is a header line "dd/mm/yy hh:mm:ssZ topic" followed by the body on one line.
+      if(!gzgets(input, line, sizeof(line)))
+      {
+         gzclose(input);
+         input = NULL;
+         file_index++;
+         continue;
+      }
+      memset(&broken, 0, sizeof(broken));
+      if(sscanf(line, "%d/%d/%d %d:%d:%dZ %63s", &broken.tm_mday, &broken.tm_mon, &broken.tm_year,
+                &broken.tm_hour, &broken.tm_min, &broken.tm_sec, name) != 7)
+      {
+         count_skipped++;
+         continue;
+      }
+      broken.tm_mon--;
+      broken.tm_year += 100;
+      pending.stamp = timegm(&broken);
+
+      if(!gzgets(input, line, sizeof(line))) continue;
+      l = strlen(line);
+      if(l && line[l - 1] == '\n') line[--l] = '\0';
+
+      for(i = 0; i < topic_count && strcmp(name, topic_names[i]); i++);
+      if(i >= topic_count || !l)
+      {
+         count_skipped++;
+         continue;
+      }
+      pending.topic = i;
+      if(!(pending.body = strdup(line)))
+      {
+         _log(CRITICAL, "Out of memory.");
+         run = false;
+         break;
+      }
+      if(!log_base)
+      {
+         log_base = pending.stamp;
+         wall_base = time_us();
+      }
+      if(!start_time) start_time = time_us();
+      have_pending = true;
+   }
+   return have_pending;
+}
+
+static void send_message(struct message * const m)
+{
+   char headers[512];
+   size_t l, b;
+
+   b = strlen(m->body);
+   l = sprintf(headers, "MESSAGE\ndestination:/topic/%s\nsubscription:%d\nmessage-id:%llu\ncontent-length:%zu\n\n",
+               topic_destinations[m->topic], subscription[m->topic], m->id, b);
+   m->sent = time_us();
+   client_send(headers, l);
+   client_send(m->body, b + 1); // Including the terminating \0
+   count_sent++;
+}
+
+static qword due_time(const time_t stamp)
+{
+   // Wall clock time in us at which a message logged at stamp should be sent.
+   if(speed <= 0.0 || stamp <= log_base) return 0;
+   return wall_base + (qword) ((stamp - log_base) * 1000000.0 / speed);
+}
+
+static void report(void)
+{
+   qword elapsed = start_time?(time_us() - start_time):0;
+
+   _log(GENERAL, "Sent %llu messages, including %llu redeliveries.", count_sent, count_resent);
+   _log(GENERAL, "Acked %llu.  Skipped %llu log entries for unconfigured topics.", count_acked, count_skipped);
+   if(elapsed)
+   {
+      _log(GENERAL, "Elapsed %llu.%03llus, %llu messages per second.", elapsed / 1000000, (elapsed / 1000) % 1000, count_acked * 1000000 / elapsed);
+   }
+   if(count_acked)
+   {
+      _log(GENERAL, "Send to ack latency mean %lluus, max %lluus.", latency_total / count_acked, latency_max);
+   }
+}
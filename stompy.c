@@ -27,6 +27,14 @@
 #include <stdlib.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 #include <fcntl.h>
 #include <sys/prctl.h>
 #include <sys/resource.h>
@@ -36,6 +44,8 @@
 #include <errno.h>
 #include <netdb.h>
 #include <dirent.h>
+#include <pthread.h>
+#include <zlib.h>
 
 #include "misc.h"
 #include "build.h"
@@ -60,8 +70,15 @@ static const char * const sm_states[] = {"SM_AWAIT_CONNECTED", "SM_RUN", "SM_SEN
 static const char * const sm_events[] = {"SM_START", "SM_ERROR", "SM_FAIL", "SM_TIMEOUT", "SM_TX_DONE", "SM_RX_DONE", "SM_SHUTDOWN"};
 
 // STOMP RX
-static enum {STOMP_IDLE, STOMP_HEADER, STOMP_BODY, STOMP_FAIL} stomp_read_state;
-static struct frame_buffer * stomp_read_buffer;
+// Data from the broker is read in large blocks into stomp_rx.  Complete frames are found with memchr() and handled
+// where they lie, and a partial frame is moved to the front of the buffer to wait for the rest.  stomp_rx_scanned
+// is how much of the partial frame is known not to contain the terminating \0.
+// STOMP_FRAME means a partial frame is waiting, STOMP_FAIL that an overlong frame is being discarded.
+#define MAX_HEADER 1024
+#define STOMP_RX_SIZE 262144
+static enum {STOMP_IDLE, STOMP_FRAME, STOMP_FAIL} stomp_read_state;
+static char stomp_rx[STOMP_RX_SIZE];
+static ssize_t stomp_rx_on, stomp_rx_scanned;
 
 // STOMP TX Queue
 #define STOMP_TX_QUEUE_SIZE 32768
@@ -74,21 +91,46 @@ static ssize_t stomp_tx_queue_on, stomp_tx_queue_off;
 #define DEFAULT_STOMP_PORT 61618
 static word stomp_port;
 
-// Select timeout period in seconds
-#define SELECT_TIMEOUT 2
+// Event loop wait during controlled shutdown, in milliseconds
+#define SHUTDOWN_WAIT 250
+// Maximum events handled per epoll_wait()
+#define EPOLL_EVENTS 32
+
+// Number of streams may be set at build time, at least 3 are required.  Subscription ids are 0 to STREAMS - 1.
+#ifndef STREAMS
+#define STREAMS 3
+#endif
+
+// Channels
+// Each stream may be fed to up to CONSUMERS clients, the number in use being set by config stompy_consumers.  Each
+// stream and consumer pair is a channel, with its own server port, queue, disc spool and ack state, so that a slow
+// client does not hold back the others.  Channel c carries stream c % STREAMS to consumer c / STREAMS on port
+// BASE_PORT + c, so channels 0 to STREAMS - 1 are the original one client per stream.  A received frame is held in
+// one buffer shared by the queues of all the channels of its stream.
+#ifndef CONSUMERS
+#define CONSUMERS 4
+#endif
+#define CHANNELS (STREAMS * CONSUMERS)
+#define CHANNEL_STREAM(c)   ((c) % STREAMS)
+#define CHANNEL_CONSUMER(c) ((c) / STREAMS)
+static word consumers;
+static char * channel_names[CHANNELS];
 
 // Sockets
-static fd_set read_sockets, write_sockets, active_read_sockets, active_write_sockets;
+// Every socket is registered with epoll with its channel and type in the event data.  The STOMP socket is
+// channel STOMP, type CLIENT.  s_events[][] holds the events currently requested for each socket.
+#define STOMP CHANNELS
 static int s_stomp;
-static byte s_stream[FD_SETSIZE];
-#define STREAMS 3
-#define STOMP STREAMS
-static byte s_type[FD_SETSIZE];
 enum s_types {CLIENT, SERVER, TYPES};
-static int s_number[STREAMS][TYPES];
+// Event data types for the timer fd and the stats socket
+#define TIMER TYPES
+#define STATS (TYPES + 1)
+static int s_number[CHANNELS][TYPES];
+static dword s_events[CHANNELS + 1][TYPES];
+static int epoll_fd, timer_fd;
 
-// Stream modes
-static enum {STREAM_DISC, STREAM_RUN, STREAM_LOCK} stream_state[STREAMS];
+// Channel modes
+static enum {STREAM_DISC, STREAM_RUN, STREAM_LOCK} stream_state[CHANNELS];
 
 static char * stomp_topics[STREAMS];
 static char * stomp_topic_names[STREAMS];
@@ -99,15 +141,14 @@ static char topics[1024];
 static time_t start_time, stomp_connect_time;
 enum stats_categories {StompBytes, ConnectAttempt, StompMessage, StompInvalid, ClientConnect,
                        BaseStreamFrameSent, 
-                       DiscWrite = BaseStreamFrameSent + STREAMS, DiscRead, MAXstats
+                       DiscWrite = BaseStreamFrameSent + CHANNELS, DiscRead, MAXstats
 };
 static qword stats[MAXstats];
 static qword grand_stats[MAXstats];
 static const char * stats_category[MAXstats] = 
    {
       "STOMP Bytes", "STOMP Connect Attempt", "Accepted STOMP Message", "Discarded STOMP Message", "Client Connect",
-      "", "", "",
-      "Frame Disc Write", "Frame Disc Read",
+      [DiscWrite] = "Frame Disc Write", [DiscRead] = "Frame Disc Read",
    };
 
 // Timers
@@ -130,7 +171,41 @@ static time_t stomp_holdoff_time[MAX_HOLDOFF] = { 8, 16, 32, 64, 64, 64, 64, 64,
 // Disc spool
 // This and sub-directories will be created if required.
 #define STOMPY_SPOOL "/var/spool/stompy"
-static char spool_path[STREAMS][1024];
+static char spool_path[CHANNELS][1024];
+// Each channel's spool is a series of numbered segment files "nnnnnnnn.seg".  Frames are appended to the newest
+// segment and read from a cursor, which is saved in the file "cursor".  A segment is deleted once the cursor has
+// passed it.  Records are described in misc.h.  Frames are written SPOOL_BATCH at a time as one compressed block,
+// and plain frame records left by earlier builds are still read.  The cursor's skip is the number of frames already
+// taken from the block at its offset.  The block at the cursor is kept inflated in block while it is being read.
+#define SPOOL_SEGMENT_SIZE (16 * 1024 * 1024)
+#define SPOOL_BATCH 32
+// Room for a deflated block, including zlib's worst case expansion.
+#define SPOOL_DEFLATE_SIZE (SPOOL_BLOCK_SIZE + SPOOL_BLOCK_SIZE / 8 + 1024)
+// Interval in seconds between syncs of a spool that has been written to.
+#define SPOOL_SYNC_INTERVAL 1
+struct spool_cursor
+{
+   dword segment;
+   dword skip;
+   qword offset;
+};
+static struct
+{
+   int fd_write, fd_read, fd_cursor;
+   dword seg_write, seg_read;
+   off_t off_write, off_read;
+   dword skip;
+   dword count;
+   word dirty;
+   char * block;
+   dword block_seg;
+   off_t block_off;
+   word block_valid;
+} spool[CHANNELS];
+static time_t spool_sync_due;
+static z_stream spool_deflate;
+static word spool_deflate_ready;
+static char spool_deflated[SPOOL_DEFLATE_SIZE];
 
 // Command file
 #define COMMAND_FILE "/tmp/stompy.cmd"
@@ -139,38 +214,118 @@ static char spool_path[STREAMS][1024];
 #define RATES_FILE "/var/log/garner/stompy.rates"
 
 // Message log
-#define MESSAGE_LOG_FILEPATH "/var/log/garner/stompy.messagelog"
+// log_message() formats frames into the active half of message_log_buffer.  A background thread swaps the halves
+// every MESSAGE_LOG_INTERVAL seconds, or sooner if the active one is half full, and appends the full one to the log
+// as a gzip member, so the log can be read with zcat or stompycat.  If the thread falls behind, messages are dropped.
+#define MESSAGE_LOG_FILEPATH "/var/log/garner/stompy.messagelog.gz"
+#define MESSAGE_LOG_BUFFER (4 * 1024 * 1024)
+#define MESSAGE_LOG_INTERVAL 8
+static pthread_t message_log_thread;
+static pthread_mutex_t message_log_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t message_log_wake = PTHREAD_COND_INITIALIZER;
+static char * message_log_buffer[2];
+static size_t message_log_length;
+static word message_log_active, message_log_run, message_log_dropping;
+static qword message_log_dropped;
+// Failures in the writer thread are left here to be logged by the main thread, in log_message().
+static word message_log_error;
+static int message_log_errno;
+#define MESSAGE_LOG_OPEN_FAILED  1
+#define MESSAGE_LOG_WRITE_FAILED 2
 
 // Frame buffers and queues thereof
-#define BUFFERS 32
+// Buffers are allocated as required in size classes of 1KB, 2KB, ... 32KB and FRAME_SIZE.  Freed buffers are kept on a
+// list per class for reuse.  The total allocated is limited to buffer_budget, set by config stompy_memory (MB), and free
+// buffers of other classes are released if needed to stay within it.  Only when the budget is used up do queues
+// go to disc.  A received STOMP message body is copied into the smallest buffer that will hold it.
+// A buffer has a queue link for each consumer and is returned to the free list when refs, the number of channel
+// queues or spool writes still holding it, falls to zero.  Free lists use next[0].
 #define FRAME_SIZE 64000
-static struct frame_buffer
+#define BUFFER_CLASSES 7
+#define DEFAULT_BUFFER_BUDGET 64
+struct frame_buffer
 {
-   char frame[FRAME_SIZE];
    qword stamp;
-   struct frame_buffer * next;
-} buffers[BUFFERS];
-static struct frame_buffer * empty_list, * stream_q_on[STREAMS], * stream_q_off[STREAMS];
+   struct frame_buffer * next[CONSUMERS];
+   word class, refs;
+   char frame[];
+};
+#define QUEUE_NEXT(b, c) ((b)->next[CHANNEL_CONSUMER(c)])
+static struct frame_buffer * empty_list[BUFFER_CLASSES], * stream_q_on[CHANNELS], * stream_q_off[CHANNELS];
+static size_t buffer_budget, buffer_allocated, buffer_idle;
+// Frames loaded from disc at a time
+#define LOAD_BATCH 16
  
 // Client interface
-static ssize_t client_length[STREAMS], client_index[STREAMS];
-static struct frame_buffer * client_buffer[STREAMS];
-static enum { CLIENT_IDLE, CLIENT_AWAIT_ACK, CLIENT_RUN} client_state[STREAMS];
+// Frames are sent to the client back to back until it has client_window[] frames unacknowledged, then we wait
+// for acks.  Frames sent are numbered from 1 on each new connection.  The client acks with either "A" (ack
+// the oldest unacked frame) or "C" followed by a sequence number (ack everything up to and including that frame).
+// It sets its window with "W" followed by a frame count.  A client which never sends "W" has a window of 1, which
+// is the original one-frame-one-ack protocol.  Unacked frames stay at the front of the channel queue.
+// A client may send "M" to have frames passed through a shared memory ring (see misc.h) instead of the socket.
+// At the next frame boundary we send a zero frame length on the socket to mark the switch, and from then on
+// frames go into the ring.  Acks still arrive on the socket.  The window ensures the ring never fills.
+#define MAX_CLIENT_WINDOW 16
+#define CLIENT_RX_SIZE 64
+static ssize_t client_length[CHANNELS], client_index[CHANNELS];
+static struct frame_buffer * client_buffer[CHANNELS], * client_last_sent[CHANNELS];
+static dword client_seq_sent[CHANNELS], client_seq_acked[CHANNELS], client_window[CHANNELS];
+static char client_rx[CHANNELS][CLIENT_RX_SIZE];
+static ssize_t client_rx_length[CHANNELS];
+static enum { CLIENT_IDLE, CLIENT_AWAIT_ACK, CLIENT_RUN} client_state[CHANNELS];
+static struct stompy_ring * client_ring[CHANNELS], * client_ring_pending[CHANNELS];
 
 // Instrumentation
-enum inst_categories {StartPeriod, StartIdle, TotalIdle, BaseStartWaitClientAck, BaseTotalWaitClientAck = BaseStartWaitClientAck + STREAMS,
-                      StartDisc = BaseTotalWaitClientAck + STREAMS, TotalDisc, CountDiscWrite, CountDiscRead, CountOnDisc, BaseCountStreamRX,
-                      BaseCountStreamTX = BaseCountStreamRX + STREAMS, MAXinst = BaseCountStreamTX + STREAMS};
+// RX counts are per stream, the others per channel.  The rates file shows consumer 0 only.
+enum inst_categories {StartPeriod, StartIdle, TotalIdle, BaseStartWaitClientAck, BaseTotalWaitClientAck = BaseStartWaitClientAck + CHANNELS,
+                      StartDisc = BaseTotalWaitClientAck + CHANNELS, TotalDisc, CountDiscWrite, CountDiscRead, CountOnDisc, BaseCountStreamRX,
+                      BaseCountStreamTX = BaseCountStreamRX + STREAMS, MAXinst = BaseCountStreamTX + CHANNELS};
 static qword inst[MAXinst];
 
+// Histograms
+// Per channel distributions of the time from receiving a frame from the broker to its ack by the client, the time
+// taken by each spill to and reload from disc, and the queue depth (memory and disc) sampled every second.  Values
+// below HIST_SUB have a bucket each, above that each power of two is split into HIST_SUB buckets, so a percentile is
+// correct to within about 1 part in HIST_SUB.  They cover the period since the last daily statistical report.
+// Anyone connecting to the stats socket is sent the percentiles as text, one histogram per line.
+#define HIST_SUB_BITS 4
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) * HIST_SUB)
+#define STATS_SOCKET "/tmp/stompy.stats"
+struct histogram
+{
+   qword count, total, max;
+   qword bucket[HIST_BUCKETS];
+};
+enum hist_types {HistAck, HistSpill, HistReload, HistDepth, HIST_TYPES};
+static const char * const hist_names[HIST_TYPES] = {"ack_latency_us", "spill_us", "reload_us", "queue_depth"};
+static struct histogram hist[CHANNELS][HIST_TYPES];
+static time_t hist_start, hist_due;
+static int s_stats;
+
 static void perform(void);
 static void set_up_server_sockets(void);
 static void stomp_write(void);
 static void stomp_read(void);
-static void client_write(const int s);
-static void client_read(const int s);
-static void client_accept(const int s);
+static void stomp_frame(char * const frame, const ssize_t length);
+static void stomp_ack(const char * const headers);
+static void client_write(const word channel);
+static void client_read(const word channel);
+static void client_accept(const word channel);
+static void client_ack(const word channel, const dword frames);
+static void client_close(const word channel);
+static word client_unacked(const word channel);
+static struct stompy_ring * ring_open(const word channel);
+static word ring_put(const word channel, const struct frame_buffer * const b, const size_t length);
+static void ring_close(const word channel);
 static void user_command(void);
+static void stream_hold(const word stream, const word hold);
+static int  watch_socket(const word channel, const word type);
+static void watch_add(const word channel, const word type, const int s);
+static void watch_set(const word channel, const word type, const dword events);
+static void watch_clr(const word channel, const word type, const dword events);
+static void watch_remove(const word channel, const word type);
+static void set_timer(void);
 static void send_subscribes(void);
 static void handle_shutdown(word report);
 static void full_shutdown(void);
@@ -185,25 +340,49 @@ static void report_status(void);
 static void dump_headers(const char * const h);
 
 static void init_buffers_queues(void);
-static struct frame_buffer * new_buffer(void);
+static size_t buffer_size(const word class);
+static struct frame_buffer * new_buffer(const size_t length);
 static void free_buffer(struct frame_buffer * const b);
+static word buffer_available(const size_t length);
 static void enqueue(const word s, struct frame_buffer * const b);
 static struct frame_buffer * dequeue(const word s);
 static struct frame_buffer * queue_front(const word s);
-static word queue_length(const word s);
+static dword queue_length(const word s);
 
 static void dump_buffer_to_disc(const word s, struct frame_buffer * const b);
 static word dump_queue_to_disc(const word s);
 static int is_a_buffer(const struct dirent *d);
+static int is_a_segment(const struct dirent *d);
 static void load_buffer_from_disc(struct frame_buffer * const b, const word s, const char * const name);
 static word load_queue_from_disc(const word s);
 static int disc_queue_length(const word s);
 static qword disc_queue_oldest(const word s);
-static void log_message(const word s);
+static int spool_open(const word s);
+static void spool_close(const word s);
+static int spool_segment_open(const word s, const dword segment, const int flags);
+static void spool_retire_segment(const word s, const dword segment);
+static void spool_next_read_segment(const word s);
+static word spool_append(const word s, struct frame_buffer * b);
+static ssize_t spool_write_all(const int fd, struct iovec * iov, int count, const off_t offset);
+static void spool_save_cursor(const word s);
+static void spool_sync(const word force);
+static int  spool_read_frame(const word s, const int fd, const dword seg, const off_t offset, const dword skip, struct spool_header * const h, const char ** const frame, off_t * const next, word * const last);
+static int  spool_inflate_block(const word s, const int fd, const dword seg, const off_t offset, const struct spool_block * const k);
+static void log_message(const word s, const struct frame_buffer * const b);
+static void message_log_start(void);
+static void message_log_stop(void);
+static void * message_log_writer(void * arg);
+static void message_log_report_error(void);
 //static word count_messages(const struct frame_buffer * const b);
 static void heartbeat_tx(void);
 static char * show_percent(qword * s, qword * t, const qword l, const qword n);
 static char * show_elapsed(time_t e);
+static void hist_record(struct histogram * const h, const qword value);
+static qword hist_percentile(const struct histogram * const h, const double fraction);
+static char * hist_text(const struct histogram * const h);
+static void hist_sample(void);
+static void stats_open(void);
+static void stats_serve(void);
 
 // Signal handling
 void termination_handler(int signum)
@@ -212,7 +391,11 @@ void termination_handler(int signum)
    {
       sigusr1 = true;
    }
-   else if(signum != SIGHUP)
+   else if(signum == SIGHUP)
+   {
+      _log_reopen();
+   }
+   else
    {
       interrupt = true;
    }
@@ -256,6 +439,20 @@ int main(int argc, char *argv[])
       stomp_port = atoi(conf[conf_nr_stomp_port]);
    }
 
+   buffer_budget = DEFAULT_BUFFER_BUDGET;
+   if(conf[conf_stompy_memory] && atoi(conf[conf_stompy_memory]) > 0)
+   {
+      buffer_budget = atoi(conf[conf_stompy_memory]);
+   }
+   buffer_budget *= 1024 * 1024;
+
+   consumers = 1;
+   if(conf[conf_stompy_consumers] && atoi(conf[conf_stompy_consumers]) > 0)
+   {
+      consumers = atoi(conf[conf_stompy_consumers]);
+      if(consumers > CONSUMERS) consumers = CONSUMERS;
+   }
+
    if(usage)
    {
       printf("\tUsage: %s [-c /path/to/config/file.conf]\n\n", argv[0] );
@@ -322,6 +519,20 @@ int main(int argc, char *argv[])
             }
          }
       }
+      for(i = 0; i < CHANNELS; i++)
+      {
+         if(CHANNEL_CONSUMER(i))
+         {
+            if((channel_names[i] = malloc(strlen(stomp_topic_names[CHANNEL_STREAM(i)]) + 8)))
+               sprintf(channel_names[i], "%s/%d", stomp_topic_names[CHANNEL_STREAM(i)], CHANNEL_CONSUMER(i));
+            else
+               channel_names[i] = stomp_topic_names[CHANNEL_STREAM(i)];
+         }
+         else
+         {
+            channel_names[i] = stomp_topic_names[i];
+         }
+      }
    }
 
    int lfp = 0;
@@ -367,7 +578,7 @@ int main(int argc, char *argv[])
          exit(1);
       }
 
-      for(s = 0; s < STREAMS; s++)
+      for(s = 0; s < STREAMS * consumers; s++)
       {
          sprintf(spool_path[s], "%s/%s%d", STOMPY_SPOOL, debug?"d-":"", s);
 
@@ -386,9 +597,9 @@ int main(int argc, char *argv[])
                _log(CRITICAL, "Failed to chmod spool directory \"%s\".  Error %d %s", spool_path[s], errno, strerror(errno));
             }
          }
-         if(disc_queue_length(s) < 0)
+         if(stat(spool_path[s], &b))
          {
-            _log(CRITICAL, "Spool directory missing for stream %d.  Fatal.", s);
+            _log(CRITICAL, "Spool directory missing for channel %d.  Fatal.", s);
             exit(1);
          }
       }
@@ -521,6 +732,7 @@ int main(int argc, char *argv[])
       {
          _log(GENERAL, "   %d: Not used.", stream);
       }
+      if(consumers > 1) _log(GENERAL, "Serving %d consumers per stream.  Consumer n of stream s on port %d + %dn + s.", consumers, BASE_PORT, STREAMS);
       if(*conf[conf_stompy_bin]) _log(CRITICAL, "All received data will be discarded due to stompy_bin option.");
    }
 
@@ -546,31 +758,65 @@ int main(int argc, char *argv[])
 
 static void perform(void)
 {
-   int s;
-   word stream, type;
+   int i;
+   word channel, type;
 
-   struct timeval wait_time;
+   struct epoll_event events[EPOLL_EVENTS];
 
    // Initialise queues
    stomp_tx_queue_on = stomp_tx_queue_off = 0;
    init_buffers_queues();
 
    // Initialise all socket settings.
-   FD_ZERO (&read_sockets);
-   FD_ZERO (&write_sockets);
+   if((epoll_fd = epoll_create1(0)) < 0)
+   {
+      _log(CRITICAL, "Failed to create epoll instance.  Error %d %s.  Fatal.", errno, strerror(errno));
+      exit(1);
+   }
+   if((timer_fd = timerfd_create(CLOCK_REALTIME, TFD_NONBLOCK)) < 0)
+   {
+      _log(CRITICAL, "Failed to create timer.  Error %d %s.  Fatal.", errno, strerror(errno));
+      exit(1);
+   }
+   events[0].events = EPOLLIN;
+   events[0].data.u32 = TIMER << 16;
+   if(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, timer_fd, &events[0]))
+   {
+      _log(CRITICAL, "Failed to register timer.  Error %d %s.  Fatal.", errno, strerror(errno));
+      exit(1);
+   }
+   stats_open();
    s_stomp = -1;
-   for(stream = 0; stream < STREAMS; stream++)
+   for(type = 0; type < TYPES; type++) s_events[STOMP][type] = 0;
+   for(channel = 0; channel < CHANNELS; channel++)
    {
       for(type = 0; type < TYPES; type++)
       {
-         s_number[stream][type] = -1;
+         s_number[channel][type] = -1;
+         s_events[channel][type] = 0;
       }
-      client_state[stream] = CLIENT_IDLE;
-      client_buffer[stream] = NULL;
-      stream_state[stream] = STREAM_DISC;
+      client_state[channel] = CLIENT_IDLE;
+      client_buffer[channel] = client_last_sent[channel] = NULL;
+      client_seq_sent[channel] = client_seq_acked[channel] = 0;
+      client_window[channel] = 1;
+      client_rx_length[channel] = 0;
+      client_ring[channel] = client_ring_pending[channel] = NULL;
+      stream_state[channel] = STREAM_DISC;
 
-      inst[CountOnDisc] += disc_queue_length(stream);
+      spool[channel].fd_write = spool[channel].fd_read = spool[channel].fd_cursor = -1;
+      spool[channel].count = 0;
+      if(CHANNEL_CONSUMER(channel) < consumers)
+      {
+         if(spool_open(channel))
+         {
+            _log(CRITICAL, "Failed to open spool for channel %d.  Fatal.", channel);
+            exit(1);
+         }
+         inst[CountOnDisc] += disc_queue_length(channel);
+      }
    }
+   spool_sync_due = 0;
+   message_log_start();
 
    run = true;
    interrupt = false;
@@ -587,10 +833,12 @@ static void perform(void)
    next_stats();
    next_alarms();
    stomp_timeout = stomp_holdoff = server_sockets_due = rates_due = heartbeat_tx_due = 0;
+   hist_start = now;
+   hist_due = now + 1;
 
    // Set up STOMP interface
    stomp_read_state = STOMP_IDLE;
-   stomp_read_buffer = NULL;
+   stomp_rx_on = stomp_rx_scanned = 0;
    stomp_manager(SM_START, NULL);
 
 
@@ -606,21 +854,12 @@ static void perform(void)
       if(now >= alarms_due)       report_alarms();
       if(now >= rates_due)        report_rates("");
       if(now >= stomp_timeout)    stomp_manager(SM_TIMEOUT, NULL);
+      if(now >= spool_sync_due)   spool_sync(false);
+      if(now >= hist_due)         hist_sample();
 
-      if(controlled_shutdown)
-      {
-         wait_time.tv_sec  = 0;
-         wait_time.tv_usec = 0x40000L;
-      }
-      else
-      {
-         wait_time.tv_sec  = SELECT_TIMEOUT;
-         wait_time.tv_usec = 0;
-      }
-      active_read_sockets = read_sockets;
-      active_write_sockets = write_sockets;
+      set_timer();
       inst[StartIdle] = time_us();
-      int result = select(FD_SETSIZE, &active_read_sockets, &active_write_sockets, NULL, &wait_time);
+      int result = epoll_wait(epoll_fd, events, EPOLL_EVENTS, controlled_shutdown?SHUTDOWN_WAIT:-1);
       inst[TotalIdle] += (time_us() - inst[StartIdle]);
       inst[StartIdle] = 0LL;
       if(result < 0)
@@ -631,30 +870,45 @@ static void perform(void)
          }
          else
          {
-            _log(CRITICAL, "Select returns error %d %s.  Fatal.", errno, strerror(errno));
+            _log(CRITICAL, "epoll_wait() returns error %d %s.  Fatal.", errno, strerror(errno));
             run = false;
          }
       }
       else if (result == 0)
       {
-         // Select has timed out
+         // Wait has timed out
          if(controlled_shutdown) handle_shutdown(true);
       }
       else
       {
          // Got some activity.
-         for(s = 0; s < FD_SETSIZE; s++)
+         for(i = 0; i < result; i++)
          {
-            if(FD_ISSET(s, &active_write_sockets))
+            channel = events[i].data.u32 & 0xffff;
+            type    = events[i].data.u32 >> 16;
+            if(type == TIMER)
+            {
+               qword expirations;
+               if(read(timer_fd, &expirations, sizeof(expirations)) != sizeof(expirations))
+                  _log(DEBUG, "Timer read failed.  Error %d %s.", errno, strerror(errno));
+               continue;
+            }
+            if(type == STATS)
             {
-               if(s_stream[s] == STOMP) stomp_write();
-               else client_write(s);
+               stats_serve();
+               continue;
             }
-            if(FD_ISSET(s, &active_read_sockets))
+            // An earlier event in this batch may have closed the socket.
+            if((events[i].events & EPOLLOUT) && watch_socket(channel, type) >= 0)
             {
-               if(s_type[s] == SERVER) client_accept(s);
-               else if(s_stream[s] == STOMP) stomp_read();
-               else client_read(s); 
+               if(channel == STOMP) stomp_write();
+               else client_write(channel);
+            }
+            if((events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)) && watch_socket(channel, type) >= 0)
+            {
+               if(type == SERVER) client_accept(channel);
+               else if(channel == STOMP) stomp_read();
+               else client_read(channel); 
             }
          }
       }
@@ -666,13 +920,23 @@ static void perform(void)
 
    report_status();
    report_stats();
+
+   message_log_stop();
+   for(channel = 0; channel < CHANNELS; channel++) spool_close(channel);
+   if(s_stats >= 0)
+   {
+      close(s_stats);
+      unlink(STATS_SOCKET);
+   }
+   close(timer_fd);
+   close(epoll_fd);
 }
 
 static void set_up_server_sockets(void)
 {
    //  
    int s;
-   word stream;
+   word channel;
    struct sockaddr_in server_addr;
 
    _log(PROC, "set_up_server_sockets()");
@@ -680,14 +944,14 @@ static void set_up_server_sockets(void)
    server_sockets_due = 0x7fffffff;
    if(controlled_shutdown) return;
 
-   for(stream = 0; stream < STREAMS; stream++)
+   for(channel = 0; channel < CHANNELS; channel++)
    {
-      if(stomp_topics[stream][0] && s_number[stream][SERVER] < 0)
+      if(stomp_topics[CHANNEL_STREAM(channel)][0] && CHANNEL_CONSUMER(channel) < consumers && s_number[channel][SERVER] < 0)
       {
          s = socket(AF_INET, SOCK_STREAM, 0);
          if (s < 0)
          {
-            _log(CRITICAL, "Failed to create server socket for stream %d.  Error %d %s.  Fatal.", stream, errno, strerror(errno));
+            _log(CRITICAL, "Failed to create server socket for channel %d.  Error %d %s.  Fatal.", channel, errno, strerror(errno));
             exit(1);
          }
    
@@ -702,11 +966,11 @@ static void set_up_server_sockets(void)
          {
             inet_aton("127.0.0.1", &(server_addr.sin_addr));
          }
-         server_addr.sin_port = htons(BASE_PORT + stream);
+         server_addr.sin_port = htons(BASE_PORT + channel);
    
          if(bind(s, (struct sockaddr *) &server_addr, sizeof(server_addr)) < 0) 
          {
-            _log(MAJOR, "Failed to bind to socket %d.  Error %d %s.", BASE_PORT + stream, errno, strerror(errno));
+            _log(MAJOR, "Failed to bind to socket %d.  Error %d %s.", BASE_PORT + channel, errno, strerror(errno));
             server_sockets_due = now + SERVER_SOCKET_RETRY;
             close(s);
             return;
@@ -719,15 +983,14 @@ static void set_up_server_sockets(void)
 
          if (listen (s, 1) < 0)
          {
-            _log(CRITICAL, "Failed to listen on socket %d, port %d, error %d %s.  Fatal.", s, BASE_PORT + stream, errno, strerror(errno));
+            _log(CRITICAL, "Failed to listen on socket %d, port %d, error %d %s.  Fatal.", s, BASE_PORT + channel, errno, strerror(errno));
             exit(1);
          }
       
-         FD_SET (s, &read_sockets);
-         s_type[s] = SERVER;
-         s_stream[s] = stream;
-         s_number[stream][SERVER] = s;
-         _log(DEBUG, "Server socket %d for stream %d set up.", s, stream);
+         s_number[channel][SERVER] = s;
+         watch_add(channel, SERVER, s);
+         watch_set(channel, SERVER, EPOLLIN);
+         _log(DEBUG, "Server socket %d for channel %d set up.", s, channel);
       }
    }
    _log(GENERAL, "All server sockets have been set up.");
@@ -758,7 +1021,7 @@ static void stomp_write(void)
    {
       stomp_tx_queue_on = stomp_tx_queue_off = 0;
 
-      FD_CLR(s_stomp, &write_sockets);
+      watch_clr(STOMP, CLIENT, EPOLLOUT);
       _log(DEBUG, "stomp_write():  Queue now empty.");
       if(controlled_shutdown && stomp_read_state == STOMP_IDLE)
       {
@@ -773,22 +1036,12 @@ static void stomp_write(void)
 
 static void stomp_read(void)
 {
-#define MAX_HEADER 1024
-   static char headers[MAX_HEADER];
-   static ssize_t stomp_read_h_i, stomp_read_b_i;
-   static char * mid, * s, * body;
-   static word stream;
-   static word fail_send_ack;
-   char d[1024];
+   char * p, * end, * nul;
 
    _log(PROC, "stomp_read()");
 
-   // N.B. Handling of stomp_read_buffer
-   // If a receive is interrupted by an error, stomp_read_buffer remains pointing to a buffer (which contains 
-   // garbage).  This will be re-used for the next frame.
-
    if(s_stomp < 0) return;
-   ssize_t l = read(s_stomp, d, 1024);
+   ssize_t l = read(s_stomp, stomp_rx + stomp_rx_on, STOMP_RX_SIZE - stomp_rx_on);
    if(l < 0)
    {
       _log(MAJOR, "STOMP read error %d %s", errno, strerror(errno));
@@ -805,555 +1058,717 @@ static void stomp_read(void)
 
    _log(DEBUG, "stomp_read():  Received %d characters.", l);
    stats[StompBytes] += l;
+   stomp_rx_on += l;
 
-   ssize_t i;
-
-   for(i=0; i < l; i++)
+   p = stomp_rx;
+   end = stomp_rx + stomp_rx_on;
+   while(p < end)
    {
-      // _log(DEBUG, "stomp_read() Rx %02x %02x %c", i, d[i], (d[i]<0x20 || d[i] > 0x7e) ? '.':d[i]);
-      switch(stomp_read_state)
+      if(stomp_read_state == STOMP_IDLE && *p == '\n')
       {
-      case STOMP_IDLE: // Start
-         stomp_read_h_i = stomp_read_b_i = fail_send_ack = 0;
-
-         // First character - could be a heartbeat
-         if(d[i] == '\n')
+         // Heartbeat
+         _log(DEBUG, "STOMP heartbeat received.");
+         stomp_manager(SM_RX_DONE, NULL);
+         p++;
+      }
+      else if((nul = memchr(p + stomp_rx_scanned, '\0', end - p - stomp_rx_scanned)))
+      {
+         if(stomp_read_state == STOMP_FAIL)
          {
-            // Heartbeat
-            _log(DEBUG, "STOMP heartbeat received.");
-            stomp_read_state = STOMP_IDLE;
-            stomp_manager(SM_RX_DONE, NULL);
+            _log(DEBUG, "End of discarded STOMP frame.");
          }
          else
          {
-            headers[stomp_read_h_i++] = d[i];
-            stomp_read_state = STOMP_HEADER;
-         }               
+            stomp_frame(p, nul - p);
+         }
+         stomp_read_state = STOMP_IDLE;
+         stomp_rx_scanned = 0;
+         p = nul + 1;
+      }
+      else if(stomp_read_state == STOMP_FAIL)
+      {
+         // Bin data until the end of the frame.
+         p = end;
+      }
+      else if(end - p > MAX_HEADER + FRAME_SIZE)
+      {
+         // Too long to be valid.  Cut it short so that stomp_frame() can report and ack it, then bin the rest.
+         p[MAX_HEADER + FRAME_SIZE] = '\0';
+         stomp_frame(p, MAX_HEADER + FRAME_SIZE);
+         stomp_read_state = STOMP_FAIL;
+         stomp_rx_scanned = 0;
+         p = end;
+      }
+      else
+      {
+         // Partial frame.  Wait for the rest.
+         stomp_read_state = STOMP_FRAME;
+         stomp_rx_scanned = end - p;
          break;
+      }
+   }
 
-      case STOMP_HEADER: // Header
-         if(stomp_read_h_i >= MAX_HEADER)
-         {
-            _log(MAJOR, "Received STOMP headers too long.  Frame discarded.");
-            stats[StompInvalid]++;
-            stomp_read_state = STOMP_FAIL;
-         }
-         else
-         {
-            if(d[i] == '\n' && headers[stomp_read_h_i - 1] == '\n')
-            {
-               // End of header
-               headers[stomp_read_h_i++] = '\0';
-               if(debug)
-               {
-                  _log(DEBUG, "Headers received:");
-                  dump_headers(headers);
-               }
-               stomp_read_state = STOMP_BODY;
-               stomp_read_b_i = 0;
-            }
-            else
-            {
-               if(stomp_read_h_i < MAX_HEADER - 2)
-               {
-                  headers[stomp_read_h_i++] = d[i];
-               }
-               else
-               {
-                  _log(MAJOR, "Received STOMP headers too long.  Frame discarded.");
-                  stats[StompInvalid]++;
-                  stomp_read_state = STOMP_FAIL;
-               }
-            }
-         }
+   // Move any partial frame to the front of the buffer
+   stomp_rx_on = end - p;
+   if(stomp_rx_on && p != stomp_rx) memmove(stomp_rx, p, stomp_rx_on);
+
+   if(controlled_shutdown && stomp_read_state == STOMP_IDLE && stomp_tx_queue_on == 0)
+   {
+      stomp_manager(SM_FAIL, NULL);
+   }
+}
+
+static void stomp_frame(char * const frame, const ssize_t length)
+{
+   // Handle a complete STOMP frame.  It is \0 terminated in place in the receive buffer, length excludes the \0.
+   char * headers = frame;
+   char * body, * p, * s;
+   ssize_t body_length;
+   word stream, channel;
+   struct frame_buffer * b;
+
+   // Headers end with a blank line.  Terminate them after the first \n of it.
+   body = frame + length;
+   for(p = frame; (p = memchr(p, '\n', frame + length - p)); p++)
+   {
+      if(p[1] == '\n')
+      {
+         p[1] = '\0';
+         body = p + 2;
          break;
+      }
+   }
+   body_length = frame + length - body;
 
-      case STOMP_BODY: // Body 
-         if(stomp_manager_state == SM_AWAIT_CONNECTED)
-         {
-            // In this case we don't care about the body contents
-            // Discard until we get the terminating NULL
-            if(d[i] == '\0')
-            {
-               stomp_read_state = STOMP_IDLE;
-               stomp_manager(SM_RX_DONE, headers);
-            }
-         }
-         else
-         {
-            if(stomp_read_b_i == 0 && d[i] == '\0')
-            {
-               _log(MAJOR, "STOMP frame received has an empty body.  Discarded.  Headers:");
-               dump_headers(headers);
-               stomp_read_state = STOMP_IDLE;
-               stomp_manager(SM_RX_DONE, headers);
-               stats[StompInvalid]++;
-            }
-            else if(stomp_read_b_i == 0)
-            {
-               if(!strstr(headers, "MESSAGE"))
-               {
-                  _log(MAJOR, "STOMP frame received is not a MESSAGE.  Discarded.  Headers:");
-                  dump_headers(headers);
-                  stomp_read_state = STOMP_FAIL;
-                  stats[StompInvalid]++;
-               }
-               else
-               {
-                  // Find which stream
-                  s = strstr(headers, "subscription:");
-                  if(s)
-                  {
-                     s += 13;
-                     _log(DEBUG, "Stream id %c.", *s);
-                  }
-                  else
-                  {
-                     _log(MAJOR, "STOMP MESSAGE received with no subscription value.  Discarded.  Headers:");
-                     dump_headers(headers);
-                     stomp_read_state = STOMP_FAIL;
-                     stats[StompInvalid]++;
-                  }
-               }
-               if(stomp_read_state == STOMP_BODY)
-               {
-                  mid = strstr(headers, "message-id:");
-                  if(mid)
-                  {
-                     mid += 11;
-                  }
-                  else
-                  {
-                     _log(MAJOR, "STOMP MESSAGE received with no message id.  Discarded.  Headers:");
-                     dump_headers(headers);
-                     stomp_read_state = STOMP_FAIL;
-                     stats[StompInvalid]++;
-                  }
-               }
-               // Set up where it's going, and get a queue entry if appropriate
-               if(stomp_read_state == STOMP_BODY)
-               {
-                  switch(*s)
-                  {
-                  case '0':  case '1': case '2': case '3':
-                     stream = *s - '0';
-                     // Note the following code allows one stream to hog all the buffers.  Is that a good idea?
-                     if(!stomp_read_buffer) stomp_read_buffer = new_buffer();
-                     if(stomp_read_buffer)
-                     {
-                        body = stomp_read_buffer->frame;
-                     }
-                     else
-                     {
-                        // Handle run out of buffers:  Dump queue to disc, switch to disc mode ask for a buffer again.
-                        _log(GENERAL, "No buffers available for stream %d (%s).  Saving to disc.", stream, stomp_topic_names[stream]);
-                        if(!dump_queue_to_disc(stream))
-                        {
-                           // None in our queue, find some elsewhere
-                           word s;
-                           for(s = 0; s < STREAMS; s++) 
-                           {
-                              if(dump_queue_to_disc(s)) 
-                              {
-                                 // Found some!
-                                 if(stream_state[s] == STREAM_RUN) stream_state[s] = STREAM_DISC;
-                                 _log(GENERAL, "Dumped queue to disc and switched to disc mode on stream %d (%s) to free space.", s, stomp_topic_names[s]);
-                                 s = STREAMS;
-                              }
-                           }
-                        }
-                        if(stream_state[stream] == STREAM_RUN) stream_state[stream] = STREAM_DISC;
-                        stomp_read_buffer = new_buffer();
-                        if(!stomp_read_buffer)
-                        {
-                           _log(CRITICAL, "Failed to find a free buffer.  STOMP MESSAGE discarded.");
-                           stomp_read_state = STOMP_FAIL;
-                           fail_send_ack = true; // Failure at our end.  Need to send ack or message feed will cease.
-            stats[StompInvalid]++;
-                           body = NULL;
-                        }
-                        else
-                           body = stomp_read_buffer->frame;
-                     }
-                     break;
-                     
-                  default: _log(MAJOR, "STOMP MESSAGE received with unrecognised subscription value \"%c\".", *s);
-                     stomp_read_state = STOMP_FAIL;
-                     body = NULL;
-                     stats[StompInvalid]++;
-                     break;
-                  }
-               }
-            }
+   if(body - frame > MAX_HEADER)
+   {
+      _log(MAJOR, "Received STOMP headers too long.  Frame discarded.");
+      stats[StompInvalid]++;
+      stomp_manager(SM_RX_DONE, NULL);
+      return;
+   }
+   if(debug)
+   {
+      _log(DEBUG, "Headers received:");
+      dump_headers(headers);
+   }
 
-            if(stomp_read_state == STOMP_BODY) 
-            {
-               stomp_read_b_i++;
+   if(stomp_manager_state == SM_AWAIT_CONNECTED)
+   {
+      // In this case we don't care about the body contents
+      stomp_manager(SM_RX_DONE, headers);
+      return;
+   }
 
-               // Handle overlong body
-               if(body && stomp_read_b_i >= FRAME_SIZE)
-               {
-                  _log(CRITICAL, "STOMP MESSAGE received with overlong payload.  Discarded.  Headers:");
-                  dump_headers(headers);
-                  stats[StompInvalid]++;
-                  stomp_read_state = STOMP_FAIL;
-                  fail_send_ack = true; // Failure at our end.  Need to send ack or message feed will cease.
-                  body = NULL;
-               }
+   if(!body_length)
+   {
+      _log(MAJOR, "STOMP frame received has an empty body.  Discarded.  Headers:");
+      dump_headers(headers);
+      stomp_manager(SM_RX_DONE, headers);
+      stats[StompInvalid]++;
+      return;
+   }
 
-               // Stick character in buffer
-               if(body) *body++ = d[i];
+   if(!strstr(headers, "MESSAGE"))
+   {
+      _log(MAJOR, "STOMP frame received is not a MESSAGE.  Discarded.  Headers:");
+      dump_headers(headers);
+      stats[StompInvalid]++;
+      stomp_manager(SM_RX_DONE, NULL);
+      return;
+   }
 
-               if(body && !d[i])
-               {
-                  // Deal with frame
-                  _log(DEBUG, "Got end of message frame.  Processing...");
-                  stomp_read_buffer->stamp = time_us();
-                  _log(DEBUG, "Stamp is %lld.", stomp_read_buffer->stamp);
-                  inst[BaseCountStreamRX + stream]++;
-                  if(!(*conf[conf_stompy_bin])) 
-                  {
-                     if(stream_state[stream] == STREAM_RUN)
-                     {
-                        enqueue(stream, stomp_read_buffer);
-                     }
-                     else
-                     {
-                        // write buffer to disc and free it
-                        dump_buffer_to_disc(stream, stomp_read_buffer);
-                     }
-                     stomp_read_buffer = NULL; // Buffer has been emptied or recorded in the queue, so we no longer own it.
-                  }
-                  stats[StompMessage]++;
-                  
-                  if(s_number[stream][CLIENT] >= 0 && client_state[stream] != CLIENT_AWAIT_ACK)
-                  {
-                     FD_SET(s_number[stream][CLIENT], &write_sockets);
-                  }
+   // Find which stream
+   if(!(s = strstr(headers, "subscription:")))
+   {
+      _log(MAJOR, "STOMP MESSAGE received with no subscription value.  Discarded.  Headers:");
+      dump_headers(headers);
+      stats[StompInvalid]++;
+      stomp_manager(SM_RX_DONE, NULL);
+      return;
+   }
+   s += 13;
+   _log(DEBUG, "Stream id %c.", *s);
 
-                  // Send ACK
-                  {
-                     char ack_h[1024];
-                     sprintf(ack_h, "ACK\nsubscription:%c\nmessage-id:", *s);
-                     ssize_t i = strlen(ack_h);
-                     while((ack_h[i++] = *mid++) != '\n');
-                     ack_h[i++] = '\n';
-                     ack_h[i++] = '\0';
-                     if(debug)
-                     {
-                        _log(DEBUG, "Ack message headers:");
-                        dump_headers(ack_h);
-                     }
-                     stomp_queue_tx(ack_h, i);
-                  }
-                  
-                  // All done
-                  stomp_read_state = STOMP_IDLE;
-                  stomp_manager(SM_RX_DONE, NULL);
-               }
-            }
+   if(!strstr(headers, "message-id:"))
+   {
+      _log(MAJOR, "STOMP MESSAGE received with no message id.  Discarded.  Headers:");
+      dump_headers(headers);
+      stats[StompInvalid]++;
+      stomp_manager(SM_RX_DONE, NULL);
+      return;
+   }
+
+   stream = (*s >= '0' && *s <= '9')?atoi(s):STREAMS;
+   if(stream >= STREAMS)
+   {
+      _log(MAJOR, "STOMP MESSAGE received with unrecognised subscription value \"%c\".", *s);
+      stats[StompInvalid]++;
+      stomp_manager(SM_RX_DONE, NULL);
+      return;
+   }
+
+   if(body_length >= FRAME_SIZE)
+   {
+      _log(CRITICAL, "STOMP MESSAGE received with overlong payload.  Discarded.  Headers:");
+      dump_headers(headers);
+      stats[StompInvalid]++;
+      stomp_ack(headers); // Failure at our end.  Need to send ack or message feed will cease.
+      stomp_manager(SM_RX_DONE, NULL);
+      return;
+   }
+
+   _log(DEBUG, "Got end of message frame.  Processing...");
+   inst[BaseCountStreamRX + stream]++;
+   if(!(*conf[conf_stompy_bin])) 
+   {
+      // Note the following code allows one stream to hog all the buffers.  Is that a good idea?
+      if(!(b = new_buffer(body_length + 1)))
+      {
+         // Handle run out of buffers:  Dump queues to disc, switch to disc mode ask for a buffer again.
+         _log(GENERAL, "No buffers available for stream %d (%s).  Saving to disc.", stream, stomp_topic_names[stream]);
+         word st, found = false;
+         for(channel = stream; channel < STREAMS * consumers; channel += STREAMS)
+         {
+            if(dump_queue_to_disc(channel)) found = true;
+            if(stream_state[channel] == STREAM_RUN) stream_state[channel] = STREAM_DISC;
          }
-         break;
-      
-      case STOMP_FAIL: // Just bin data until the end of the STOMP frame.
-         if(d[i] == '\0')
+         if(!found)
          {
-            if(fail_send_ack)
-               // Send ACK
+            // None in our queues, find some elsewhere
+            for(st = 0; st < CHANNELS; st++) 
             {
-               char ack_h[1024];
-               sprintf(ack_h, "ACK\nsubscription:%c\nmessage-id:", *s);
-               ssize_t i = strlen(ack_h);
-               while((ack_h[i++] = *mid++) != '\n');
-               ack_h[i++] = '\n';
-               ack_h[i++] = '\0';
-               if(debug)
+               if(dump_queue_to_disc(st)) 
                {
-                  _log(DEBUG, "Ack message headers:");
-                  dump_headers(ack_h);
+                  // Found some!
+                  if(stream_state[st] == STREAM_RUN) stream_state[st] = STREAM_DISC;
+                  _log(GENERAL, "Dumped queue to disc and switched to disc mode on channel %d (%s) to free space.", st, channel_names[st]);
+                  st = CHANNELS;
                }
-               stomp_queue_tx(ack_h, i);
             }
-            stomp_read_state = STOMP_IDLE;
+         }
+         if(!(b = new_buffer(body_length + 1)))
+         {
+            _log(CRITICAL, "Failed to find a free buffer.  STOMP MESSAGE discarded.");
+            stats[StompInvalid]++;
+            stomp_ack(headers); // Failure at our end.  Need to send ack or message feed will cease.
             stomp_manager(SM_RX_DONE, NULL);
+            return;
          }
-         break;
+      }
+      memcpy(b->frame, body, body_length + 1);
+      b->stamp = time_us();
+      _log(DEBUG, "Stamp is %lld.", b->stamp);
+      // One reference for each channel of the stream, taken before any of them can drop theirs.
+      b->refs = consumers;
+      for(channel = stream; channel < STREAMS * consumers; channel += STREAMS)
+      {
+         if(stream_state[channel] == STREAM_RUN)
+         {
+            enqueue(channel, b);
+         }
+         else
+         {
+            // write buffer to disc and release it
+            dump_buffer_to_disc(channel, b);
+         }
+      }
+   }
+   stats[StompMessage]++;
+                  
+   for(channel = stream; channel < STREAMS * consumers; channel += STREAMS)
+   {
+      if(client_state[channel] != CLIENT_AWAIT_ACK)
+      {
+         watch_set(channel, CLIENT, EPOLLOUT);
       }
    }
 
-   if(controlled_shutdown && stomp_read_state == STOMP_IDLE && stomp_tx_queue_on == 0)
+   stomp_ack(headers);
+   stomp_manager(SM_RX_DONE, NULL);
+}
+
+static void stomp_ack(const char * const headers)
+{
+   // Send ACK for the MESSAGE with these headers.
+   char ack_h[1024];
+   const char * mid = strstr(headers, "message-id:") + 11;
+   ssize_t i;
+
+   sprintf(ack_h, "ACK\nsubscription:%d\nmessage-id:", atoi(strstr(headers, "subscription:") + 13));
+   i = strlen(ack_h);
+   while((ack_h[i++] = *mid++) != '\n');
+   ack_h[i++] = '\n';
+   ack_h[i++] = '\0';
+   if(debug)
    {
-      stomp_manager(SM_FAIL, NULL);
+      _log(DEBUG, "Ack message headers:");
+      dump_headers(ack_h);
    }
+   stomp_queue_tx(ack_h, i);
 }
 
-static void client_write(const int s)
+static void client_write(const word channel)
 {
-   word stream = s_stream[s];
-   _log(PROC, "client_write(%d):  Stream %d, client state %d", s, stream, client_state[stream]);
+   int s = s_number[channel][CLIENT];
+   _log(PROC, "client_write(%d):  Channel %d, client state %d, unacked %d", s, channel, client_state[channel], client_unacked(channel));
 
    ssize_t l;
 
-   if(client_state[stream] == CLIENT_AWAIT_ACK)
+   if(client_state[channel] == CLIENT_AWAIT_ACK)
    {
-      // Shouldn't happen
-      _log(CRITICAL, "client_write() Unexpected state CLIENT_AWAIT_ACK on stream %d", stream);
-      FD_CLR(s, &write_sockets);
+      // Window is full.  Nothing to do until an ack arrives.
+      watch_clr(channel, CLIENT, EPOLLOUT);
       return;
    }
 
-   if(client_state[stream] == CLIENT_IDLE && controlled_shutdown)
+   if(client_state[channel] == CLIENT_IDLE && controlled_shutdown)
    {
-      dump_queue_to_disc(stream);
-      stream_state[stream] = STREAM_LOCK;
-      close(s);
-      FD_CLR(s, &write_sockets);
-      FD_CLR(s, &read_sockets);
-      s_number[s][CLIENT] = -1;
+      if(client_unacked(channel))
+      {
+         // Wait for the outstanding acks.  client_ack() will finish off.
+         watch_clr(channel, CLIENT, EPOLLOUT);
+         return;
+      }
+      dump_queue_to_disc(channel);
+      stream_state[channel] = STREAM_LOCK;
+      client_close(channel);
       return;
    }
    
-   if(client_state[stream] == CLIENT_IDLE)
+   if(client_state[channel] == CLIENT_IDLE && client_ring_pending[channel])
+   {
+      // Switch to the ring.  A zero length tells the client that the rest of the frames are there.
+      client_length[channel] = 0;
+      l = write(s, &client_length[channel], sizeof(ssize_t));
+      if(l != sizeof(ssize_t))
+      {
+         _log(MAJOR, "Error sending ring switch to client.  l = %ld, error %d %s.", l, errno, strerror(errno));
+         client_close(channel);
+         _log(GENERAL, "Client disconnected from channel %d (%s).", channel, channel_names[channel]);
+         return;
+      }
+      client_ring[channel] = client_ring_pending[channel];
+      client_ring_pending[channel] = NULL;
+      _log(GENERAL, "Client on channel %d (%s) switched to shared memory ring.", channel, channel_names[channel]);
+   }
+
+   if(client_state[channel] == CLIENT_IDLE)
    {
-      if(client_buffer[stream]) _log(CRITICAL, "Unexpected client buffer!");
-      client_buffer[stream] = queue_front(stream);
-      if(!client_buffer[stream])
+      if(client_buffer[channel]) _log(CRITICAL, "Unexpected client buffer!");
+      client_buffer[channel] = client_last_sent[channel]?QUEUE_NEXT(client_last_sent[channel], channel):queue_front(channel);
+      if(!client_buffer[channel])
       {
-         // Queue is empty
-         if(stream_state[stream] == STREAM_RUN || stream_state[stream] == STREAM_LOCK)
+         // Nothing waiting to be sent
+         if(stream_state[channel] == STREAM_RUN || stream_state[channel] == STREAM_LOCK)
          {
             // Nothing more to do
-            FD_CLR(s, &write_sockets);
+            watch_clr(channel, CLIENT, EPOLLOUT);
             return;
          }
 
          // stream_state is _DISC, queue is empty.  Read some more from disc.
-         if(disc_queue_length(stream))
+         if(disc_queue_length(channel))
          {
-            if(queue_length(STREAMS))
-            {
-               load_queue_from_disc(stream);
-               client_buffer[stream] = queue_front(stream);
-            }
-            else 
+            if(!buffer_available(FRAME_SIZE))
             {
                // There is stuff on the disc, but we have no room to read it.
-               // This is a problem.  If we just leave the stream in this state, it will hog the select.
-               _log(GENERAL, "Unable to load stream %d (%s) messages from disc.  No buffers available.", stream, stomp_topic_names[stream]);
+               // This is a problem.  If we just leave the channel in this state, it will hog the event loop.
+               _log(GENERAL, "Unable to load channel %d (%s) messages from disc.  No buffers available.", channel, channel_names[channel]);
                word st;
-               for(st = 0; st < STREAMS; st++)
+               for(st = 0; st < CHANNELS; st++)
                {
                   if(dump_queue_to_disc(st))
                   {
                      if(stream_state[st] == STREAM_RUN) stream_state[st] = STREAM_DISC;
-                     _log(GENERAL, "client_write() dumped queue for stream %d (%s) to disc to free space.", st, stomp_topic_names[st]);
-                     st = STREAMS;
+                     _log(GENERAL, "client_write() dumped queue for channel %d (%s) to disc to free space.", st, channel_names[st]);
+                     st = CHANNELS;
                   }
                }
-               load_queue_from_disc(stream);
-               client_buffer[stream] = queue_front(stream);
+            }
+            load_queue_from_disc(channel);
+            client_buffer[channel] = client_last_sent[channel]?QUEUE_NEXT(client_last_sent[channel], channel):queue_front(channel);
+            if(!client_buffer[channel])
+            {
+               watch_clr(channel, CLIENT, EPOLLOUT);
+               return;
             }
          }
          else
          {
             // We have emptied the disc
-            _log(GENERAL, "Stream %d (%s) disc queue empty.", stream, stomp_topic_names[stream]);
-            stream_state[stream] = STREAM_RUN;
-            FD_CLR(s, &write_sockets);
+            _log(GENERAL, "Channel %d (%s) disc queue empty.", channel, channel_names[channel]);
+            stream_state[channel] = STREAM_RUN;
+            watch_clr(channel, CLIENT, EPOLLOUT);
             return;
          }
       }
 
-      client_length[stream] = strlen(client_buffer[stream]->frame) + 1; // INCLUDING the terminating \0
-      _log(DEBUG, "Frame length is %ld.", client_length[stream]);
-      client_index[stream] = 0;
-      l = write(s,  &client_length[stream], sizeof(ssize_t));
-      if(l != sizeof(ssize_t))
+      client_length[channel] = strlen(client_buffer[channel]->frame) + 1; // INCLUDING the terminating \0
+      _log(DEBUG, "Frame length is %ld.", client_length[channel]);
+      client_index[channel] = 0;
+      if(client_ring[channel])
+      {
+         if(!ring_put(channel, client_buffer[channel], client_length[channel]))
+         {
+            // No room.  Wait for the client to ack some frames.
+            client_buffer[channel] = NULL;
+            watch_clr(channel, CLIENT, EPOLLOUT);
+            return;
+         }
+         client_index[channel] = client_length[channel];
+         client_state[channel] = CLIENT_RUN;
+      }
+      else if((l = write(s,  &client_length[channel], sizeof(ssize_t))) != sizeof(ssize_t))
       {
          // Handle error
          _log(MAJOR, "Error sending buffer size to client.  l = %ld, error %d %s.", l, errno, strerror(errno));
-         client_state[stream] = CLIENT_IDLE;
-         client_buffer[stream] = NULL;
-         close(s);
-         s_number[stream][CLIENT] = -1;
-         FD_CLR(s, &write_sockets);
-         FD_CLR(s, &read_sockets);
-         _log(GENERAL, "Client disconnected from stream %d (%s).", stream, stomp_topic_names[stream]);
+         client_close(channel);
+         _log(GENERAL, "Client disconnected from channel %d (%s).", channel, channel_names[channel]);
          // Could switch to disc mode here?  Or wait until queue fills.
       }
       else
       {
          _log(DEBUG, "Wrote length OK");
-         client_state[stream] = CLIENT_RUN;
+         client_state[channel] = CLIENT_RUN;
       }
    }
 
-   if(client_state[stream] == CLIENT_RUN)
+   if(client_state[channel] == CLIENT_RUN)
    {
-      _log(DEBUG, "About to write %ld bytes of body.",   client_length[stream] - client_index[stream]);
-      l = write(s, &client_buffer[stream]->frame[client_index[stream]], client_length[stream] - client_index[stream]);
+      _log(DEBUG, "About to write %ld bytes of body.",   client_length[channel] - client_index[channel]);
+      l = client_ring[channel]?0:write(s, &client_buffer[channel]->frame[client_index[channel]], client_length[channel] - client_index[channel]);
       if(l < 0)
       {
          // Handle error
          _log(MAJOR, "Error writing message to client buffer.  Error %d %s", errno, strerror(errno));
-         client_state[stream] = CLIENT_IDLE;
-         client_buffer[stream] = NULL; // Buffer is still on queue
-         close(s);
-         s_number[stream][CLIENT] = -1;
-         FD_CLR(s, &write_sockets);
-         FD_CLR(s, &read_sockets);
-         _log(GENERAL, "Client disconnected from stream %d (%s).", stream, stomp_topic_names[stream]);
+         client_close(channel); // Buffers are still on queue
+         _log(GENERAL, "Client disconnected from channel %d (%s).", channel, channel_names[channel]);
          // Could switch to disc mode here?  Or wait until queue fills.
       }
       else
       {
          _log(DEBUG, "client_write() sent %ld bytes of frame", l);
-         client_index[stream] += l;
-         if(client_index[stream] >= client_length[stream])
+         client_index[channel] += l;
+         if(client_index[channel] >= client_length[channel])
          {
-            // Finished
-            client_state[stream] = CLIENT_AWAIT_ACK;
-            FD_CLR(s, &write_sockets);
-            FD_SET(s, &read_sockets);
-            inst[BaseStartWaitClientAck + stream] = time_us();
+            // Finished.  Frame stays at the front of the queue until it is acked.
+            client_last_sent[channel] = client_buffer[channel];
+            client_buffer[channel] = NULL;
+            client_seq_sent[channel]++;
+            client_state[channel] = CLIENT_IDLE;
+            if(client_unacked(channel) >= client_window[channel])
+            {
+               client_state[channel] = CLIENT_AWAIT_ACK;
+               watch_clr(channel, CLIENT, EPOLLOUT);
+               inst[BaseStartWaitClientAck + channel] = time_us();
+            }
          }
       }
    }
-   //   _log(DEBUG, "client_write():  Returns with client state = %d.", client_state[stream]);
+   //   _log(DEBUG, "client_write():  Returns with client state = %d.", client_state[channel]);
 }
 
-static void client_read(const int s)
+static void client_read(const word channel)
 {
-   word stream = s_stream[s];
-   _log(PROC, "client_read(%d) stream %d", s, stream);
+   int s = s_number[channel][CLIENT];
+   _log(PROC, "client_read(%d) channel %d", s, channel);
    
-   ssize_t l;
-   static char buffer[16];
+   ssize_t l, i;
+   char * buffer = client_rx[channel];
+   dword value;
+   word partial;
 
-   if(client_state[stream] != CLIENT_AWAIT_ACK)
-   {
-      _log(CRITICAL, "Unexpected client receive on socket %d stream %d", s, stream);
-      FD_CLR(s, &read_sockets);
-      l = read(s, buffer, 16);
-      return;
-   }
-   l = read(s, buffer, 8);
+   l = read(s, buffer + client_rx_length[channel], CLIENT_RX_SIZE - client_rx_length[channel]);
+   if(l < 0 && errno == EAGAIN) return;
    if(l < 0)
    {
-      _log(MAJOR, "Error reading ACK from client on stream %d (%s).  Error %d %s.", stream, stomp_topic_names[stream], errno, strerror(errno));
-      client_state[stream] = CLIENT_IDLE;
-      client_buffer[stream] = NULL;
-      close(s);
-      s_number[stream][CLIENT] = -1;
-      FD_CLR(s, &write_sockets);
-      FD_CLR(s, &read_sockets);
-      _log(GENERAL, "Client disconnected from stream %d (%s).", stream, stomp_topic_names[stream]);
+      _log(MAJOR, "Error reading ACK from client on channel %d (%s).  Error %d %s.", channel, channel_names[channel], errno, strerror(errno));
+      client_close(channel);
+      _log(GENERAL, "Client disconnected from channel %d (%s).", channel, channel_names[channel]);
       return;
    }
    else if(!l)
    {
-      _log(MAJOR, "EOF reading ACK from client on stream %d (%s).", stream, stomp_topic_names[stream]);
-      client_state[stream] = CLIENT_IDLE;
-      client_buffer[stream] = NULL;
-      close(s);
-      s_number[stream][CLIENT] = -1;
-      FD_CLR(s, &write_sockets);
-      FD_CLR(s, &read_sockets);
-      _log(GENERAL, "Client disconnected from stream %d (%s).", stream, stomp_topic_names[stream]);
+      _log(MAJOR, "EOF reading ACK from client on channel %d (%s).", channel, channel_names[channel]);
+      client_close(channel);
+      _log(GENERAL, "Client disconnected from channel %d (%s).", channel, channel_names[channel]);
       return;
    }
-   else if(l != 1 || buffer[0] != 'A')
+   client_rx_length[channel] += l;
+
+   // Process complete records.  A partial record is kept until the rest of it arrives.
+   i = 0;
+   partial = false;
+   while(i < client_rx_length[channel] && !partial && s_number[channel][CLIENT] == s)
    {
-      buffer[l] = '\0';
+      switch(buffer[i])
       {
-         char z1[32], z2[16], z3[16];
-         word ii = 0;
-         z1[0] = '\0';
-         while(buffer[ii])
+      case 'A':
+         i++;
+         if(client_unacked(channel))
          {
-            sprintf(z3, "%02x ", buffer[ii]);
-            strcat(z1, z3);
-            z2[ii] = (buffer[ii]>31 && buffer[ii]<127)?buffer[ii]:'.';
-            ii++;
+            client_ack(channel, 1);
          }
-         z2[ii] = '\0';
-         _log(MAJOR, "Invalid ACK %s\"%s\" from client on stream %d (%s).", z1, z2, stream, stomp_topic_names[stream]);
-      }
-      client_state[stream] = CLIENT_IDLE;
-      client_buffer[stream] = NULL;
-      close(s);
-      s_number[stream][CLIENT] = -1;
-      FD_CLR(s, &write_sockets);
-      FD_CLR(s, &read_sockets);
-      _log(GENERAL, "Client disconnected from stream %d (%s).", stream, stomp_topic_names[stream]);
-      return;
-   }
-   FD_CLR(s, &read_sockets);
-   client_state[stream] = CLIENT_IDLE;
-
-   // Log message
-   if(stomp_topic_log[stream]) log_message(stream);
-
-   if(inst[BaseStartWaitClientAck + stream]) inst[BaseTotalWaitClientAck + stream] += (time_us() - inst[BaseStartWaitClientAck + stream]);
-   inst[BaseStartWaitClientAck + stream] = 0LL;
-   inst[BaseCountStreamTX + stream]++;
+         else
+         {
+            _log(CRITICAL, "Unexpected ACK from client on socket %d channel %d", s, channel);
+         }
+         break;
 
-   if(client_buffer[stream] != dequeue(stream))
-   {
-      _log(CRITICAL, "Queue end mismatch detected in client_read() on stream %d (%s).  Fatal.", stream, stomp_topic_names[stream]);
-      run = false;
-      return;
+      case 'M':
+         i++;
+         if(!client_ring[channel] && !client_ring_pending[channel])
+         {
+            // If the ring can't be set up, the client simply carries on reading the socket.
+            if((client_ring_pending[channel] = ring_open(channel)))
+            {
+               watch_set(channel, CLIENT, EPOLLOUT);
+            }
+         }
+         break;
+
+      case 'W':
+      case 'C':
+         if(client_rx_length[channel] - i < 1 + sizeof(dword))
+         {
+            partial = true;
+            break;
+         }
+         memcpy(&value, buffer + i + 1, sizeof(dword));
+         value = ntohl(value);
+         if(buffer[i] == 'W')
+         {
+            if(value < 1) value = 1;
+            if(value > MAX_CLIENT_WINDOW) value = MAX_CLIENT_WINDOW;
+            client_window[channel] = value;
+            _log(GENERAL, "Client on channel %d (%s) set window to %d frame%s.", channel, channel_names[channel], value, (value == 1)?"":"s");
+            if(client_state[channel] == CLIENT_AWAIT_ACK && client_unacked(channel) < client_window[channel])
+            {
+               client_state[channel] = CLIENT_IDLE;
+               if(inst[BaseStartWaitClientAck + channel]) inst[BaseTotalWaitClientAck + channel] += (time_us() - inst[BaseStartWaitClientAck + channel]);
+               inst[BaseStartWaitClientAck + channel] = 0LL;
+               watch_set(channel, CLIENT, EPOLLOUT);
+            }
+         }
+         else if(value < client_seq_acked[channel] || value > client_seq_sent[channel])
+         {
+            _log(MAJOR, "Invalid ACK to sequence %d from client on channel %d (%s).  Acked %d, sent %d.", value, channel, channel_names[channel], client_seq_acked[channel], client_seq_sent[channel]);
+            client_close(channel);
+            _log(GENERAL, "Client disconnected from channel %d (%s).", channel, channel_names[channel]);
+            return;
+         }
+         else if(value > client_seq_acked[channel])
+         {
+            client_ack(channel, value - client_seq_acked[channel]);
+         }
+         i += 1 + sizeof(dword);
+         break;
+
+      default:
+         {
+            char z1[3 * CLIENT_RX_SIZE + 1], z2[CLIENT_RX_SIZE + 1], z3[16];
+            word ii = 0;
+            z1[0] = '\0';
+            while(i + ii < client_rx_length[channel] && ii < 16)
+            {
+               sprintf(z3, "%02x ", (byte) buffer[i + ii]);
+               strcat(z1, z3);
+               z2[ii] = (buffer[i + ii]>31 && buffer[i + ii]<127)?buffer[i + ii]:'.';
+               ii++;
+            }
+            z2[ii] = '\0';
+            _log(MAJOR, "Invalid ACK %s\"%s\" from client on channel %d (%s).", z1, z2, channel, channel_names[channel]);
+         }
+         client_close(channel);
+         _log(GENERAL, "Client disconnected from channel %d (%s).", channel, channel_names[channel]);
+         return;
+      }
+   }
+   if(s_number[channel][CLIENT] != s) return;
+
+   client_rx_length[channel] -= i;
+   if(client_rx_length[channel]) memmove(buffer, buffer + i, client_rx_length[channel]);
+}
+
+static void client_ack(const word channel, const dword frames)
+{
+   // The client has acked the oldest unacked frames.  Remove them from the queue.
+   _log(PROC, "client_ack(%d, %d)", channel, frames);
+   dword i;
+   struct frame_buffer * b;
+   qword acked = time_us();
+
+   for(i = 0; i < frames; i++)
+   {
+      if(!(b = dequeue(channel)) || b == client_buffer[channel])
+      {
+         _log(CRITICAL, "Queue end mismatch detected in client_ack() on channel %d (%s).  Fatal.", channel, channel_names[channel]);
+         run = false;
+         return;
+      }
+
+      // Log message
+      if(!CHANNEL_CONSUMER(channel) && stomp_topic_log[channel]) log_message(channel, b);
+
+      if(b == client_last_sent[channel]) client_last_sent[channel] = NULL;
+      if(b->stamp && b->stamp <= acked) hist_record(&hist[channel][HistAck], acked - b->stamp);
+      free_buffer(b);
+      client_seq_acked[channel]++;
+      inst[BaseCountStreamTX + channel]++;
+      stats[BaseStreamFrameSent + channel]++;
+   }
+
+   if(client_state[channel] == CLIENT_AWAIT_ACK && client_unacked(channel) < client_window[channel])
+   {
+      client_state[channel] = CLIENT_IDLE;
+      if(inst[BaseStartWaitClientAck + channel]) inst[BaseTotalWaitClientAck + channel] += (time_us() - inst[BaseStartWaitClientAck + channel]);
+      inst[BaseStartWaitClientAck + channel] = 0LL;
    }
-   free_buffer(client_buffer[stream]);
-   client_buffer[stream] = NULL;
-   stats[BaseStreamFrameSent + stream]++;
+
    if(controlled_shutdown)
    {
-      dump_queue_to_disc(stream);
-      stream_state[stream] = STREAM_LOCK;
-      close(s);
-      FD_CLR(s, &write_sockets);
-      FD_CLR(s, &read_sockets);
-      s_number[stream][CLIENT] = -1;
+      if(client_state[channel] == CLIENT_IDLE && !client_unacked(channel))
+      {
+         dump_queue_to_disc(channel);
+         stream_state[channel] = STREAM_LOCK;
+         client_close(channel);
+      }
       return;
    }
-   FD_SET(s, &write_sockets);
-   if(stream_state[stream] == STREAM_LOCK)
+   if(client_state[channel] != CLIENT_AWAIT_ACK) watch_set(channel, CLIENT, EPOLLOUT);
+   if(stream_state[channel] == STREAM_LOCK)
+   {
+      dump_queue_to_disc(channel);
+   }
+}
+
+static void client_close(const word channel)
+{
+   // Close the client connection on a channel.  Any frames sent but not acked are still on the queue and will
+   // be sent again to the next client.
+   _log(PROC, "client_close(%d)", channel);
+   int s = s_number[channel][CLIENT];
+   if(s >= 0)
+   {
+      watch_remove(channel, CLIENT);
+      close(s);
+   }
+   s_number[channel][CLIENT] = -1;
+   if(inst[BaseStartWaitClientAck + channel]) inst[BaseTotalWaitClientAck + channel] += (time_us() - inst[BaseStartWaitClientAck + channel]);
+   inst[BaseStartWaitClientAck + channel] = 0LL;
+   client_state[channel] = CLIENT_IDLE;
+   client_buffer[channel] = client_last_sent[channel] = NULL;
+   client_seq_sent[channel] = client_seq_acked[channel] = 0;
+   client_window[channel] = 1;
+   client_rx_length[channel] = 0;
+   ring_close(channel);
+}
+
+static word client_unacked(const word channel)
+{
+   // Number of frames sent to the client and not yet acked.
+   return client_seq_sent[channel] - client_seq_acked[channel];
+}
+
+static struct stompy_ring * ring_open(const word channel)
+{
+   // Create, map and initialise the shared memory ring for a channel.  Returns NULL on failure.
+   char path[64];
+   int fd;
+   struct stompy_ring * r;
+   const size_t size = sizeof(struct stompy_ring) + STOMPY_RING_SIZE;
+
+   sprintf(path, STOMPY_RING_PATH, BASE_PORT + channel);
+   // Always a new file, only accessible to this user, so that nothing left in /dev/shm by anyone else is used.
+   if(unlink(path) && errno != ENOENT)
+   {
+      _log(MAJOR, "Failed to remove old ring \"%s\".  Error %d %s.", path, errno, strerror(errno));
+      return NULL;
+   }
+   if((fd = open(path, O_RDWR | O_CREAT | O_EXCL | O_NOFOLLOW, 0600)) < 0)
+   {
+      _log(MAJOR, "Failed to create ring \"%s\".  Error %d %s.", path, errno, strerror(errno));
+      return NULL;
+   }
+   if(ftruncate(fd, size))
    {
-      dump_queue_to_disc(stream);
+      _log(MAJOR, "Failed to size ring \"%s\".  Error %d %s.", path, errno, strerror(errno));
+      close(fd);
+      return NULL;
+   }
+   r = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+   close(fd);
+   if(r == MAP_FAILED)
+   {
+      _log(MAJOR, "Failed to map ring \"%s\".  Error %d %s.", path, errno, strerror(errno));
+      return NULL;
    }
+   r->size = STOMPY_RING_SIZE;
+   r->head = r->tail = 0;
+   r->written = r->waiting = 0;
+   __atomic_store_n(&r->magic, STOMPY_RING_MAGIC, __ATOMIC_RELEASE);
+   _log(DEBUG, "Ring \"%s\" set up for channel %d.", path, channel);
+   return r;
 }
 
-static void client_accept(const int s)
+static word ring_put(const word channel, const struct frame_buffer * const b, const size_t length)
 {
+   // Append a frame to a channel's ring and wake the client if it is waiting.  Returns false if there is no room.
+   struct stompy_ring * r = client_ring[channel];
+   qword head = r->head;
+   qword tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+   size_t need = sizeof(qword) + ((length + 7) & ~7);
+   size_t offset = head % r->size;
+   size_t skip = (offset + need > r->size)?(r->size - offset):0;
+
+   if(head + skip + need - tail > r->size) return false;
+   if(skip)
+   {
+      *(qword *) (r->data + offset) = STOMPY_RING_WRAP;
+      head += skip;
+      offset = 0;
+   }
+   *(qword *) (r->data + offset) = length;
+   memcpy(r->data + offset + sizeof(qword), b->frame, length);
+   __atomic_store_n(&r->head, head + need, __ATOMIC_RELEASE);
+   __atomic_add_fetch(&r->written, 1, __ATOMIC_SEQ_CST);
+   if(__atomic_load_n(&r->waiting, __ATOMIC_SEQ_CST))
+   {
+      syscall(SYS_futex, &r->written, FUTEX_WAKE, 1, NULL, NULL, 0);
+   }
+   return true;
+}
+
+static void ring_close(const word channel)
+{
+   if(client_ring[channel])         munmap(client_ring[channel],         sizeof(struct stompy_ring) + STOMPY_RING_SIZE);
+   if(client_ring_pending[channel]) munmap(client_ring_pending[channel], sizeof(struct stompy_ring) + STOMPY_RING_SIZE);
+   client_ring[channel] = client_ring_pending[channel] = NULL;
+}
+
+static void client_accept(const word channel)
+{
+   int s = s_number[channel][SERVER];
    _log(PROC, "client_accept(%d)", s);
    struct sockaddr_in acc_add;
    socklen_t acc_add_len = sizeof(acc_add);
    
-   word stream = s_stream[s];
    int new_socket = accept(s, (struct sockaddr *)&acc_add, &acc_add_len);
    if(new_socket < 0)
    {
-      _log(CRITICAL, "accept() on stream %d failed.  Error %d %s", stream, errno, strerror(errno));
+      _log(CRITICAL, "accept() on channel %d failed.  Error %d %s", channel, errno, strerror(errno));
    }
    else
    {
       // Handle the error condition where the socket is already open... Just close it quietly.
-      if(s_number[stream][CLIENT] >= 0)
+      if(s_number[channel][CLIENT] >= 0)
       {
-         _log(MAJOR, "Client connect for stream %d, socket %d when socket %d already in use.", stream, new_socket, s_number[stream][CLIENT]);
+         _log(MAJOR, "Client connect for channel %d, socket %d when socket %d already in use.", channel, new_socket, s_number[channel][CLIENT]);
          _log(MAJOR, "   New connection is from %s:%d", inet_ntoa(acc_add.sin_addr), acc_add.sin_port);
          // Already open.  Close the old one.
-         close(s_number[stream][CLIENT]);
-         FD_CLR(s_number[stream][CLIENT], &write_sockets);
-         FD_CLR(s_number[stream][CLIENT], &read_sockets);
-         s_number[stream][CLIENT] = -1;
-         if(client_state[stream] != CLIENT_IDLE)
-         {
-            // Deal with an unacknowledged client write buffer.
-            // The buffer is still in the queue so in fact we don't have to do anything.
-            client_state[stream] = CLIENT_IDLE;
-         }
+         // Any unacknowledged client write buffers are still in the queue so in fact we don't have to do anything.
+         client_close(channel);
       }
       // Make it non-blocking
       int oldflags = fcntl(new_socket, F_GETFL, 0);
@@ -1361,15 +1776,100 @@ static void client_accept(const int s)
       oldflags |= O_NONBLOCK;
       fcntl(new_socket, F_SETFL, oldflags);
 
-      s_stream[new_socket] = stream;
-      s_type[new_socket] = CLIENT;
-      s_number[stream][CLIENT] = new_socket;
-      FD_SET(new_socket, &write_sockets);
-      _log(GENERAL, "Client %s:%d connected to stream %d (%s).", inet_ntoa(acc_add.sin_addr), acc_add.sin_port, stream, stomp_topic_names[stream]);
+      s_number[channel][CLIENT] = new_socket;
+      watch_add(channel, CLIENT, new_socket);
+      watch_set(channel, CLIENT, EPOLLIN | EPOLLOUT);
+      _log(GENERAL, "Client %s:%d connected to channel %d (%s).", inet_ntoa(acc_add.sin_addr), acc_add.sin_port, channel, channel_names[channel]);
       stats[ClientConnect]++;
    }
 }
 
+static int watch_socket(const word channel, const word type)
+{
+   // Socket number for a channel and type, or -1 if not open.
+   if(channel == STOMP) return s_stomp;
+   return s_number[channel][type];
+}
+
+static void watch_add(const word channel, const word type, const int s)
+{
+   // Register a newly opened socket with epoll, initially with no events requested.
+   struct epoll_event e;
+
+   s_events[channel][type] = 0;
+   e.events = 0;
+   e.data.u32 = (type << 16) | channel;
+   if(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, s, &e))
+   {
+      _log(CRITICAL, "Failed to add socket %d to epoll.  Error %d %s.", s, errno, strerror(errno));
+   }
+}
+
+static void watch_set(const word channel, const word type, const dword events)
+{
+   struct epoll_event e;
+   int s = watch_socket(channel, type);
+
+   if(s < 0 || (s_events[channel][type] & events) == events) return;
+   s_events[channel][type] |= events;
+   e.events = s_events[channel][type];
+   e.data.u32 = (type << 16) | channel;
+   if(epoll_ctl(epoll_fd, EPOLL_CTL_MOD, s, &e))
+   {
+      _log(CRITICAL, "Failed to modify socket %d events.  Error %d %s.", s, errno, strerror(errno));
+   }
+}
+
+static void watch_clr(const word channel, const word type, const dword events)
+{
+   struct epoll_event e;
+   int s = watch_socket(channel, type);
+
+   if(s < 0 || !(s_events[channel][type] & events)) return;
+   s_events[channel][type] &= ~events;
+   e.events = s_events[channel][type];
+   e.data.u32 = (type << 16) | channel;
+   if(epoll_ctl(epoll_fd, EPOLL_CTL_MOD, s, &e))
+   {
+      _log(CRITICAL, "Failed to modify socket %d events.  Error %d %s.", s, errno, strerror(errno));
+   }
+}
+
+static void watch_remove(const word channel, const word type)
+{
+   // Remove a socket from epoll.  Call before closing it.
+   int s = watch_socket(channel, type);
+
+   s_events[channel][type] = 0;
+   if(s >= 0 && epoll_ctl(epoll_fd, EPOLL_CTL_DEL, s, NULL))
+   {
+      _log(MAJOR, "Failed to remove socket %d from epoll.  Error %d %s.", s, errno, strerror(errno));
+   }
+}
+
+static void set_timer(void)
+{
+   // Arm the timer fd for the earliest due timer.
+   struct itimerspec t;
+   time_t due = stats_due;
+
+   if(alarms_due < due)                                  due = alarms_due;
+   if(rates_due < due)                                   due = rates_due;
+   if(heartbeat_tx_due < due)                            due = heartbeat_tx_due;
+   if(stomp_timeout < due)                               due = stomp_timeout;
+   if(spool_sync_due < due)                              due = spool_sync_due;
+   if(hist_due < due)                                    due = hist_due;
+   if(server_sockets_due < due && !controlled_shutdown)  due = server_sockets_due;
+   if(due < now) due = now; // Also catches timers set to 0 for "now", since 0 would disarm.
+
+   memset(&t, 0, sizeof(t));
+   t.it_value.tv_sec = due;
+   if(timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &t, NULL))
+   {
+      _log(CRITICAL, "Failed to set timer.  Error %d %s.", errno, strerror(errno));
+   }
+}
+
 static void user_command(void)
 {
    _log(PROC, "user_command()");
@@ -1391,40 +1891,27 @@ static void user_command(void)
          {
          case 'v':
             _log(GENERAL, "Command v - Stream 0 (VSTP) hold.");
-            stream_state[0] = STREAM_LOCK;
+            stream_hold(0, true);
             break;
          case 't':
             _log(GENERAL, "Command t - Stream 1 (TRUST) hold.");
-            stream_state[1] = STREAM_LOCK;
+            stream_hold(1, true);
             break;
          case 'd':
             _log(GENERAL, "Command d - Stream 2 (TD) hold.");
-            stream_state[2] = STREAM_LOCK;
+            stream_hold(2, true);
             break;
          case 'V':
             _log(GENERAL, "Command V - Stream 0 (VSTP) run.");
-            // We set the stream to DISC.  If the disc is empty it'll drop to RUN on the first client_write
-            if(!controlled_shutdown && stream_state[0] == STREAM_LOCK)
-            {
-               stream_state[0] = STREAM_DISC;
-               if(s_number[0][CLIENT] >= 0) FD_SET(s_number[0][CLIENT], &write_sockets);
-            }
+            stream_hold(0, false);
             break;
          case 'T':
             _log(GENERAL, "Command T - Stream 1 (TRUST) run.");
-            if(!controlled_shutdown && stream_state[1] == STREAM_LOCK)
-            {
-               stream_state[1] = STREAM_DISC;
-               if(s_number[1][CLIENT] >= 0) FD_SET(s_number[1][CLIENT], &write_sockets);
-            }
+            stream_hold(1, false);
             break;
          case 'D':
             _log(GENERAL, "Command D - Stream 2 (TD) run.");
-            if(!controlled_shutdown && stream_state[2] == STREAM_LOCK)
-            {
-               stream_state[2] = STREAM_DISC;
-               if(s_number[2][CLIENT] >= 0) FD_SET(s_number[2][CLIENT], &write_sockets);
-            }
+            stream_hold(2, false);
             break;
          case 's':
             _log(GENERAL, "Command s - Commence controlled shutdown.");
@@ -1444,6 +1931,26 @@ static void user_command(void)
    
 }
 
+static void stream_hold(const word stream, const word hold)
+{
+   // Hold or release all the channels of a stream.
+   word channel;
+
+   for(channel = stream; channel < CHANNELS; channel += STREAMS)
+   {
+      if(hold)
+      {
+         stream_state[channel] = STREAM_LOCK;
+      }
+      else if(!controlled_shutdown && stream_state[channel] == STREAM_LOCK)
+      {
+         // We set the channel to DISC.  If the disc is empty it'll drop to RUN on the first client_write
+         stream_state[channel] = STREAM_DISC;
+         watch_set(channel, CLIENT, EPOLLOUT);
+      }
+   }
+}
+
 static void send_subscribes(void)
 {
    char headers[1024];
@@ -1481,7 +1988,7 @@ static void handle_shutdown(word report)
 {
    _log(PROC, "handle_shutdown()");
 
-   word stream, complete;
+   word channel, complete;
    char reason[128];
 
    complete = true;
@@ -1492,32 +1999,28 @@ static void handle_shutdown(word report)
       strcpy(reason, "STOMP socket open");
    }
 
-   for(stream = 0; stream < STREAMS; stream++)
+   for(channel = 0; channel < CHANNELS; channel++)
    {
-      if(s_number[stream][SERVER] >= 0)
+      if(s_number[channel][SERVER] >= 0)
       {
          complete = false;
-         sprintf(reason, "Stream %d (%s) server socket still open", stream, stomp_topic_names[stream]);
-         //close(s_number[stream][SERVER]);
-         shutdown(s_number[stream][SERVER], 2);
-         FD_CLR(s_number[stream][SERVER], &read_sockets);
-         FD_CLR(s_number[stream][SERVER], &write_sockets);
-         s_number[stream][SERVER] = -1;
+         sprintf(reason, "Channel %d (%s) server socket still open", channel, channel_names[channel]);
+         //close(s_number[channel][SERVER]);
+         shutdown(s_number[channel][SERVER], 2);
+         watch_remove(channel, SERVER);
+         s_number[channel][SERVER] = -1;
       }
-      if(s_number[stream][CLIENT] >= 0)
+      if(s_number[channel][CLIENT] >= 0)
       {
          complete = false;
-         sprintf(reason, "Stream %d (%s) client connection still active", stream, stomp_topic_names[stream]);
-         if(client_state[stream] == CLIENT_IDLE)
+         sprintf(reason, "Channel %d (%s) client connection still active", channel, channel_names[channel]);
+         if(client_state[channel] == CLIENT_IDLE && !client_unacked(channel))
          {
-            dump_queue_to_disc(stream);
-            close(s_number[stream][CLIENT]);
-            FD_CLR(s_number[stream][CLIENT], &read_sockets);
-            FD_CLR(s_number[stream][CLIENT], &write_sockets);
-            s_number[stream][CLIENT] = -1;
+            dump_queue_to_disc(channel);
+            client_close(channel);
          }
       }
-      stream_state[stream] = STREAM_LOCK;
+      stream_state[channel] = STREAM_LOCK;
    }  
 
    if(complete) 
@@ -1533,7 +2036,7 @@ static void handle_shutdown(word report)
 
 static void full_shutdown(void)
 {
-   word stream, type;
+   word channel, type;
    _log(PROC, "full_shutdown()");
 
    if(interrupt) _log(GENERAL, "Shutting down due to interrupt.");
@@ -1541,17 +2044,21 @@ static void full_shutdown(void)
    // Close all sockets
    if(s_stomp >= 0)
    {
+      watch_remove(STOMP, CLIENT);
       close(s_stomp);
       s_stomp = -1;
    }
-   for(stream = 0; stream < STREAMS; stream++)
+   for(channel = 0; channel < CHANNELS; channel++)
    {
-      dump_queue_to_disc(stream);
+      // Close the client first so that any unacked frames are dumped as well.
+      if(s_number[channel][CLIENT] >= 0) client_close(channel);
+      dump_queue_to_disc(channel);
       for(type = 0; type < TYPES; type++)
       {
-         if(s_number[stream][type] >= 0) 
+         if(s_number[channel][type] >= 0) 
          {
-            close(s_number[stream][type]);
+            watch_remove(channel, type);
+            close(s_number[channel][type]);
          }
       }
    }
@@ -1626,7 +2133,7 @@ static void stomp_manager(const enum stomp_manager_event event, const char * con
       report_rates("Connecting to STOMP server.");
 
       stomp_read_state = STOMP_IDLE;
-      // DO NOT stomp_read_buffer = NULL; HERE
+      stomp_rx_on = stomp_rx_scanned = 0;
       stomp_tx_queue_on = stomp_tx_queue_off = 0;
 
       s_stomp = socket(AF_INET, SOCK_STREAM, 0);
@@ -1642,8 +2149,6 @@ static void stomp_manager(const enum stomp_manager_event event, const char * con
       if (server == NULL) 
       {
          close(s_stomp);
-         FD_CLR(s_stomp, &read_sockets);
-         FD_CLR(s_stomp, &write_sockets);
          s_stomp = -1;
          _log(CRITICAL, "Failed to resolve STOMP server hostname.");
          stomp_manager_state = SM_HOLD;
@@ -1659,14 +2164,12 @@ static void stomp_manager(const enum stomp_manager_event event, const char * con
       serv_addr.sin_port = htons(stomp_port);
 
       // Now connect to the server
-      // Really, we should do this in non-blocking mode and handle the successful/unsuccessful connection in the main select.
+      // Really, we should do this in non-blocking mode and handle the successful/unsuccessful connection in the main event loop.
       // This connect blocks if there's no-one there.
       if (connect(s_stomp, (const struct sockaddr *) &serv_addr, sizeof(serv_addr)) < 0) 
       {
          _log(MAJOR, "Unable to connect to STOMP server.  Error %d %s.", errno, strerror(errno));
          close(s_stomp);
-         FD_CLR(s_stomp, &read_sockets);
-         FD_CLR(s_stomp, &write_sockets);
          s_stomp = -1;
          stomp_manager_state = SM_HOLD;
          SET_TIMER_HOLDOFF;
@@ -1677,6 +2180,7 @@ static void stomp_manager(const enum stomp_manager_event event, const char * con
       int oldflags = fcntl(s_stomp, F_GETFL, 0);
       oldflags |= O_NONBLOCK;
       fcntl(s_stomp, F_SETFL, oldflags);
+      watch_add(STOMP, CLIENT, s_stomp);
 
       _log(GENERAL, "Socket connected to STOMP server.  Sending CONNECT message.");
       
@@ -1706,8 +2210,7 @@ static void stomp_manager(const enum stomp_manager_event event, const char * con
          stomp_queue_tx(headers, strlen(headers) + 1);
       }
       stomp_manager_state = SM_AWAIT_CONNECTED;
-      FD_SET(s_stomp, &read_sockets);
-      s_stream[s_stomp] = STOMP;
+      watch_set(STOMP, CLIENT, EPOLLIN);
       SET_TIMER_RUNNING;
       break;
       
@@ -1719,9 +2222,8 @@ static void stomp_manager(const enum stomp_manager_event event, const char * con
       }
       if(s_stomp >= 0)
       {
+         watch_remove(STOMP, CLIENT);
          close(s_stomp);
-         FD_CLR(s_stomp, &read_sockets);
-         FD_CLR(s_stomp, &write_sockets);
          s_stomp = -1;
          _log(GENERAL, "%s in state %s.  STOMP socket disconnected.  Connection up time %s.", sm_events[event], sm_states[stomp_manager_state], show_elapsed(stomp_connect_time?(now - stomp_connect_time):0));
       }
@@ -1790,11 +2292,7 @@ static void stomp_manager(const enum stomp_manager_event event, const char * con
          else
          {
             _log(MAJOR, "CONNECT response incorrect.");
-            if(s_stomp >= 0)
-            {
-               FD_CLR(s_stomp, &read_sockets);
-               FD_CLR(s_stomp, &write_sockets);
-            }
+            watch_clr(STOMP, CLIENT, EPOLLIN | EPOLLOUT);
             // This will get an immediate action 2
             stomp_manager_state = SM_SEND_DISCO;
             SET_TIMER_IMMEDIATE;
@@ -1827,7 +2325,7 @@ static void stomp_queue_tx(const char * const d, const ssize_t l)
    memcpy(stomp_tx_queue + stomp_tx_queue_on, d, l);
    stomp_tx_queue_on += l;
 
-   FD_SET(s_stomp, &write_sockets);
+   watch_set(STOMP, CLIENT, EPOLLOUT);
 }
 
 static void report_stats(void)
@@ -1874,11 +2372,12 @@ static void report_stats(void)
    for(i=0; i<MAXstats; i++)
    {
       grand_stats[i] += stats[i];
-      if(i >= BaseStreamFrameSent && i < BaseStreamFrameSent + STREAMS)
+      if(i >= BaseStreamFrameSent && i < BaseStreamFrameSent + CHANNELS)
       {
-         if(stomp_topics[i - BaseStreamFrameSent][0])
+         word channel = i - BaseStreamFrameSent;
+         if(stomp_topics[CHANNEL_STREAM(channel)][0] && CHANNEL_CONSUMER(channel) < consumers)
          {
-            sprintf(zs1, "%s Frame Sent", stomp_topic_names[i - BaseStreamFrameSent]);
+            sprintf(zs1, "%s Frame Sent", channel_names[channel]);
             sprintf(zs, "%27s: %-14s ", zs1, commas_q(stats[i]));
             strcat(zs, commas_q(grand_stats[i]));
             _log(GENERAL, zs);
@@ -1897,6 +2396,23 @@ static void report_stats(void)
       stats[i] = 0;
    }
 
+   for(i = 0; i < CHANNELS; i++)
+   {
+      if(stomp_topics[CHANNEL_STREAM(i)][0] && CHANNEL_CONSUMER(i) < consumers)
+      {
+         struct histogram * h = &hist[i][HistAck];
+         sprintf(zs1, "%s Ack Latency", channel_names[i]);
+         sprintf(zs, "%27s: p50 %sms", zs1, commas_q(hist_percentile(h, 0.5) / 1000));
+         sprintf(zs + strlen(zs), "  p99 %sms", commas_q(hist_percentile(h, 0.99) / 1000));
+         sprintf(zs + strlen(zs), "  max %sms", commas_q(h->max / 1000));
+         _log(GENERAL, zs);
+         strcat(report, zs);
+         strcat(report, "\n");
+      }
+   }
+   memset(hist, 0, sizeof(hist));
+   hist_start = now;
+
    email_alert(NAME, BUILD, "Statistics Report", report);
 
    next_stats();
@@ -1907,7 +2423,7 @@ static void report_alarms(void)
    // Survey queues and report any alarms detected.
 
    char zs[128];
-   word head, too_old, stream;
+   word head, too_old, channel;
    char report[2048];
    qword oldest = 0;
 
@@ -1926,17 +2442,17 @@ static void report_alarms(void)
       strcat(report, "STOMP connection is down.\n");
    }
 
-   for(stream = 0; stream < STREAMS && !(*conf[conf_stompy_bin]); stream++)
+   for(channel = 0; channel < CHANNELS && !(*conf[conf_stompy_bin]); channel++)
    {
-      if(stomp_topics[stream][0])
+      if(stomp_topics[CHANNEL_STREAM(channel)][0] && CHANNEL_CONSUMER(channel) < consumers)
       {
          too_old = false;
-         if(disc_queue_length(stream)) 
+         if(disc_queue_length(channel)) 
          {
-            oldest = disc_queue_oldest(stream);
+            oldest = disc_queue_oldest(channel);
             too_old = time_us() - oldest > 0x80000000LL;  // About 36 minutes.
          }
-         if(too_old || stream_state[stream] != STREAM_RUN || s_number[stream][CLIENT] < 0)
+         if(too_old || stream_state[channel] != STREAM_RUN || s_number[channel][CLIENT] < 0)
          {
             if(head)
             {
@@ -1946,17 +2462,17 @@ static void report_alarms(void)
             }
          }
 
-         if(s_number[stream][CLIENT] < 0)
+         if(s_number[channel][CLIENT] < 0)
          {
-            sprintf(zs, "Stream %d (%s) client connection is down.", stream, stomp_topic_names[stream]);
+            sprintf(zs, "Channel %d (%s) client connection is down.", channel, channel_names[channel]);
             _log(GENERAL, zs);
             strcat(report, zs);
             strcat(report, "\n");
          }
 
-         if(stream_state[stream] != STREAM_RUN)
+         if(stream_state[channel] != STREAM_RUN)
          {
-            sprintf(zs, "Stream %d (%s) is currently routing messages to disc.  %d messages on disc.", stream, stomp_topic_names[stream], disc_queue_length(stream));
+            sprintf(zs, "Channel %d (%s) is currently routing messages to disc.  %d messages on disc.", channel, channel_names[channel], disc_queue_length(channel));
             _log(GENERAL, zs);
             strcat(report, zs);
             strcat(report, "\n");
@@ -1965,7 +2481,7 @@ static void report_alarms(void)
          {
             oldest /= 1000;
             oldest /= 1000; // Gives seconds
-            sprintf(zs, "Stream %d (%s) oldest message in disc queue is stamped %s.", stream, stomp_topic_names[stream], time_text(oldest, true));
+            sprintf(zs, "Channel %d (%s) oldest message in disc queue is stamped %s.", channel, channel_names[channel], time_text(oldest, true));
             _log(GENERAL, zs);
             strcat(report, zs);
             strcat(report, "\n");
@@ -2069,7 +2585,8 @@ static void report_rates(const char * const m)
          // Calculate frames on disc
          inst[CountOnDisc] = inst[CountOnDisc] + inst[CountDiscWrite] - inst[CountDiscRead];
 
-         for(i=0; i < STREAMS; i++) inst[BaseCountStreamRX + i] = inst[BaseCountStreamTX + i] = 0LL;
+         for(i=0; i < STREAMS; i++) inst[BaseCountStreamRX + i] = 0LL;
+         for(i=0; i < CHANNELS; i++) inst[BaseCountStreamTX + i] = 0LL;
 
          {
             word i;
@@ -2084,7 +2601,7 @@ static void report_rates(const char * const m)
             fprintf(rates_fp, "%5s  %5llu  %5llu%8s ", show_percent(&inst[StartDisc], &inst[TotalDisc], period_length, now), inst[CountDiscWrite], inst[CountDiscRead], commas_q(inst[CountOnDisc]));
             inst[StartPeriod] = now;
             inst[TotalIdle] = inst[TotalDisc] = inst[CountDiscWrite] = inst[CountDiscRead] = 0LL;
-            for(i = 0; i < STREAMS;i++) inst[BaseTotalWaitClientAck + i] = 0LL;
+            for(i = 0; i < CHANNELS;i++) inst[BaseTotalWaitClientAck + i] = 0LL;
          }
          fprintf(rates_fp, "|");
          // Bodge.  Don't do flow checking unless both "busy" streams are enabled.
@@ -2158,22 +2675,28 @@ static void next_alarms(void)
 
 static void report_status(void)
 {
-   word stream, dql;
+   word channel, dql;
    char * ss[] = {"Disc", "Run", "Lock"};
    char * cs[] = {"Idle", "Await ack", "Run"}; 
    _log(GENERAL, "System status:");
-   _log(GENERAL, "Frame buffers free %d.", queue_length(STREAMS));
-   _log(GENERAL, "STOMP:  Manager state %d, read state %d, read buffer %sowned, socket %d.", stomp_manager_state, stomp_read_state, stomp_read_buffer?"":"not ", s_stomp);
-   for(stream = 0; stream < STREAMS; stream++)
    {
-      if(stomp_topics[stream][0])
+      char allocated[64], idle[64];
+      strcpy(allocated, commas_q(buffer_allocated));
+      strcpy(idle, commas_q(buffer_idle));
+      _log(GENERAL, "Frame buffers:  %s bytes allocated, of which %s free for reuse.  Budget %s bytes.", allocated, idle, commas_q(buffer_budget));
+   }
+   _log(GENERAL, "STOMP:  Manager state %d, read state %d, %ld bytes buffered, socket %d.", stomp_manager_state, stomp_read_state, stomp_rx_on, s_stomp);
+   for(channel = 0; channel < CHANNELS; channel++)
+   {
+      if(stomp_topics[CHANNEL_STREAM(channel)][0] && CHANNEL_CONSUMER(channel) < consumers)
       {
-         dql = disc_queue_length(stream);
-         _log(GENERAL, "Stream %d (%s): Server socket %d, client socket %d, frames in queue %d, on disc %d.", stream, stomp_topic_names[stream], s_number[stream][SERVER], s_number[stream][CLIENT], queue_length(stream), dql);
-         _log(GENERAL, "   Stream state %d (%s), client state %d (%s), length %ld, index %ld.", stream_state[stream], ss[stream_state[stream]], client_state[stream], cs[client_state[stream]], client_length[stream], client_index[stream]);
+         dql = disc_queue_length(channel);
+         _log(GENERAL, "Channel %d (%s): Server socket %d, client socket %d, frames in queue %u, on disc %d.", channel, channel_names[channel], s_number[channel][SERVER], s_number[channel][CLIENT], queue_length(channel), dql);
+         _log(GENERAL, "   Stream state %d (%s), client state %d (%s), length %ld, index %ld.", stream_state[channel], ss[stream_state[channel]], client_state[channel], cs[client_state[channel]], client_length[channel], client_index[channel]);
+         _log(GENERAL, "   Client window %d, frames sent %d, acked %d%s.", client_window[channel], client_seq_sent[channel], client_seq_acked[channel], client_ring[channel]?", through ring":"");
          if(dql) 
          {
-            qword oldest = disc_queue_oldest(stream);
+            qword oldest = disc_queue_oldest(channel);
             oldest /= 1000;
             oldest /= 1000;
             _log(GENERAL, "   Oldest message in disc queue is stamped %s.", time_text(oldest, true));
@@ -2229,43 +2752,105 @@ static void init_buffers_queues(void)
    word s;
    _log(PROC, "init_buffers_queues()");
 
-   for(s = 0; s < BUFFERS - 1; s++)
+   for(s = 0; s < BUFFER_CLASSES; s++)
    {
-      buffers[s].next = &buffers[s + 1];
+      empty_list[s] = NULL;
    }
-   buffers[s].next = NULL;
-   empty_list = buffers;
+   buffer_allocated = buffer_idle = 0;
 
-   for(s = 0; s < STREAMS; s++)
+   for(s = 0; s < CHANNELS; s++)
    {
       stream_q_on[s] = NULL;
       stream_q_off[s] = NULL;
    }
 }
 
-static struct frame_buffer * new_buffer(void)
+static size_t buffer_size(const word class)
+{
+   // Frame capacity of buffers in a class, including the \0.
+   if(class >= BUFFER_CLASSES - 1) return FRAME_SIZE;
+   return 1024 << class;
+}
+
+static struct frame_buffer * new_buffer(const size_t length)
 {
-   _log(PROC, "new_buffer()");
-   struct frame_buffer * result = empty_list;
-   if(result) empty_list = result->next;
-   if(!result) _log(DEBUG, "new_buffer():  No buffers available.");
+   // Get a buffer able to hold length bytes, including the \0.  Returns NULL if that would exceed the budget.
+   _log(PROC, "new_buffer(%ld)", length);
+   struct frame_buffer * result;
+   word class, c;
+   size_t cost;
+
+   if(length > FRAME_SIZE) return NULL;
+   for(class = 0; buffer_size(class) < length; class++);
+
+   if((result = empty_list[class]))
+   {
+      empty_list[class] = result->next[0];
+      buffer_idle -= sizeof(struct frame_buffer) + buffer_size(class);
+      result->refs = 1;
+      return result;
+   }
+
+   cost = sizeof(struct frame_buffer) + buffer_size(class);
+   // Release free buffers of other classes to make room.
+   for(c = 0; c < BUFFER_CLASSES && buffer_allocated + cost > buffer_budget; c++)
+   {
+      while(empty_list[c] && buffer_allocated + cost > buffer_budget)
+      {
+         result = empty_list[c];
+         empty_list[c] = result->next[0];
+         buffer_allocated -= sizeof(struct frame_buffer) + buffer_size(c);
+         buffer_idle      -= sizeof(struct frame_buffer) + buffer_size(c);
+         free(result);
+      }
+   }
+   if(buffer_allocated + cost > buffer_budget)
+   {
+      _log(DEBUG, "new_buffer():  No buffers available.");
+      return NULL;
+   }
+   if(!(result = malloc(cost)))
+   {
+      _log(CRITICAL, "new_buffer():  Failed to allocate %ld bytes.", cost);
+      return NULL;
+   }
+   result->class = class;
+   result->refs = 1;
+   buffer_allocated += cost;
    return result;
 }
 
 void free_buffer(struct frame_buffer * const b)
 {
    _log(PROC, "free_buffer(~)");
-   b->next = empty_list;
-   empty_list = b;
+   if(b->refs > 1)
+   {
+      // Still held by another channel.
+      b->refs--;
+      return;
+   }
+   b->refs = 0;
+   b->next[0] = empty_list[b->class];
+   empty_list[b->class] = b;
+   buffer_idle += sizeof(struct frame_buffer) + buffer_size(b->class);
+}
+
+static word buffer_available(const size_t length)
+{
+   // True if new_buffer(length) would succeed.
+   word class;
+
+   for(class = 0; buffer_size(class) < length; class++);
+   return empty_list[class] || buffer_allocated - buffer_idle + sizeof(struct frame_buffer) + buffer_size(class) <= buffer_budget;
 }
 
 static void enqueue(const word s, struct frame_buffer * const b)
 {
    _log(PROC, "enqueue(%d, ~)", s);
-   if(stream_q_on[s]) stream_q_on[s]->next = b;
+   if(stream_q_on[s]) QUEUE_NEXT(stream_q_on[s], s) = b;
    stream_q_on[s] = b;
    if(!stream_q_off[s]) stream_q_off[s] = b;
-   b->next = NULL;
+   QUEUE_NEXT(b, s) = NULL;
 }
 
 static struct frame_buffer * dequeue(const word s)
@@ -2274,7 +2859,7 @@ static struct frame_buffer * dequeue(const word s)
    struct frame_buffer * result = stream_q_off[s];
    if(result)
    {
-      stream_q_off[s] = result->next;
+      stream_q_off[s] = QUEUE_NEXT(result, s);
       if(stream_q_on[s] == result) stream_q_on[s] = NULL;
    }
    return result;
@@ -2289,100 +2874,53 @@ static struct frame_buffer * queue_front(const word s)
    return result;
 }
 
-static word queue_length(const word s)
+static dword queue_length(const word s)
 {
-   // Return length of queue for specified stream.  If s == STREAMS, return length of free queue
+   // Return length of queue for specified channel.
    _log(PROC, "queue_length(%d)", s);
    struct frame_buffer * b;
-   word result = 0;
-   if(s < STREAMS)
-   {
-      b = stream_q_off[s];
-   }
-   else
-   {
-      b = empty_list;
-   }
-   while(b && result < 999)
-   {
-      result++;
-      b = b->next;
-   }
+   dword result = 0;
+   for(b = stream_q_off[s]; b; b = QUEUE_NEXT(b, s)) result++;
    return result;
 }
 
 static void dump_buffer_to_disc(const word s, struct frame_buffer * const b)
 {
-   char filename[256];
-
-   word declash = 0;
-   int fd = -1;
-
-   ssize_t length = strlen(b->frame);
+   QUEUE_NEXT(b, s) = NULL;
+   spool_append(s, b);
+}
 
-   inst[StartDisc] = time_us();
+static word dump_queue_to_disc(const word s)
+{
+   // Note.  Entries at the front of the queue which have been sent and are awaiting ack, or are
+   // currently being transmitted, must not be dumped or freed, and must be left in the 
+   // queue.  They will only be freed when the client acks them.
+   _log(PROC, "dump_queue_to_disc(%d)", s);
+   struct frame_buffer * b, * next;
+   word r;
+   word keep = client_unacked(s) + ((client_state[s] == CLIENT_RUN)?1:0);
 
-   while(fd < 0 && declash < 100)
+   b = NULL;
+   if(keep)
    {
-      sprintf(filename, "%s/%lld_%02d", spool_path[s], b->stamp, declash++);
-      _log(DEBUG, "dump_buffer_to_disc():  Target filename \"%s\".", filename);
-
-      // O_EXCL -> open will fail if file already exists
-      fd = open(filename, O_WRONLY | O_CREAT | O_EXCL, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
-      if(fd < 0)
+      word i;
+      b = stream_q_off[s];
+      for(i = 1; i < keep && b; i++) b = QUEUE_NEXT(b, s);
+      if(b)
       {
-         _log(MAJOR, "Writing buffer to disc, failed to open \"%s\".  Error %d %s.", filename, errno, strerror(errno));
+         stream_q_on[s] = b;
+         next = QUEUE_NEXT(b, s);
+         QUEUE_NEXT(b, s) = NULL;
+         b = next;
       }
    }
-   
-   if(fd < 0)
-   {
-      _log(CRITICAL, "Writing buffer to disc, failed to open file after declashing attempted.  Error %d %s.", errno, strerror(errno));
-   }
    else
    {
-      ssize_t l, done;
-      done = 0;
-      while (done < length)
-      {
-         l = write(fd, b->frame + done, length - done);
-         if(l < 0)
-         {
-            _log(CRITICAL, "dump_buffer_to_disc()  Failed during write to \"%s\".  Error %d %s.", filename, errno, strerror(errno));
-            done = length;
-         }
-         else
-         {
-            done += l;
-         }
-      }
-      close(fd);
-      stats[DiscWrite]++;
-      inst[TotalDisc] += (time_us() - inst[StartDisc]);
-      inst[StartDisc] = 0LL;
-      inst[CountDiscWrite]++;
+      b = stream_q_off[s];
+      stream_q_off[s] = stream_q_on[s] = NULL;
    }
 
-   free_buffer(b);   
-}
-
-static word dump_queue_to_disc(const word s)
-{
-   // Note.  If the front entry is currently being transmitted or is awaiting ack,
-   // it must not be dumped or freed, and must be left in the 
-   // queue.  It will only be freed when the client acks it.
-   _log(PROC, "dump_queue_to_disc(%d)", s);
-   struct frame_buffer * b, * requeue = NULL;
-   word r = 0;
-
-   if(client_state[s] != CLIENT_IDLE) requeue = dequeue(s);
-
-   while((b = dequeue(s)))
-   {
-      dump_buffer_to_disc(s, b);
-      r++;
-   }
-   if(client_state[s] != CLIENT_IDLE && requeue) enqueue(s, requeue);
+   r = spool_append(s, b);
 
    _log(DEBUG, "dump_queue_to_disc(%d) returns %d", s, r);
    return r;
@@ -2390,24 +2928,37 @@ static word dump_queue_to_disc(const word s)
    
 static int is_a_buffer(const struct dirent *d)
 {
-   if(d->d_name[0] >= '0' && d->d_name[0] <= '9')
+   // Frame files from the old one-file-per-frame spool
+   if(d->d_name[0] >= '0' && d->d_name[0] <= '9' && strchr(d->d_name, '_'))
+      return 1;
+   return 0;
+}
+
+static int is_a_segment(const struct dirent *d)
+{
+   size_t l = strlen(d->d_name);
+   if(d->d_name[0] >= '0' && d->d_name[0] <= '9' && l > 4 && !strcmp(d->d_name + l - 4, ".seg"))
       return 1;
    return 0;
 }
 
 static void load_buffer_from_disc(struct frame_buffer * const b, const word s, const char * const name)
 {
+   // Load a frame file from the old one-file-per-frame spool.
    // NB if returned buffer has ->stamp==0 this indicates failure.
-   char filepath[256], newpath[256];
+   // name is a d_name, of up to 255 characters.
+   char filepath[sizeof(spool_path[0]) + 256], newpath[64 + 256];
    _log(PROC, "load_buffer_from_disc(~, %d, \"%s\")", s, name);
 
-   sprintf(filepath, "%s/%s", spool_path[s], name);
-   _log(DEBUG, "load_buffer_from_disc():  Target filename \"%s\".", filepath);
-
    b->frame[0] = '\0';
    b->stamp = 0;
 
-   inst[StartDisc] = time_us();
+   if((size_t) snprintf(filepath, sizeof(filepath), "%s/%s", spool_path[s], name) >= sizeof(filepath))
+   {
+      _log(CRITICAL, "load_buffer_from_disc():  Path of \"%s\" too long.", name);
+      return;
+   }
+   _log(DEBUG, "load_buffer_from_disc():  Target filename \"%s\".", filepath);
 
    int fd = open(filepath, O_RDONLY);
    if(fd < 0)
@@ -2445,7 +2996,6 @@ static void load_buffer_from_disc(struct frame_buffer * const b, const word s, c
             b->stamp = atoll(name);
             b->frame[length] = 0; // Append the \0.
             _log(DEBUG, "load_buffer_from_disc(): Successfully read %ld bytes with stamp %lld.", length, b->stamp);
-            stats[DiscRead]++;
          }
       }
       close(fd);
@@ -2453,18 +3003,14 @@ static void load_buffer_from_disc(struct frame_buffer * const b, const word s, c
       // Now "delete" the file
       if(debug)
       {
-         sprintf(newpath, "/tmp/stompy-%d-%s", s, name);
-         rename(filepath, newpath);
+         if((size_t) snprintf(newpath, sizeof(newpath), "/tmp/stompy-%d-%s", s, name) < sizeof(newpath)) rename(filepath, newpath);
+         else unlink(filepath);
       }
       else
       {
          if(unlink(filepath))
-            _log(MAJOR, "Failed to delete \"%s\" from disc.  Error %d %s.", errno, strerror(errno));
+            _log(MAJOR, "Failed to delete \"%s\" from disc.  Error %d %s.", filepath, errno, strerror(errno));
       }
-
-      inst[TotalDisc] += (time_us() - inst[StartDisc]);
-      inst[StartDisc] = 0LL;
-      inst[CountDiscRead]++;
    }
 }
 
@@ -2473,130 +3019,737 @@ static word load_queue_from_disc(const word s)
    // returns number loaded
    _log(PROC, "load_queue_from_disc(%d)", s);
    word result = 0;
-   struct dirent **eps;
    struct frame_buffer * b;
+   struct spool_header h;
+   const char * frame;
+   off_t next;
+   word last;
+   int r;
 
-   // Get some file names
    inst[StartDisc] = time_us();
-   int n = scandir (spool_path[s], &eps, is_a_buffer, alphasort);
-   inst[TotalDisc] += (time_us() - inst[StartDisc]);
-   inst[StartDisc] = 0LL;
 
-   if (n >= 0)
+   while(spool[s].count && result < LOAD_BATCH)
    {
-      int cnt;
-      for (cnt = 0; cnt < n && cnt < BUFFERS / 2; cnt++)
+      r = spool_read_frame(s, spool[s].fd_read, spool[s].seg_read, spool[s].off_read, spool[s].skip, &h, &frame, &next, &last);
+      if(r > 0 && spool[s].seg_read != spool[s].seg_write)
       {
-         if( (b = new_buffer()) )
+         // End of this segment
+         spool_next_read_segment(s);
+         continue;
+      }
+      b = NULL;
+      if(!r)
+      {
+         if(!(b = new_buffer(h.length + 1))) break;
+         if(frame)
          {
-            _log(DEBUG, "Loading \"%s\".", eps[cnt]->d_name);
-            load_buffer_from_disc(b, s, eps[cnt]->d_name);
-            if(b->stamp)
-            {
-               enqueue(s, b);
-               result++;
-            }
-            else
-            {
-               free_buffer(b);
-            }
+            memcpy(b->frame, frame, h.length);
+         }
+         else if(pread(spool[s].fd_read, b->frame, h.length, spool[s].off_read + sizeof(h)) != h.length)
+         {
+            free_buffer(b);
+            b = NULL;
          }
-         free(eps[cnt]);
-      }  
-      for(;cnt < n; cnt++)
+      }
+      if(!b)
       {
-         free(eps[cnt]);
-      }         
-      free(eps);
+         _log(CRITICAL, "Spool for channel %d damaged in segment %u at offset %ld.  %u frames abandoned.", s, spool[s].seg_read, spool[s].off_read, spool[s].count);
+         while(spool[s].seg_read != spool[s].seg_write) spool_next_read_segment(s);
+         spool[s].off_read = spool[s].off_write;
+         spool[s].skip = 0;
+         spool[s].count = 0;
+      }
+      else
+      {
+         b->frame[h.length] = '\0';
+         b->stamp = h.stamp;
+         enqueue(s, b);
+         if(last)
+         {
+            spool[s].off_read = next;
+            spool[s].skip = 0;
+         }
+         else
+         {
+            spool[s].skip++;
+         }
+         spool[s].count--;
+         result++;
+         stats[DiscRead]++;
+         inst[CountDiscRead]++;
+      }
    }
-   else
+
+   if(!spool[s].count)
    {
-      // Couldn't open the directory");
-      _log(CRITICAL, "load_queue_from_disc() failed to open directory \"%s\".  Error %d %s.  Fatal", spool_path[s], errno, strerror(errno));
-      run = false;
+      // Spool is empty.  Start again at the beginning of the current segment.
+      while(spool[s].seg_read != spool[s].seg_write) spool_next_read_segment(s);
+      if(spool[s].fd_write >= 0 && ftruncate(spool[s].fd_write, 0))
+      {
+         _log(MAJOR, "Failed to truncate spool segment %u for channel %d.  Error %d %s.", spool[s].seg_write, s, errno, strerror(errno));
+      }
+      spool[s].off_read = spool[s].off_write = 0;
+      spool[s].skip = 0;
+      spool[s].block_valid = false;
    }
+   spool_save_cursor(s);
 
-   _log(DEBUG, "load_queue_from_disc() returns %d", result);
-   return result;
+   hist_record(&hist[s][HistReload], time_us() - inst[StartDisc]);
+   inst[TotalDisc] += (time_us() - inst[StartDisc]);
+   inst[StartDisc] = 0LL;
+
+   _log(DEBUG, "load_queue_from_disc() returns %d", result);
+   return result;
 }
 
 static int disc_queue_length(const word s)
 {
-   // returns number found, or -1 for error.
-   // _log(PROC, "disc_queue_length(%d)", s);
+   _log(PROC, "disc_queue_length(%d) returns %u.", s, spool[s].count);
+   return spool[s].count;
+}
+
+static qword disc_queue_oldest(const word s)
+{
+   // returns timestamp of oldest disc buffer.  Units are microseconds.
+   // Or 0 for none found or error.
+   struct spool_header h;
+   const char * frame;
+   off_t next;
+   word last;
+   int fd, r;
+
+   if(!spool[s].count) return 0;
+
+   r = spool_read_frame(s, spool[s].fd_read, spool[s].seg_read, spool[s].off_read, spool[s].skip, &h, &frame, &next, &last);
+   if(r > 0 && spool[s].seg_read != spool[s].seg_write)
+   {
+      // Cursor is at the end of a segment, oldest is at the start of the next.
+      if((fd = spool_segment_open(s, spool[s].seg_read + 1, O_RDONLY)) < 0) return 0;
+      r = spool_read_frame(s, fd, spool[s].seg_read + 1, 0, 0, &h, &frame, &next, &last);
+      close(fd);
+   }
+   if(r) return 0;
+   return h.stamp;
+}
+
+static int spool_open(const word s)
+{
+   // Open the spool for channel s and scan it.  Any torn record at the end of a segment, which can only be
+   // the result of a crash part way through a write, is truncated away.  Frame files left by the old
+   // one-file-per-frame spool are appended.
+   // Returns 0 on success.
    struct dirent **eps;
-   int result, i;
+   struct spool_cursor c;
+   struct spool_block k;
+   char filepath[1100];
+   dword first, last, seg;
+   off_t offset, size;
+   int n, i, fd;
 
-   // Get some file names
-   inst[StartDisc] = time_us();
-   result = scandir (spool_path[s], &eps, is_a_buffer, alphasort);
-   inst[TotalDisc] += (time_us() - inst[StartDisc]);
-   inst[StartDisc] = 0LL;
-   if(result >=0)
+   _log(PROC, "spool_open(%d)", s);
+
+   spool[s].fd_write = spool[s].fd_read = spool[s].fd_cursor = -1;
+   spool[s].count = 0;
+   spool[s].dirty = false;
+   spool[s].block_valid = false;
+
+   first = last = 0;
+   n = scandir(spool_path[s], &eps, is_a_segment, alphasort);
+   if(n < 0)
+   {
+      _log(CRITICAL, "Failed to scan spool directory \"%s\".  Error %d %s.", spool_path[s], errno, strerror(errno));
+      return 1;
+   }
+   for(i = 0; i < n; i++)
+   {
+      seg = strtoul(eps[i]->d_name, NULL, 10);
+      if(!i || seg < first) first = seg;
+      if(!i || seg > last)  last  = seg;
+      free(eps[i]);
+   }
+   free(eps);
+
+   sprintf(filepath, "%s/cursor", spool_path[s]);
+   if((spool[s].fd_cursor = open(filepath, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH)) < 0)
+   {
+      _log(CRITICAL, "Failed to open spool cursor \"%s\".  Error %d %s.", filepath, errno, strerror(errno));
+      return 1;
+   }
+   if(n && pread(spool[s].fd_cursor, &c, sizeof(c), 0) == sizeof(c) && c.segment >= first && c.segment <= last)
+   {
+      spool[s].seg_read = c.segment;
+      spool[s].off_read = c.offset;
+      spool[s].skip     = c.skip;
+   }
+   else
+   {
+      spool[s].seg_read = first;
+      spool[s].off_read = 0;
+      spool[s].skip     = 0;
+   }
+
+   // Segments before the cursor have been consumed
+   for(seg = first; seg < spool[s].seg_read; seg++) spool_retire_segment(s, seg);
+
+   // Scan the unread records
+   for(seg = spool[s].seg_read; seg <= last; seg++)
+   {
+      if((fd = spool_segment_open(s, seg, O_RDWR | O_CREAT)) < 0) return 1;
+      size = lseek(fd, 0, SEEK_END);
+      offset = 0;
+      if(seg == spool[s].seg_read)
+      {
+         if(spool[s].off_read > size) spool[s].off_read = size;
+         offset = spool[s].off_read;
+      }
+      // A frame record and a block header are the same size, so either can be read into k.
+      while(offset + (off_t) sizeof(k) <= size && pread(fd, &k, sizeof(k), offset) == sizeof(k))
+      {
+         word at_cursor = (seg == spool[s].seg_read && offset == spool[s].off_read);
+         if(k.magic == SPOOL_MAGIC && k.length < FRAME_SIZE && offset + (off_t) sizeof(struct spool_header) + k.length <= size)
+         {
+            if(at_cursor) spool[s].skip = 0;
+            offset += sizeof(struct spool_header) + k.length;
+            spool[s].count++;
+         }
+         else if(k.magic == SPOOL_BLOCK_MAGIC && k.frames && k.frames <= SPOOL_BATCH && k.raw <= SPOOL_BLOCK_SIZE
+                 && k.length <= SPOOL_DEFLATE_SIZE && offset + (off_t) sizeof(k) + k.length <= size)
+         {
+            offset += sizeof(k) + k.length;
+            if(at_cursor && spool[s].skip >= k.frames)
+            {
+               // Every frame in the block has been taken.  Read on from the next record.
+               spool[s].off_read = offset;
+               spool[s].skip = 0;
+            }
+            else
+            {
+               spool[s].count += k.frames - (at_cursor?spool[s].skip:0);
+            }
+         }
+         else
+         {
+            break;
+         }
+      }
+      if(offset < size)
+      {
+         _log(MAJOR, "Spool segment %u for channel %d is damaged at offset %ld.  Truncated, %ld bytes discarded.", seg, s, offset, size - offset);
+         if(ftruncate(fd, offset))
+         {
+            _log(CRITICAL, "Failed to truncate spool segment %u for channel %d.  Error %d %s.", seg, s, errno, strerror(errno));
+         }
+      }
+      if(seg == last)
+      {
+         spool[s].fd_write = fd;
+         spool[s].seg_write = seg;
+         spool[s].off_write = offset;
+      }
+      else
+      {
+         close(fd);
+      }
+   }
+
+   if((spool[s].fd_read = spool_segment_open(s, spool[s].seg_read, O_RDONLY)) < 0) return 1;
+
+   // Pick up any frames from the old style spool
+   n = scandir(spool_path[s], &eps, is_a_buffer, alphasort);
+   if(n > 0)
    {
-      for(i = 0; i < result; i++)
+      struct frame_buffer * b;
+      _log(GENERAL, "Converting %d old style spool files for channel %d.", n, s);
+      for(i = 0; i < n; i++)
       {
+         if((b = new_buffer(FRAME_SIZE)))
+         {
+            load_buffer_from_disc(b, s, eps[i]->d_name);
+            if(b->stamp)
+            {
+               QUEUE_NEXT(b, s) = NULL;
+               spool_append(s, b);
+            }
+            else
+            {
+               free_buffer(b);
+            }
+         }
          free(eps[i]);
       }
       free(eps);
    }
+   else if(!n)
+   {
+      free(eps);
+   }
 
-   _log(PROC, "disc_queue_length(%d) returns %d.", s, result);
-   return result;
+   spool_save_cursor(s);
+   _log(GENERAL, "Spool for channel %d opened.  Segments %u to %u, %u frames on disc.", s, spool[s].seg_read, spool[s].seg_write, spool[s].count);
+   return 0;
 }
 
-static qword disc_queue_oldest(const word s)
+static void spool_close(const word s)
 {
-   // returns timestamp of oldest disc buffer.  Units are microseconds.
-   // Or 0 for none found or error.
-   struct dirent **eps;
-   qword result = 0;
-   int n, i;
+   _log(PROC, "spool_close(%d)", s);
+   spool_save_cursor(s);
+   if(spool[s].fd_write  >= 0 && fdatasync(spool[s].fd_write))
+      _log(MAJOR, "Failed to sync spool segment %u for channel %d.  Error %d %s.", spool[s].seg_write, s, errno, strerror(errno));
+   if(spool[s].fd_cursor >= 0 && fdatasync(spool[s].fd_cursor))
+      _log(MAJOR, "Failed to sync spool cursor for channel %d.  Error %d %s.", s, errno, strerror(errno));
+   if(spool[s].fd_write  >= 0) close(spool[s].fd_write);
+   if(spool[s].fd_read   >= 0) close(spool[s].fd_read);
+   if(spool[s].fd_cursor >= 0) close(spool[s].fd_cursor);
+   spool[s].fd_write = spool[s].fd_read = spool[s].fd_cursor = -1;
+   free(spool[s].block);
+   spool[s].block = NULL;
+   spool[s].block_valid = false;
+}
+
+static int spool_segment_open(const word s, const dword segment, const int flags)
+{
+   char filepath[1100];
+   int fd;
+
+   sprintf(filepath, "%s/%08u.seg", spool_path[s], segment);
+   if((fd = open(filepath, flags, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH)) < 0)
+   {
+      _log(CRITICAL, "Failed to open spool segment \"%s\".  Error %d %s.", filepath, errno, strerror(errno));
+   }
+   return fd;
+}
+
+static void spool_retire_segment(const word s, const dword segment)
+{
+   char filepath[1100], newpath[1100];
+
+   sprintf(filepath, "%s/%08u.seg", spool_path[s], segment);
+   if(debug)
+   {
+      sprintf(newpath, "/tmp/stompy-%d-%08u.seg", s, segment);
+      rename(filepath, newpath);
+   }
+   else if(unlink(filepath) && errno != ENOENT)
+   {
+      _log(MAJOR, "Failed to delete spool segment \"%s\".  Error %d %s.", filepath, errno, strerror(errno));
+   }
+}
+
+static void spool_next_read_segment(const word s)
+{
+   // Move the read cursor to the start of the next segment and delete the one it has finished with.
+   dword done = spool[s].seg_read;
+
+   if(spool[s].fd_read >= 0) close(spool[s].fd_read);
+   spool[s].seg_read++;
+   spool[s].off_read = 0;
+   spool[s].skip = 0;
+   spool_save_cursor(s);
+   spool_retire_segment(s, done);
+   spool[s].fd_read = spool_segment_open(s, spool[s].seg_read, O_RDONLY);
+}
+
+static word spool_append(const word s, struct frame_buffer * b)
+{
+   // Append a chain of frames to the spool and release the buffers.  Up to SPOOL_BATCH frames, and no more than
+   // SPOOL_BLOCK_SIZE bytes of records, are compressed into a block and written with a single write.  If they
+   // can't be compressed they are written as plain records instead.  Returns number of buffers freed.
+   struct spool_header h[SPOOL_BATCH];
+   struct spool_block k;
+   struct iovec iov[SPOOL_BATCH * 2];
+   struct frame_buffer * batch[SPOOL_BATCH];
+   word n, i, count, result = 0;
+   off_t length;
+   int z;
+
+   if(!b) return 0;
 
-   // Get some file names
    inst[StartDisc] = time_us();
-   n = scandir(spool_path[s], &eps, is_a_buffer, alphasort);
+
+   if(!spool_deflate_ready)
+   {
+      if(deflateInit(&spool_deflate, Z_BEST_SPEED) == Z_OK) spool_deflate_ready = true;
+      else _log(MAJOR, "Failed to initialise spool compression.  Frames will be spooled uncompressed.");
+   }
+
+   while(b)
+   {
+      if(spool[s].off_write >= SPOOL_SEGMENT_SIZE)
+      {
+         // Start a new segment
+         if(spool[s].fd_write >= 0)
+         {
+            if(fdatasync(spool[s].fd_write)) _log(MAJOR, "Failed to sync spool segment %u for channel %d.  Error %d %s.", spool[s].seg_write, s, errno, strerror(errno));
+            close(spool[s].fd_write);
+         }
+         spool[s].seg_write++;
+         spool[s].off_write = 0;
+         spool[s].fd_write = spool_segment_open(s, spool[s].seg_write, O_RDWR | O_CREAT | O_TRUNC);
+      }
+
+      length = 0;
+      for(n = 0; b && n < SPOOL_BATCH; n++)
+      {
+         h[n].length = strlen(b->frame);
+         if(n && length + sizeof(h[n]) + h[n].length > SPOOL_BLOCK_SIZE) break;
+         h[n].magic  = SPOOL_MAGIC;
+         h[n].stamp  = b->stamp;
+         iov[2 * n].iov_base     = &h[n];
+         iov[2 * n].iov_len      = sizeof(h[n]);
+         iov[2 * n + 1].iov_base = b->frame;
+         iov[2 * n + 1].iov_len  = h[n].length;
+         length += sizeof(h[n]) + h[n].length;
+         batch[n] = b;
+         b = QUEUE_NEXT(b, s);
+      }
+      count = 2 * n;
+
+      if(spool_deflate_ready)
+      {
+         deflateReset(&spool_deflate);
+         spool_deflate.next_out  = (Bytef *) spool_deflated;
+         spool_deflate.avail_out = SPOOL_DEFLATE_SIZE;
+         z = Z_OK;
+         for(i = 0; i < count && z == Z_OK; i++)
+         {
+            spool_deflate.next_in  = (Bytef *) iov[i].iov_base;
+            spool_deflate.avail_in = iov[i].iov_len;
+            z = deflate(&spool_deflate, (i + 1 < count)?Z_NO_FLUSH:Z_FINISH);
+         }
+         if(z == Z_STREAM_END)
+         {
+            k.magic  = SPOOL_BLOCK_MAGIC;
+            k.length = spool_deflate.total_out;
+            k.raw    = length;
+            k.frames = n;
+            iov[0].iov_base = &k;
+            iov[0].iov_len  = sizeof(k);
+            iov[1].iov_base = spool_deflated;
+            iov[1].iov_len  = k.length;
+            count = 2;
+            length = sizeof(k) + k.length;
+         }
+         else
+         {
+            _log(MAJOR, "Failed to compress %d frames for channel %d, zlib error %d.  Written uncompressed.", n, s, z);
+         }
+      }
+
+      if(spool[s].fd_write < 0 || spool_write_all(spool[s].fd_write, iov, count, spool[s].off_write) < 0)
+      {
+         _log(CRITICAL, "Failed to write %d frames to spool segment %u for channel %d.  Error %d %s.  Frames lost.", n, spool[s].seg_write, s, errno, strerror(errno));
+         if(spool[s].fd_write >= 0 && ftruncate(spool[s].fd_write, spool[s].off_write))
+         {
+            _log(CRITICAL, "Failed to truncate spool segment %u for channel %d.  Error %d %s.", spool[s].seg_write, s, errno, strerror(errno));
+         }
+      }
+      else
+      {
+         spool[s].off_write += length;
+         spool[s].count += n;
+         spool[s].dirty = true;
+         stats[DiscWrite] += n;
+         inst[CountDiscWrite] += n;
+      }
+
+      for(i = 0; i < n; i++) free_buffer(batch[i]);
+      result += n;
+   }
+
+   hist_record(&hist[s][HistSpill], time_us() - inst[StartDisc]);
    inst[TotalDisc] += (time_us() - inst[StartDisc]);
    inst[StartDisc] = 0LL;
 
-   if(n > 0)
+   return result;
+}
+
+static int spool_read_frame(const word s, const int fd, const dword seg, const off_t offset, const dword skip, struct spool_header * const h, const char ** const frame, off_t * const next, word * const last)
+{
+   // Find frame number skip of the record at offset in segment seg, and fill in its header.  For a block, *frame
+   // points at the frame in the inflated block.  For a plain record it is NULL and the frame follows the header on
+   // disc.  *next is the offset of the following record and *last is set if this is the last frame of its record.
+   // Returns 0 on success, 1 at the end of the segment or -1 if the spool is damaged.
+   struct spool_block k;
+   const char * p;
+   dword i;
+   ssize_t l;
+
+   *frame = NULL;
+   l = pread(fd, &k, sizeof(k), offset);
+   if(l == 0) return 1;
+   if(l != sizeof(k)) return -1;
+
+   if(k.magic == SPOOL_MAGIC)
    {
-      result = atoll(eps[0]->d_name);
+      memcpy(h, &k, sizeof(*h));
+      if(skip || h->length >= FRAME_SIZE) return -1;
+      *next = offset + sizeof(*h) + h->length;
+      *last = true;
+      return 0;
    }
-   if(n >= 0)
+
+   if(k.magic != SPOOL_BLOCK_MAGIC || skip >= k.frames) return -1;
+   if(!spool[s].block_valid || spool[s].block_seg != seg || spool[s].block_off != offset)
    {
-      for(i = 0; i < n; i++)
+      if(spool_inflate_block(s, fd, seg, offset, &k)) return -1;
+   }
+   // The records in the block were checked when it was inflated.
+   p = spool[s].block;
+   for(i = 0; i < skip; i++) p += sizeof(*h) + ((const struct spool_header *) p)->length;
+   memcpy(h, p, sizeof(*h));
+   *frame = p + sizeof(*h);
+   *next = offset + sizeof(k) + k.length;
+   *last = (skip + 1 >= k.frames);
+   return 0;
+}
+
+static int spool_inflate_block(const word s, const int fd, const dword seg, const off_t offset, const struct spool_block * const k)
+{
+   // Read and inflate the block at offset in segment seg into spool[s].block, and check the frame records in it.
+   // Returns 0 on success.
+   uLongf raw = SPOOL_BLOCK_SIZE;
+   const struct spool_header * h;
+   size_t i;
+   dword n;
+   int z;
+
+   spool[s].block_valid = false;
+   if(k->raw > SPOOL_BLOCK_SIZE || k->length > SPOOL_DEFLATE_SIZE) return -1;
+   if(!spool[s].block && !(spool[s].block = malloc(SPOOL_BLOCK_SIZE)))
+   {
+      _log(CRITICAL, "Failed to allocate spool block for channel %d.", s);
+      return -1;
+   }
+   if(pread(fd, spool_deflated, k->length, offset + sizeof(*k)) != k->length) return -1;
+   if((z = uncompress((Bytef *) spool[s].block, &raw, (Bytef *) spool_deflated, k->length)) != Z_OK || raw != k->raw)
+   {
+      _log(MAJOR, "Failed to inflate spool block for channel %d in segment %u at offset %ld, zlib error %d.", s, seg, offset, z);
+      return -1;
+   }
+
+   for(i = 0, n = 0; i + sizeof(*h) <= raw; n++)
+   {
+      h = (const struct spool_header *) (spool[s].block + i);
+      if(h->magic != SPOOL_MAGIC || h->length >= FRAME_SIZE) break;
+      i += sizeof(*h) + h->length;
+   }
+   if(i != raw || n != k->frames) return -1;
+
+   spool[s].block_seg = seg;
+   spool[s].block_off = offset;
+   spool[s].block_valid = true;
+   return 0;
+}
+
+static ssize_t spool_write_all(const int fd, struct iovec * iov, int count, const off_t offset)
+{
+   // pwritev() the whole of iov, carrying on after short writes.  Returns bytes written or -1.
+   ssize_t l, done = 0;
+
+   while(count > 0)
+   {
+      l = pwritev(fd, iov, count, offset + done);
+      if(l < 0)
       {
-         free(eps[i]);
+         if(errno == EINTR) continue;
+         return -1;
+      }
+      done += l;
+      while(count > 0 && (size_t) l >= iov->iov_len)
+      {
+         l -= iov->iov_len;
+         iov++;
+         count--;
+      }
+      if(count > 0)
+      {
+         iov->iov_base = (char *) iov->iov_base + l;
+         iov->iov_len -= l;
       }
-      free(eps);
    }
-   return result;
+   return done;
 }
 
-static void log_message(const word s)
+static void spool_save_cursor(const word s)
 {
-   FILE * fp;
-   
+   struct spool_cursor c;
+
+   if(spool[s].fd_cursor < 0) return;
+   memset(&c, 0, sizeof(c));
+   c.segment = spool[s].seg_read;
+   c.skip    = spool[s].skip;
+   c.offset  = spool[s].off_read;
+   if(pwrite(spool[s].fd_cursor, &c, sizeof(c), 0) != sizeof(c))
+   {
+      _log(MAJOR, "Failed to save spool cursor for channel %d.  Error %d %s.", s, errno, strerror(errno));
+   }
+   spool[s].dirty = true;
+}
+
+static void spool_sync(const word force)
+{
+   // Flush written spools to disc.  Called every SPOOL_SYNC_INTERVAL seconds so that a burst of frames
+   // shares one fsync.
+   word s;
+
+   if(!force && now < spool_sync_due) return;
+   spool_sync_due = now + SPOOL_SYNC_INTERVAL;
+
+   for(s = 0; s < CHANNELS; s++)
+   {
+      if(spool[s].dirty)
+      {
+         inst[StartDisc] = time_us();
+         if(spool[s].fd_write >= 0 && fdatasync(spool[s].fd_write))
+            _log(MAJOR, "Failed to sync spool segment %u for channel %d.  Error %d %s.", spool[s].seg_write, s, errno, strerror(errno));
+         if(spool[s].fd_cursor >= 0 && fdatasync(spool[s].fd_cursor))
+            _log(MAJOR, "Failed to sync spool cursor for channel %d.  Error %d %s.", s, errno, strerror(errno));
+         spool[s].dirty = false;
+         inst[TotalDisc] += (time_us() - inst[StartDisc]);
+         inst[StartDisc] = 0LL;
+      }
+   }
+}
+
+static void log_message(const word s, const struct frame_buffer * const b)
+{
+   // Add a frame to the message log buffer.  The writer thread does the rest.
+   char * p;
+   size_t length;
    time_t now = time(NULL);
    struct tm * broken = gmtime(&now);
-   
-   
-   if((fp = fopen(MESSAGE_LOG_FILEPATH, "a")))
+
+   if(!message_log_run) return;
+   length = strlen(b->frame);
+
+   pthread_mutex_lock(&message_log_lock);
+   message_log_report_error();
+   if(message_log_length + length + 256 > MESSAGE_LOG_BUFFER)
    {
-      fprintf(fp, "%02d/%02d/%02d %02d:%02d:%02dZ %s\n",
-              broken->tm_mday, 
-              broken->tm_mon + 1, 
-              broken->tm_year % 100,
-              broken->tm_hour,
-              broken->tm_min,
-              broken->tm_sec,
-              stomp_topic_names[s]);
-      fprintf(fp, "%s\n", client_buffer[s]->frame);
-      fclose(fp);
+      message_log_dropped++;
+      if(!message_log_dropping) _log(MAJOR, "Message log writer is behind.  Messages will be dropped.");
+      message_log_dropping = true;
+   }
+   else
+   {
+      p = message_log_buffer[message_log_active] + message_log_length;
+      p += sprintf(p, "%02d/%02d/%02d %02d:%02d:%02dZ %s\n",
+                   broken->tm_mday, 
+                   broken->tm_mon + 1, 
+                   broken->tm_year % 100,
+                   broken->tm_hour,
+                   broken->tm_min,
+                   broken->tm_sec,
+                   stomp_topic_names[s]);
+      memcpy(p, b->frame, length);
+      p[length] = '\n';
+      message_log_length = p + length + 1 - message_log_buffer[message_log_active];
+      message_log_dropping = false;
+   }
+   if(message_log_length > MESSAGE_LOG_BUFFER / 2) pthread_cond_signal(&message_log_wake);
+   pthread_mutex_unlock(&message_log_lock);
+}
+
+static void message_log_start(void)
+{
+   // Start the message log writer, if any stream is logged.
+   word i, wanted = false;
+
+   for(i = 0; i < STREAMS; i++) if(stomp_topic_log[i]) wanted = true;
+   if(!wanted) return;
+
+   if(!(message_log_buffer[0] = malloc(MESSAGE_LOG_BUFFER)) || !(message_log_buffer[1] = malloc(MESSAGE_LOG_BUFFER)))
+   {
+      _log(CRITICAL, "Failed to allocate message log buffers.  Message logging disabled.");
+      return;
+   }
+   message_log_active = 0;
+   message_log_length = 0;
+   message_log_dropped = 0;
+   message_log_dropping = false;
+   message_log_run = true;
+   if(pthread_create(&message_log_thread, NULL, message_log_writer, NULL))
+   {
+      _log(CRITICAL, "Failed to start message log writer.  Message logging disabled.");
+      message_log_run = false;
    }
 }
 
+static void message_log_stop(void)
+{
+   // Flush the message log and stop the writer.
+   if(!message_log_run) return;
+   pthread_mutex_lock(&message_log_lock);
+   message_log_run = false;
+   pthread_cond_signal(&message_log_wake);
+   pthread_mutex_unlock(&message_log_lock);
+   pthread_join(message_log_thread, NULL);
+   message_log_report_error();
+   if(message_log_dropped) _log(MAJOR, "%s messages were dropped from the message log.", commas_q(message_log_dropped));
+}
+
+static void * message_log_writer(void * arg)
+{
+   // Message log writer thread.  Each batch is appended to the log as a separate gzip member, and the file is closed
+   // in between so that log rotation needs no signal.
+   struct timespec due;
+   char * buffer;
+   size_t length;
+   word running = true, error;
+   int e;
+   gzFile gz;
+
+   while(running)
+   {
+      pthread_mutex_lock(&message_log_lock);
+      clock_gettime(CLOCK_REALTIME, &due);
+      due.tv_sec += MESSAGE_LOG_INTERVAL;
+      while(message_log_run && message_log_length <= MESSAGE_LOG_BUFFER / 2)
+      {
+         if(pthread_cond_timedwait(&message_log_wake, &message_log_lock, &due)) break;
+      }
+      running = message_log_run;
+      buffer = message_log_buffer[message_log_active];
+      length = message_log_length;
+      message_log_active ^= 1;
+      message_log_length = 0;
+      pthread_mutex_unlock(&message_log_lock);
+
+      if(length)
+      {
+         error = e = 0;
+         if((gz = gzopen(MESSAGE_LOG_FILEPATH, "ab1")))
+         {
+            if(gzwrite(gz, buffer, length) != (int) length) error = MESSAGE_LOG_WRITE_FAILED;
+            gzclose(gz);
+         }
+         else
+         {
+            error = MESSAGE_LOG_OPEN_FAILED;
+            e = errno;
+         }
+         if(error)
+         {
+            pthread_mutex_lock(&message_log_lock);
+            message_log_error = error;
+            message_log_errno = e;
+            pthread_mutex_unlock(&message_log_lock);
+         }
+      }
+   }
+   return NULL;
+}
+
+static void message_log_report_error(void)
+{
+   // Log a failure left by the writer thread.  Called with message_log_lock held, or after the writer has stopped.
+   if(message_log_error == MESSAGE_LOG_OPEN_FAILED)
+      _log(MAJOR, "Failed to open message log \"%s\".  Error %d %s.", MESSAGE_LOG_FILEPATH, message_log_errno, strerror(message_log_errno));
+   else if(message_log_error == MESSAGE_LOG_WRITE_FAILED)
+      _log(MAJOR, "Failed to write message log.");
+   message_log_error = 0;
+}
+
 #if 0
 static word count_messages(const struct frame_buffer * const b)
 {
@@ -2691,3 +3844,122 @@ static char * show_elapsed(time_t e)
 
    return display;
 }
+
+static void hist_record(struct histogram * const h, const qword value)
+{
+   word e, i;
+
+   if(value < HIST_SUB)
+   {
+      i = value;
+   }
+   else
+   {
+      e = 63 - __builtin_clzll(value);
+      i = (e - HIST_SUB_BITS + 1) * HIST_SUB + ((value >> (e - HIST_SUB_BITS)) & (HIST_SUB - 1));
+   }
+   h->bucket[i]++;
+   h->count++;
+   h->total += value;
+   if(value > h->max) h->max = value;
+}
+
+static qword hist_percentile(const struct histogram * const h, const double fraction)
+{
+   // Returns the highest value in the bucket holding the given fraction of the samples.
+   qword target, seen = 0;
+   word i, e;
+
+   if(!h->count) return 0;
+   target = fraction * h->count + 0.5;
+   if(target < 1) target = 1;
+   for(i = 0; i < HIST_BUCKETS - 1 && seen + h->bucket[i] < target; i++) seen += h->bucket[i];
+   if(i < HIST_SUB) return i;
+   e = i / HIST_SUB + HIST_SUB_BITS - 1;
+   target = ((qword) (HIST_SUB + i % HIST_SUB) << (e - HIST_SUB_BITS)) + (1ULL << (e - HIST_SUB_BITS)) - 1;
+   return (target > h->max)?h->max:target;
+}
+
+static char * hist_text(const struct histogram * const h)
+{
+   static char display[256];
+
+   sprintf(display, "count=%llu mean=%llu p50=%llu p90=%llu p99=%llu p99.9=%llu max=%llu",
+           h->count, h->count?(h->total / h->count):0,
+           hist_percentile(h, 0.5), hist_percentile(h, 0.9), hist_percentile(h, 0.99), hist_percentile(h, 0.999),
+           h->max);
+   return display;
+}
+
+static void hist_sample(void)
+{
+   // Sample the queue depth of each channel in use.
+   word channel;
+
+   hist_due = now + 1;
+   for(channel = 0; channel < CHANNELS; channel++)
+   {
+      if(stomp_topics[CHANNEL_STREAM(channel)][0] && CHANNEL_CONSUMER(channel) < consumers)
+      {
+         hist_record(&hist[channel][HistDepth], queue_length(channel) + disc_queue_length(channel));
+      }
+   }
+}
+
+static void stats_open(void)
+{
+   // Set up the stats socket.  Failure is not fatal.
+   struct sockaddr_un addr;
+   struct epoll_event e;
+
+   s_stats = -1;
+   unlink(STATS_SOCKET);
+   memset(&addr, 0, sizeof(addr));
+   addr.sun_family = AF_UNIX;
+   strcpy(addr.sun_path, STATS_SOCKET);
+   if((s_stats = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0)) < 0
+      || bind(s_stats, (struct sockaddr *) &addr, sizeof(addr))
+      || listen(s_stats, 4))
+   {
+      _log(MAJOR, "Failed to set up stats socket \"%s\".  Error %d %s.", STATS_SOCKET, errno, strerror(errno));
+      if(s_stats >= 0) close(s_stats);
+      s_stats = -1;
+      return;
+   }
+   chmod(STATS_SOCKET, 0666);
+   e.events = EPOLLIN;
+   e.data.u32 = STATS << 16;
+   if(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, s_stats, &e))
+   {
+      _log(MAJOR, "Failed to register stats socket.  Error %d %s.", errno, strerror(errno));
+      close(s_stats);
+      s_stats = -1;
+   }
+}
+
+static void stats_serve(void)
+{
+   // Send the histograms to a client of the stats socket and hang up.  The text is small enough
+   // to go straight into the socket buffer.
+   static char report[CHANNELS * HIST_TYPES * 320 + 256];
+   size_t l;
+   word channel, type;
+   int s;
+
+   if((s = accept(s_stats, NULL, NULL)) < 0) return;
+
+   l = sprintf(report, "%s %s since %s", NAME, BUILD, time_text(hist_start, true));
+   l += sprintf(report + l, " buffer_bytes=%zu\n", buffer_allocated);
+   for(channel = 0; channel < CHANNELS; channel++)
+   {
+      if(stomp_topics[CHANNEL_STREAM(channel)][0] && CHANNEL_CONSUMER(channel) < consumers)
+      {
+         for(type = 0; type < HIST_TYPES; type++)
+         {
+            l += sprintf(report + l, "%s %s %s\n", channel_names[channel], hist_names[type], hist_text(&hist[channel][type]));
+         }
+      }
+   }
+   if(write(s, report, l) != l) _log(MINOR, "Short write to stats socket client.");
+   close(s);
+}
@@ -0,0 +1,184 @@
+/*
+    Copyright (C) 2026 Phil Wieland
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    phil@philwieland.com
+
+*/
+
+// Print the frames in stompy spool segments, or the contents of stompy message logs, on stdout.
+// Each spool frame is shown after a line giving its receive time and length, in the message log style.
+
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <zlib.h>
+
+#include "misc.h"
+#include "build.h"
+
+#define NAME "stompycat"
+
+#ifndef RELEASE_BUILD
+#define BUILD "0001p"
+#else
+#define BUILD RELEASE_BUILD
+#endif
+
+static int cat_message_log(const char * const filepath);
+static int cat_spool_segment(const char * const filepath);
+static void show_frame(const struct spool_header * const h, const char * const frame);
+
+static char block_raw[SPOOL_BLOCK_SIZE];
+static char block_deflated[SPOOL_BLOCK_SIZE + SPOOL_BLOCK_SIZE / 8 + 1024];
+static char frame[64000];
+
+int main(int argc, char *argv[])
+{
+   int i, result = 0;
+   FILE * fp;
+   byte magic[2];
+
+   if(argc < 2 || !strcmp(argv[1], "-h"))
+   {
+      printf("%s %s\n\tUsage: %s file...\n\tFiles may be stompy spool segments or message logs.\n\n", NAME, BUILD, argv[0]);
+      exit(1);
+   }
+
+   for(i = 1; i < argc; i++)
+   {
+      if(!(fp = fopen(argv[i], "r")))
+      {
+         fprintf(stderr, "Failed to open \"%s\".  Error %d %s.\n", argv[i], errno, strerror(errno));
+         result = 1;
+         continue;
+      }
+      magic[0] = magic[1] = 0;
+      if(fread(magic, 1, 2, fp)) {}
+      fclose(fp);
+
+      // gzip, or uncompressed message log from an earlier build.
+      if((magic[0] == 0x1f && magic[1] == 0x8b) || (magic[0] >= '0' && magic[0] <= '9'))
+      {
+         if(cat_message_log(argv[i])) result = 1;
+      }
+      else
+      {
+         if(cat_spool_segment(argv[i])) result = 1;
+      }
+   }
+   exit(result);
+}
+
+static int cat_message_log(const char * const filepath)
+{
+   // gzread() copes with concatenated gzip members and with plain files.
+   gzFile gz;
+   int l;
+
+   if(!(gz = gzopen(filepath, "rb")))
+   {
+      fprintf(stderr, "Failed to open \"%s\".\n", filepath);
+      return 1;
+   }
+   while((l = gzread(gz, block_raw, sizeof(block_raw))) > 0)
+   {
+      fwrite(block_raw, 1, l, stdout);
+   }
+   gzclose(gz);
+   if(l < 0)
+   {
+      fprintf(stderr, "\"%s\" is damaged.\n", filepath);
+      return 1;
+   }
+   return 0;
+}
+
+static int cat_spool_segment(const char * const filepath)
+{
+   FILE * fp;
+   struct spool_block k;
+   struct spool_header h;
+   uLongf raw;
+   size_t i;
+   dword n;
+   long offset = 0;
+
+   if(!(fp = fopen(filepath, "r")))
+   {
+      fprintf(stderr, "Failed to open \"%s\".  Error %d %s.\n", filepath, errno, strerror(errno));
+      return 1;
+   }
+
+   // A frame record and a block header are the same size.
+   while(fread(&k, sizeof(k), 1, fp) == 1)
+   {
+      if(k.magic == SPOOL_MAGIC && k.length < sizeof(frame))
+      {
+         memcpy(&h, &k, sizeof(h));
+         if(fread(frame, 1, h.length, fp) != h.length) break;
+         show_frame(&h, frame);
+         offset += sizeof(h) + h.length;
+      }
+      else if(k.magic == SPOOL_BLOCK_MAGIC && k.length <= sizeof(block_deflated) && k.raw <= sizeof(block_raw))
+      {
+         if(fread(block_deflated, 1, k.length, fp) != k.length) break;
+         raw = sizeof(block_raw);
+         if(uncompress((Bytef *) block_raw, &raw, (Bytef *) block_deflated, k.length) != Z_OK || raw != k.raw) break;
+         for(i = 0, n = 0; i + sizeof(h) <= raw && n < k.frames; n++)
+         {
+            memcpy(&h, block_raw + i, sizeof(h));
+            if(h.magic != SPOOL_MAGIC || i + sizeof(h) + h.length > raw) break;
+            show_frame(&h, block_raw + i + sizeof(h));
+            i += sizeof(h) + h.length;
+         }
+         if(n != k.frames) break;
+         offset += sizeof(k) + k.length;
+      }
+      else
+      {
+         break;
+      }
+   }
+
+   if(!feof(fp) || ftell(fp) != offset)
+   {
+      fprintf(stderr, "\"%s\" is damaged at offset %ld.\n", filepath, offset);
+      fclose(fp);
+      return 1;
+   }
+   fclose(fp);
+   return 0;
+}
+
+static void show_frame(const struct spool_header * const h, const char * const frame)
+{
+   time_t when = h->stamp / 1000000LL;
+   struct tm * broken = gmtime(&when);
+
+   printf("%02d/%02d/%02d %02d:%02d:%02dZ %u bytes\n",
+          broken->tm_mday,
+          broken->tm_mon + 1,
+          broken->tm_year % 100,
+          broken->tm_hour,
+          broken->tm_min,
+          broken->tm_sec,
+          h->length);
+   fwrite(frame, 1, h->length, stdout);
+   printf("\n");
+}
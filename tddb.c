@@ -51,8 +51,10 @@
 #endif
 
 static void perform(void);
-static void process_frame(const char * const body);
-static void process_message(const word describer, const char * const body, const size_t index);
+struct frame;
+static void process_frame(const struct frame * const f);
+static void process_frame_job(void * const arg);
+static void process_message(const word describer, const jsmn_index * const fields);
 static void signalling_update(const char * const message_name, const word describer, const time_t t, const word a, const dword d);
 static void update_database_berth(const word describer, const char * const k, const char * const v);
 static void update_database(const word type, const word describer, const char * const k, const char * const v);
@@ -71,13 +73,25 @@ static word debug, run, interrupt, holdoff;
 static char zs[4096];
 
 #define FRAME_SIZE 64000
-static char body[FRAME_SIZE];
-
 #define NUM_TOKENS 8192
-static jsmntok_t tokens[NUM_TOKENS];
+
+// Frames are read and parsed here while earlier ones are processed by the database worker thread.
+static struct frame
+{
+   char body[FRAME_SIZE];
+   jsmntok_t tokens[NUM_TOKENS];
+   int parsed;
+} frames[DB_ASYNC_DEPTH + 1];
+static qword frames_read;
+static volatile word pipeline_failed;
+
+// Tokens of the frame being processed.
+static const jsmntok_t * tokens;
 
 // stompy port for TD stream
 #define STOMPY_PORT 55842
+// Number of frames stompy may send ahead of our acks
+#define STOMPY_WINDOW 8
 
 // Time in hours (local) when daily statistical report is produced.
 // (Set > 23 to disable daily report.)
@@ -85,6 +99,7 @@ static jsmntok_t tokens[NUM_TOKENS];
 #define REPORT_MINUTE 3
 
 static time_t start_time;
+static word last_report_day;
 
 // Describers 
 #define DESCRIBERS 512
@@ -128,6 +143,9 @@ static const char * stats_category[MAXstats] =
       "Relevant message", "CA message", "CB message", "CC message", "CT message", "SF message", "SG message", "SH message", "New describer", "New key", "Unrecognised message", "Handle wrap",
    };
 
+// Prepared statements
+static word stmt_obfus_lookup, stmt_state_update, stmt_state_insert, stmt_state_query;
+
 // Signalling
 #define SIG_BYTES 256
 static word signalling[DESCRIBERS][SIG_BYTES];
@@ -163,7 +181,11 @@ word describer_M0, describer_M1;
 // Signal handling
 void termination_handler(int signum)
 {
-   if(signum != SIGHUP)
+   if(signum == SIGHUP)
+   {
+      _log_reopen();
+   }
+   else
    {
       run = false;
       interrupt = true;
@@ -321,7 +343,7 @@ int main(int argc, char *argv[])
       act.sa_handler = termination_handler;
       act.sa_mask = block_mask;
       act.sa_flags = 0;
-      if(sigaction(SIGTERM, &act, NULL) || sigaction(SIGINT, &act, NULL))
+      if(sigaction(SIGTERM, &act, NULL) || sigaction(SIGINT, &act, NULL) || sigaction(SIGHUP, &act, NULL))
       {
          _log(CRITICAL, "Failed to set up signal handler.");
          exit(1);
@@ -364,7 +386,6 @@ int main(int argc, char *argv[])
 
 static void perform(void)
 {
-   word last_report_day;
    word stompy_timeout = true;
 
    // Initialise database connection
@@ -377,11 +398,17 @@ static void perform(void)
 
    create_database();
 
+   stmt_obfus_lookup = db_statement("obfus_lookup", "SELECT true_hc FROM obfus_lookup where obfus_hc = ? ORDER BY created DESC LIMIT 1");
+   stmt_state_update = db_statement("td_states update", "UPDATE td_states SET updated = ?, v = ? where k = ?");
+   stmt_state_insert = db_statement("td_states insert", "INSERT INTO td_states VALUES(?, ?, ?)");
+   stmt_state_query  = db_statement("td_states query", "SELECT v FROM td_states where k = ?");
+   db_async_start();
+
    handle = MAX_HANDLE;
 
    {
       time_t now = time(NULL);
-      struct tm * broken = localtime(&now);
+      struct tm broken_tm, * broken = localtime_r(&now, &broken_tm);
       last_report_day = broken->tm_wday;
       last_message_count_report = now;
       message_count = message_count_rel = 0;
@@ -411,75 +438,36 @@ static void perform(void)
    {   
       stats[ConnectAttempt]++;
       int run_receive = !open_stompy(STOMPY_PORT);
+      if(run_receive && window_stompy(STOMPY_WINDOW)) run_receive = false;
+      pipeline_failed = false;
       while(run_receive && run)
       {
          holdoff = 0;
-         {
-            time_t now = time(NULL);
-            struct tm * broken = localtime(&now);
-            if(broken->tm_wday != last_report_day && broken->tm_hour >= REPORT_HOUR && broken->tm_min >= REPORT_MINUTE)
-            {
-               last_report_day = broken->tm_wday;
-               report_stats();
-            }
-            if(now - last_message_count_report > MESSAGE_COUNT_REPORT_INTERVAL)
-            {
-               char query[256];
-               sprintf(query, "INSERT INTO message_count VALUES('tddb', %ld, %d)", now, message_count);
-               if(!db_query(query))
-               {
-                  message_count = 0;
-                  last_message_count_report = now;
-               }
-               sprintf(query, "INSERT INTO message_count VALUES('tddbrel', %ld, %d)", now, message_count_rel);
-               if(!db_query(query))
-               {
-                  message_count_rel = 0;
-               }
-            }
-         }
 
-         int r = read_stompy(body, FRAME_SIZE, 64);
+         // Up to DB_ASYNC_DEPTH frames may be queued or in progress, so this one is free.
+         struct frame * const f = &frames[frames_read % (DB_ASYNC_DEPTH + 1)];
+         int r = read_stompy(f->body, FRAME_SIZE, 64);
          _log(DEBUG, "read_stompy() returned %d.", r);
-         if(!r && run && run_receive)
+         if(pipeline_failed)
+         {
+            run_receive = false;
+         }
+         else if(!r && run)
          {
             if(stompy_timeout)
             {
                _log(MINOR, "TD message stream - Receive OK.");
                stompy_timeout = false;
             }
-            if(db_start_transaction())
-            {
-               run_receive = false;
-            }
-            if(run_receive) process_frame(body);
-
-            if(!db_errored)
-            {
-               if(db_commit_transaction())
-               {
-                  db_rollback_transaction();
-                  run_receive = false;
-               }
-               else
-               {
-                  // Send ACK
-                  if(ack_stompy())
-                  {
-                     _log(CRITICAL, "Failed to write message ack.  Error %d %s", errno, strerror(errno));
-                     run_receive = false;
-                  }
-               }
-            }
-            else
-            {
-               // DB error.
-               db_rollback_transaction();
-               run_receive = false;
-            }
+            jsmn_parser parser;
+            jsmn_init(&parser);
+            f->parsed = jsmn_parse(&parser, f->body, f->tokens, NUM_TOKENS);
+            frames_read++;
+            db_async_submit(process_frame_job, f);
          }
-         else if(run && run_receive)
+         else if(run)
          {
+            db_async_drain();
             if(r != 3)
             {
                run_receive = false;
@@ -490,13 +478,14 @@ static void perform(void)
                if(!stompy_timeout) _log(MINOR, "TD message stream - Receive timeout."); 
                no_feed = NO_FEED_LOCKOUT;
                stompy_timeout = true;
+               check_timeout();
             }
          }
-
-         if(!run_receive) no_feed = NO_FEED_LOCKOUT;
-         if(run) check_timeout();
       } // while(run_receive && run)
 
+      // Frames not yet acked will be sent again by stompy.
+      db_async_drain();
+      no_feed = NO_FEED_LOCKOUT;
       close_stompy();
       if(run) check_timeout();
       {      
@@ -511,17 +500,61 @@ static void perform(void)
       _log(CRITICAL, "Terminating due to interrupt.");
    }
 
+   db_async_stop();
    db_disconnect();
    report_stats();
+   db_profile_report();
+}
+
+static void process_frame_job(void * const arg)
+{
+   // Runs on the database worker thread, one frame at a time in the order read.  The frame is acked once its
+   // transaction is committed.  After a failure later frames are skipped, to be redelivered after reconnection.
+   const struct frame * const f = arg;
+
+   if(pipeline_failed) return;
+
+   check_timeout();
+
+   if(db_start_transaction())
+   {
+      pipeline_failed = true;
+      return;
+   }
+   process_frame(f);
+
+   if(!db_errored)
+   {
+      if(db_commit_transaction())
+      {
+         db_rollback_transaction();
+         pipeline_failed = true;
+      }
+      else
+      {
+         // Send ACK
+         if(ack_stompy())
+         {
+            _log(CRITICAL, "Failed to write message ack.  Error %d %s", errno, strerror(errno));
+            pipeline_failed = true;
+         }
+      }
+   }
+   else
+   {
+      // DB error.
+      db_rollback_transaction();
+      pipeline_failed = true;
+   }
 }
 
-static void process_frame(const char * const body)
+static void process_frame(const struct frame * const f)
 {
-   jsmn_parser parser;
+   const char * const body = f->body;
    qword elapsed = time_ms();
    
-   jsmn_init(&parser);
-   int r = jsmn_parse(&parser, body, tokens, NUM_TOKENS);
+   tokens = f->tokens;
+   int r = f->parsed;
    if(r != 0) 
    {
       _log(MAJOR, "Parser result %d.  Message discarded.", r);
@@ -548,7 +581,9 @@ static void process_frame(const char * const body)
       {
          char area_id[4];
          word describer, hit;
-         jsmn_find_extract_token(body, tokens, index, "area_id", area_id, sizeof(area_id));
+         jsmn_index fields;
+         jsmn_index_object(&fields, body, tokens, index);
+         jsmn_index_extract(&fields, "area_id", area_id, sizeof(area_id));
 
          stats[GoodMessage]++;
          message_count++;
@@ -561,7 +596,7 @@ static void process_frame(const char * const body)
                // HIT
                if(describers[describer].process_mode)
                {
-                  process_message(describer, body, index);
+                  process_message(describer, &fields);
                   stats[RelMessage]++;
                   message_count_rel++;
                }
@@ -596,18 +631,15 @@ static void process_frame(const char * const body)
    }
 }
 
-static void process_message(const word describer, const char * const body, const size_t index)
+static void process_message(const word describer, const jsmn_index * const fields)
 {
    char message_type[8];
-   char times[16];
    time_t timestamp;
    char from[16], to[16], descr[16], wasf[16], wast[16];
 
-   jsmn_find_extract_token(body, tokens, index, "msg_type", message_type, sizeof(message_type));
+   jsmn_index_extract(fields, "msg_type", message_type, sizeof(message_type));
    _log(DEBUG, "Message name = \"%s\".", message_type);
-   jsmn_find_extract_token(body, tokens, index, "time", times, sizeof(times));
-   times[10] = '\0';
-   timestamp = atol(times);
+   timestamp = jsmn_index_timestamp(fields, "time");
 
    time_t now = time(NULL);
    // Handle Network Rail's midnight bug
@@ -639,9 +671,9 @@ static void process_message(const word describer, const char * const body, const
 
    if(!strcasecmp(message_type, "CA"))
    {
-      jsmn_find_extract_token(body, tokens, index, "from", from, sizeof(from));
-      jsmn_find_extract_token(body, tokens, index, "to", to, sizeof(to));
-      jsmn_find_extract_token(body, tokens, index, "descr", descr, sizeof(descr));
+      jsmn_index_extract(fields, "from", from, sizeof(from));
+      jsmn_index_extract(fields, "to", to, sizeof(to));
+      jsmn_index_extract(fields, "descr", descr, sizeof(descr));
       if(describers[describer].process_mode == 2) 
       {
          strcpy(wasf, query_berth(describer, from));
@@ -668,10 +700,10 @@ static void process_message(const word describer, const char * const body, const
    }
    else if(!strcasecmp(message_type, "CB"))
    {
-      jsmn_find_extract_token(body, tokens, index, "from", from, sizeof(from));
+      jsmn_index_extract(fields, "from", from, sizeof(from));
       if(describers[describer].process_mode == 2) 
       {
-         jsmn_find_extract_token(body, tokens, index, "descr", descr, sizeof(descr));
+         jsmn_index_extract(fields, "descr", descr, sizeof(descr));
          strcpy(wasf, query_berth(describer, from));
          _log(DEBUG, "%s CB:             Berth cancel (%s) Description \"%s\" from berth \"%s\"", describers[describer].id, time_text(timestamp, true), descr, from);
          log_detail(timestamp, "%s CB: %s from %s         %s", describers[describer].id, descr, from, show_signalling_state(describer));
@@ -685,8 +717,8 @@ static void process_message(const word describer, const char * const body, const
    }
    else if(!strcasecmp(message_type, "CC"))
    {
-      jsmn_find_extract_token(body, tokens, index, "to", to, sizeof(to));
-      jsmn_find_extract_token(body, tokens, index, "descr", descr, sizeof(descr));
+      jsmn_index_extract(fields, "to", to, sizeof(to));
+      jsmn_index_extract(fields, "descr", descr, sizeof(descr));
       if(describers[describer].process_mode == 2) 
       {
          _log(DEBUG, "%s CC:          Berth interpose (%s) Description \"%s\" to berth \"%s\"", describers[describer].id, time_text(timestamp, true), descr, to);
@@ -701,7 +733,7 @@ static void process_message(const word describer, const char * const body, const
       if(describers[describer].process_mode == 2) 
       {
          char report_time[16];
-         jsmn_find_extract_token(body, tokens, index, "report_time", report_time, sizeof(report_time));
+         jsmn_index_extract(fields, "report_time", report_time, sizeof(report_time));
          _log(DEBUG, "%s CT:                  Heartbeat (%s) Report time = %s", describers[describer].id, time_text(timestamp, true), report_time);
          log_detail(timestamp, "%s CT: Heartbeat, report time %s", describers[describer].id, report_time);
       }
@@ -709,26 +741,19 @@ static void process_message(const word describer, const char * const body, const
    }
    else if(!strcasecmp(message_type, "SF"))
    {
-      char address[16], data[32];
-      jsmn_find_extract_token(body, tokens, index, "address", address, sizeof(address));
-      jsmn_find_extract_token(body, tokens, index, "data", data, sizeof(data));
-      _log(DEBUG, "%s SF:        Signalling update (%s) Address \"%s\", data \"%s\"", describers[describer].id, time_text(timestamp, true), address, data);
+      word  a = jsmn_index_hex(fields, "address");
+      dword d = jsmn_index_hex(fields, "data");
+      _log(DEBUG, "%s SF:        Signalling update (%s) Address %04x, data %02x", describers[describer].id, time_text(timestamp, true), a, d);
 
-      word  a = strtoul(address, NULL, 16);
-      dword d = strtoul(data,    NULL, 16);
       signalling_update("SF", describer, timestamp, a, d);
 
       stats[SF]++;
    }
    else if(!strcasecmp(message_type, "SG"))
    {
-      char address[16], data[32];
-      jsmn_find_extract_token(body, tokens, index, "address", address, sizeof(address));
-      jsmn_find_extract_token(body, tokens, index, "data", data, sizeof(data));
-      _log(DEBUG, "%s SG:       Signalling refresh (%s) Address \"%s\", data \"%s\"", describers[describer].id, time_text(timestamp, true), address, data);
-      word  a = strtoul(address, NULL, 16);
-      dword d = strtoul(data,    NULL, 16);
-      _log(DEBUG, "a = %04x, d = %08x", a, d);
+      word  a = jsmn_index_hex(fields, "address");
+      dword d = jsmn_index_hex(fields, "data");
+      _log(DEBUG, "%s SG:       Signalling refresh (%s) Address %04x, data %08x", describers[describer].id, time_text(timestamp, true), a, d);
       signalling_update("SG", describer, timestamp, a     , 0xff & (d >> 24));
       signalling_update("SG", describer, timestamp, a + 1 , 0xff & (d >> 16));
       signalling_update("SG", describer, timestamp, a + 2 , 0xff & (d >> 8 ));
@@ -738,13 +763,9 @@ static void process_message(const word describer, const char * const body, const
    }
    else if(!strcasecmp(message_type, "SH"))
    {
-      char address[16], data[32];
-      jsmn_find_extract_token(body, tokens, index, "address", address, sizeof(address));
-      jsmn_find_extract_token(body, tokens, index, "data", data, sizeof(data));
-      _log(DEBUG, "%s SH: Signalling refresh final (%s) Address \"%s\", data \"%s\"", describers[describer].id, time_text(timestamp, true), address, data);
-      word  a = strtoul(address, NULL, 16);
-      dword d = strtoul(data,    NULL, 16);
-      _log(DEBUG, "a = %04x, d = %08x", a, d);
+      word  a = jsmn_index_hex(fields, "address");
+      dword d = jsmn_index_hex(fields, "data");
+      _log(DEBUG, "%s SH: Signalling refresh final (%s) Address %04x, data %08x", describers[describer].id, time_text(timestamp, true), a, d);
       signalling_update("SH", describer, timestamp, a     , 0xff & (d >> 24));
       signalling_update("SH", describer, timestamp, a + 1 , 0xff & (d >> 16));
       signalling_update("SH", describer, timestamp, a + 2 , 0xff & (d >> 8 ));
@@ -756,7 +777,7 @@ static void process_message(const word describer, const char * const body, const
    else
    {
       _log(GENERAL, "Unrecognised message type \"%s\":", message_type);
-      jsmn_dump_tokens(body, tokens, index);
+      jsmn_dump_tokens(fields->string, fields->tokens, fields->object_index);
    }
 }
 
@@ -842,9 +863,7 @@ static void update_database_berth(const word describer, const char * const k, co
 
 static void update_database(const word type, const word describer, const char * const b, const char * const v)
 {
-   char query[512], typec, vv[8];
-   MYSQL_RES * result;
-   MYSQL_ROW row;
+   char query[512], typec, vv[8], k[32];
    time_t now = time(NULL);
 
    _log(PROC, "update_database(%d, %d, \"%s\", \"%s\")", type, describer, b, v);
@@ -859,16 +878,12 @@ static void update_database(const word type, const word describer, const char *
       typec = 'b';
       if(v[0])
       {
-         sprintf(query, "SELECT true_hc FROM obfus_lookup where obfus_hc = '%s' ORDER BY created DESC LIMIT 1", v);
-         if(!db_query(query))
+         if(!db_execute(stmt_obfus_lookup, "s", v))
          {
-            result = db_store_result();
-            if((row = mysql_fetch_row(result))) 
+            if(!db_fetch(stmt_obfus_lookup, "s", vv, sizeof(vv)))
             {
-               strcpy(vv, row[0]);
                _log(DEBUG, "De-obfuscating \"%s\" to \"%s\".", v, vv);
             }
-            mysql_free_result(result);
          }
       }
    }
@@ -898,13 +913,12 @@ static void update_database(const word type, const word describer, const char *
 
    if(describers[describer].control_mode == 2) typec++;
 
-   sprintf(query, "UPDATE td_states SET updated = %ld, v = '%s' where k = '%s%c%s'", now, vv, describers[describer].id, typec, b);
-   if(!db_query(query))
+   sprintf(k, "%s%c%s", describers[describer].id, typec, b);
+   if(!db_execute(stmt_state_update, "lss", now, vv, k))
    {
-      if(!db_affected_rows())
+      if(!db_statement_affected_rows(stmt_state_update))
       {
-         sprintf(query, "INSERT INTO td_states VALUES(%ld, '%s%c%s', '%s')", now, describers[describer].id, typec, b, vv);
-         db_query(query);
+         db_execute(stmt_state_insert, "lss", now, k, vv);
          if(describers[describer].control_mode != 2)
          {
             char report[1024];
@@ -919,22 +933,15 @@ static void update_database(const word type, const word describer, const char *
 
 static const char * const query_berth(const word describer, const char * const b)
 {
-   char query[512];
-   MYSQL_RES * result;
-   MYSQL_ROW row;
+   char k[32];
    static char reply[32];
 
    strcpy(reply, "");
 
-   sprintf(query, "SELECT * FROM td_states where k = '%sb%s'", describers[describer].id, b);
-   if(!db_query(query))
+   sprintf(k, "%sb%s", describers[describer].id, b);
+   if(!db_execute(stmt_state_query, "s", k))
    {
-      result = db_store_result();
-      if((row = mysql_fetch_row(result))) 
-      {
-         strcpy(reply,row[2]);
-      }
-      mysql_free_result(result);
+      if(db_fetch(stmt_state_query, "s", reply, sizeof(reply))) reply[0] = '\0';
    }
    return reply;
 }
@@ -1108,7 +1115,32 @@ static void check_timeout(void)
    MYSQL_ROW row;
    char report[512];
 
+   db_profile_poll();
+
    time_t now = time(NULL);
+   struct tm broken_tm, * broken = localtime_r(&now, &broken_tm);
+   if(broken->tm_wday != last_report_day && broken->tm_hour >= REPORT_HOUR && broken->tm_min >= REPORT_MINUTE)
+   {
+      last_report_day = broken->tm_wday;
+      report_stats();
+      db_profile_report();
+   }
+   if(now - last_message_count_report > MESSAGE_COUNT_REPORT_INTERVAL)
+   {
+      char query[256];
+      sprintf(query, "INSERT INTO message_count VALUES('tddb', %ld, %d)", now, message_count);
+      if(!db_query(query))
+      {
+         message_count = 0;
+         last_message_count_report = now;
+      }
+      sprintf(query, "INSERT INTO message_count VALUES('tddbrel', %ld, %d)", now, message_count_rel);
+      if(!db_query(query))
+      {
+         message_count_rel = 0;
+      }
+   }
+
    if(now > check_describers_flow_due)
    {   
       check_describers_flow_due = now + CHECK_DESCRIBERS_FLOW_INTERVAL;
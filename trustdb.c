@@ -35,11 +35,13 @@
 #include <netinet/in.h>
 #include <errno.h>
 #include <netdb.h>
+#include <pthread.h>
 
 #include "jsmn.h"
 #include "misc.h"
 #include "db.h"
 #include "database.h"
+#include "corpus.h"
 #include "build.h"
 
 #define NAME  "trustdb"
@@ -51,14 +53,27 @@
 #endif
 
 static void perform(void);
-static void process_frame(const char * const body);
-static void process_trust_0001(const char * const string, const jsmntok_t * const tokens, const int index);
-static void process_trust_0002(const char * const string, const jsmntok_t * const tokens, const int index);
-static void process_trust_0003(const char * const string, const jsmntok_t * const tokens, const int index);
-static void process_trust_0005(const char * const string, const jsmntok_t * const tokens, const int index);
-static void process_trust_0006(const char * const string, const jsmntok_t * const tokens, const int index);
-static void process_trust_0007(const char * const string, const jsmntok_t * const tokens, const int index);
-static void process_trust_0008(const char * const string, const jsmntok_t * const tokens, const int index);
+struct frame;
+static word process_frame(const struct frame * const f, const word shard);
+static void process_frame_job(void * const arg);
+static void group_commit_job(void * const arg);
+static void group_rollback_job(void * const arg);
+static void shards_start(void);
+static void shards_stop(void);
+static void shards_drain(void);
+static word shard_dispatch(struct frame * const f);
+static void shard_frame_done(struct frame * const f);
+static word shard_part_committed(const struct frame * const f);
+static void * shard_worker(void * arg);
+static void stat_count(const word category);
+static void latency_record(const time_t latency);
+static void process_trust_0001(const jsmn_index * const fields);
+static void process_trust_0002(const jsmn_index * const fields);
+static void process_trust_0003(const jsmn_index * const fields);
+static void process_trust_0005(const jsmn_index * const fields);
+static void process_trust_0006(const jsmn_index * const fields);
+static void process_trust_0007(const jsmn_index * const fields);
+static void process_trust_0008(const jsmn_index * const fields);
 static void jsmn_dump_tokens(const char * const string, const jsmntok_t * const tokens, const word object_index);
 static void report_stats(void);
 #define INVALID_SORT_TIME 9999
@@ -68,18 +83,88 @@ static void defer_activation(const char * const uid, const time_t schedule_start
 static void process_deferred_activations(void);
 static word count_deferred_activations(void);
 static void check_timeout(void);
+static void timetable_build(void);
+static void timetable_refresh(void);
+static word timetable_candidates(const char * const tiploc, const char * const planned, const char event, const time_t when, const word day, char * const ids);
+static word timetable_search(const char * const tiploc, const char * const planned, const char event, const time_t when, const word day, char * const ids);
+static void activation_cache_add(const char * const trust_id, const time_t created, const dword cif_schedule_id, const word latest);
+static const struct activation_cache_entry * activation_cache_find(const char * const trust_id);
+static void activation_cache_clear(void);
 
 static word debug, run, interrupt, holdoff;
 static char zs[4096];
 
 #define FRAME_SIZE 64000
-static char body[FRAME_SIZE];
-
 #define NUM_TOKENS 8192
-static jsmntok_t tokens[NUM_TOKENS];
+
+// Frames are read and parsed here while earlier ones are processed by the database worker thread, or the shards.
+// More than both DB_ASYNC_DEPTH and STOMPY_WINDOW.
+#define FRAMES 9
+static struct frame
+{
+   char body[FRAME_SIZE];
+   jsmntok_t tokens[NUM_TOKENS];
+   int parsed;
+   size_t length;
+   dword sequence;
+   qword digest;             // Sharded mode.  Hash of the body, to recognise the frame when stompy sends it again.
+   word replay;              // Sharded mode.  Read soon after connection, so may have been sent before.
+   word parts;               // Sharded mode.  Number of shards yet to finish with the frame.
+   byte shard[NUM_TOKENS];   // Sharded mode.  Shard of each message.
+} frames[FRAMES];
+static qword frames_read, frames_done;
+static volatile word pipeline_failed;
+
+// Sharded mode.  When trustdb_shards is more than 1 the messages in each frame are shared out by train_id between
+// that many worker threads, each with its own database connection, so that the messages about a train are processed
+// in order.  Each shard commits its part of a frame, and frames are acked in order once every part is committed.
+// A change of identity (0007) goes to the shard of the old train_id, after everything earlier about that id.  The
+// messages for the revised id which follow it in the frame go to the same shard, and later frames are not dispatched
+// until the frame with the change has been committed, so everything about the new id is processed after the change.
+#define MAX_SHARDS 8
+#define MAX_FRAME_CHANGES 8
+#define SHARD_ALL 0xffff
+static word shards;
+static struct shard
+{
+   pthread_t thread;
+   struct frame * queue[FRAMES];
+   qword queued, taken;
+} shard_state[MAX_SHARDS];
+static pthread_mutex_t shard_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t shard_work = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t shard_done = PTHREAD_COND_INITIALIZER;
+static word shards_stopping;
+// The shard run by this thread, 0 for the others.
+static __thread word worker_shard;
+// A frame is redelivered if any of its parts failed, so each shard records the parts it commits in trust_frame_part,
+// in the same transaction, and skips them when they come round again.  Stompy only resends the frames which were
+// unacked at disconnection, so they are looked up for the first REPLAY_FRAMES frames after each connection.
+#define REPLAY_FRAMES FRAMES
+static word stmt_part_find, stmt_part_insert;
+static word replay_frames;
+// Rows which every shard would touch are left to the reader thread, so that the shards don't wait on each other.
+#define STATUS_UPDATE_INTERVAL 1
+#define OBFUS_PRUNE_INTERVAL 64
+static time_t status_update_due, obfus_prune_due;
+
+// Group commit.  When trustdb_group_ms is set, frames are committed and acked in groups rather than one at a time.
+// The group is owned by the database worker thread.  The reader thread, which can't see it, commits a group by
+// group_ms after the first frame it submitted to it, by submitting group_commit_job if no frame arrives before then.
+static qword group_ms, group_messages_max, group_bytes_max;
+static word group_open, group_frames, group_messages;
+static size_t group_bytes;
+static qword group_started;
+static dword group_sequence;
+#define GROUP_MESSAGES 2000
+#define GROUP_KB 1024
 
 // stompy port for trust stream
 #define STOMPY_PORT 55841
+// Number of frames stompy may send ahead of our acks
+#define STOMPY_WINDOW 8
+// With group commit, the whole group must fit in the window.  This is the most stompy allows.
+#define STOMPY_GROUP_WINDOW 16
 
 // Time in hours (local) when daily statistical report is produced.
 // (Set > 23 to disable daily report.)
@@ -87,7 +172,8 @@ static jsmntok_t tokens[NUM_TOKENS];
 #define REPORT_MINUTE 2
 static word last_report_day;
 
-static time_t start_time, now;
+static time_t start_time;
+static __thread time_t now;
 
 // Status
 static time_t status_last_trust_processed, status_last_trust_actual;
@@ -96,7 +182,7 @@ static time_t status_last_trust_processed, status_last_trust_actual;
 enum stats_categories {ConnectAttempt, GoodMessage, // Don't insert any here
                        Mess1, Mess2, Mess3, Mess4, Mess5, Mess6, Mess7, Mess8,
                        NotMessage, NotRecog, Mess1Miss, Mess1MissHit, Mess1Cape, MovtNoAct, DeducedAct, 
-                       DeducedHC, DeducedHCReplaced, DeducedTSC, MAXstats};
+                       DeducedHC, DeducedHCReplaced, DeducedTSC, ActCacheHit, ActCacheMiss, MAXstats};
 static qword stats[MAXstats];
 static qword grand_stats[MAXstats];
 static const char * stats_category[MAXstats] = 
@@ -104,16 +190,42 @@ static const char * stats_category[MAXstats] =
       "Stompy connect attempt", "Good message", 
       "Message type 1","Message type 2","Message type 3","Message type 4","Message type 5","Message type 6","Message type 7","Message type 8",
       "Not a message", "Invalid or not recognised", "Activation no schedule", "Found by second search", "Act. cancelled schedule", "Movement without act.", "Deduced activation",
-      "Deduced headcode", "Changed deduced headcode", "Deduced TSC",
+      "Deduced headcode", "Changed deduced headcode", "Deduced TSC", "Activation cache hit", "Activation cache miss",
    };
 
+// Prepared statements
+static word stmt_movement_insert;
+
+// Timetable index
+#define TIMETABLE_WINDOW (3*24*60*60)
+#define TIMETABLE_COVER (36*60*60)
+#define TIMETABLE_REFRESH 60
+#define TIMETABLE_CANDIDATES 32
+// NULL if there is no usable index.  The shards search it while the reader thread refreshes it.
+static struct timetable * timetable;
+static pthread_rwlock_t timetable_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+// Activation cache
+#define ACTIVATION_CACHE_SETS 16384
+#define ACTIVATION_CACHE_WAYS 4
+#define ACTIVATION_CACHE_AGE (4*24*60*60)
+static struct activation_cache_entry
+{
+   char trust_id[16];
+   time_t created;           // Latest activation, or 0 if not known
+   time_t scheduled_created; // Latest activation with a schedule, or 0 if none known
+   dword cif_schedule_id;    // Of the latest activation
+}
+   activation_cache[MAX_SHARDS][ACTIVATION_CACHE_SETS][ACTIVATION_CACHE_WAYS];
+
 // Message count
 word message_count;
 time_t message_count_report_due;
 #define MESSAGE_COUNT_REPORT_INTERVAL 64
 
 // Latency check
-static qword latency_sum, latency_count, latency_max;
+static qword latency_sum, latency_count;
+static time_t latency_max;
 static time_t latency_check_due;
 static byte latency_alarm_raised;
 #define LATENCY_CHECK_INTERVAL 256
@@ -122,7 +234,11 @@ static byte latency_alarm_raised;
 // Signal handling
 void termination_handler(int signum)
 {
-   if(signum != SIGHUP)
+   if(signum == SIGHUP)
+   {
+      _log_reopen();
+   }
+   else
    {
       run = false;
       interrupt = true;
@@ -280,7 +396,7 @@ int main(int argc, char *argv[])
       act.sa_handler = termination_handler;
       act.sa_mask = block_mask;
       act.sa_flags = 0;
-      if(sigaction(SIGTERM, &act, NULL) || sigaction(SIGINT, &act, NULL))
+      if(sigaction(SIGTERM, &act, NULL) || sigaction(SIGINT, &act, NULL) || sigaction(SIGHUP, &act, NULL))
       {
          _log(CRITICAL, "Failed to set up signal handler.");
          exit(1);
@@ -337,11 +453,31 @@ static void perform(void)
       exit(1);
    }
 
+   stmt_movement_insert = db_statement("trust_movement insert", "INSERT INTO trust_movement VALUES(?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?)");
+   stmt_part_find = db_statement("trust_frame_part find", "SELECT COUNT(*) FROM trust_frame_part WHERE digest = ? AND shards = ? AND shard = ?");
+   stmt_part_insert = db_statement("trust_frame_part insert", "INSERT IGNORE INTO trust_frame_part VALUES(?, ?, ?, ?)");
+   if(!*conf[conf_trustdb_no_deduce_act]) timetable_build();
+   shards = atoi(conf[conf_trustdb_shards]);
+   if(shards > MAX_SHARDS) shards = MAX_SHARDS;
+   if(shards < 2) shards = 0;
+   group_ms = shards ? 0 : atol(conf[conf_trustdb_group_ms]);
+   group_messages_max = *conf[conf_trustdb_group_messages] ? atol(conf[conf_trustdb_group_messages]) : GROUP_MESSAGES;
+   group_bytes_max = (*conf[conf_trustdb_group_kb] ? atol(conf[conf_trustdb_group_kb]) : GROUP_KB) * 1024;
+   if(group_ms)
+   {
+      char messages[32];
+      strcpy(messages, commas_q(group_messages_max));
+      _log(GENERAL, "Group commit after %s ms, %s messages or %s bytes.", commas_q(group_ms), messages, commas_q(group_bytes_max));
+   }
+   if(shards) shards_start();
+   else db_async_start();
+
    {
       now = time(NULL);
-      struct tm * broken = localtime(&now);
+      struct tm broken_tm, * broken = localtime_r(&now, &broken_tm);
       last_report_day = broken->tm_wday;
       message_count_report_due = now + MESSAGE_COUNT_REPORT_INTERVAL;
+      status_update_due = obfus_prune_due = now;
       latency_check_due = now + LATENCY_CHECK_INTERVAL;
       message_count = 0;
       latency_alarm_raised = latency_sum = latency_count = latency_max = 0;
@@ -352,55 +488,73 @@ static void perform(void)
 
    while(run)
    {   
-      stats[ConnectAttempt]++;
+      stat_count(ConnectAttempt);
       int run_receive = !open_stompy(STOMPY_PORT);
+      if(run_receive && window_stompy(group_ms ? STOMPY_GROUP_WINDOW : STOMPY_WINDOW)) run_receive = false;
+      pipeline_failed = false;
+      replay_frames = REPLAY_FRAMES;
+      word group_waiting = false;
+      qword group_deadline = 0;
       while(run && run_receive)
       {
          holdoff = 0;
-         check_timeout();
 
-         int r = read_stompy(body, FRAME_SIZE, 128);
-         _log(DEBUG, "read_stompy() returned %d.", r);
-         if(!r && run && run_receive)
+         // Up to DB_ASYNC_DEPTH frames, or STOMPY_WINDOW when sharded, may be queued or in progress, so this one is free.
+         struct frame * const f = &frames[frames_read % FRAMES];
+         qword wait_ms = 128000;
+         if(group_waiting)
+         {
+            qword now_ms = time_ms();
+            wait_ms = (group_deadline > now_ms) ? group_deadline - now_ms : 1;
+         }
+         int r = read_stompy_ms(f->body, FRAME_SIZE, wait_ms);
+         _log(DEBUG, "read_stompy_ms() returned %d.", r);
+         if(pipeline_failed)
+         {
+            run_receive = false;
+         }
+         else if(r == 3 && group_waiting)
+         {
+            // The group's time is up and the stream has paused.  Commit the group so far.
+            db_async_submit(group_commit_job, NULL);
+            group_waiting = false;
+         }
+         else if(!r && run)
          {
             if(stompy_timeout)
             {
                _log(MINOR, "TRUST message stream - Receive OK.");
                stompy_timeout = false;
             }
-            if(db_start_transaction())
+            jsmn_parser parser;
+            jsmn_init(&parser);
+            f->parsed = jsmn_parse(&parser, f->body, f->tokens, NUM_TOKENS);
+            f->length = strlen(f->body);
+            f->sequence = sequence_stompy();
+            if(shards)
             {
-               run_receive = false;
+               const char * c;
+               for(f->digest = 14695981039346656037ull, c = f->body; *c; c++) f->digest = (f->digest ^ (byte) *c) * 1099511628211ull;
+               f->replay = (replay_frames > 0);
+               if(replay_frames) replay_frames--;
+               check_timeout();
+               if(shard_dispatch(f)) shards_drain();
             }
-            if(run_receive) process_deferred_activations();
-            if(run_receive && !db_errored) process_frame(body);
-
-            if(!db_errored)
+            else
             {
-               if(db_commit_transaction())
-               {
-                  db_rollback_transaction();
-                  run_receive = false;
-               }
-               else
+               frames_read++;
+               db_async_submit(process_frame_job, f);
+               if(group_ms && !group_waiting)
                {
-                  // Send ACK
-                  if(ack_stompy())
-                  {
-                     _log(CRITICAL, "Failed to write message ack.  Error %d %s", errno, strerror(errno));
-                     run_receive = false;
-                  }
+                  group_waiting = true;
+                  group_deadline = time_ms() + group_ms;
                }
             }
-            else
-            {
-               // DB error occurred during processing of frame.
-               db_rollback_transaction();
-               run_receive = false;
-            }
          }
-         else if(run && run_receive)
+         else if(run)
          {
+            db_async_drain();
+            shards_drain();
             if(r != 3)
             {
                run_receive = false;
@@ -410,9 +564,14 @@ static void perform(void)
             {
                if(!stompy_timeout) _log(MINOR, "Receive timeout on stompy connection."); 
                stompy_timeout = true;
+               check_timeout();
             }
          }
       } // while(run_receive && run)
+      // Frames not yet acked will be sent again by stompy, including any uncommitted group.
+      db_async_submit(group_rollback_job, NULL);
+      db_async_drain();
+      shards_drain();
       close_stompy();
       if(run) check_timeout();
       {      
@@ -428,29 +587,352 @@ static void perform(void)
       _log(CRITICAL, "Terminating due to interrupt.");
    }
 
+   db_async_stop();
+   shards_stop();
    db_disconnect();
    word lost = count_deferred_activations();
    if(lost) _log(MINOR, "%d deferred activation%s discarded.", lost, (lost == 1)?"":"s");
+   now = time(NULL);
    report_stats();
+   db_profile_report();
+}
+
+static void process_frame_job(void * const arg)
+{
+   // Runs on the database worker thread, one frame at a time in the order read.  The frame is acked once its
+   // transaction is committed.  After a failure later frames are skipped, to be redelivered after reconnection.
+   // In group commit mode the transaction stays open across frames until the group is big enough or old enough.
+   const struct frame * const f = arg;
+
+   if(pipeline_failed) return;
+
+   if(!group_open)
+   {
+      check_timeout();
+
+      if(db_start_transaction())
+      {
+         pipeline_failed = true;
+         return;
+      }
+      group_open = true;
+      group_frames = group_messages = group_bytes = 0;
+      group_started = time_ms();
+   }
+   process_deferred_activations();
+   if(!db_errored) group_messages += process_frame(f, SHARD_ALL);
+
+   if(!db_errored)
+   {
+      group_frames++;
+      group_bytes += f->length;
+      group_sequence = f->sequence;
+      if(!group_ms ||
+         group_frames >= STOMPY_GROUP_WINDOW ||
+         group_messages >= group_messages_max ||
+         group_bytes >= group_bytes_max ||
+         time_ms() - group_started >= group_ms)
+      {
+         group_commit_job(NULL);
+      }
+   }
+   else
+   {
+      // DB error occurred during processing of frame.
+      group_rollback_job(NULL);
+      pipeline_failed = true;
+   }
+}
+
+static void group_commit_job(void * const arg)
+{
+   // Commit the open transaction and ack every frame in it.
+   if(!group_open || pipeline_failed) return;
+   group_open = false;
+
+   if(db_commit_transaction())
+   {
+      db_rollback_transaction();
+      activation_cache_clear();
+      pipeline_failed = true;
+      return;
+   }
+   if(group_ms) _log(DEBUG, "Committed group of %d frame%s, %d message%s.", group_frames, (group_frames == 1)?"":"s", group_messages, (group_messages == 1)?"":"s");
+
+   // Send ACK
+   if(group_ms ? ack_to_stompy(group_sequence) : ack_stompy())
+   {
+      _log(CRITICAL, "Failed to write message ack.  Error %d %s", errno, strerror(errno));
+      pipeline_failed = true;
+   }
+}
+
+static void group_rollback_job(void * const arg)
+{
+   // Abandon the open transaction.  Its frames have not been acked, so stompy will send them again.
+   if(!group_open) return;
+   group_open = false;
+   db_rollback_transaction();
+   activation_cache_clear();
+   if(group_frames) _log(MINOR, "Group of %d frame%s rolled back.", group_frames, (group_frames == 1)?"":"s");
+}
+
+static void shards_start(void)
+{
+   // Start the shard worker threads.  If one can't be started, carry on with those that were, or with the single
+   // database worker thread if that leaves fewer than two.
+   word i;
+   int rc;
+
+   shards_stopping = false;
+   for(i = 0; i < shards; i++)
+   {
+      shard_state[i].queued = shard_state[i].taken = 0;
+      if((rc = pthread_create(&shard_state[i].thread, NULL, shard_worker, &shard_state[i])))
+      {
+         _log(MAJOR, "Failed to start shard %d.  Error %d %s.  Continuing with %d shard%s.", i, rc, strerror(rc), i, (i == 1)?"":"s");
+         shards = i;
+         break;
+      }
+   }
+   if(shards < 2)
+   {
+      shards_stop();
+      shards = 0;
+      db_async_start();
+      return;
+   }
+   _log(GENERAL, "Processing with %d shards.", shards);
+}
+
+static void shards_stop(void)
+{
+   word i;
+
+   if(!shards) return;
+
+   pthread_mutex_lock(&shard_lock);
+   shards_stopping = true;
+   pthread_cond_broadcast(&shard_work);
+   pthread_mutex_unlock(&shard_lock);
+   for(i = 0; i < shards; i++) pthread_join(shard_state[i].thread, NULL);
+   _log(DEBUG, "Shard worker threads stopped.");
+}
+
+static void shards_drain(void)
+{
+   // Wait until every frame dispatched so far has been finished by all its shards.
+   if(!shards) return;
+
+   pthread_mutex_lock(&shard_lock);
+   while(frames_done < frames_read) pthread_cond_wait(&shard_done, &shard_lock);
+   pthread_mutex_unlock(&shard_lock);
+}
+
+static word shard_dispatch(struct frame * const f)
+{
+   // Work out which shard each message in the frame belongs to, and queue the frame for each of those shards.
+   // A frame which failed to parse goes to shard 0, to be reported.
+   // Returns true if the frame holds a change of identity, in which case the caller waits for it to be finished.
+   char train_id[64], msg_type[8], revised[MAX_FRAME_CHANGES][64];
+   size_t i, messages, index;
+   word s, c, wanted[MAX_SHARDS], revised_shard[MAX_FRAME_CHANGES], changes = 0, change = false;
+   dword h;
+
+   memset(wanted, 0, sizeof(wanted));
+   if(f->parsed)
+   {
+      wanted[0] = true;
+   }
+   else
+   {
+      if(f->tokens[0].type == JSMN_ARRAY)
+      {
+         messages = f->tokens[0].size;
+         index = 1;
+      }
+      else
+      {
+         messages = 1;
+         index = 0;
+      }
+
+      for(i = 0; i < messages; i++)
+      {
+         jsmn_find_extract_token(f->body, f->tokens, index, "train_id", train_id, sizeof(train_id));
+         for(c = 0; c < changes && strcmp(train_id, revised[c]); c++);
+         if(c < changes)
+         {
+            f->shard[i] = revised_shard[c];
+         }
+         else
+         {
+            for(h = 2166136261u, s = 0; train_id[s]; s++) h = (h ^ (byte) train_id[s]) * 16777619u;
+            f->shard[i] = h % shards;
+         }
+         wanted[f->shard[i]] = true;
+
+         jsmn_find_extract_token(f->body, f->tokens, index, "msg_type", msg_type, sizeof(msg_type));
+         if(!strcmp(msg_type, "0007"))
+         {
+            change = true;
+            if(changes < MAX_FRAME_CHANGES)
+            {
+               jsmn_find_extract_token(f->body, f->tokens, index, "revised_train_id", revised[changes], sizeof(revised[changes]));
+               revised_shard[changes++] = f->shard[i];
+            }
+         }
+
+         size_t message_ends = f->tokens[index].end;
+         do  index++; 
+         while ( f->tokens[index].start < message_ends && f->tokens[index].start >= 0 && index < NUM_TOKENS);
+      }
+      // An empty array is still acked, by shard 0.
+      if(!messages) wanted[0] = true;
+   }
+
+   pthread_mutex_lock(&shard_lock);
+   // The frame about to be read goes in the slot after this one, so wait until that is free.
+   while(frames_read + 1 - frames_done >= FRAMES) pthread_cond_wait(&shard_done, &shard_lock);
+   for(f->parts = s = 0; s < shards; s++)
+   {
+      if(wanted[s])
+      {
+         shard_state[s].queue[shard_state[s].queued++ % FRAMES] = f;
+         f->parts++;
+      }
+   }
+   frames_read++;
+   pthread_cond_broadcast(&shard_work);
+   pthread_mutex_unlock(&shard_lock);
+   return change;
+}
+
+static void shard_frame_done(struct frame * const f)
+{
+   // Called with shard_lock held when a shard has finished with its part of the frame.  Acks the frames that every
+   // shard has now finished, in the order read.  After a failure nothing more is acked, so stompy will send the
+   // unacked frames again after reconnection.
+   dword sequence = 0;
+   word finished = false;
+
+   f->parts--;
+   while(frames_done < frames_read && !frames[frames_done % FRAMES].parts)
+   {
+      sequence = frames[frames_done % FRAMES].sequence;
+      frames_done++;
+      finished = true;
+   }
+   if(!finished) return;
+
+   if(!pipeline_failed && ack_to_stompy(sequence))
+   {
+      _log(CRITICAL, "Failed to write message ack.  Error %d %s", errno, strerror(errno));
+      pipeline_failed = true;
+   }
+   pthread_cond_broadcast(&shard_done);
+}
+
+static word shard_part_committed(const struct frame * const f)
+{
+   // Returns true if this shard's part of a frame which may have been sent before has already been committed.
+   int count = 0;
+
+   if(!f->replay) return false;
+   // On failure db_errored is set and the frame is abandoned.
+   if(db_execute(stmt_part_find, "lii", (long) f->digest, shards, worker_shard)) return false;
+   if(db_fetch(stmt_part_find, "i", &count))
+   {
+      db_errored = true;
+      return false;
+   }
+   if(count) _log(MINOR, "Shard %d skipping part of redelivered frame, already committed.", worker_shard);
+   return (count > 0);
+}
+
+static void * shard_worker(void * arg)
+{
+   // Processes this shard's part of each frame queued for it, in the order read, each in its own transaction.
+   // After a failure the remaining frames are skipped.
+   struct shard * const state = arg;
+   struct frame * f;
+
+   worker_shard = state - shard_state;
+   db_thread_init();
+
+   pthread_mutex_lock(&shard_lock);
+   for(;;)
+   {
+      while(state->taken == state->queued && !shards_stopping) pthread_cond_wait(&shard_work, &shard_lock);
+      if(state->taken == state->queued) break;
+      f = state->queue[state->taken++ % FRAMES];
+      pthread_mutex_unlock(&shard_lock);
+
+      if(!pipeline_failed)
+      {
+         if(db_start_transaction())
+         {
+            pipeline_failed = true;
+         }
+         else
+         {
+            process_deferred_activations();
+            if(!db_errored && !shard_part_committed(f) && !db_errored)
+            {
+               if(process_frame(f, worker_shard) && !db_errored) db_execute(stmt_part_insert, "liil", (long) f->digest, shards, worker_shard, (long) time(NULL));
+            }
+            if(db_errored || db_commit_transaction())
+            {
+               db_rollback_transaction();
+               activation_cache_clear();
+               pipeline_failed = true;
+            }
+         }
+      }
+
+      pthread_mutex_lock(&shard_lock);
+      shard_frame_done(f);
+   }
+   pthread_mutex_unlock(&shard_lock);
+
+   db_thread_end();
+   return NULL;
+}
+
+static void stat_count(const word category)
+{
+   // The shards count concurrently.
+   __atomic_add_fetch(&stats[category], 1, __ATOMIC_RELAXED);
 }
 
-static void process_frame(const char * const body)
+static void latency_record(const time_t latency)
 {
-   jsmn_parser parser;
+   time_t max = __atomic_load_n(&latency_max, __ATOMIC_RELAXED);
+
+   __atomic_add_fetch(&latency_sum, latency, __ATOMIC_RELAXED);
+   __atomic_add_fetch(&latency_count, 1, __ATOMIC_RELAXED);
+   while(latency > max && !__atomic_compare_exchange_n(&latency_max, &max, latency, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+static word process_frame(const struct frame * const f, const word shard)
+{
+   // Process the messages in the frame which belong to shard, or all of them if shard is SHARD_ALL.
+   // Returns the number of TRUST messages processed.
+   const char * const body = f->body;
+   const jsmntok_t * const tokens = f->tokens;
    char query[256];
    qword elapsed = time_ms();
    
-   jsmn_init(&parser);
-   int r = jsmn_parse(&parser, body, tokens, NUM_TOKENS);
+   size_t messages = 0, processed = 0;
+   int r = f->parsed;
    if(r != 0) 
    {
-      sprintf(zs, "Parser result %d.  Message discarded.", r);
-      _log(MAJOR, zs);
-      stats[NotRecog]++;
+      _log(MAJOR, "Parser result %d.  Message discarded.", r);
+      stat_count(NotRecog);
    }
    else
    {
-      size_t messages, i, index;
+      size_t i, index;
       // Is it an array?
       if(tokens[0].type == JSMN_ARRAY)
       {
@@ -467,25 +949,33 @@ static void process_frame(const char * const body)
 
       for(i=0; i < messages && !db_errored; i++)
       {
-         char message_name[128], queue_timestamp_s[128];
-         jsmn_find_extract_token(body, tokens, index, "msg_type", message_name, sizeof(message_name));
+         if(shard != SHARD_ALL && f->shard[i] != shard)
+         {
+            size_t message_ends = tokens[index].end;
+            do  index++; 
+            while ( tokens[index].start < message_ends && tokens[index].start >= 0 && index < NUM_TOKENS);
+            continue;
+         }
+         processed++;
+
+         char message_name[128];
+         jsmn_index fields;
+         jsmn_index_object(&fields, body, tokens, index);
+         jsmn_index_extract(&fields, "msg_type", message_name, sizeof(message_name));
          word message_type = atoi(message_name);
 
          now = time(NULL);
          
-         jsmn_find_extract_token(body, tokens, index, "msg_queue_timestamp", queue_timestamp_s, sizeof(queue_timestamp_s));
-         queue_timestamp_s[10] = '\0';
-         status_last_trust_actual = atol(queue_timestamp_s);
+         time_t actual = jsmn_index_timestamp(&fields, "msg_queue_timestamp");
+         __atomic_store_n(&status_last_trust_actual, actual, __ATOMIC_RELAXED);
          time_t latency;
-         if(now > status_last_trust_actual)
-            latency = now - status_last_trust_actual;
+         if(now > actual)
+            latency = now - actual;
          else
             latency = 0;
          //ra_latency_ms = ( (ra_latency_ms * 499) + (latency * 1000))/500;
-         latency_sum += latency;
-         latency_count++;
-         if(latency > latency_max) latency_max = latency;
-         _log(DEBUG, "Queue timestamp = %s, latency %ld s, sum = %s s", time_text(status_last_trust_actual, false), latency, commas_q(latency_sum));
+         latency_record(latency);
+         _log(DEBUG, "Queue timestamp = %s, latency %ld s", time_text(actual, false), latency);
          
          if(debug)
          {
@@ -493,20 +983,20 @@ static void process_frame(const char * const body)
          }
          if(!strncmp(message_name, "000", 3) && message_type > 0 && message_type < 9) 
          {
-            stats[GoodMessage]++;
-            message_count++;
-            stats[GoodMessage + message_type]++;
-            status_last_trust_processed = now;
+            stat_count(GoodMessage);
+            __atomic_add_fetch(&message_count, 1, __ATOMIC_RELAXED);
+            stat_count(GoodMessage + message_type);
+            __atomic_store_n(&status_last_trust_processed, now, __ATOMIC_RELAXED);
 
             switch(message_type)
             {
-            case 1: process_trust_0001(body, tokens, index); break;
-            case 2: process_trust_0002(body, tokens, index); break;
-            case 3: process_trust_0003(body, tokens, index); break;
-            case 5: process_trust_0005(body, tokens, index); break;
-            case 6: process_trust_0006(body, tokens, index); break;
-            case 7: process_trust_0007(body, tokens, index); break;
-            case 8: process_trust_0008(body, tokens, index); break;
+            case 1: process_trust_0001(&fields); break;
+            case 2: process_trust_0002(&fields); break;
+            case 3: process_trust_0003(&fields); break;
+            case 5: process_trust_0005(&fields); break;
+            case 6: process_trust_0006(&fields); break;
+            case 7: process_trust_0007(&fields); break;
+            case 8: process_trust_0008(&fields); break;
             default:
                _log(MINOR, "Message type \"%s\" discarded.", message_name);
                break;
@@ -516,7 +1006,7 @@ static void process_frame(const char * const body)
          {
             _log(MINOR, "Unrecognised message type \"%s\".", message_name);
             jsmn_dump_tokens(body, tokens, index);
-            stats[NotRecog]++;
+            stat_count(NotRecog);
          }
          
          size_t message_ends = tokens[index].end;
@@ -530,11 +1020,15 @@ static void process_frame(const char * const body)
    {
       _log(MINOR, "Frame took %s ms to process.", commas_q(elapsed));
    }
-   sprintf(query, "UPDATE status SET last_trust_processed = %ld, last_trust_actual = %ld", status_last_trust_processed, status_last_trust_actual);
-   db_query(query);
+   if(shard == SHARD_ALL)
+   {
+      sprintf(query, "UPDATE status SET last_trust_processed = %ld, last_trust_actual = %ld", status_last_trust_processed, status_last_trust_actual);
+      db_query(query);
+   }
+   return processed;
 }
 
-static void process_trust_0001(const char * const string, const jsmntok_t * const tokens, const int index)
+static void process_trust_0001(const jsmn_index * const fields)
 {
    char zs[128], zs1[128], report[1024];
    char train_id[64], train_uid[64], tsc[64];
@@ -545,29 +1039,29 @@ static void process_trust_0001(const char * const string, const jsmntok_t * cons
    
    sprintf(report, "Activation message:");
 
-   jsmn_find_extract_token(string, tokens, index, "train_id", train_id, sizeof(train_id));
+   jsmn_index_extract(fields, "train_id", train_id, sizeof(train_id));
    sprintf(zs1, " train_id=\"%s\"", train_id);
    strcat(report, zs1);
 
-   jsmn_find_extract_token(string, tokens, index, "schedule_start_date", zs, sizeof(zs));
+   jsmn_index_extract(fields, "schedule_start_date", zs, sizeof(zs));
    time_t schedule_start_date_stamp = parse_datestamp(zs);
    sprintf(zs1, " schedule_start_date=%.32s", zs);
    strcat(report, zs1);
 
-   jsmn_find_extract_token(string, tokens, index, "schedule_end_date", zs, sizeof(zs));
+   jsmn_index_extract(fields, "schedule_end_date", zs, sizeof(zs));
    time_t schedule_end_date_stamp   = parse_datestamp(zs);
    sprintf(zs1, " schedule_end_date=%.32s", zs);
    strcat(report, zs1);
 
-   jsmn_find_extract_token(string, tokens, index, "train_uid", train_uid, sizeof(train_uid));
+   jsmn_index_extract(fields, "train_uid", train_uid, sizeof(train_uid));
    sprintf(zs1, " train_uid=\"%s\"", train_uid);
    strcat(report, zs1);
 
-   jsmn_find_extract_token(string, tokens, index, "schedule_source", zs, sizeof(zs));
+   jsmn_index_extract(fields, "schedule_source", zs, sizeof(zs));
    sprintf(zs1, " schedule_source=\"%.8s\"", zs);
    strcat(report, zs1);
 
-   jsmn_find_extract_token(string, tokens, index, "schedule_wtt_id", zs, sizeof(zs));
+   jsmn_index_extract(fields, "schedule_wtt_id", zs, sizeof(zs));
    sprintf(zs1, " schedule_wtt_id=\"%.16s\"", zs);
    strcat(report, zs1);
 
@@ -580,7 +1074,7 @@ static void process_trust_0001(const char * const string, const jsmntok_t * cons
       if(num_rows < 1) 
       {
          mysql_free_result(result0);
-         stats[Mess1Miss]++;
+         stat_count(Mess1Miss);
          _log(MINOR, report);
          _log(MINOR, "   No schedules found.  Deferring activation.");
          defer_activation(train_uid, schedule_start_date_stamp, schedule_end_date_stamp, train_id);
@@ -594,87 +1088,88 @@ static void process_trust_0001(const char * const string, const jsmntok_t * cons
             // Activation matches cancelled schedule.  This is BAU so don't log it
             _log(DEBUG, report);
             _log(DEBUG, "   Matches cancelled schedule %ld.", cif_schedule_id);
-            stats[Mess1Cape]++;
+            stat_count(Mess1Cape);
             cancelled = true;
          }
          sprintf(query, "INSERT INTO trust_activation VALUES(%ld, '%s', %u, 0)", now, train_id, cif_schedule_id);
          db_query(query);
+         activation_cache_add(train_id, now, cif_schedule_id, true);
          mysql_free_result(result0);
 
          // Process "extra" data
          sprintf(query, "INSERT INTO trust_activation_extra VALUES(%ld, '%s', '", now, train_id);
 
-         jsmn_find_extract_token(string, tokens, index, "schedule_source", zs, sizeof(zs));
+         jsmn_index_extract(fields, "schedule_source", zs, sizeof(zs));
          strcat(query, zs);
          strcat(query, "', '");
          
-         jsmn_find_extract_token(string, tokens, index, "train_file_address", zs, sizeof(zs));
+         jsmn_index_extract(fields, "train_file_address", zs, sizeof(zs));
          strcat(query, zs);
          strcat(query, "', ");
              
-         jsmn_find_extract_token(string, tokens, index, "schedule_end_date", zs, sizeof(zs));
+         jsmn_index_extract(fields, "schedule_end_date", zs, sizeof(zs));
          sprintf(zs1, "%lu", parse_datestamp(zs));
          strcat(query, zs1);
          strcat(query, ", ");
                              
-         jsmn_find_extract_token(string, tokens, index, "tp_origin_timestamp", zs, sizeof(zs));
+         jsmn_index_extract(fields, "tp_origin_timestamp", zs, sizeof(zs));
          sprintf(zs1, "%lu", parse_datestamp(zs));
          strcat(query, zs1);
          strcat(query, ", ");
               
-         jsmn_find_extract_token(string, tokens, index, "creation_timestamp", zs, sizeof(zs));
+         jsmn_index_extract(fields, "creation_timestamp", zs, sizeof(zs));
          zs[10] = '\0';
          sprintf(zs1, "%lu", correct_trust_timestamp(atol(zs)));
          strcat(query, zs1);
          strcat(query, ", '");
                
-         jsmn_find_extract_token(string, tokens, index, "tp_origin_stanox", zs, sizeof(zs));
+         jsmn_index_extract(fields, "tp_origin_stanox", zs, sizeof(zs));
          strcat(query, zs);
          strcat(query, "', ");
                  
-         jsmn_find_extract_token(string, tokens, index, "origin_dep_timestamp", zs, sizeof(zs));
+         jsmn_index_extract(fields, "origin_dep_timestamp", zs, sizeof(zs));
          zs[10] = '\0';
          sprintf(zs1, "%lu", correct_trust_timestamp(atol(zs)));
          strcat(query, zs1);
          strcat(query, ", '");
              
-         jsmn_find_extract_token(string, tokens, index, "train_service_code", tsc, sizeof(tsc));
+         jsmn_index_extract(fields, "train_service_code", tsc, sizeof(tsc));
          strcat(query, tsc);
          strcat(query, "', '");
                
-         jsmn_find_extract_token(string, tokens, index, "toc_id", zs, sizeof(zs));
+         jsmn_index_extract(fields, "toc_id", zs, sizeof(zs));
          strcat(query, zs);
          strcat(query, "', '");
                            
-         jsmn_find_extract_token(string, tokens, index, "d1266_record_number", zs, sizeof(zs));
+         jsmn_index_extract(fields, "d1266_record_number", zs, sizeof(zs));
          strcat(query, zs);
          strcat(query, "', '");
               
-         jsmn_find_extract_token(string, tokens, index, "train_call_type", zs, sizeof(zs));
+         jsmn_index_extract(fields, "train_call_type", zs, sizeof(zs));
          strcat(query, zs);
          strcat(query, "', '");
                   
-         jsmn_find_extract_token(string, tokens, index, "train_uid", zs, sizeof(zs));
+         jsmn_index_extract(fields, "train_uid", zs, sizeof(zs));
          strcat(query, zs);
          strcat(query, "', '");
                         
-         jsmn_find_extract_token(string, tokens, index, "train_call_mode", zs, sizeof(zs));
+         jsmn_index_extract(fields, "train_call_mode", zs, sizeof(zs));
          strcat(query, zs);
          strcat(query, "', '");
                   
-         jsmn_find_extract_token(string, tokens, index, "schedule_type", zs, sizeof(zs));
+         jsmn_index_extract(fields, "schedule_type", zs, sizeof(zs));
          strcat(query, zs);
          strcat(query, "', '");
                     
-         jsmn_find_extract_token(string, tokens, index, "sched_origin_stanox", zs, sizeof(zs));
+         jsmn_index_extract(fields, "sched_origin_stanox", zs, sizeof(zs));
          strcat(query, zs);
          strcat(query, "', '");
               
-         jsmn_find_extract_token(string, tokens, index, "schedule_wtt_id", zs, sizeof(zs));
+         jsmn_index_extract(fields, "schedule_wtt_id", zs, sizeof(zs));
          strcat(query, zs);
          strcat(query, "', ");
                   
-         jsmn_find_extract_token(string, tokens, index, "schedule_start_date", zs, sizeof(zs));
+         jsmn_index_extract(fields, "schedule_start_date", zs, sizeof(zs));
          sprintf(zs1, "%lu", parse_datestamp(zs));
          strcat(query, zs1);
          strcat(query, ")");
@@ -717,8 +1212,11 @@ static void process_trust_0001(const char * const string, const jsmntok_t * cons
                   sprintf(query, "INSERT INTO obfus_lookup (created, true_hc, obfus_hc) VALUES(%ld, '%s', '%s')", now, true_hc, obfus_hc);
                   db_query(query);
                   _log(DEBUG, "Added obfuscated headcode \"%s\", true headcode \"%s\" (%s) to obfuscation lookup table.  TRUST id \"%s\", garner schedule id %u.",obfus_hc, true_hc, status, train_id, cif_schedule_id);
-                  sprintf(query, "DELETE FROM obfus_lookup WHERE created < %ld", now - 86400L); // 24 hours.
-                  db_query(query);
+                  if(!shards)
+                  {
+                     sprintf(query, "DELETE FROM obfus_lookup WHERE created < %ld", now - 86400L); // 24 hours.
+                     db_query(query);
+                  }
                }
                else if(true_hc[0])
                {
@@ -759,7 +1257,7 @@ static void process_trust_0001(const char * const string, const jsmntok_t * cons
                      sprintf(query, "UPDATE cif_schedules SET deduced_headcode = '%s', deduced_headcode_status = 'A' WHERE id = %u", act_headcode, cif_schedule_id);
                      _log(GENERAL, "Deduced headcode \"%s\" for schedule %u.", act_headcode, cif_schedule_id);
                      db_query(query);
-                     stats[DeducedHC]++;
+                     stat_count(DeducedHC);
                   }
                   else if(strcmp(row0[1], act_headcode) && row0[2][0] == 'A')
                   {
@@ -767,7 +1265,7 @@ static void process_trust_0001(const char * const string, const jsmntok_t * cons
                      sprintf(query, "UPDATE cif_schedules SET deduced_headcode = '%s', deduced_headcode_status = 'A' WHERE id = %u", act_headcode, cif_schedule_id);
                      _log(MAJOR, "Previously deduced headcode \"%s\", status \"%s\" replaced by \"%s\" for schedule %u.", row0[1], row0[2], act_headcode, cif_schedule_id);
                      db_query(query);
-                     stats[DeducedHCReplaced]++;
+                     stat_count(DeducedHCReplaced);
                   }
                   else if(strcmp(row0[1], act_headcode))
                   {
@@ -789,7 +1287,7 @@ static void process_trust_0001(const char * const string, const jsmntok_t * cons
                      _log(GENERAL, "TSC in activation message \"%s\", schedule %ld has \"%s\".  Schedule updated.", tsc, cif_schedule_id, row0[3]);
                      sprintf(query, "UPDATE cif_schedules SET CIF_train_service_code = '%s' WHERE id = %u", tsc, cif_schedule_id);
                      db_query(query);
-                     stats[DeducedTSC]++;
+                     stat_count(DeducedTSC);
                   }
                   else
                   {
@@ -805,15 +1303,15 @@ static void process_trust_0001(const char * const string, const jsmntok_t * cons
    return;
 }
 
-static void process_trust_0002(const char * string, const jsmntok_t * tokens, const int index)
+static void process_trust_0002(const jsmn_index * const fields)
 {
    char query[1024];
    char train_id[128], reason[128], type[128], stanox[128];
    
-   jsmn_find_extract_token(string, tokens, index, "train_id", train_id, sizeof(train_id));
-   jsmn_find_extract_token(string, tokens, index, "canx_reason_code", reason, sizeof(reason));
-   jsmn_find_extract_token(string, tokens, index, "canx_type", type, sizeof(type));
-   jsmn_find_extract_token(string, tokens, index, "loc_stanox", stanox, sizeof(stanox));
+   jsmn_index_extract(fields, "train_id", train_id, sizeof(train_id));
+   jsmn_index_extract(fields, "canx_reason_code", reason, sizeof(reason));
+   jsmn_index_extract(fields, "canx_type", type, sizeof(type));
+   jsmn_index_extract(fields, "loc_stanox", stanox, sizeof(stanox));
 
    sprintf(query, "INSERT INTO trust_cancellation VALUES(%ld, '%s', '%s', '%s', '%s', 0)", now, train_id, reason, type, stanox);
    db_query(query);
@@ -821,92 +1319,57 @@ static void process_trust_0002(const char * string, const jsmntok_t * tokens, co
    return;
 }
 
-static void process_trust_0003(const char * string, const jsmntok_t * tokens, const int index)
+static void process_trust_0003(const jsmn_index * const fields)
 {
-  char query[1024], zs[32], zs1[32], train_id[16], loc_stanox[16], event_type[16];
+   char query[1024], train_id[16], loc_stanox[16], platform[16], next_report_stanox[16];
+   jsmn_view v;
    word flags;
+   int timetable_variation, next_report_run_time;
   
-   time_t planned_timestamp, actual_timestamp, timestamp;
+   time_t planned_timestamp, actual_timestamp, gbtt_timestamp;
 
    flags = 0;
    
-   sprintf(query, "INSERT INTO trust_movement VALUES(%ld, '", now);
-   jsmn_find_extract_token(string, tokens, index, "train_id", train_id, sizeof(train_id));
-   strcat(query, train_id);
-   strcat(query, "', '");
-   jsmn_find_extract_token(string, tokens, index, "event_type", event_type, sizeof(event_type));
-   jsmn_find_extract_token(string, tokens, index, "planned_event_type", zs, sizeof(zs));
-   if     (event_type[0] == 'D' && zs[0] == 'D') flags = 0x0001;
-   else if(event_type[0] == 'A' && zs[0] == 'A') flags = 0x0002;
-   else if(event_type[0] == 'A' && zs[0] == 'D') flags = 0x0003; // ARRIVAL, DESTINATION
-   else _log(MAJOR, "TRUST movement:  Unexpected fields event_type \"%s\", planned_event_type \"%s\".", event_type, zs);
-   jsmn_find_extract_token(string, tokens, index, "platform", zs, sizeof(zs));
-   strcat(query, zs);
-   strcat(query, "', '");
-   jsmn_find_extract_token(string, tokens, index, "loc_stanox", loc_stanox, sizeof(loc_stanox));
-   strcat(query, loc_stanox);
-   strcat(query, "', ");
-   jsmn_find_extract_token(string, tokens, index, "actual_timestamp", zs, sizeof(zs));
-   zs[10] = '\0';
-   actual_timestamp = correct_trust_timestamp(atol(zs));
-   sprintf(zs, "%ld", actual_timestamp);
-   strcat(query, zs);
-   strcat(query, ", ");
+   jsmn_index_extract(fields, "train_id", train_id, sizeof(train_id));
+   jsmn_view event_type = jsmn_index_view(fields, "event_type");
+   jsmn_view planned_event_type = jsmn_index_view(fields, "planned_event_type");
+   if     (event_type.text[0] == 'D' && planned_event_type.text[0] == 'D') flags = 0x0001;
+   else if(event_type.text[0] == 'A' && planned_event_type.text[0] == 'A') flags = 0x0002;
+   else if(event_type.text[0] == 'A' && planned_event_type.text[0] == 'D') flags = 0x0003; // ARRIVAL, DESTINATION
+   else _log(MAJOR, "TRUST movement:  Unexpected fields event_type \"%.*s\", planned_event_type \"%.*s\".", (int) event_type.length, event_type.text, (int) planned_event_type.length, planned_event_type.text);
+   jsmn_index_extract(fields, "platform", platform, sizeof(platform));
+   jsmn_index_extract(fields, "loc_stanox", loc_stanox, sizeof(loc_stanox));
+   actual_timestamp = correct_trust_timestamp(jsmn_index_timestamp(fields, "actual_timestamp"));
    //if(actual_timestamp > status_last_trust_actual)
    //{
    //   status_last_trust_actual = actual_timestamp;
    //}
-   jsmn_find_extract_token(string, tokens, index, "gbtt_timestamp", zs, sizeof(zs));
-   zs[10] = '\0';
-   timestamp = correct_trust_timestamp(atol(zs));
-   sprintf(zs, "%ld", timestamp);
-   strcat(query, zs);
-   strcat(query, ", ");
-   jsmn_find_extract_token(string, tokens, index, "planned_timestamp", zs, sizeof(zs));
-   zs[10] = '\0';
-   planned_timestamp = correct_trust_timestamp(atol(zs));
-   sprintf(zs, "%ld", planned_timestamp);
-   strcat(query, zs);
-   strcat(query, ", ");
-   jsmn_find_extract_token(string, tokens, index, "timetable_variation", zs, sizeof(zs));
-   strcat(query, zs);
-   strcat(query, ", '");
-   jsmn_find_extract_token(string, tokens, index, "event_source", zs, sizeof(zs));
-   switch(zs[0])
+   gbtt_timestamp = correct_trust_timestamp(jsmn_index_timestamp(fields, "gbtt_timestamp"));
+   planned_timestamp = correct_trust_timestamp(jsmn_index_timestamp(fields, "planned_timestamp"));
+   timetable_variation = jsmn_index_integer(fields, "timetable_variation");
+   v = jsmn_index_view(fields, "event_source");
+   switch(v.text[0])
       {
       case 'A': break;
       case 'M': flags += 0x0004; break;
-      default: _log(MAJOR, "TRUST movement:  Unexpected event_source field \"%s\".", zs); break;
+      default: _log(MAJOR, "TRUST movement:  Unexpected event_source field \"%.*s\".", (int) v.length, v.text); break;
       }
-   jsmn_find_extract_token(string, tokens, index, "offroute_ind", zs, sizeof(zs));
-   if(zs[0] == 't') flags += 0x0020;
-   jsmn_find_extract_token(string, tokens, index, "train_terminated", zs, sizeof(zs));
-   if(zs[0] == 't') flags += 0x0040;
-   jsmn_find_extract_token(string, tokens, index, "variation_status", zs, sizeof(zs));
-   switch(zs[2])
+   if(jsmn_index_view(fields, "offroute_ind").text[0] == 't') flags += 0x0020;
+   if(jsmn_index_view(fields, "train_terminated").text[0] == 't') flags += 0x0040;
+   v = jsmn_index_view(fields, "variation_status");
+   switch((v.length > 2) ? v.text[2] : '\0')
       {
       case 'R': break; // EARLY
       case ' ': flags += 0x0008; break; // ON TIME
       case 'T': flags += 0x0010; break; // LATE
       case 'F': flags += 0x0018; break; // OFF ROUTE
-      default: _log(MAJOR, "TRUST movement:  Unexpected variation_status field \"%s\".", zs); break;
+      default: _log(MAJOR, "TRUST movement:  Unexpected variation_status field \"%.*s\".", (int) v.length, v.text); break;
       }
-   jsmn_find_extract_token(string, tokens, index, "next_report_stanox", zs, sizeof(zs));
-   strcat(query, zs);
-   strcat(query, "', ");
-   jsmn_find_extract_token(string, tokens, index, "next_report_run_time", zs, sizeof(zs));
-   sprintf(zs1, "%d", atoi(zs));
-   strcat(query, zs1);
-   strcat(query, ", ");
-   jsmn_find_extract_token(string, tokens, index, "correction_ind", zs, sizeof(zs));
-   if(zs[0] == 't') flags += 0x0080;
-
-   sprintf(zs1, "%d", flags);
-   strcat(query, zs1);
-   
-   strcat(query, ")");
+   jsmn_index_extract(fields, "next_report_stanox", next_report_stanox, sizeof(next_report_stanox));
+   next_report_run_time = jsmn_index_integer(fields, "next_report_run_time");
+   if(jsmn_index_view(fields, "correction_ind").text[0] == 't') flags += 0x0080;
 
-   db_query(query);
+   db_execute(stmt_movement_insert, "lsssllliisi", now, train_id, platform, loc_stanox, actual_timestamp, gbtt_timestamp, planned_timestamp, timetable_variation, next_report_stanox, next_report_run_time, flags);
 
    // Old one?
    if(planned_timestamp && now - actual_timestamp > 12*60*60)
@@ -917,13 +1380,35 @@ static void process_trust_0003(const char * string, const jsmntok_t * tokens, co
    // NB Don't accept cif_schedule_id==0 ones here as the schedule may have arrived after the activation!
    // This can happen due to a VSTP race, hopefully fixed V505
    // OR due to the service being activated before the daily timetable download.
-   sprintf(query, "SELECT * from trust_activation where trust_id = '%s' and created > %ld and cif_schedule_id > 0", train_id, actual_timestamp - (4*24*60*60));
-   if(!(*conf[conf_trustdb_no_deduce_act]) && !db_query(query))
+   // Number of activations, or -1 if not known.
+   int activations = -1;
+   if(!(*conf[conf_trustdb_no_deduce_act]))
    {
-      MYSQL_RES * result0 = db_store_result();
+      const struct activation_cache_entry * activation = activation_cache_find(train_id);
+      if(activation && activation->scheduled_created > actual_timestamp - (4*24*60*60))
+      {
+         stat_count(ActCacheHit);
+         activations = 1;
+      }
+      else
+      {
+         sprintf(query, "SELECT created, cif_schedule_id from trust_activation where trust_id = '%s' and created > %ld and cif_schedule_id > 0", train_id, actual_timestamp - (4*24*60*60));
+         if(!db_query(query))
+         {
+            MYSQL_RES * result0 = db_store_result();
+            MYSQL_ROW row0;
 
-      word num_rows = mysql_num_rows(result0);
-      mysql_free_result(result0);
+            stat_count(ActCacheMiss);
+            activations = mysql_num_rows(result0);
+            while((row0 = mysql_fetch_row(result0))) activation_cache_add(train_id, atol(row0[0]), atol(row0[1]), false);
+            mysql_free_result(result0);
+         }
+      }
+   }
+   if(activations >= 0)
+   {
+      MYSQL_RES * result0;
+      word num_rows = activations;
       if(num_rows > 1)
       {
          // This is not actually invalid, if there's some cancellations as well
@@ -956,7 +1441,7 @@ static void process_trust_0003(const char * string, const jsmntok_t * tokens, co
                _log(MINOR, "   A matching activation with no schedule exists.");
             }
          }
-         stats[MovtNoAct]++;
+         stat_count(MovtNoAct);
 
          if(!run)
          {
@@ -977,28 +1462,18 @@ static void process_trust_0003(const char * string, const jsmntok_t * tokens, co
 
          if(!reason[0])
          {
-            sprintf(query, "SELECT tiploc FROM corpus WHERE stanox = %s AND tiploc != ''", loc_stanox);
-            if(!db_query(query))
+            strcpy(tiploc, corpus_stanox_tiploc(loc_stanox));
+            if(!tiploc[0])
             {
-               result0 = db_store_result();
-               num_rows = mysql_num_rows(result0);
-               if(num_rows)
-               {
-                  row0 = mysql_fetch_row(result0);
-                  strcpy(tiploc, row0[0]);
-               }
-               else
-               {
-                  strcpy(reason, "Unable to determine TIPLOC");
-               }
-               mysql_free_result(result0);
+               strcpy(reason, "Unable to determine TIPLOC");
             }
          }
 
          if(!reason[0])
          {
             char query1[256];
-            struct tm * broken = localtime(&planned_timestamp);
+            struct tm planned_tm;
+            struct tm * broken = localtime_r(&planned_timestamp, &planned_tm);
             //sort_time = broken->tm_hour * 4 * 60 + broken->tm_min * 4;
             sprintf(planned, "%02d%02d%s", broken->tm_hour, broken->tm_min, (broken->tm_sec > 29)?"H":"");
             // Select the day
@@ -1009,19 +1484,24 @@ static void process_trust_0003(const char * string, const jsmntok_t * tokens, co
             broken->tm_sec = 0;
             time_t when = timegm(broken);
 
-            // TODO It is this query which takes ages.  Can we accelerate it?
+            char ids[TIMETABLE_CANDIDATES * 12];
+            if(!timetable_candidates(tiploc, planned, event_type.text[0], when, day, ids))
+            {
+               // The timetable index gives the candidates.  Check they have not been deleted since it was loaded.
+               sprintf(query, "SELECT id, CIF_train_uid, signalling_id, CIF_stp_indicator FROM cif_schedules WHERE id IN (%s) AND deleted > %ld ORDER BY LOCATE(CIF_stp_indicator, 'NPO')", ids, planned_timestamp);
+            }
+            else
+            {
+            // Timetable index not available.  This query takes ages.
             sprintf(query, "SELECT cif_schedules.id, cif_schedules.CIF_train_uid, signalling_id, CIF_stp_indicator FROM cif_schedules INNER JOIN cif_schedule_locations AS l ON cif_schedules.id = l.cif_schedule_id WHERE l.tiploc_code = '%s'",
                     tiploc);
 
-            if(event_type[0] == 'A')
+            if(event_type.text[0] == 'A')
                sprintf(query1, " AND (l.arrival = '%s' OR l.pass = '%s')", planned, planned);
-            else if(event_type[0] == 'D')
+            else if(event_type.text[0] == 'D')
                sprintf(query1, " AND (l.departure = '%s' OR l.pass = '%s')", planned, planned);
             else
-            {
                sprintf(query1, " AND 0");
-               strcpy(reason, "Unrecognised event type");
-            }
             strcat(query, query1);
 
             strcat(query, " AND (cif_schedules.CIF_stp_indicator = 'N' OR cif_schedules.CIF_stp_indicator = 'P' OR cif_schedules.CIF_stp_indicator = 'O')");
@@ -1037,6 +1517,7 @@ static void process_trust_0003(const char * string, const jsmntok_t * tokens, co
             //                                      Exclude buses . . . . . . . . . . . . . . .
             sprintf(query1, " AND deleted > %ld AND train_status != 'B' AND train_status != '5' ORDER BY LOCATE(CIF_stp_indicator, 'NPO')", planned_timestamp);
             strcat(query, query1);
+            }
             if(!db_query(query))
             {
 #define ROWS 8
@@ -1097,6 +1578,7 @@ static void process_trust_0003(const char * string, const jsmntok_t * tokens, co
                {
                   sprintf(query, "INSERT INTO trust_activation VALUES(%ld, '%s', %u, 1)", now, train_id, cif_schedule_id);
                   db_query(query);
+                  activation_cache_add(train_id, now, cif_schedule_id, true);
                   elapsed = time_ms() - elapsed;
                   _log(MINOR, "   Successfully deduced schedule %u.  Elapsed time %s ms.", cif_schedule_id, commas_q(elapsed));
 
@@ -1133,8 +1615,11 @@ static void process_trust_0003(const char * string, const jsmntok_t * tokens, co
                               sprintf(query, "INSERT INTO obfus_lookup VALUES(%ld, '%s', '%s')", now, true_hc, obfus_hc);
                               db_query(query);
                               _log(DEBUG, "   Added obfuscated \"%s\", true \"%s\" (%s) to headcode obfuscation table.  TRUST id \"%s\", garner schedule id %u.  [Deduced activation]", obfus_hc, true_hc, status, train_id, cif_schedule_id);
-                              sprintf(query, "DELETE FROM obfus_lookup WHERE created < %ld", now - 86400L); // 24 hours.
-                              db_query(query);
+                              if(!shards)
+                              {
+                                 sprintf(query, "DELETE FROM obfus_lookup WHERE created < %ld", now - 86400L); // 24 hours.
+                                 db_query(query);
+                              }
                            }
                            else if(true_hc[0])
                            {
@@ -1150,7 +1635,7 @@ static void process_trust_0003(const char * string, const jsmntok_t * tokens, co
 
          if(!reason[0])
          {
-            stats[DeducedAct]++;
+            stat_count(DeducedAct);
          }
          else
          {
@@ -1164,13 +1649,13 @@ static void process_trust_0003(const char * string, const jsmntok_t * tokens, co
    return;
 }
 
-static void process_trust_0005(const char * const string, const jsmntok_t * const tokens, const int index)
+static void process_trust_0005(const jsmn_index * const fields)
 {
    char query[1024];
    char train_id[128], stanox[128];
    
-   jsmn_find_extract_token(string, tokens, index, "train_id", train_id, sizeof(train_id));
-   jsmn_find_extract_token(string, tokens, index, "loc_stanox", stanox, sizeof(stanox));
+   jsmn_index_extract(fields, "train_id", train_id, sizeof(train_id));
+   jsmn_index_extract(fields, "loc_stanox", stanox, sizeof(stanox));
 
    sprintf(query, "INSERT INTO trust_cancellation VALUES(%ld, '%s', '', '', '%s', 1)", now, train_id, stanox);
    db_query(query);
@@ -1178,14 +1663,14 @@ static void process_trust_0005(const char * const string, const jsmntok_t * cons
    return;
 }
 
-static void process_trust_0006(const char * const string, const jsmntok_t * const tokens, const int index)
+static void process_trust_0006(const jsmn_index * const fields)
 {
    char query[1024];
    char train_id[128], reason[128], stanox[128];
    
-   jsmn_find_extract_token(string, tokens, index, "train_id", train_id, sizeof(train_id));
-   jsmn_find_extract_token(string, tokens, index, "reason_code", reason, sizeof(reason));
-   jsmn_find_extract_token(string, tokens, index, "loc_stanox", stanox, sizeof(stanox));
+   jsmn_index_extract(fields, "train_id", train_id, sizeof(train_id));
+   jsmn_index_extract(fields, "reason_code", reason, sizeof(reason));
+   jsmn_index_extract(fields, "loc_stanox", stanox, sizeof(stanox));
 
    sprintf(query, "INSERT INTO trust_changeorigin VALUES(%ld, '%s', '%s', '%s')", now, train_id, reason, stanox);
    db_query(query);
@@ -1193,7 +1678,7 @@ static void process_trust_0006(const char * const string, const jsmntok_t * cons
    return;
 }
 
-static void process_trust_0007(const char * const string, const jsmntok_t * const tokens, const int index)
+static void process_trust_0007(const jsmn_index * const fields)
 {
    char query[1024];
    char train_id[128], new_id[128];
@@ -1201,22 +1686,33 @@ static void process_trust_0007(const char * const string, const jsmntok_t * cons
    MYSQL_ROW row;
    dword cif_schedule_id = 0;
    
-   jsmn_find_extract_token(string, tokens, index, "train_id", train_id, sizeof(train_id));
-   jsmn_find_extract_token(string, tokens, index, "revised_train_id", new_id, sizeof(new_id));
+   jsmn_index_extract(fields, "train_id", train_id, sizeof(train_id));
+   jsmn_index_extract(fields, "revised_train_id", new_id, sizeof(new_id));
 
    sprintf(query, "INSERT INTO trust_changeid VALUES(%ld, '%s', '%s')", now, train_id, new_id);
    db_query(query);
    
-   sprintf(query, "SELECT cif_schedule_id FROM trust_activation WHERE created > %lu AND trust_id = '%s' ORDER BY created DESC",
-           now - 20*24*60*60, train_id);
-   if(!db_query(query))
+   const struct activation_cache_entry * activation = activation_cache_find(train_id);
+   if(activation && activation->created)
    {
-      result = db_store_result();
-      if((row = mysql_fetch_row(result)))
+      stat_count(ActCacheHit);
+      cif_schedule_id = activation->cif_schedule_id;
+   }
+   else
+   {
+      sprintf(query, "SELECT cif_schedule_id, created FROM trust_activation WHERE created > %lu AND trust_id = '%s' ORDER BY created DESC",
+              now - 20*24*60*60, train_id);
+      if(!db_query(query))
       {
-         cif_schedule_id = atol(row[0]);
+         stat_count(ActCacheMiss);
+         result = db_store_result();
+         if((row = mysql_fetch_row(result)))
+         {
+            cif_schedule_id = atol(row[0]);
+            activation_cache_add(train_id, atol(row[1]), cif_schedule_id, true);
+         }
+         mysql_free_result(result);
       }
-      mysql_free_result(result);
    }
 
    if(cif_schedule_id && 
@@ -1266,14 +1762,14 @@ static void process_trust_0007(const char * const string, const jsmntok_t * cons
    return;
 }
 
-static void process_trust_0008(const char * const string, const jsmntok_t * const tokens, const int index)
+static void process_trust_0008(const jsmn_index * const fields)
 {
    char query[1024];
    char train_id[128], original_stanox[128], stanox[128];
    
-   jsmn_find_extract_token(string, tokens, index, "train_id", train_id, sizeof(train_id));
-   jsmn_find_extract_token(string, tokens, index, "original_loc_stanox", original_stanox, sizeof(original_stanox));
-   jsmn_find_extract_token(string, tokens, index, "loc_stanox", stanox, sizeof(stanox));
+   jsmn_index_extract(fields, "train_id", train_id, sizeof(train_id));
+   jsmn_index_extract(fields, "original_loc_stanox", original_stanox, sizeof(original_stanox));
+   jsmn_index_extract(fields, "loc_stanox", stanox, sizeof(stanox));
 
    sprintf(query, "INSERT INTO trust_changelocation (created, trust_id, original_stanox, stanox) VALUES(%ld, '%s', '%s', '%s')", now, train_id, original_stanox, stanox);
    db_query(query);
@@ -1335,26 +1831,28 @@ static void report_stats(void)
    strcat(report, "\n");
    for(i=0; i<MAXstats; i++)
    {
-      grand_stats[i] += stats[i];
-      sprintf(zs, "%25s: %-12s ", stats_category[i], commas_q(stats[i]));
+      qword day = __atomic_exchange_n(&stats[i], 0, __ATOMIC_RELAXED);
+      grand_stats[i] += day;
+      sprintf(zs, "%25s: %-12s ", stats_category[i], commas_q(day));
       strcat(zs, commas_q(grand_stats[i]));
       _log(GENERAL, zs);
       strcat(report, zs);
       strcat(report, "\n");
-      stats[i] = 0;
    }
    email_alert(NAME, BUILD, "Statistics Report", report);
 }
 
 static time_t correct_trust_timestamp(const time_t in)
 {
-   struct tm * broken = localtime(&in);
+   struct tm tm;
+   struct tm * broken = localtime_r(&in, &tm);
 
    if(in && broken->tm_isdst) return in - 60*60;
    return in;
 }
 
 // Deferred activation engine
+// Each shard has its own queue.
 #define DEFERRED_ACTIVATIONS 16
 static struct deferred_activation_detail
 {
@@ -1362,13 +1860,14 @@ static struct deferred_activation_detail
    time_t due,schedule_start_date, schedule_end_date;
    word active;
 }
-   deferred_activations[DEFERRED_ACTIVATIONS];
+   deferred_activations[MAX_SHARDS][DEFERRED_ACTIVATIONS];
 
 static void init_deferred_activations(void)
 {
-   word i;
-   for(i = 0; i < DEFERRED_ACTIVATIONS; i++)
-      deferred_activations[i].active = false;
+   word i, j;
+   for(j = 0; j < MAX_SHARDS; j++)
+      for(i = 0; i < DEFERRED_ACTIVATIONS; i++)
+         deferred_activations[j][i].active = false;
 }
 
 static void defer_activation(const char * const uid, const time_t schedule_start_date, const time_t schedule_end_date, const char * const trust_id)
@@ -1382,16 +1881,16 @@ static void defer_activation(const char * const uid, const time_t schedule_start
    
    
    word i;
-   for(i = 0; i < DEFERRED_ACTIVATIONS && deferred_activations[i].active; i++);
+   for(i = 0; i < DEFERRED_ACTIVATIONS && deferred_activations[worker_shard][i].active; i++);
 
    if(i < DEFERRED_ACTIVATIONS)
    {
-      strcpy(deferred_activations[i].uid, uid);
-      strcpy(deferred_activations[i].trust_id, trust_id);
-      deferred_activations[i].due = now + 32;
-      deferred_activations[i].schedule_start_date = schedule_start_date;
-      deferred_activations[i].schedule_end_date = schedule_end_date;
-      deferred_activations[i].active = true;
+      strcpy(deferred_activations[worker_shard][i].uid, uid);
+      strcpy(deferred_activations[worker_shard][i].trust_id, trust_id);
+      deferred_activations[worker_shard][i].due = now + 32;
+      deferred_activations[worker_shard][i].schedule_start_date = schedule_start_date;
+      deferred_activations[worker_shard][i].schedule_end_date = schedule_end_date;
+      deferred_activations[worker_shard][i].active = true;
    }
    else
    {
@@ -1408,46 +1907,51 @@ static void process_deferred_activations(void)
 
    for(i = 0; i < DEFERRED_ACTIVATIONS; i++)
    {
-      if(deferred_activations[i].active && deferred_activations[i].due < now)
+      if(deferred_activations[worker_shard][i].active && deferred_activations[worker_shard][i].due < now)
       {
          char query[1024];
-         sprintf(query, "select id from cif_schedules where cif_train_uid = '%s' AND schedule_start_date = %ld AND schedule_end_date = %ld AND deleted > %ld AND CIF_stp_indicator != 'C' ORDER BY LOCATE(CIF_stp_indicator, 'OCNP')", deferred_activations[i].uid, deferred_activations[i].schedule_start_date, deferred_activations[i].schedule_end_date, now);
+         sprintf(query, "select id from cif_schedules where cif_train_uid = '%s' AND schedule_start_date = %ld AND schedule_end_date = %ld AND deleted > %ld AND CIF_stp_indicator != 'C' ORDER BY LOCATE(CIF_stp_indicator, 'OCNP')", deferred_activations[worker_shard][i].uid, deferred_activations[worker_shard][i].schedule_start_date, deferred_activations[worker_shard][i].schedule_end_date, now);
          if(!db_query(query))
          {
             db_result = db_store_result();
             word num_rows = mysql_num_rows(db_result);
             if(num_rows < 1) 
             {
-               _log(MINOR, "No schedules found for deferred activation \"%s\".  Activation recorded without schedule.", deferred_activations[i].trust_id);
+               _log(MINOR, "No schedules found for deferred activation \"%s\".  Activation recorded without schedule.", deferred_activations[worker_shard][i].trust_id);
 
-               sprintf(query, "INSERT INTO trust_activation VALUES(%ld, '%s', %ld, 0)", now, deferred_activations[i].trust_id, 0L);
+               sprintf(query, "INSERT INTO trust_activation VALUES(%ld, '%s', %ld, 0)", now, deferred_activations[worker_shard][i].trust_id, 0L);
                db_query(query);
+               activation_cache_add(deferred_activations[worker_shard][i].trust_id, now, 0, true);
             }
             else
             {
                db_row = mysql_fetch_row(db_result);
                dword cif_schedule_id = atol(db_row[0]);
-               _log(MINOR, "Found schedule %ld for deferred activation \"%s\".", cif_schedule_id, deferred_activations[i].trust_id);
-               stats[Mess1MissHit]++;
-               sprintf(query, "INSERT INTO trust_activation VALUES(%ld, '%s', %u, 0)", now, deferred_activations[i].trust_id, cif_schedule_id);
+               _log(MINOR, "Found schedule %ld for deferred activation \"%s\".", cif_schedule_id, deferred_activations[worker_shard][i].trust_id);
+               stat_count(Mess1MissHit);
+               sprintf(query, "INSERT INTO trust_activation VALUES(%ld, '%s', %u, 0)", now, deferred_activations[worker_shard][i].trust_id, cif_schedule_id);
                db_query(query);
+               activation_cache_add(deferred_activations[worker_shard][i].trust_id, now, cif_schedule_id, true);
                // TODO:  We should do the 'deduced headcode' processing here.
             }
             mysql_free_result(db_result);
          }
-         deferred_activations[i].active = false;
+         deferred_activations[worker_shard][i].active = false;
       }
    }
 }               
 
 static word count_deferred_activations(void)
 {
-   word i, result;
+   word i, j, result;
    result = 0;
 
-   for(i = 0; i < DEFERRED_ACTIVATIONS; i++)
+   for(j = 0; j < MAX_SHARDS; j++)
    {
-      if(deferred_activations[i].active) result++;
+      for(i = 0; i < DEFERRED_ACTIVATIONS; i++)
+      {
+         if(deferred_activations[j][i].active) result++;
+      }
    }
 
    return result;
@@ -1457,29 +1961,56 @@ static void check_timeout(void)
 {
    char report[1024];
 
+   db_profile_poll();
+
    // Daily report
    now = time(NULL);
-   struct tm * broken = localtime(&now);
+   struct tm broken_tm, * broken = localtime_r(&now, &broken_tm);
    if(broken->tm_wday != last_report_day && broken->tm_hour >= REPORT_HOUR && broken->tm_min >= REPORT_MINUTE)
    {
       last_report_day = broken->tm_wday;
       report_stats();
+      db_profile_report();
       {
          char query[256];
          sprintf(query, "DELETE FROM message_count WHERE time < %ld", now - (24*60*60));
          db_query(query);
       }
+      if(!*conf[conf_trustdb_no_deduce_act]) timetable_build();
    }
+
+   // New schedules
+   if(!*conf[conf_trustdb_no_deduce_act]) timetable_refresh();
    
+   // Status, obfuscated headcodes and committed frame parts, in sharded mode.
+   if(shards && now >= status_update_due)
+   {
+      char query[256];
+      sprintf(query, "UPDATE status SET last_trust_processed = %ld, last_trust_actual = %ld",
+              __atomic_load_n(&status_last_trust_processed, __ATOMIC_RELAXED), __atomic_load_n(&status_last_trust_actual, __ATOMIC_RELAXED));
+      db_query(query);
+      status_update_due = now + STATUS_UPDATE_INTERVAL;
+   }
+   if(shards && now >= obfus_prune_due)
+   {
+      char query[256];
+      sprintf(query, "DELETE FROM obfus_lookup WHERE created < %ld", now - 86400L); // 24 hours.
+      db_query(query);
+      sprintf(query, "DELETE FROM trust_frame_part WHERE created < %ld", now - 86400L);
+      db_query(query);
+      obfus_prune_due = now + OBFUS_PRUNE_INTERVAL;
+   }
+
    // Message counts
    if(now > message_count_report_due)
    {
       char query[256];
-      sprintf(query, "INSERT INTO message_count VALUES('trustdb', %ld, %d)", now, message_count);
+      word count = __atomic_load_n(&message_count, __ATOMIC_RELAXED);
+      sprintf(query, "INSERT INTO message_count VALUES('trustdb', %ld, %d)", now, count);
       if(!db_query(query))
       {
-         _log(DEBUG, "Message count of %d recorded.", message_count);
-         message_count = 0;
+         _log(DEBUG, "Message count of %d recorded.", count);
+         __atomic_sub_fetch(&message_count, count, __ATOMIC_RELAXED);
          message_count_report_due = now + MESSAGE_COUNT_REPORT_INTERVAL;
       }
    }
@@ -1487,13 +2018,16 @@ static void check_timeout(void)
    // Latency report.
    if(now > latency_check_due)
    {
-      if(latency_count > 0)
+      qword sum = __atomic_exchange_n(&latency_sum, 0, __ATOMIC_RELAXED);
+      qword count = __atomic_exchange_n(&latency_count, 0, __ATOMIC_RELAXED);
+      time_t max = __atomic_exchange_n(&latency_max, 0, __ATOMIC_RELAXED);
+      if(count > 0)
       {
          qword mean_latency;
-         mean_latency = (latency_sum * 1000) / latency_count;
+         mean_latency = (sum * 1000) / count;
          mean_latency = (mean_latency + 500) / 1000;
          char peak[32];
-         strcpy(peak, commas_q(latency_max));
+         strcpy(peak, commas_q(max));
          if(mean_latency > LATENCY_ALARM_THRESHOLD)
          {
             _log(MINOR, "Average message latency %s s, peak %s s.", commas_q(mean_latency), peak);
@@ -1514,9 +2048,382 @@ static void check_timeout(void)
                latency_alarm_raised = false;
             }
          }
-
-         latency_sum = latency_count = latency_max = 0;
       }
       latency_check_due = now + LATENCY_CHECK_INTERVAL;
    } 
 }
+
+// Timetable index
+// Every call at a TIPLOC by a schedule which might run within TIMETABLE_WINDOW of the build, hashed on TIPLOC and WTT time.
+// Used to find the candidate schedules when deducing an activation.  New schedules are picked up by id, they are never
+// modified apart from being deleted, which the caller checks in the database against the planned time.  Schedules
+// deleted before the build are kept if a movement the index answers for could be planned before the deletion.
+// The index is built, and new schedules are loaded, without holding timetable_lock.  The write lock is only taken to
+// swap in a new index or add the new calls, so that the shards are not held up while the SQL runs.
+#define TIMETABLE_ARRIVE   0x01
+#define TIMETABLE_DEPART   0x02
+#define TIMETABLE_NEXT_DAY 0x04
+struct timetable_call
+{
+   dword next, cif_schedule_id;
+   dword schedule_start_date, schedule_end_date;
+   char tiploc[8];
+   word time;  // Half minutes
+   byte runs;  // Bit per tm_wday
+   byte flags;
+};
+struct timetable
+{
+   struct timetable_call * calls;
+   dword * buckets;
+   dword bucket_count, call_count, call_size;
+   time_t built;
+};
+static dword timetable_loaded_id, timetable_seen_id, timetable_update_id;
+static time_t timetable_refresh_due;
+
+static word timetable_time(const char * const t)
+{
+   // "HHMM" or "HHMMH" to half minutes.  Anything else gives 0xffff.
+   word i;
+   for(i = 0; i < 4; i++) if(t[i] < '0' || t[i] > '9') return 0xffff;
+   return (((t[0] - '0') * 10 + t[1] - '0') * 60 + (t[2] - '0') * 10 + t[3] - '0') * 2 + (t[4] == 'H');
+}
+
+static dword timetable_hash(const char * const tiploc, const word time)
+{
+   dword h = 2166136261u;
+   word i;
+   for(i = 0; i < 7 && tiploc[i]; i++) h = (h ^ (byte) tiploc[i]) * 16777619u;
+   h = (h ^ (time & 0xff)) * 16777619u;
+   h = (h ^ (time >> 8)) * 16777619u;
+   return h;
+}
+
+static word timetable_rehash(struct timetable * const t, const dword bucket_count)
+{
+   dword i, b;
+   dword * buckets = calloc(bucket_count, sizeof(dword));
+   if(!buckets) return 1;
+   free(t->buckets);
+   t->buckets = buckets;
+   t->bucket_count = bucket_count;
+   // Chains hold call number + 1, so that 0 is the end.
+   for(i = 0; i < t->call_count; i++)
+   {
+      b = timetable_hash(t->calls[i].tiploc, t->calls[i].time) & (t->bucket_count - 1);
+      t->calls[i].next = t->buckets[b];
+      t->buckets[b] = i + 1;
+   }
+   return 0;
+}
+
+static struct timetable * timetable_new(const time_t built)
+{
+   struct timetable * t = calloc(1, sizeof(struct timetable));
+   if(t && timetable_rehash(t, 1 << 12))
+   {
+      free(t);
+      return NULL;
+   }
+   if(t) t->built = built;
+   return t;
+}
+
+static void timetable_free(struct timetable * const t)
+{
+   if(!t) return;
+   free(t->calls);
+   free(t->buckets);
+   free(t);
+}
+
+static void timetable_swap(struct timetable * const t)
+{
+   // Make t, which may be NULL, the index searched by timetable_candidates().
+   struct timetable * old;
+
+   pthread_rwlock_wrlock(&timetable_lock);
+   old = timetable;
+   timetable = t;
+   pthread_rwlock_unlock(&timetable_lock);
+   timetable_free(old);
+}
+
+static word timetable_add(struct timetable * const t, const struct timetable_call * const call)
+{
+   if(t->call_count >= t->call_size)
+   {
+      dword size = t->call_size ? t->call_size * 2 : 1 << 12;
+      struct timetable_call * calls = realloc(t->calls, size * sizeof(struct timetable_call));
+      if(!calls) return 1;
+      t->calls = calls;
+      t->call_size = size;
+   }
+   if(t->call_count >= t->bucket_count && timetable_rehash(t, t->bucket_count * 2)) return 1;
+
+   struct timetable_call * c = t->calls + t->call_count;
+   *c = *call;
+   dword b = timetable_hash(c->tiploc, c->time) & (t->bucket_count - 1);
+   c->next = t->buckets[b];
+   t->buckets[b] = ++t->call_count;
+   return 0;
+}
+
+static word timetable_add_row(struct timetable * const t, const MYSQL_ROW row, const char * const time_text, const byte flags)
+{
+   struct timetable_call c;
+   word i;
+
+   if((c.time = timetable_time(time_text)) == 0xffff) return 0;
+   c.cif_schedule_id     = atol(row[0]);
+   c.schedule_start_date = atol(row[1]);
+   c.schedule_end_date   = atol(row[2]);
+   for(c.runs = 0, i = 0; i < 7; i++) if(row[3 + i][0] == '1') c.runs |= 1 << i;
+   strncpy(c.tiploc, row[10], 7);
+   c.tiploc[7] = '\0';
+   c.flags = flags | ((row[14][0] == '1') ? TIMETABLE_NEXT_DAY : 0);
+   return timetable_add(t, &c);
+}
+
+static word timetable_load(struct timetable * const t, const dword from_id, const dword to_id)
+{
+   // Load the calls of the schedules with from_id < id <= to_id.
+   // timetable_search() answers for days whose noon is within TIMETABLE_COVER of the build, so the earliest planned time
+   // it sees is 12 hours before that.
+   const time_t deleted_after = t->built - TIMETABLE_COVER - 12*60*60;
+   char query[1024];
+   MYSQL_RES * result;
+   MYSQL_ROW row;
+   dword before = t->call_count;
+   word failed = false;
+
+   sprintf(query, "SELECT s.id, s.schedule_start_date, s.schedule_end_date, s.runs_su, s.runs_mo, s.runs_tu, s.runs_we, s.runs_th, s.runs_fr, s.runs_sa, l.tiploc_code, l.arrival, l.departure, l.pass, l.next_day FROM cif_schedules AS s INNER JOIN cif_schedule_locations AS l ON s.id = l.cif_schedule_id WHERE s.id > %u AND s.id <= %u AND s.CIF_stp_indicator IN ('N', 'P', 'O') AND s.train_status != 'B' AND s.train_status != '5' AND s.deleted > %ld AND s.schedule_start_date <= %ld AND s.schedule_end_date >= %ld",
+           from_id, to_id, deleted_after, t->built + TIMETABLE_WINDOW, t->built - TIMETABLE_WINDOW);
+   if(db_query(query)) return 1;
+   if(!(result = db_use_result())) return 1;
+   while((row = mysql_fetch_row(result)))
+   {
+      if(failed) continue;
+      if(timetable_add_row(t, row, row[11], TIMETABLE_ARRIVE) ||
+         timetable_add_row(t, row, row[12], TIMETABLE_DEPART) ||
+         timetable_add_row(t, row, row[13], TIMETABLE_ARRIVE | TIMETABLE_DEPART))
+      {
+         _log(MAJOR, "Timetable index:  Out of memory after %s calls.", commas(t->call_count));
+         failed = true;
+      }
+   }
+   mysql_free_result(result);
+   if(failed) return 1;
+
+   _log(DEBUG, "Timetable index:  Loaded %s calls for schedules %u to %u.", commas(t->call_count - before), from_id + 1, to_id);
+   return 0;
+}
+
+static dword timetable_max_id(const char * const table)
+{
+   char query[128];
+   MYSQL_RES * result;
+   MYSQL_ROW row;
+   dword id = 0;
+
+   sprintf(query, "SELECT MAX(id) FROM %s", table);
+   if(db_query(query)) return 0;
+   result = db_store_result();
+   if((row = mysql_fetch_row(result)) && row[0]) id = atol(row[0]);
+   mysql_free_result(result);
+   return id;
+}
+
+static void timetable_build(void)
+{
+   time_t built = time(NULL);
+   struct timetable * t = timetable_new(built);
+
+   timetable_refresh_due = built + TIMETABLE_REFRESH;
+   timetable_update_id = timetable_max_id("updates_processed");
+   timetable_seen_id = timetable_max_id("cif_schedules");
+   if(!t || timetable_load(t, 0, timetable_seen_id))
+   {
+      _log(MAJOR, "Failed to build timetable index.  Activations will be deduced from the database.");
+      timetable_free(t);
+      timetable_swap(NULL);
+      return;
+   }
+   timetable_loaded_id = timetable_seen_id;
+   timetable_swap(t);
+   _log(GENERAL, "Timetable index built in %ld s.  %s calls, schedules up to %u.", time(NULL) - built, commas(t->call_count), timetable_loaded_id);
+}
+
+static void timetable_refresh(void)
+{
+   // Schedules are loaded one refresh after they first appear, so that vstpdb has had time to insert all their locations.
+   // A CIF update is inserted in one long transaction, during which vstpdb commits schedules with higher ids, so the
+   // update's schedules would be below timetable_loaded_id when they appear.  The index is rebuilt when an update is
+   // recorded in updates_processed, which is done in the same transaction.
+   // Only this thread changes timetable, so it can be read here without the lock.
+   struct timetable * t;
+   dword id, i;
+   word failed;
+
+   if(now < timetable_refresh_due) return;
+   timetable_refresh_due = now + TIMETABLE_REFRESH;
+   if(!timetable)
+   {
+      timetable_build();
+      return;
+   }
+
+   if(timetable_max_id("updates_processed") != timetable_update_id)
+   {
+      _log(GENERAL, "Timetable index:  Timetable update processed.  Rebuilding.");
+      timetable_build();
+      return;
+   }
+   id = timetable_max_id("cif_schedules");
+   if(id < timetable_loaded_id)
+   {
+      // Timetable has been reloaded from scratch.
+      _log(GENERAL, "Timetable index:  Schedule ids have gone back from %u to %u.  Rebuilding.", timetable_loaded_id, id);
+      timetable_build();
+      return;
+   }
+   if(timetable_seen_id > timetable_loaded_id)
+   {
+      failed = !(t = timetable_new(timetable->built)) || timetable_load(t, timetable_loaded_id, timetable_seen_id);
+      if(!failed)
+      {
+         pthread_rwlock_wrlock(&timetable_lock);
+         for(i = 0; i < t->call_count && !failed; i++) failed = timetable_add(timetable, t->calls + i);
+         pthread_rwlock_unlock(&timetable_lock);
+      }
+      timetable_free(t);
+      if(failed)
+      {
+         _log(MAJOR, "Timetable index:  Failed to load new schedules.  Activations will be deduced from the database.");
+         timetable_swap(NULL);
+         return;
+      }
+      timetable_loaded_id = timetable_seen_id;
+   }
+   timetable_seen_id = id;
+}
+
+static word timetable_candidates(const char * const tiploc, const char * const planned, const char event, const time_t when, const word day, char * const ids)
+{
+   word r;
+
+   pthread_rwlock_rdlock(&timetable_lock);
+   r = timetable_search(tiploc, planned, event, when, day, ids);
+   pthread_rwlock_unlock(&timetable_lock);
+   return r;
+}
+
+static word timetable_search(const char * const tiploc, const char * const planned, const char event, const time_t when, const word day, char * const ids)
+{
+   // Write the ids of the schedules which could match to ids, as a list for IN(), or "0" if none.
+   // Returns non-zero if the index can't answer, including when there are too many candidates to list.
+   dword i, candidates[TIMETABLE_CANDIDATES];
+   word count = 0, j, time, yest = (day + 6) % 7;
+   byte flag = (event == 'A') ? TIMETABLE_ARRIVE : (event == 'D') ? TIMETABLE_DEPART : 0;
+
+   if(!timetable || when < timetable->built - TIMETABLE_COVER || when > timetable->built + TIMETABLE_COVER) return 1;
+
+   strcpy(ids, "0");
+   time = timetable_time(planned);
+   if(!flag || time == 0xffff) return 0;
+
+   for(i = timetable->buckets[timetable_hash(tiploc, time) & (timetable->bucket_count - 1)]; i; i = timetable->calls[i - 1].next)
+   {
+      const struct timetable_call * const c = timetable->calls + i - 1;
+      if(c->time != time || !(c->flags & flag) || strcmp(c->tiploc, tiploc)) continue;
+      if(c->flags & TIMETABLE_NEXT_DAY)
+      {
+         if(!(c->runs & (1 << yest)) || c->schedule_start_date > when - 12*60*60 || c->schedule_end_date < when - 36*60*60) continue;
+      }
+      else
+      {
+         if(!(c->runs & (1 << day)) || c->schedule_start_date > when + 12*60*60 || c->schedule_end_date < when - 12*60*60) continue;
+      }
+      for(j = 0; j < count && candidates[j] != c->cif_schedule_id; j++);
+      if(j < count) continue;
+      if(count >= TIMETABLE_CANDIDATES)
+      {
+         // A partial list could miss the right schedule.
+         _log(MINOR, "Timetable index:  Over %d candidates at %s %s.  Using full search.", TIMETABLE_CANDIDATES, tiploc, planned);
+         return 1;
+      }
+      candidates[count++] = c->cif_schedule_id;
+   }
+
+   for(j = 0; j < count; j++) sprintf(ids + (j ? strlen(ids) : 0), j ? ",%u" : "%u", candidates[j]);
+   return 0;
+}
+
+// Activation cache
+// Recent activations of each TRUST id, as recorded in trust_activation.  trustdb is the only writer of that table,
+// so every activation inserted is added here, as are those found in the database on a miss.  Only activations found
+// are cached, so an absent entry means ask the database.  Entries expire with age, and the oldest in a full set is
+// overwritten.  Each shard has its own cache, as a TRUST id always goes to the same shard.
+static time_t activation_cache_age(const struct activation_cache_entry * const e)
+{
+   return (e->created > e->scheduled_created) ? e->created : e->scheduled_created;
+}
+
+static struct activation_cache_entry * activation_cache_set(const char * const trust_id)
+{
+   dword h = 2166136261u;
+   word i;
+   for(i = 0; trust_id[i]; i++) h = (h ^ (byte) trust_id[i]) * 16777619u;
+   return activation_cache[worker_shard][h % ACTIVATION_CACHE_SETS];
+}
+
+static const struct activation_cache_entry * activation_cache_find(const char * const trust_id)
+{
+   struct activation_cache_entry * set = activation_cache_set(trust_id);
+   word i;
+
+   for(i = 0; i < ACTIVATION_CACHE_WAYS; i++)
+   {
+      if(activation_cache_age(set + i) > now - ACTIVATION_CACHE_AGE && !strcmp(set[i].trust_id, trust_id)) return set + i;
+   }
+   return NULL;
+}
+
+static void activation_cache_add(const char * const trust_id, const time_t created, const dword cif_schedule_id, const word latest)
+{
+   // latest is true if there is no later activation of trust_id in the database.
+   struct activation_cache_entry * set, * e;
+   word i;
+
+   if(strlen(trust_id) >= sizeof(set->trust_id) || created <= now - ACTIVATION_CACHE_AGE) return;
+
+   set = activation_cache_set(trust_id);
+   for(i = 0, e = set; i < ACTIVATION_CACHE_WAYS && strcmp(set[i].trust_id, trust_id); i++)
+   {
+      if(activation_cache_age(set + i) < activation_cache_age(e)) e = set + i;
+   }
+   if(i < ACTIVATION_CACHE_WAYS && activation_cache_age(set + i) > now - ACTIVATION_CACHE_AGE)
+   {
+      e = set + i;
+   }
+   else
+   {
+      if(i < ACTIVATION_CACHE_WAYS) e = set + i;
+      strcpy(e->trust_id, trust_id);
+      e->created = e->scheduled_created = 0;
+   }
+
+   if(latest && created >= e->created)
+   {
+      e->created = created;
+      e->cif_schedule_id = cif_schedule_id;
+   }
+   if(cif_schedule_id && created > e->scheduled_created) e->scheduled_created = created;
+}
+
+static void activation_cache_clear(void)
+{
+   // After a rollback the cache may hold activations which are no longer in the database.
+   memset(activation_cache[worker_shard], 0, sizeof(activation_cache[worker_shard]));
+}
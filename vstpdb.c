@@ -41,6 +41,7 @@
 #include "misc.h"
 #include "db.h"
 #include "database.h"
+#include "corpus.h"
 #include "build.h"
 
 #define NAME  "vstpdb"
@@ -52,7 +53,10 @@
 #endif
 
 static void perform(void);
-static void process_frame(char const * const body);
+struct frame;
+static void process_frame(struct frame const * const f);
+static void process_frame_job(void * const arg);
+static void check_timeout(void);
 static void process_vstp(char const * const string, jsmntok_t const * const tokens);
 static void process_delete_schedule(char const * const string, jsmntok_t const * const tokens);
 static void process_create_schedule(char const * const string, jsmntok_t const * const tokens, const word update);
@@ -67,17 +71,30 @@ static char * vstp_to_CIF_time(char const * const buffer);
 static char * tiploc_name(char const * const tiploc);
 
 static word debug, run, interrupt, holdoff, huyton_flag;
+static word batch_locations;
 
-#define FRAME_SIZE 64000
-static char body[FRAME_SIZE];
+// Name index of the VSTP message being processed, used by the EXTRACT macros.
+static jsmn_index message_fields;
 
+#define FRAME_SIZE 64000
 #define NUM_TOKENS 8192
-static jsmntok_t tokens[NUM_TOKENS];
+
+// Frames are read and parsed here while earlier ones are processed by the database worker thread.
+static struct frame
+{
+   char body[FRAME_SIZE];
+   jsmntok_t tokens[NUM_TOKENS];
+   int parsed;
+} frames[DB_ASYNC_DEPTH + 1];
+static qword frames_read;
+static volatile word pipeline_failed;
 
 #define NOT_DELETED 0xffffffffL
 
 // stompy port for vstp stream
 #define STOMPY_PORT 55840
+// Number of frames stompy may send ahead of our acks
+#define STOMPY_WINDOW 8
 
 // Time in hours (local) when daily statistical report is produced.
 // (Set > 23 to disable daily report.)
@@ -86,6 +103,7 @@ static jsmntok_t tokens[NUM_TOKENS];
 
 // Stats
 static time_t start_time;
+static word last_report_day;
 enum stats_categories {ConnectAttempt, GoodMessage, DeleteHit, DeleteMiss, DeleteMulti, Create, 
                        UpdateCreate, UpdateDeleteMiss, UpdateDeleteMulti, SpeedCorrected, HeadcodeDeduced,
                        NotMessage, NotVSTP, NotTransaction, MAXstats};
@@ -128,7 +146,11 @@ static struct speed_correct_table { char given[4]; char actual[4]; } speed_corre
 // Signal handling
 void termination_handler(int signum)
 {
-   if(signum != SIGHUP)
+   if(signum == SIGHUP)
+   {
+      _log_reopen();
+   }
+   else
    {
       run = false;
       interrupt = true;
@@ -283,7 +305,7 @@ int main(int argc, char *argv[])
       act.sa_handler = termination_handler;
       act.sa_mask = block_mask;
       act.sa_flags = 0;
-      if(sigaction(SIGTERM, &act, NULL) || sigaction(SIGINT, &act, NULL))
+      if(sigaction(SIGTERM, &act, NULL) || sigaction(SIGINT, &act, NULL) || sigaction(SIGHUP, &act, NULL))
       {
          _log(CRITICAL, "Failed to set up signal handler.");
          exit(1);
@@ -327,10 +349,11 @@ int main(int argc, char *argv[])
 
 static void perform(void)
 {
-   word last_report_day;
    // Initialise database
    {
       db_init(conf[conf_db_server], conf[conf_db_user], conf[conf_db_password], conf[conf_db_name], DB_MODE_NORMAL);
+      batch_locations = db_batch("cif_schedule_locations", NULL, 0, 0);
+      db_async_start();
 
       word e;
       if((e=database_upgrade(vstpdb)))
@@ -342,62 +365,38 @@ static void perform(void)
 
    {
       time_t now = time(NULL);
-      struct tm * broken = localtime(&now);
+      struct tm broken_tm, * broken = localtime_r(&now, &broken_tm);
       last_report_day = broken->tm_wday;
    }
    while(run)
    {   
       stats[ConnectAttempt]++;
       int run_receive = !open_stompy(STOMPY_PORT);
+      if(run_receive && window_stompy(STOMPY_WINDOW)) run_receive = false;
+      pipeline_failed = false;
       while(run_receive && run)
       {
          holdoff = 0;
-         {
-            time_t now = time(NULL);
-            struct tm * broken = localtime(&now);
-            if(broken->tm_wday != last_report_day && broken->tm_hour >= REPORT_HOUR && broken->tm_min >= REPORT_MINUTE)
-            {
-               last_report_day = broken->tm_wday;
-               report_stats();
-            }
-         }
 
-         word r = read_stompy(body, FRAME_SIZE, 64);
+         // Up to DB_ASYNC_DEPTH frames may be queued or in progress, so this one is free.
+         struct frame * const f = &frames[frames_read % (DB_ASYNC_DEPTH + 1)];
+         word r = read_stompy(f->body, FRAME_SIZE, 64);
          _log(DEBUG, "read_stompy() returned %d.", r);
-         if(!r && run && run_receive)
+         if(pipeline_failed)
          {
-            if(db_start_transaction())
-            {
-               run_receive = false;
-            }
-            if(run_receive) process_frame(body);
-
-            if(!db_errored)
-            {
-               if(db_commit_transaction())
-               {
-                  db_rollback_transaction();
-                  run_receive = false;
-               }
-               else
-               {
-                  // Send ACK
-                  if(ack_stompy())
-                  {
-                     _log(CRITICAL, "Failed to write message ack.  Error %d %s", errno, strerror(errno));
-                     run_receive = false;
-                  }
-               }
-            }
-            else
-            {
-               // DB error occurred during processing of frame.
-               db_rollback_transaction();
-               run_receive = false;
-            }
+            run_receive = false;
          }
-         else if(run && run_receive)
+         else if(!r && run)
          {
+            jsmn_parser parser;
+            jsmn_init(&parser);
+            f->parsed = jsmn_parse(&parser, f->body, f->tokens, NUM_TOKENS);
+            frames_read++;
+            db_async_submit(process_frame_job, f);
+         }
+         else if(run)
+         {
+            db_async_drain();
             if(r != 3)
             {
                run_receive = false;
@@ -407,9 +406,12 @@ static void perform(void)
             {
                // Don't report these because it is normal on VSTP stream
                // _log(MINOR, "Receive timeout on stompy connection."); 
+               check_timeout();
             }
          }
       } // while(run_receive && run)
+      // Frames not yet acked will be sent again by stompy.
+      db_async_drain();
       close_stompy();
       {      
          word i;
@@ -424,17 +426,76 @@ static void perform(void)
       _log(CRITICAL, "Terminating due to interrupt.");
    }
 
+   db_async_stop();
    db_disconnect();
    report_stats();
+   db_profile_report();
 }
 
-static void process_frame(char const * const body)
+static void process_frame_job(void * const arg)
 {
-   jsmn_parser parser;
+   // Runs on the database worker thread, one frame at a time in the order read.  The frame is acked once its
+   // transaction is committed.  After a failure later frames are skipped, to be redelivered after reconnection.
+   struct frame const * const f = arg;
+
+   if(pipeline_failed) return;
+
+   check_timeout();
+
+   if(db_start_transaction())
+   {
+      pipeline_failed = true;
+      return;
+   }
+   process_frame(f);
+
+   if(!db_errored)
+   {
+      if(db_commit_transaction())
+      {
+         db_rollback_transaction();
+         pipeline_failed = true;
+      }
+      else
+      {
+         // Send ACK
+         if(ack_stompy())
+         {
+            _log(CRITICAL, "Failed to write message ack.  Error %d %s", errno, strerror(errno));
+            pipeline_failed = true;
+         }
+      }
+   }
+   else
+   {
+      // DB error occurred during processing of frame.
+      db_rollback_transaction();
+      pipeline_failed = true;
+   }
+}
+
+static void check_timeout(void)
+{
+   db_profile_poll();
+
+   // Daily report
+   time_t now = time(NULL);
+   struct tm broken_tm, * broken = localtime_r(&now, &broken_tm);
+   if(broken->tm_wday != last_report_day && broken->tm_hour >= REPORT_HOUR && broken->tm_min >= REPORT_MINUTE)
+   {
+      last_report_day = broken->tm_wday;
+      report_stats();
+      db_profile_report();
+   }
+}
+
+static void process_frame(struct frame const * const f)
+{
+   char const * const body = f->body;
+   jsmntok_t const * const tokens = f->tokens;
    time_t elapsed = time(NULL);
    
-   jsmn_init(&parser);
-   int r = jsmn_parse(&parser, body, tokens, NUM_TOKENS);
+   int r = f->parsed;
    if(r != 0) 
    {
       _log(MAJOR, "Parser result %d.  Message discarded.", r);
@@ -469,7 +530,9 @@ static void process_vstp(char const * const string, jsmntok_t const * const toke
 
    stats[GoodMessage]++;
 
-   jsmn_find_extract_token(string, tokens, 0, "transaction_type", zs, sizeof(zs));
+   // The fields of the message are found through this index by the EXTRACT macros.
+   jsmn_index_object(&message_fields, string, tokens, 0);
+   jsmn_index_extract(&message_fields, "transaction_type", zs, sizeof(zs));
    if(zs[0])
    {
       // printf("   Transaction type: \"%s\"", zs);
@@ -479,22 +542,22 @@ static void process_vstp(char const * const string, jsmntok_t const * const toke
       else 
       {
          _log(MAJOR, "process_schedule():  Unrecognised transaction type \"%s\".", zs);
-         jsmn_dump_tokens(body, tokens, 0);
+         jsmn_dump_tokens(string, tokens, 0);
          stats[NotTransaction]++;
       }
    }
    else
    {
       _log(MAJOR, "process_schedule():  Failed to determine transaction type.");
-      jsmn_dump_tokens(body, tokens, 0);
+      jsmn_dump_tokens(string, tokens, 0);
       stats[NotTransaction]++;
    }
 }
 
-#define EXTRACT(a,b) jsmn_find_extract_token(string, tokens, 0, a, b, sizeof( b ))
-#define EXTRACT_OBJECT(a,b) jsmn_find_extract_token(string, tokens, index, a, b, sizeof( b ))
-#define EXTRACT_APPEND_SQL(a) { jsmn_find_extract_token(string, tokens, 0, a, zs, sizeof( zs )); sprintf(zs1, ", \"%.900s\"", zs); strcat(query, zs1); }
-#define EXTRACT_APPEND_SQL_OBJECT(a) { jsmn_find_extract_token(string, tokens, index, a, zs, sizeof( zs )); sprintf(zs1, ", \"%.900s\"", zs); strcat(query, zs1); }
+#define EXTRACT(a,b) jsmn_index_extract(&message_fields, a, b, sizeof( b ))
+#define EXTRACT_OBJECT(a,b) jsmn_index_extract(&location_fields, a, b, sizeof( b ))
+#define EXTRACT_APPEND_SQL(a) { jsmn_index_extract(&message_fields, a, zs, sizeof( zs )); sprintf(zs1, ", \"%.900s\"", zs); strcat(query, zs1); }
+#define EXTRACT_APPEND_SQL_OBJECT(a) { jsmn_index_extract(&location_fields, a, zs, sizeof( zs )); sprintf(zs1, ", \"%.900s\"", zs); strcat(query, zs1); }
 
 static void process_delete_schedule(char const * const string, jsmntok_t const * const tokens)
 {
@@ -667,7 +730,7 @@ static void process_create_schedule(char const * const string, jsmntok_t const *
       
    dword id = db_insert_id();
 
-   word index = jsmn_find_name_token(string, tokens, 0, "schedule_location");
+   word index = jsmn_index_find(&message_fields, "schedule_location");
    word locations = tokens[index+1].size;
 
    huyton_flag = false;
@@ -824,8 +887,10 @@ static word process_create_schedule_location(char const * const string, jsmntok_
    sprintf(zs, "process_create_schedule_location(%d, %ld)", index, schedule_id);
    _log(PROC, zs);
 
-   sprintf(query, "INSERT INTO cif_schedule_locations VALUES(%ld, %ld",
-           0L, schedule_id);
+   jsmn_index location_fields;
+   jsmn_index_object(&location_fields, string, tokens, index);
+
+   sprintf(query, "%ld, %ld", 0L, schedule_id);
 
    EXTRACT_APPEND_SQL_OBJECT("CIF_activity");
    //EXTRACT_APPEND_SQL_OBJECT("record_identity");
@@ -886,9 +951,8 @@ static word process_create_schedule_location(char const * const string, jsmntok_
    EXTRACT_APPEND_SQL_OBJECT("CIF_engineering_allowance");
    EXTRACT_APPEND_SQL_OBJECT("CIF_pathing_allowance");
    EXTRACT_APPEND_SQL_OBJECT("CIF_performance_allowance");
-   strcat(query, ")");
 
-   (void) db_query(query); 
+   (void) db_batch_add(batch_locations, query);
 
    return (index + tokens[index].size + 5);
 }
@@ -1049,24 +1113,11 @@ static char * vstp_to_CIF_time(char const * const buffer)
 static char * tiploc_name(char const * const tiploc)
 {
    // Not re-entrant
-   char query[256];
-   MYSQL_RES * result0;
-   MYSQL_ROW row0;
    static char result[128];
+   const char * fn = corpus_tiploc_name(tiploc);
 
-   sprintf(query, "select fn from corpus where tiploc = '%s'", tiploc);
-   db_query(query);
-   result0 = db_store_result();
-   if((row0 = mysql_fetch_row(result0)) && row0[0][0]) 
-   {
-      strncpy(result, row0[0], 127);
-      result[127] = '\0';
-   }
-   else
-   {
-      strcpy(result, tiploc);
-   }
-   mysql_free_result(result0);
+   strncpy(result, fn[0] ? fn : tiploc, 127);
+   result[127] = '\0';
 
    return result;
 }